@@ -1013,6 +1013,114 @@ void LICE_Blur(LICE_IBitmap *dest, LICE_IBitmap *src, int dstx, int dsty, int sr
 #endif
 
 #ifndef LICE_NO_BLIT_SUPPORT
+static bool LICE_BitmapsOverlap(LICE_IBitmap *a, LICE_IBitmap *b)
+{
+  if (a == b) return true;
+  const char *pa=(const char *)a->getBits(), *pb=(const char *)b->getBits();
+  if (!pa || !pb) return false;
+  const INT_PTR la = (INT_PTR)a->getRowSpan()*a->getHeight()*sizeof(LICE_pixel);
+  const INT_PTR lb = (INT_PTR)b->getRowSpan()*b->getHeight()*sizeof(LICE_pixel);
+  // be conservative and treat the whole of each row span as touched, either side of a flipped origin
+  return pa - la < pb + lb && pb - lb < pa + la;
+}
+
+struct LICE_ScaledBlit_rowsctx
+{
+  LICE_pixel_chan *pdest, *psrc;
+  int dstw, icurx, icury, idx, idy, clip_r, clip_b, src_span, dest_span, ia, mode;
+  double xadvance, yadvance;
+};
+
+// does rows [y,y+dsth) of a LICE_ScaledBlit
+static void LICE_ScaledBlit_rows(void *parm, int y, int dsth)
+{
+  const LICE_ScaledBlit_rowsctx *c = (const LICE_ScaledBlit_rowsctx *)parm;
+  LICE_pixel_chan *pdest = c->pdest + y*c->dest_span, *psrc = c->psrc;
+  const int dstw=c->dstw, icurx=c->icurx, icury=c->icury + y*c->idy, idx=c->idx, idy=c->idy;
+  const int clip_r=c->clip_r, clip_b=c->clip_b, src_span=c->src_span, dest_span=c->dest_span;
+  const int ia=c->ia, mode=c->mode;
+  const double xadvance=c->xadvance, yadvance=c->yadvance;
+
+
+  if ((mode&(LICE_BLIT_FILTER_MASK|LICE_BLIT_MODE_MASK|LICE_BLIT_USE_ALPHA))==LICE_BLIT_MODE_COPY && (ia==128 || ia==256))
+  {
+    if (ia==128)
+    {
+      _LICE_Template_Blit0<_LICE_CombinePixelsHalfMixFAST>::scaleBlitFAST(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span);
+    }
+    else
+    {
+      _LICE_Template_Blit0<_LICE_CombinePixelsClobberFAST>::scaleBlitFAST(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span);
+    }
+  }
+  else
+  {
+    if (xadvance>=1.7 && yadvance >=1.7 && (mode&LICE_BLIT_FILTER_MASK)==LICE_BLIT_FILTER_BILINEAR)
+    {
+      int msc = max(idx,idy);
+      const int filtsz=msc>(3<<16) ? 5 : 3;
+      const int filt_start = - (filtsz/2);
+
+      int filter[25]; // 5x5 max
+      {
+        int y;
+      //  char buf[4096];
+    //    sprintf(buf,"filter, msc=%f: ",msc);
+        int *p=filter;
+        for(y=0;y<filtsz;y++)
+        {
+          int x;
+          for(x=0;x<filtsz;x++)
+          {
+            if (x==y && x==filtsz/2) *p++ = 65536; // src pix is always valued at 1.
+            else
+            {
+              double dx=x+filt_start;
+              double dy=y+filt_start;
+              double v = (msc-1.0) / sqrt(dx*dx+dy*dy); // this needs serious tweaking...
+
+  //            sprintf(buf+strlen(buf),"%f,",v);
+
+              if(v<0.0) *p++=0;
+              else if (v>1.0) *p++=65536;
+              else *p++=(int)(v*65536.0);
+            }
+          }
+        }
+//        OutputDebugString(buf);
+      }
+
+      #ifdef LICE_FAVOR_SIZE
+        LICE_COMBINEFUNC blitfunc=NULL;      
+        #define __LICE__ACTION(comb) blitfunc=comb::doPix;
+      #else
+        #define __LICE__ACTION(comb) _LICE_Template_Blit2<comb>::scaleBlitFilterDown(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,filter,filt_start,filtsz)
+      #endif
+          __LICE_ACTION_SRCALPHA(mode,ia,false);
+      #undef __LICE__ACTION
+
+      #ifdef LICE_FAVOR_SIZE
+        if (blitfunc) _LICE_Template_Blit2::scaleBlitFilterDown(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,filter,filt_start,filtsz,blitfunc);
+      #endif
+
+    }
+    else
+    {
+      #ifdef LICE_FAVOR_SIZE
+        LICE_COMBINEFUNC blitfunc=NULL;      
+        #define __LICE__ACTION(comb) blitfunc=comb::doPix;
+      #else
+        #define __LICE__ACTION(comb) _LICE_Template_Blit2<comb>::scaleBlit(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK)
+      #endif
+          __LICE_ACTION_SRCALPHA(mode,ia,false);
+      #undef __LICE__ACTION
+      #ifdef LICE_FAVOR_SIZE
+        if (blitfunc) _LICE_Template_Blit2::scaleBlit(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK,blitfunc);
+      #endif
+    }
+  }
+}
+
 void LICE_ScaledBlit(LICE_IBitmap *dest, LICE_IBitmap *src, 
                      int dstx, int dsty, int dstw, int dsth, 
                      float srcx, float srcy, float srcw, float srch, 
@@ -1150,85 +1258,45 @@ void LICE_ScaledBlit(LICE_IBitmap *dest, LICE_IBitmap *src,
 
   if (clip_r<1||clip_b<1) return;
 
-  int ia=(int)(alpha*256.0);
-
-  if ((mode&(LICE_BLIT_FILTER_MASK|LICE_BLIT_MODE_MASK|LICE_BLIT_USE_ALPHA))==LICE_BLIT_MODE_COPY && (ia==128 || ia==256))
-  {
-    if (ia==128)
-    {
-      _LICE_Template_Blit0<_LICE_CombinePixelsHalfMixFAST>::scaleBlitFAST(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span);
-    }
-    else
-    {
-      _LICE_Template_Blit0<_LICE_CombinePixelsClobberFAST>::scaleBlitFAST(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span);
-    }
-  }
-  else
-  {
-    if (xadvance>=1.7 && yadvance >=1.7 && (mode&LICE_BLIT_FILTER_MASK)==LICE_BLIT_FILTER_BILINEAR)
-    {
-      int msc = max(idx,idy);
-      const int filtsz=msc>(3<<16) ? 5 : 3;
-      const int filt_start = - (filtsz/2);
-
-      int filter[25]; // 5x5 max
-      {
-        int y;
-      //  char buf[4096];
-    //    sprintf(buf,"filter, msc=%f: ",msc);
-        int *p=filter;
-        for(y=0;y<filtsz;y++)
-        {
-          int x;
-          for(x=0;x<filtsz;x++)
-          {
-            if (x==y && x==filtsz/2) *p++ = 65536; // src pix is always valued at 1.
-            else
-            {
-              double dx=x+filt_start;
-              double dy=y+filt_start;
-              double v = (msc-1.0) / sqrt(dx*dx+dy*dy); // this needs serious tweaking...
+  LICE_ScaledBlit_rowsctx ctx = { pdest, psrc, dstw, icurx, icury, idx, idy, clip_r, clip_b, src_span, dest_span,
+                                  (int)(alpha*256.0), mode, xadvance, yadvance };
+  // rows are independent, so large blits can be split into bands (unless reading and writing the same pixels)
+  LICE_RunBands(dsth, LICE_BitmapsOverlap(dest,src) ? 0 : dstw*dsth, LICE_ScaledBlit_rows, &ctx);
+}
 
-  //            sprintf(buf+strlen(buf),"%f,",v);
+struct LICE_DeltaBlit_rowsctx
+{
+  LICE_pixel_chan *pdest, *psrc;
+  int dstw, isrcx, isrcy, idsdx, idtdx, idsdy, idtdy, idsdxdy, idtdxdy;
+  int sl, st, sr, sb, src_span, dest_span, ia, mode;
+};
 
-              if(v<0.0) *p++=0;
-              else if (v>1.0) *p++=65536;
-              else *p++=(int)(v*65536.0);
-            }
-          }
-        }
-//        OutputDebugString(buf);
-      }
+// does rows [y,y+dsth) of a LICE_DeltaBlit. the per-row steps are all integer adds, so starting
+// a band at row y gives exactly what stepping there from row 0 would
+static void LICE_DeltaBlit_rows(void *parm, int y, int dsth)
+{
+  const LICE_DeltaBlit_rowsctx *c = (const LICE_DeltaBlit_rowsctx *)parm;
+  LICE_pixel_chan *pdest = c->pdest + y*c->dest_span, *psrc = c->psrc;
+  const int dstw=c->dstw;
+  const int isrcx=c->isrcx + y*c->idsdy, isrcy=c->isrcy + y*c->idtdy;
+  const int idsdx=c->idsdx + y*c->idsdxdy, idtdx=c->idtdx + y*c->idtdxdy;
+  const int idsdy=c->idsdy, idtdy=c->idtdy, idsdxdy=c->idsdxdy, idtdxdy=c->idtdxdy;
+  const int sl=c->sl, st=c->st, sr=c->sr, sb=c->sb, src_span=c->src_span, dest_span=c->dest_span;
+  const int ia=c->ia, mode=c->mode;
 
-      #ifdef LICE_FAVOR_SIZE
-        LICE_COMBINEFUNC blitfunc=NULL;      
-        #define __LICE__ACTION(comb) blitfunc=comb::doPix;
-      #else
-        #define __LICE__ACTION(comb) _LICE_Template_Blit2<comb>::scaleBlitFilterDown(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,filter,filt_start,filtsz)
-      #endif
-          __LICE_ACTION_SRCALPHA(mode,ia,false);
-      #undef __LICE__ACTION
+#ifndef LICE_FAVOR_SPEED
+  LICE_COMBINEFUNC blitfunc=NULL;
+  #define __LICE__ACTION(comb) blitfunc = comb::doPix;
+#else
+  #define __LICE__ACTION(comb) _LICE_Template_Blit3<comb>::deltaBlit(pdest,psrc,dstw,dsth,isrcx,isrcy,idsdx,idtdx,idsdy,idtdy,idsdxdy,idtdxdy,sl,st,sr,sb,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK)
+#endif
+      __LICE_ACTION_SRCALPHA(mode,ia,false);
+  #undef __LICE__ACTION
 
-      #ifdef LICE_FAVOR_SIZE
-        if (blitfunc) _LICE_Template_Blit2::scaleBlitFilterDown(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,filter,filt_start,filtsz,blitfunc);
-      #endif
+#ifndef LICE_FAVOR_SPEED
+  if (blitfunc) _LICE_Template_Blit3::deltaBlit(pdest,psrc,dstw,dsth,isrcx,isrcy,idsdx,idtdx,idsdy,idtdy,idsdxdy,idtdxdy,sl,st,sr,sb,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK,blitfunc);
+#endif
 
-    }
-    else
-    {
-      #ifdef LICE_FAVOR_SIZE
-        LICE_COMBINEFUNC blitfunc=NULL;      
-        #define __LICE__ACTION(comb) blitfunc=comb::doPix;
-      #else
-        #define __LICE__ACTION(comb) _LICE_Template_Blit2<comb>::scaleBlit(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK)
-      #endif
-          __LICE_ACTION_SRCALPHA(mode,ia,false);
-      #undef __LICE__ACTION
-      #ifdef LICE_FAVOR_SIZE
-        if (blitfunc) _LICE_Template_Blit2::scaleBlit(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK,blitfunc);
-      #endif
-    }
-  }
 }
 
 void LICE_DeltaBlit(LICE_IBitmap *dest, LICE_IBitmap *src, 
@@ -1320,19 +1388,9 @@ void LICE_DeltaBlit(LICE_IBitmap *dest, LICE_IBitmap *src,
   int idsdxdy=(int)(dsdxdy*65536.0);
   int idtdxdy=(int)(dtdxdy*65536.0);
 
-#ifndef LICE_FAVOR_SPEED
-  LICE_COMBINEFUNC blitfunc=NULL;
-  #define __LICE__ACTION(comb) blitfunc = comb::doPix;
-#else
-  #define __LICE__ACTION(comb) _LICE_Template_Blit3<comb>::deltaBlit(pdest,psrc,dstw,dsth,isrcx,isrcy,idsdx,idtdx,idsdy,idtdy,idsdxdy,idtdxdy,sl,st,sr,sb,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK)
-#endif
-      __LICE_ACTION_SRCALPHA(mode,ia,false);
-  #undef __LICE__ACTION
-
-#ifndef LICE_FAVOR_SPEED
-  if (blitfunc) _LICE_Template_Blit3::deltaBlit(pdest,psrc,dstw,dsth,isrcx,isrcy,idsdx,idtdx,idsdy,idtdy,idsdxdy,idtdxdy,sl,st,sr,sb,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK,blitfunc);
-#endif
-
+  LICE_DeltaBlit_rowsctx ctx = { pdest, psrc, dstw, isrcx, isrcy, idsdx, idtdx, idsdy, idtdy, idsdxdy, idtdxdy,
+                                 sl, st, sr, sb, src_span, dest_span, ia, mode };
+  LICE_RunBands(dsth, LICE_BitmapsOverlap(dest,src) ? 0 : dstw*dsth, LICE_DeltaBlit_rows, &ctx);
 }
                       
 
@@ -1562,6 +1620,48 @@ void LICE_ProcessRect(LICE_IBitmap *dest, int x, int y, int w, int h, void (*pro
 
 }
 
+struct LICE_ProcessRectRows_ctx
+{
+  LICE_pixel *p;
+  int sp, w;
+  void (*rowFunc)(LICE_pixel *p, int n, void *parm);
+  void *parm;
+};
+
+static void LICE_ProcessRectRows_band(void *ctx, int y, int h)
+{
+  const LICE_ProcessRectRows_ctx *c = (const LICE_ProcessRectRows_ctx *)ctx;
+  LICE_pixel *p = c->p + y*c->sp;
+  while (h--)
+  {
+    c->rowFunc(p,c->w,c->parm);
+    p+=c->sp;
+  }
+}
+
+void LICE_ProcessRectRows(LICE_IBitmap *dest, int x, int y, int w, int h, void (*rowFunc)(LICE_pixel *p, int n, void *parm), void *parm)
+{
+  if (!dest||!rowFunc) return;
+  LICE_pixel *p=dest->getBits();
+
+  if (x<0) { w+=x; x=0; }
+  if (y<0) { h+=y; y=0; }
+  if (x+w>dest->getWidth()) w=dest->getWidth()-x;
+  if (y+h>dest->getHeight()) h=dest->getHeight()-y;
+
+  int sp=dest->getRowSpan();
+  if (!p || w<1 || h<1 || sp<1) return;
+
+  if (dest->isFlipped())
+  {
+    p+=(dest->getHeight() - y - h)*sp;
+  }
+  else p+=sp*y;
+
+  LICE_ProcessRectRows_ctx ctx = { p + x, sp, w, rowFunc, parm };
+  LICE_RunBands(h,w*h,LICE_ProcessRectRows_band,&ctx);
+}
+
 void LICE_FillRect(LICE_IBitmap *dest, int x, int y, int w, int h, LICE_pixel color, float alpha, int mode)
 {
   if (!dest) return;
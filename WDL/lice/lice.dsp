@@ -767,6 +767,42 @@ SOURCE=.\lice_jpg_write.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\lice_resample.cpp
+
+!IF  "$(CFG)" == "lice - Win32 Release"
+
+# ADD CPP /D "USE_ICC"
+
+!ELSEIF  "$(CFG)" == "lice - Win32 Debug"
+
+!ELSEIF  "$(CFG)" == "lice - Win32 Release Profile"
+
+# ADD BASE CPP /D "USE_ICC"
+# ADD CPP /D "USE_ICC"
+
+!ENDIF 
+
+# End Source File
+# Begin Source File
+
+SOURCE=.\lice_parallel.cpp
+
+!IF  "$(CFG)" == "lice - Win32 Release"
+
+# ADD CPP /D "USE_ICC"
+
+!ELSEIF  "$(CFG)" == "lice - Win32 Debug"
+
+!ELSEIF  "$(CFG)" == "lice - Win32 Release Profile"
+
+# ADD BASE CPP /D "USE_ICC"
+# ADD CPP /D "USE_ICC"
+
+!ENDIF 
+
+# End Source File
+# Begin Source File
+
 SOURCE=.\lice_line.cpp
 
 !IF  "$(CFG)" == "lice - Win32 Release"
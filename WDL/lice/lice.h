@@ -314,14 +314,21 @@ class LICE_SubBitmap : public LICE_IBitmap // note: you should only keep these a
 
 // dispatch to a linked loader implementation based on file extension 
 LICE_IBitmap* LICE_LoadImage(const char* filename, LICE_IBitmap* bmp=NULL, bool tryIgnoreExtension=false);
+// same, but the result may be smaller than the source when the loader can cheaply decode at reduced size (JPEG).
+// the returned bitmap will still be at least as large as the source fit to want_w x want_h. srcw_out/srch_out receive the full source size.
+LICE_IBitmap* LICE_LoadImageScaled(const char* filename, int want_w, int want_h, LICE_IBitmap* bmp=NULL, bool tryIgnoreExtension=false, int *srcw_out=NULL, int *srch_out=NULL);
 char *LICE_GetImageExtensionList(bool wantAllSup=true, bool wantAllFiles=true); // returns doublenull terminated GetOpenFileName() style list -- free() when done.
 bool LICE_ImageIsSupported(const char *filename);  // must be a filename that ends in .jpg, etc. if you want to check the extension, pass .ext
 
 
+// strip decoding: proc gets the decoded w x h image band_rows at a time, band (reused) holds rows y..y+band->getHeight()-1. return false to abort.
+typedef bool (*LICE_ReadRowsProc)(void *ctx, int w, int h, int y, LICE_IBitmap *band);
+
 // pass a bmp if you wish to load it into that bitmap. note that if it fails bmp will not be deleted.
 LICE_IBitmap *LICE_LoadPNG(const char *filename, LICE_IBitmap *bmp=NULL); // returns a bitmap (bmp if nonzero) on success
 LICE_IBitmap *LICE_LoadPNGFromMemory(const void *data_in, int buflen, LICE_IBitmap *bmp=NULL);
 LICE_IBitmap *LICE_LoadPNGFromResource(HINSTANCE hInst, int resid, LICE_IBitmap *bmp=NULL); // returns a bitmap (bmp if nonzero) on success
+bool LICE_LoadPNGRowsFromMemory(const void *data_in, int buflen, int band_rows, LICE_ReadRowsProc proc, void *ctx, int *srcw_out=NULL, int *srch_out=NULL); // fails on interlaced PNGs
 #ifndef _WIN32
 LICE_IBitmap *LICE_LoadPNGFromNamedResource(const char *name, LICE_IBitmap *bmp=NULL); // returns a bitmap (bmp if nonzero) on success
 #endif
@@ -333,7 +340,11 @@ LICE_IBitmap *LICE_LoadIcon(const char *filename, int reqiconsz=16, LICE_IBitmap
 LICE_IBitmap *LICE_LoadIconFromResource(HINSTANCE hInst, int resid, int reqiconsz=16, LICE_IBitmap *bmp=NULL); // returns a bitmap (bmp if nonzero) on success
 
 LICE_IBitmap *LICE_LoadJPG(const char *filename, LICE_IBitmap *bmp=NULL);
+LICE_IBitmap *LICE_LoadJPGScaled(const char *filename, int want_w, int want_h, LICE_IBitmap *bmp=NULL, int *srcw_out=NULL, int *srch_out=NULL); // decodes at 1/2, 1/4 or 1/8 size if that still covers want_w x want_h
 LICE_IBitmap* LICE_LoadJPGFromResource(HINSTANCE hInst, int resid, LICE_IBitmap* bmp = 0);
+LICE_IBitmap *LICE_LoadJPGFromMemory(const void *data_in, int buflen, LICE_IBitmap *bmp=NULL);
+LICE_IBitmap *LICE_LoadJPGFromMemoryScaled(const void *data_in, int buflen, int want_w, int want_h, LICE_IBitmap *bmp=NULL, int *srcw_out=NULL, int *srch_out=NULL); // as LICE_LoadJPGScaled()
+bool LICE_LoadJPGRowsFromMemory(const void *data_in, int buflen, int want_w, int want_h, int band_rows, LICE_ReadRowsProc proc, void *ctx, int *srcw_out=NULL, int *srch_out=NULL); // want_w/want_h as LICE_LoadJPGScaled()
 
 LICE_IBitmap *LICE_LoadGIF(const char *filename, LICE_IBitmap *bmp=NULL, int *nframes=NULL); // if nframes set, will be set to number of images (stacked vertically), otherwise first frame used
 
@@ -342,8 +353,17 @@ LICE_IBitmap *LICE_LoadPCX(const char *filename, LICE_IBitmap *bmp=NULL); // ret
 LICE_IBitmap *LICE_LoadSVG(const char *filename, LICE_IBitmap *bmp=NULL);
 
 // bitmap saving
+class WDL_HeapBuf;
 bool LICE_WritePNG(const char *filename, LICE_IBitmap *bmp, bool wantalpha=true);
+bool LICE_WritePNGToMemory(WDL_HeapBuf *out, LICE_IBitmap *bmp, bool wantalpha=true); // appends to out
 bool LICE_WriteJPG(const char *filename, LICE_IBitmap *bmp, int quality=95, bool force_baseline=true);
+bool LICE_WriteJPGToMemory(WDL_HeapBuf *out, LICE_IBitmap *bmp, int quality=95, bool force_baseline=true); // appends to out
+
+// streaming: proc fills band (w x nrows, reused between calls) with output rows y..y+nrows-1, nrows <= band_rows,
+// and returns false to abort. only one band exists at a time, so the whole image never needs to be in memory.
+typedef bool (*LICE_WriteRowsProc)(void *ctx, LICE_IBitmap *band, int y, int nrows);
+bool LICE_WriteJPGRowsToMemory(WDL_HeapBuf *out, int w, int h, int band_rows, LICE_WriteRowsProc proc, void *ctx, int quality=95, bool force_baseline=true); // appends to out
+bool LICE_WritePNGRowsToMemory(WDL_HeapBuf *out, int w, int h, int band_rows, LICE_WriteRowsProc proc, void *ctx, bool wantalpha=true); // appends to out
 bool LICE_WriteGIF(const char *filename, LICE_IBitmap *bmp, int transparent_alpha=0, bool dither=true); // if alpha<transparent_alpha then transparent. if transparent_alpha<0, then intra-frame checking is used
 
 // animated GIF API. use transparent_alpha=-1 to encode unchanged pixels as transparent
@@ -373,6 +393,38 @@ void LICE_ScaledBlit(LICE_IBitmap *dest, LICE_IBitmap *src, int dstx, int dsty,
                      float srcx, float srcy, float srcw, float srch, float alpha, int mode);
 
 
+// separable filtered resample of a source rect into a dest rect (always copies, ignores alpha). rot is clockwise in 90 degree steps,
+// dstw/dsth are the size after rotation. box is area averaging, mitchell is a good general default, lanczos3 is sharpest.
+// much higher quality than LICE_ScaledBlit's bilinear on large reductions, and faster there too. returns false on bad params/alloc failure.
+// if dstclip is set only dest pixels inside it are computed, so an output can be produced in independent tiles.
+#define LICE_RESAMPLE_BOX 0
+#define LICE_RESAMPLE_MITCHELL 1
+#define LICE_RESAMPLE_LANCZOS3 2
+// filter weights for resampling srcw x srch to dstw x dsth (after rotation). when an output is produced in tiles,
+// build once and pass to each LICE_Resample call rather than having every call build its own (weights that don't
+// match the call's size/filter/rotation are ignored). read-only once built, so tiles can share it across threads.
+class LICE_ResampleAxis;
+class LICE_ResampleWeights
+{
+public:
+  LICE_ResampleWeights();
+  ~LICE_ResampleWeights();
+
+  bool Build(int dstw, int dsth, int srcw, int srch, int filter, int rot=0); // false on bad params/alloc failure
+  bool Matches(int dstw, int dsth, int srcw, int srch, int filter, int rot=0) const;
+
+  LICE_ResampleAxis *m_hax, *m_vax; // in source orientation
+  int m_dstw, m_dsth, m_srcw, m_srch, m_filter, m_rot;
+
+private:
+  LICE_ResampleWeights(const LICE_ResampleWeights &);
+  LICE_ResampleWeights &operator=(const LICE_ResampleWeights &);
+};
+
+bool LICE_Resample(LICE_IBitmap *dest, LICE_IBitmap *src, int dstx, int dsty, int dstw, int dsth,
+                   int srcx, int srcy, int srcw, int srch, int filter, int rot=0, const RECT *dstclip=NULL,
+                   const LICE_ResampleWeights *weights=NULL);
+
 void LICE_HalveBlitAA(LICE_IBitmap *dest, LICE_IBitmap *src); // AA's src down to dest. uses the minimum size of both (use with LICE_SubBitmap to do sections)
 
 // if cliptosourcerect is false, then areas outside the source rect can get in (otherwise they are not drawn)
@@ -413,6 +465,22 @@ void LICE_GradRect(LICE_IBitmap *dest, int dstx, int dsty, int dstw, int dsth,
 
 void LICE_FillRect(LICE_IBitmap *dest, int x, int y, int w, int h, LICE_pixel color, float alpha = 1.0f, int mode = 0);
 void LICE_ProcessRect(LICE_IBitmap *dest, int x, int y, int w, int h, void (*procFunc)(LICE_pixel *p, void *parm), void *parm);
+// like LICE_ProcessRect but rowFunc gets a row (n pixels) at a time. rows may be processed in parallel (see LICE_SetThreadCount)
+void LICE_ProcessRectRows(LICE_IBitmap *dest, int x, int y, int w, int h, void (*rowFunc)(LICE_pixel *p, int n, void *parm), void *parm);
+
+// fused adjustment in one pass over the pixels: HSV shift (same as LICE_AlterRectHSV), then optionally grayscale ((r+g+b)/3),
+// then optionally lut[] (256 entries) applied to r/g/b (or to the gray value). alpha is kept.
+void LICE_AdjustRect(LICE_IBitmap *dest, int x, int y, int w, int h, float dH, float dS, float dV, bool gray, const unsigned char *lut);
+
+// optional multithreading: LICE_ScaledBlit, LICE_DeltaBlit and LICE_AlterRectHSV split rects of at least min_pixels
+// into row bands and run them on a thread pool (the caller does a share too). output is identical to single threaded.
+// off by default (nthreads<=1). don't call while other threads are using LICE; LICE_SetThreadCount(0) frees the pool.
+// if the pool is already busy with another thread's call, the work just runs on the calling thread.
+void LICE_SetThreadCount(int nthreads, int min_pixels=256*1024);
+int LICE_GetThreadCount();
+// runs proc(ctx,y,h) over rows [0,nrows) in bands, in parallel when enabled and npixels>=min_pixels (pass 0 to force serial).
+// proc must only touch its own rows. returns once all rows are done.
+void LICE_RunBands(int nrows, int npixels, void (*proc)(void *ctx, int y, int h), void *ctx);
 
 void LICE_Clear(LICE_IBitmap *dest, LICE_pixel color);
 void LICE_ClearRect(LICE_IBitmap *dest, int x, int y, int w, int h, LICE_pixel mask=0, LICE_pixel orbits=0);
@@ -546,6 +614,7 @@ void LICE_TestPalette(LICE_IBitmap* bmp, LICE_pixel* palette, int numcolors);
 struct _LICE_ImageLoader_rec
 {
   LICE_IBitmap *(*loadfunc)(const char *filename, bool checkFileName, LICE_IBitmap *bmpbase); 
+  LICE_IBitmap *(*loadfunc_scaled)(const char *filename, bool checkFileName, LICE_IBitmap *bmpbase, int want_w, int want_h, int *srcw_out, int *srch_out); // optional, NULL if loader can only decode full size
   const char *(*get_extlist)(); // returns GetOpenFileName sort of list "JPEG files (*.jpg)\0*.jpg\0"
 
   struct _LICE_ImageLoader_rec *_next;
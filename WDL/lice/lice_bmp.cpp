@@ -88,6 +88,7 @@ public:
   LICE_BMPLoader() 
   {
     rec.loadfunc = loadfunc;
+    rec.loadfunc_scaled = NULL;
     rec.get_extlist = get_extlist;
     rec._next = LICE_ImageLoader_list;
     LICE_ImageLoader_list = &rec;
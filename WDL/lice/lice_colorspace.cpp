@@ -45,6 +45,82 @@ void LICE_AlterBitmapHSV(LICE_IBitmap* src, float dH, float dS, float dV) // H i
   if (src) LICE_AlterRectHSV(src,0,0,src->getWidth(),src->getHeight(),dH,dS,dV);
 }
 
+// tables of HSV translations with clip/clamp, h is [0,384)
+static void LICE_MakeHSVTables(int dHi, int dSi, int dVi, unsigned char *stab, unsigned char *vtab, short *htab)
+{
+  int x;
+  for(x=0;x<256;x++)
+  {
+    int a=x+dSi;
+    if(a<0)a=0; else if (a>255)a=255;
+    stab[x]=a;
+
+    a=x+dVi;
+    if(a<0)a=0; else if (a>255)a=255;
+    vtab[x]=a;
+
+    a=x+dHi;
+    if(a<0)a+=384; else if (a>=384)a-=384;
+    htab[x]=a;
+  }
+  for(;x<384;x++)
+  {
+    int a=x+dHi;
+    if(a<0)a+=384; else if (a>=384)a-=384;
+    htab[x]=a;
+  }
+}
+
+struct LICE_AlterRectHSV_rowsctx
+{
+  LICE_pixel *px;
+  int span, w;
+  int dHi, dSi, dVi;
+  const unsigned char *stab, *vtab; // tables are only used for larger rects
+  const short *htab;
+};
+
+static void LICE_AlterRectHSV_rows(void *parm, int y, int h)
+{
+  const LICE_AlterRectHSV_rowsctx *c = (const LICE_AlterRectHSV_rowsctx *)parm;
+  const int span=c->span, w=c->w;
+  LICE_pixel *px = c->px + y*span;
+
+  if (c->htab)
+  {
+    const unsigned char *stab=c->stab, *vtab=c->vtab;
+    const short *htab=c->htab;
+    while (h-->0)
+    {
+      LICE_pixel* tpx = px;
+      px+=span;
+      int xi=w;
+      while (xi-->0)
+      {
+        LICE_pixel color = *tpx;
+        int h,s,v;
+        LICE_RGB2HSV(LICE_GETR(color), LICE_GETG(color), LICE_GETB(color), &h, &s, &v);
+        *tpx++ = LICE_HSV2Pix(htab[h],stab[s],vtab[v],LICE_GETA(color));
+      }
+    }
+  }
+  else
+  {
+    const int dHi=c->dHi, dSi=c->dSi, dVi=c->dVi;
+    while (h-->0)
+    {
+      LICE_pixel* tpx = px;
+      px+=span;
+      int xi=w;
+      while (xi-->0)
+      {
+        *tpx = LICE_AlterColorHSV_int(*tpx, dHi, dSi, dVi);
+        tpx++;
+      }
+    }
+  }
+}
+
 void LICE_AlterRectHSV(LICE_IBitmap* src, int x, int y, int w, int h, float dH, float dS, float dV) // H is rolled over, S and V are clamped
 {
   if (!src) return;
@@ -76,59 +152,129 @@ void LICE_AlterRectHSV(LICE_IBitmap* src, int x, int y, int w, int h, float dH,
 
   if (!dHi && !dSi && !dVi) return; // no mod
 
+  LICE_AlterRectHSV_rowsctx ctx = { px, span, w, dHi, dSi, dVi, NULL, NULL, NULL };
+
+  // larger rects use tables of the HSV translations
+  unsigned char stab[256], vtab[256];
+  short htab[384];
   if (w*h > 8192)
   {
-    // generate a table of HSV translations with clip/clamp
-    unsigned char stab[256], vtab[256];
-    short htab[384];
-    int x;
-    for(x=0;x<256;x++)
-    {
-      int a=x+dSi;
-      if(a<0)a=0; else if (a>255)a=255;
-      stab[x]=a;
+    LICE_MakeHSVTables(dHi,dSi,dVi,stab,vtab,htab);
+    ctx.stab=stab;
+    ctx.vtab=vtab;
+    ctx.htab=htab;
+  }
 
-      a=x+dVi;
-      if(a<0)a=0; else if (a>255)a=255;
-      vtab[x]=a;
+  LICE_RunBands(h, w*h, LICE_AlterRectHSV_rows, &ctx);
+}
 
-      a=x+dHi;
-      if(a<0)a+=384; else if (a>=384)a-=384;
-      htab[x]=a;
-    }
-    for(;x<384;x++)
-    {
-      int a=x+dHi;
-      if(a<0)a+=384; else if (a>=384)a-=384;
-      htab[x]=a;
-    }
 
-    while (h-->0)
+#if !defined(LICE_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LICE_ADJUST_SSE2
+#include <emmintrin.h>
+#endif
+
+struct LICE_AdjustRect_ctx
+{
+  const unsigned char *stab, *vtab; // NULL if no HSV adjustment
+  const short *htab;
+  const unsigned char *lut;
+  bool gray;
+};
+
+// (r+g+b)/3 of 4 pixels at a time, alpha kept. works for any channel order since alpha is masked off before summing
+#ifdef LICE_ADJUST_SSE2
+static int LICE_AdjustRow_gray_sse2(LICE_pixel *p, int n)
+{
+  const __m128i amask = _mm_set1_epi32((int)LICE_RGBA(0,0,0,255));
+  const __m128i bmask = _mm_set1_epi32(0xff);
+  const __m128i third = _mm_set1_epi32(21846); // (x*21846)>>16 == x/3 for x <= 765
+  int i=0;
+  for (; i+4 <= n; i += 4)
+  {
+    const __m128i px = _mm_loadu_si128((const __m128i *)(p+i));
+    const __m128i c = _mm_andnot_si128(amask,px);
+    __m128i sum = _mm_add_epi32(_mm_and_si128(c,bmask),_mm_and_si128(_mm_srli_epi32(c,8),bmask));
+    sum = _mm_add_epi32(sum,_mm_and_si128(_mm_srli_epi32(c,16),bmask));
+    sum = _mm_add_epi32(sum,_mm_srli_epi32(c,24));
+    const __m128i s = _mm_mulhi_epu16(sum,third); // high 16 bits of each lane are zero, so stay zero
+    __m128i o = _mm_or_si128(s,_mm_slli_epi32(s,8));
+    o = _mm_or_si128(o,_mm_slli_epi32(o,16));
+    _mm_storeu_si128((__m128i *)(p+i),_mm_or_si128(_mm_andnot_si128(amask,o),_mm_and_si128(px,amask)));
+  }
+  return i;
+}
+#endif
+
+static void LICE_AdjustRect_row(LICE_pixel *p, int n, void *parm)
+{
+  const LICE_AdjustRect_ctx *c = (const LICE_AdjustRect_ctx *)parm;
+  const unsigned char *lut = c->lut;
+
+  if (!c->htab && !lut)
+  {
+    if (!c->gray) return;
+#ifdef LICE_ADJUST_SSE2
+    const int done = LICE_AdjustRow_gray_sse2(p,n);
+    p += done;
+    n -= done;
+#endif
+    while (n-->0)
     {
-      LICE_pixel* tpx = px;
-      px+=span;
-      int xi=w;
-      while (xi-->0)
-      {
-        LICE_pixel color = *tpx;
-        int h,s,v;
-        LICE_RGB2HSV(LICE_GETR(color), LICE_GETG(color), LICE_GETB(color), &h, &s, &v);
-        *tpx++ = LICE_HSV2Pix(htab[h],stab[s],vtab[v],LICE_GETA(color));
-      }
+      const LICE_pixel pix=*p;
+      const int s = (LICE_GETR(pix)+LICE_GETG(pix)+LICE_GETB(pix))/3;
+      *p++ = LICE_RGBA(s,s,s,LICE_GETA(pix));
     }
+    return;
   }
-  else
+
+  const unsigned char *stab=c->stab, *vtab=c->vtab;
+  const short *htab=c->htab;
+  const bool gray=c->gray;
+  while (n-->0)
   {
-    while (h-->0)
+    LICE_pixel pix=*p;
+    if (htab)
     {
-      LICE_pixel* tpx = px;
-      px+=span;
-      int xi=w;
-      while (xi-->0)
-      {
-        *tpx = LICE_AlterColorHSV_int(*tpx, dHi, dSi, dVi);
-        tpx++;
-      }
+      int h,s,v;
+      LICE_RGB2HSV(LICE_GETR(pix), LICE_GETG(pix), LICE_GETB(pix), &h, &s, &v);
+      pix = LICE_HSV2Pix(htab[h],stab[s],vtab[v],LICE_GETA(pix));
+    }
+    if (gray)
+    {
+      int s = (LICE_GETR(pix)+LICE_GETG(pix)+LICE_GETB(pix))/3;
+      if (lut) s = lut[s];
+      pix = LICE_RGBA(s,s,s,LICE_GETA(pix));
     }
+    else if (lut)
+    {
+      pix = LICE_RGBA(lut[LICE_GETR(pix)],lut[LICE_GETG(pix)],lut[LICE_GETB(pix)],LICE_GETA(pix));
+    }
+    *p++ = pix;
+  }
+}
+
+void LICE_AdjustRect(LICE_IBitmap *dest, int x, int y, int w, int h, float dH, float dS, float dV, bool gray, const unsigned char *lut)
+{
+  if (!dest) return;
+
+  int dHi = (int)(dH*384.0f);
+  int dSi = (int)(dS*255.0f);
+  int dVi = (int)(dV*255.0f);
+  if (dHi > 383) dHi=383;
+  else if (dHi < -383) dHi=-383;
+
+  unsigned char stab[256], vtab[256];
+  short htab[384];
+  LICE_AdjustRect_ctx ctx = { NULL, NULL, NULL, lut, gray };
+  if (dHi || dSi || dVi)
+  {
+    LICE_MakeHSVTables(dHi,dSi,dVi,stab,vtab,htab);
+    ctx.stab=stab;
+    ctx.vtab=vtab;
+    ctx.htab=htab;
   }
+  else if (!gray && !lut) return;
+
+  LICE_ProcessRectRows(dest,x,y,w,h,LICE_AdjustRect_row,&ctx);
 }
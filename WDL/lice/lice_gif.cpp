@@ -133,6 +133,7 @@ public:
   LICE_GIFLoader() 
   {
     rec.loadfunc = loadfunc;
+    rec.loadfunc_scaled = NULL;
     rec.get_extlist = get_extlist;
     rec._next = LICE_ImageLoader_list;
     LICE_ImageLoader_list = &rec;
@@ -160,6 +160,7 @@ public:
   LICE_ICOLoader() 
   {
     rec.loadfunc = loadfunc;
+    rec.loadfunc_scaled = NULL;
     rec.get_extlist = get_extlist;
     rec._next = LICE_ImageLoader_list;
     LICE_ImageLoader_list = &rec;
@@ -25,6 +25,49 @@ LICE_IBitmap* LICE_LoadImage(const char* filename, LICE_IBitmap* bmp, bool tryIg
   return 0;
 }
 
+static LICE_IBitmap *LoadImageScaledPass(_LICE_ImageLoader_rec *hdr, const char *filename, bool checkFileName, 
+                                         int want_w, int want_h, LICE_IBitmap *bmp, int *srcw_out, int *srch_out)
+{
+  LICE_IBitmap *ret;
+  if (hdr->loadfunc_scaled) 
+  {
+    ret = hdr->loadfunc_scaled(filename,checkFileName,bmp,want_w,want_h,srcw_out,srch_out);
+  }
+  else
+  {
+    ret = hdr->loadfunc(filename,checkFileName,bmp);
+    if (ret)
+    {
+      if (srcw_out) *srcw_out = ret->getWidth();
+      if (srch_out) *srch_out = ret->getHeight();
+    }
+  }
+  return ret;
+}
+
+LICE_IBitmap* LICE_LoadImageScaled(const char* filename, int want_w, int want_h, LICE_IBitmap* bmp, bool tryIgnoreExtension, int *srcw_out, int *srch_out)
+{
+  _LICE_ImageLoader_rec *hdr = LICE_ImageLoader_list;
+  while (hdr)
+  {
+    LICE_IBitmap *ret = LoadImageScaledPass(hdr,filename,true,want_w,want_h,bmp,srcw_out,srch_out);
+    if (ret) return ret;
+    hdr=hdr->_next;
+  }
+  if (tryIgnoreExtension)
+  {
+    hdr = LICE_ImageLoader_list;
+    while (hdr)
+    {
+      LICE_IBitmap *ret = LoadImageScaledPass(hdr,filename,false,want_w,want_h,bmp,srcw_out,srch_out);
+      if (ret) return ret;
+      hdr=hdr->_next;
+    }
+  }
+
+  return 0;
+}
+
 
 static bool grow_buf(char **buf, int *bufsz, int *wrpos, const char *rd, int len)
 {
@@ -66,116 +66,204 @@ LICE_IBitmap *LICE_LoadJPGFromResource(HINSTANCE hInst, int resid, LICE_IBitmap
   const void* pResourceData = LockResource(res);
   if(!pResourceData) return NULL;
 
-  unsigned char *data = (unsigned char *)pResourceData;
+  return LICE_LoadJPGFromMemory(pResourceData, imageSize, bmp);
+#else
+  return 0;
+#endif
+}
 
-  struct jpeg_decompress_struct cinfo;
-  struct my_error_mgr jerr={0,};
+
+// strip decoding: rows go to proc a band at a time, through band
+struct lice_jpg_rowdest {
+  LICE_IBitmap *band;
+  int band_rows;
+  LICE_ReadRowsProc proc;
+  void *ctx;
+};
+
+// reads the header and decodes cinfo (source already set up) into bmp, or into rows if set, scaled as LICE_LoadJPGScaled(). 
+// errors longjmp to the caller, returns NULL if bmp could not be sized (or rows->proc aborted). the caller destroys cinfo.
+static LICE_IBitmap *LICEJPEG_Decode(struct jpeg_decompress_struct *cinfo, int want_w, int want_h, LICE_IBitmap *bmp, int *srcw_out, int *srch_out,
+                                     const lice_jpg_rowdest *rows=NULL)
+{
   JSAMPARRAY buffer;
   int row_stride;
 
-  jerr.pub.error_exit = LICEJPEG_Error;
-  jerr.pub.emit_message = LICEJPEG_EmitMsg;
-  jerr.pub.output_message = LICEJPEG_OutMsg;
-  jerr.pub.format_message = LICEJPEG_FmtMsg;
-  jerr.pub.reset_error_mgr = LICEJPEG_reset_error_mgr;
+  jpeg_read_header(cinfo, TRUE);
 
-  cinfo.err = &jerr.pub;
+  if (srcw_out) *srcw_out = cinfo->image_width;
+  if (srch_out) *srch_out = cinfo->image_height;
 
-  if (setjmp(jerr.setjmp_buffer)) 
+  if (want_w > 0 || want_h > 0)
   {
-    jpeg_destroy_decompress(&cinfo);
-    return 0;
-  }
-  jpeg_create_decompress(&cinfo);
+    // have the IDCT downsample by 1/2, 1/4 or 1/8, provided the output still 
+    // covers want_w x want_h once fit to that box
+    double fit = 1.0;
+    if (want_w > 0 && (int)cinfo->image_width > want_w) fit = want_w / (double)cinfo->image_width;
+    if (want_h > 0 && (int)cinfo->image_height * fit > want_h) fit = want_h / (double)cinfo->image_height;
 
-  cinfo.src = (struct jpeg_source_mgr *) (*cinfo.mem->alloc_small) ((j_common_ptr) &cinfo, JPOOL_PERMANENT, sizeof (struct jpeg_source_mgr));
-  
-  cinfo.src->init_source = LICEJPEG_init_source;
-  cinfo.src->fill_input_buffer = LICEJPEG_fill_input_buffer;
-  cinfo.src->skip_input_data = LICEJPEG_skip_input_data;
-  cinfo.src->resync_to_restart = jpeg_resync_to_restart;	
-  cinfo.src->term_source = LICEJPEG_term_source;
+    int denom = 8;
+    while (denom > 1 && fit * denom > 1.0) denom /= 2;
 
-  cinfo.src->next_input_byte = data;
-  cinfo.src->bytes_in_buffer = imageSize;
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = denom;
+  }
 
-  jpeg_read_header(&cinfo, TRUE);
-  jpeg_start_decompress(&cinfo);
+  jpeg_start_decompress(cinfo);
 
-  row_stride = cinfo.output_width * cinfo.output_components;
+  row_stride = cinfo->output_width * cinfo->output_components;
 
-  buffer = (*cinfo.mem->alloc_sarray) ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
+  buffer = (*cinfo->mem->alloc_sarray)
+		((j_common_ptr) cinfo, JPOOL_IMAGE, row_stride, 1);
 
-  if (bmp)
+  const int outw = cinfo->output_width, outh = cinfo->output_height;
+  if (rows)
+  {
+    bmp = rows->band;
+  }
+  else if (bmp)
   {
-    bmp->resize(cinfo.output_width,cinfo.output_height);
-    if (bmp->getWidth() != (int)cinfo.output_width || bmp->getHeight() != (int)cinfo.output_height) 
+    bmp->resize(outw,outh);
+    if (bmp->getWidth() != outw || bmp->getHeight() != outh) 
     {
-      jpeg_finish_decompress(&cinfo);
-      jpeg_destroy_decompress(&cinfo);
+      jpeg_abort_decompress(cinfo);
       return 0;
     }
   }
-  else bmp=new LICE_MemBitmap(cinfo.output_width,cinfo.output_height);
+  else bmp=new LICE_MemBitmap(outw,outh);
 
-  LICE_pixel *bmpptr = bmp->getBits();
-  int dbmpptr=bmp->getRowSpan();
-  if (bmp->isFlipped())
-  {
-    bmpptr += dbmpptr*(bmp->getHeight()-1);
-    dbmpptr=-dbmpptr;
-  }
+  int bmp_y = 0, bmp_h = rows ? 0 : outh; // output rows currently in bmp
+
+  while (cinfo->output_scanline < cinfo->output_height) {
+    const int y = cinfo->output_scanline;
+    if (y >= bmp_y + bmp_h)
+    {
+      // strip decoding: hand over the full band and start the next
+      if (bmp_h && !rows->proc(rows->ctx,outw,outh,bmp_y,bmp))
+      {
+        jpeg_abort_decompress(cinfo);
+        return 0;
+      }
+      bmp_h = outh - y < rows->band_rows ? outh - y : rows->band_rows;
+      bmp->resize(outw,bmp_h);
+      if (bmp->getWidth() != outw || bmp->getHeight() != bmp_h)
+      {
+        jpeg_abort_decompress(cinfo);
+        return 0;
+      }
+      bmp_y = y;
+    }
+    LICE_pixel *bmpptr = bmp->getBits() + (bmp->isFlipped() ? bmp_h-1-(y-bmp_y) : y-bmp_y) * bmp->getRowSpan();
 
-  while (cinfo.output_scanline < cinfo.output_height)
-  {
     /* jpeg_read_scanlines expects an array of pointers to scanlines.
      * Here the array is only one element long, but you could ask for
      * more than one scanline at a time if that's more convenient.
      */
-    jpeg_read_scanlines(&cinfo, buffer, 1);
+    jpeg_read_scanlines(cinfo, buffer, 1);
     /* Assume put_scanline_someplace wants a pointer and sample count. */
 //    put_scanline_someplace(buffer[0], row_stride);
-    if (cinfo.output_components==3)
+    if (cinfo->output_components==3)
     {
       int x;
-      for (x = 0; x < (int)cinfo.output_width; x++)
+      for (x = 0; x < (int)cinfo->output_width; x++)
       {
         bmpptr[x]=LICE_RGBA(buffer[0][x*3],buffer[0][x*3+1],buffer[0][x*3+2],255);
       }
     }
-    else if (cinfo.output_components==1)
+    else if (cinfo->output_components==1)
     {
       int x;
-      for (x = 0; x < (int)cinfo.output_width; x++)
+      for (x = 0; x < (int)cinfo->output_width; x++)
       {
         int v=buffer[0][x];
         bmpptr[x]=LICE_RGBA(v,v,v,255);
       }
     }
     else
-    {
-      memset(bmpptr,0,4*cinfo.output_width);
-    }
-    bmpptr+=dbmpptr;
+      memset(bmpptr,0,4*cinfo->output_width);
+  }
+
+  if (rows && bmp_h && !rows->proc(rows->ctx,outw,outh,bmp_y,bmp))
+  {
+    jpeg_abort_decompress(cinfo);
+    return 0;
   }
 
-  jpeg_finish_decompress(&cinfo);
+  jpeg_finish_decompress(cinfo);
+  return bmp;
+}
+
+static LICE_IBitmap *LICEJPEG_LoadFromMemory(const void *data_in, int buflen, int want_w, int want_h, LICE_IBitmap *bmp, int *srcw_out, int *srch_out,
+                                             const lice_jpg_rowdest *rows)
+{
+  if (!data_in || buflen < 4) return 0;
+
+  struct jpeg_decompress_struct cinfo;
+  struct my_error_mgr jerr={0,};
+
+  jerr.pub.error_exit = LICEJPEG_Error;
+  jerr.pub.emit_message = LICEJPEG_EmitMsg;
+  jerr.pub.output_message = LICEJPEG_OutMsg;
+  jerr.pub.format_message = LICEJPEG_FmtMsg;
+  jerr.pub.reset_error_mgr = LICEJPEG_reset_error_mgr;
+
+  cinfo.err = &jerr.pub;
+
+  if (setjmp(jerr.setjmp_buffer)) 
+  {
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+  }
+  jpeg_create_decompress(&cinfo);
+
+  cinfo.src = (struct jpeg_source_mgr *) (*cinfo.mem->alloc_small) ((j_common_ptr) &cinfo, JPOOL_PERMANENT, sizeof (struct jpeg_source_mgr));
+  
+  cinfo.src->init_source = LICEJPEG_init_source;
+  cinfo.src->fill_input_buffer = LICEJPEG_fill_input_buffer;
+  cinfo.src->skip_input_data = LICEJPEG_skip_input_data;
+  cinfo.src->resync_to_restart = jpeg_resync_to_restart;	
+  cinfo.src->term_source = LICEJPEG_term_source;
+
+  cinfo.src->next_input_byte = (const JOCTET *)data_in;
+  cinfo.src->bytes_in_buffer = buflen;
+
+  bmp = LICEJPEG_Decode(&cinfo,want_w,want_h,bmp,srcw_out,srch_out,rows);
+
   jpeg_destroy_decompress(&cinfo);  // we created cinfo.src with some special alloc so I think it gets collected
 
   return bmp;
+}
 
-#else
-  return 0;
-#endif
+LICE_IBitmap *LICE_LoadJPGFromMemory(const void *data_in, int buflen, LICE_IBitmap *bmp)
+{
+  return LICE_LoadJPGFromMemoryScaled(data_in,buflen,0,0,bmp);
 }
 
+LICE_IBitmap *LICE_LoadJPGFromMemoryScaled(const void *data_in, int buflen, int want_w, int want_h, LICE_IBitmap *bmp, int *srcw_out, int *srch_out)
+{
+  return LICEJPEG_LoadFromMemory(data_in,buflen,want_w,want_h,bmp,srcw_out,srch_out,NULL);
+}
+
+bool LICE_LoadJPGRowsFromMemory(const void *data_in, int buflen, int want_w, int want_h, int band_rows, LICE_ReadRowsProc proc, void *ctx, int *srcw_out, int *srch_out)
+{
+  if (!proc || band_rows < 1) return false;
+  LICE_MemBitmap band;
+  const lice_jpg_rowdest rows = { &band, band_rows, proc, ctx };
+  return !!LICEJPEG_LoadFromMemory(data_in,buflen,want_w,want_h,NULL,srcw_out,srch_out,&rows);
+}
+
+
 
 LICE_IBitmap *LICE_LoadJPG(const char *filename, LICE_IBitmap *bmp)
+{
+  return LICE_LoadJPGScaled(filename,0,0,bmp);
+}
+
+
+LICE_IBitmap *LICE_LoadJPGScaled(const char *filename, int want_w, int want_h, LICE_IBitmap *bmp, int *srcw_out, int *srch_out)
 {
   struct jpeg_decompress_struct cinfo;
   struct my_error_mgr jerr={{0},};
-  JSAMPARRAY buffer;
-  int row_stride;
 
   FILE *fp=NULL;
 #ifdef _WIN32
@@ -207,66 +295,9 @@ LICE_IBitmap *LICE_LoadJPG(const char *filename, LICE_IBitmap *bmp)
   jpeg_create_decompress(&cinfo);
 
   jpeg_stdio_src(&cinfo, fp);
-  jpeg_read_header(&cinfo, TRUE);
-  jpeg_start_decompress(&cinfo);
-
-  row_stride = cinfo.output_width * cinfo.output_components;
 
-  buffer = (*cinfo.mem->alloc_sarray)
-		((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
-
-  if (bmp)
-  {
-    bmp->resize(cinfo.output_width,cinfo.output_height);
-    if (bmp->getWidth() != (int)cinfo.output_width || bmp->getHeight() != (int)cinfo.output_height) 
-    {
-      jpeg_finish_decompress(&cinfo);
-      jpeg_destroy_decompress(&cinfo);
-      fclose(fp);
-      return 0;
-    }
-  }
-  else bmp=new LICE_MemBitmap(cinfo.output_width,cinfo.output_height);
+  bmp = LICEJPEG_Decode(&cinfo,want_w,want_h,bmp,srcw_out,srch_out);
 
-  LICE_pixel *bmpptr = bmp->getBits();
-  int dbmpptr=bmp->getRowSpan();
-  if (bmp->isFlipped())
-  {
-    bmpptr += dbmpptr*(bmp->getHeight()-1);
-    dbmpptr=-dbmpptr;
-  }
-
-  while (cinfo.output_scanline < cinfo.output_height) {
-    /* jpeg_read_scanlines expects an array of pointers to scanlines.
-     * Here the array is only one element long, but you could ask for
-     * more than one scanline at a time if that's more convenient.
-     */
-    jpeg_read_scanlines(&cinfo, buffer, 1);
-    /* Assume put_scanline_someplace wants a pointer and sample count. */
-//    put_scanline_someplace(buffer[0], row_stride);
-    if (cinfo.output_components==3)
-    {
-      int x;
-      for (x = 0; x < (int)cinfo.output_width; x++)
-      {
-        bmpptr[x]=LICE_RGBA(buffer[0][x*3],buffer[0][x*3+1],buffer[0][x*3+2],255);
-      }
-    }
-    else if (cinfo.output_components==1)
-    {
-      int x;
-      for (x = 0; x < (int)cinfo.output_width; x++)
-      {
-        int v=buffer[0][x];
-        bmpptr[x]=LICE_RGBA(v,v,v,255);
-      }
-    }
-    else
-      memset(bmpptr,0,4*cinfo.output_width);
-    bmpptr+=dbmpptr;
-  }
-
-  jpeg_finish_decompress(&cinfo);
   jpeg_destroy_decompress(&cinfo);
   fclose(fp);
 
@@ -281,6 +312,7 @@ public:
   LICE_JPGLoader() 
   {
     rec.loadfunc = loadfunc;
+    rec.loadfunc_scaled = loadfunc_scaled;
     rec.get_extlist = get_extlist;
     rec._next = LICE_ImageLoader_list;
     LICE_ImageLoader_list = &rec;
@@ -297,6 +329,17 @@ public:
     }
     return LICE_LoadJPG(filename,bmpbase);
   }
+  static LICE_IBitmap *loadfunc_scaled(const char *filename, bool checkFileName, LICE_IBitmap *bmpbase, int want_w, int want_h, int *srcw_out, int *srch_out)
+  {
+    if (checkFileName)
+    {
+      const char *p=filename;
+      while (*p)p++;
+      while (p>filename && *p != '\\' && *p != '/' && *p != '.') p--;
+      if (stricmp(p,".jpg")&&stricmp(p,".jpeg")&&stricmp(p,".jfif")) return 0;
+    }
+    return LICE_LoadJPGScaled(filename,want_w,want_h,bmpbase,srcw_out,srch_out);
+  }
   static const char *get_extlist()
   {
     return "JPEG files (*.JPG;*.JPEG;*.JFIF)\0*.JPG;*.JPEG;*.JFIF\0";
@@ -304,4 +347,4 @@ public:
 
 };
 
-LICE_JPGLoader LICE_jgpldr;
+LICE_JPGLoader LICE_jgpldr;
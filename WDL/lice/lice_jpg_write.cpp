@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include "lice.h"
 #include <setjmp.h>
+#include "../heapbuf.h"
 
 extern "C" {
 #include "../jpeglib/jpeglib.h"
@@ -30,23 +31,49 @@ static void LICEJPEG_reset_error_mgr(j_common_ptr cinfo)
   cinfo->err->msg_code = 0;
 }
 
-bool LICE_WriteJPG(const char *filename, LICE_IBitmap *bmp, int quality, bool force_baseline)
-{
-  if (!bmp || !filename) return false;
+struct lice_jpg_memdest {
+  struct jpeg_destination_mgr pub;
+  WDL_HeapBuf *out;
+  int startpos;
+};
 
-  FILE *fp=NULL;
-#ifdef _WIN32
-  if (GetVersion()<0x80000000)
-  {
-    WCHAR wf[2048];
-    if (MultiByteToWideChar(CP_UTF8,MB_ERR_INVALID_CHARS,filename,-1,wf,2048))
-      fp = _wfopen(wf,L"wb");
-  }
-#endif
-  if (!fp) fp = fopen(filename,"wb");
+static void LICEJPEG_MemDest_Init(j_compress_ptr cinfo)
+{
+  lice_jpg_memdest *dest = (lice_jpg_memdest *)cinfo->dest;
+  const int sz = dest->startpos + 16384;
+  if (dest->out->GetSize() < sz) dest->out->Resize(sz,false);
+  if (dest->out->GetSize() < sz) cinfo->err->error_exit((j_common_ptr)cinfo);
+  dest->pub.next_output_byte = (JOCTET *)dest->out->Get() + dest->startpos;
+  dest->pub.free_in_buffer = dest->out->GetSize() - dest->startpos;
+}
+static boolean LICEJPEG_MemDest_Empty(j_compress_ptr cinfo)
+{
+  // buffer is full, grow it
+  lice_jpg_memdest *dest = (lice_jpg_memdest *)cinfo->dest;
+  const int oldsz = dest->out->GetSize();
+  const int sz = oldsz + oldsz/2 + 16384;
+  dest->out->Resize(sz,false);
+  if (dest->out->GetSize() != sz) cinfo->err->error_exit((j_common_ptr)cinfo);
+  dest->pub.next_output_byte = (JOCTET *)dest->out->Get() + oldsz;
+  dest->pub.free_in_buffer = sz - oldsz;
+  return TRUE;
+}
+static void LICEJPEG_MemDest_Term(j_compress_ptr cinfo)
+{
+  lice_jpg_memdest *dest = (lice_jpg_memdest *)cinfo->dest;
+  dest->out->Resize(dest->out->GetSize() - (int)dest->pub.free_in_buffer,false);
+}
 
-  if (!fp) return false;
+// rows come from bmp, or from proc a band at a time
+struct lice_jpg_rowsrc {
+  LICE_IBitmap *bmp;
+  int w, h, band_rows;
+  LICE_WriteRowsProc proc;
+  void *ctx;
+};
 
+static bool LICE_WriteJPG_Int(const lice_jpg_rowsrc *rows, int quality, bool force_baseline, FILE *fp, WDL_HeapBuf *memout)
+{
   struct jpeg_compress_struct cinfo;
   struct my_error_mgr jerr={0,};
   jerr.pub.error_exit = LICEJPEG_Error;
@@ -57,20 +84,37 @@ bool LICE_WriteJPG(const char *filename, LICE_IBitmap *bmp, int quality, bool fo
 
   cinfo.err = &jerr.pub;
   unsigned char *buf = NULL;
+  lice_jpg_memdest memdest;
+  LICE_MemBitmap band;
+  LICE_IBitmap *src = rows->bmp;
+  int src_y = 0, src_h = src ? rows->h : 0;
+  const int memout_startpos = memout ? memout->GetSize() : 0;
 
   if (setjmp(jerr.setjmp_buffer)) 
   {
     jpeg_destroy_compress(&cinfo);
-    if (fp) fclose(fp);
     free(buf);
+    if (memout) memout->Resize(memout_startpos,false);
     return false;
   }
   jpeg_create_compress(&cinfo);
 
-  jpeg_stdio_dest(&cinfo, fp);
+  if (memout)
+  {
+    memdest.pub.init_destination = LICEJPEG_MemDest_Init;
+    memdest.pub.empty_output_buffer = LICEJPEG_MemDest_Empty;
+    memdest.pub.term_destination = LICEJPEG_MemDest_Term;
+    memdest.out = memout;
+    memdest.startpos = memout_startpos;
+    cinfo.dest = &memdest.pub;
+  }
+  else
+  {
+    jpeg_stdio_dest(&cinfo, fp);
+  }
 
-  cinfo.image_width = bmp->getWidth(); 	/* image width and height, in pixels */
-  cinfo.image_height = bmp->getHeight();
+  cinfo.image_width = rows->w; 	/* image width and height, in pixels */
+  cinfo.image_height = rows->h;
   cinfo.input_components = 3;		/* # of color components per pixel */
   cinfo.in_color_space = JCS_RGB; 	/* colorspace of input image */
 
@@ -79,17 +123,23 @@ bool LICE_WriteJPG(const char *filename, LICE_IBitmap *bmp, int quality, bool fo
   jpeg_start_compress(&cinfo, TRUE);
 
   buf = (unsigned char *)malloc(cinfo.image_width * 3);
-  LICE_pixel_chan *rd = (LICE_pixel_chan *)bmp->getBits();
-  int rowspan = bmp->getRowSpan()*4;
-  if (bmp->isFlipped())
-  {
-    rd += rowspan*(bmp->getHeight()-1);
-    rowspan=-rowspan;
-  }
   while (cinfo.next_scanline < cinfo.image_height) 
   {
+    const int y = cinfo.next_scanline;
+    if (y >= src_y + src_h)
+    {
+      src_h = min(rows->band_rows, rows->h - y);
+      band.resize(rows->w,src_h);
+      if (band.getWidth() != rows->w || band.getHeight() != src_h ||
+          !rows->proc(rows->ctx,&band,y,src_h)) cinfo.err->error_exit((j_common_ptr)&cinfo);
+      src = &band;
+      src_y = y;
+    }
+    int sy = y - src_y;
+    if (src->isFlipped()) sy = src->getHeight()-1-sy;
+
     unsigned char *outp=buf;
-    LICE_pixel_chan *rdp = rd;
+    const LICE_pixel_chan *rdp = (const LICE_pixel_chan *)(src->getBits() + sy*src->getRowSpan());
     int x=cinfo.image_width;
     while(x--)
     {
@@ -100,18 +150,50 @@ bool LICE_WriteJPG(const char *filename, LICE_IBitmap *bmp, int quality, bool fo
       rdp+=4;
     }
     jpeg_write_scanlines(&cinfo, &buf, 1);
-
-    rd+=rowspan;
   }
   free(buf); 
   buf=0;
 
   jpeg_finish_compress(&cinfo);
 
-  if (fp) fclose(fp);
-  fp=0;
-
   jpeg_destroy_compress(&cinfo);
 
   return true;
-}
\ No newline at end of file
+}
+
+bool LICE_WriteJPG(const char *filename, LICE_IBitmap *bmp, int quality, bool force_baseline)
+{
+  if (!bmp || !filename) return false;
+
+  FILE *fp=NULL;
+#ifdef _WIN32
+  if (GetVersion()<0x80000000)
+  {
+    WCHAR wf[2048];
+    if (MultiByteToWideChar(CP_UTF8,MB_ERR_INVALID_CHARS,filename,-1,wf,2048))
+      fp = _wfopen(wf,L"wb");
+  }
+#endif
+  if (!fp) fp = fopen(filename,"wb");
+
+  if (!fp) return false;
+
+  const lice_jpg_rowsrc rows = { bmp, bmp->getWidth(), bmp->getHeight(), 0, NULL, NULL };
+  const bool rv = LICE_WriteJPG_Int(&rows,quality,force_baseline,fp,NULL);
+  fclose(fp);
+  return rv;
+}
+
+bool LICE_WriteJPGToMemory(WDL_HeapBuf *out, LICE_IBitmap *bmp, int quality, bool force_baseline)
+{
+  if (!bmp || !out) return false;
+  const lice_jpg_rowsrc rows = { bmp, bmp->getWidth(), bmp->getHeight(), 0, NULL, NULL };
+  return LICE_WriteJPG_Int(&rows,quality,force_baseline,NULL,out);
+}
+
+bool LICE_WriteJPGRowsToMemory(WDL_HeapBuf *out, int w, int h, int band_rows, LICE_WriteRowsProc proc, void *ctx, int quality, bool force_baseline)
+{
+  if (!out || !proc || w < 1 || h < 1 || band_rows < 1) return false;
+  const lice_jpg_rowsrc rows = { NULL, w, h, band_rows, proc, ctx };
+  return LICE_WriteJPG_Int(&rows,quality,force_baseline,NULL,out);
+}
@@ -0,0 +1,178 @@
+/*
+  Cockos WDL - LICE - Lightweight Image Compositing Engine
+  Copyright (C) 2007 and later, Cockos Incorporated
+  File: lice_parallel.cpp (optional row-band threading for the heavier primitives)
+  See lice.h for license and other information
+*/
+
+#include "lice.h"
+#include "../mutex.h"
+
+#ifndef _WIN32
+#include "../swell/swell.h"
+#endif
+
+#define LICE_PARALLEL_MAX_THREADS 64
+#define LICE_PARALLEL_BANDS_PER_THREAD 2 // a few more bands than threads evens out uneven rows
+
+class LICE_ThreadPool
+{
+public:
+  LICE_ThreadPool(int nthreads)
+  {
+    m_quit=false;
+    m_busy=false;
+    m_proc=NULL;
+    m_ctx=NULL;
+    m_nrows=m_nbands=m_nextband=m_bandsleft=0;
+    m_done=CreateEvent(NULL,FALSE,FALSE,NULL);
+
+    // the calling thread works on bands too, so start one less
+    m_nthreads=0;
+    while (m_nthreads < nthreads-1 && m_nthreads < LICE_PARALLEL_MAX_THREADS)
+    {
+      worker *w=m_workers+m_nthreads;
+      DWORD tid;
+      w->pool=this;
+      w->wake=CreateEvent(NULL,FALSE,FALSE,NULL);
+      w->thread=CreateThread(NULL,0,ThreadProc,w,0,&tid);
+      if (!w->thread)
+      {
+        CloseHandle(w->wake);
+        break;
+      }
+      m_nthreads++;
+    }
+  }
+  ~LICE_ThreadPool()
+  {
+    m_quit=true;
+    int x;
+    for (x=0;x<m_nthreads;x++) SetEvent(m_workers[x].wake);
+    for (x=0;x<m_nthreads;x++)
+    {
+      WaitForSingleObject(m_workers[x].thread,INFINITE);
+      CloseHandle(m_workers[x].thread);
+      CloseHandle(m_workers[x].wake);
+    }
+    CloseHandle(m_done);
+  }
+
+  // returns false if another thread has the pool (caller should just do the work itself)
+  bool Run(int nrows, void (*proc)(void *ctx, int y, int h), void *ctx)
+  {
+    m_mutex.Enter();
+    if (m_busy)
+    {
+      m_mutex.Leave();
+      return false;
+    }
+    m_busy=true;
+    m_proc=proc;
+    m_ctx=ctx;
+    m_nrows=nrows;
+    m_nbands=(m_nthreads+1)*LICE_PARALLEL_BANDS_PER_THREAD;
+    if (m_nbands > nrows) m_nbands=nrows;
+    m_nextband=0;
+    m_bandsleft=m_nbands;
+    m_mutex.Leave();
+
+    int x;
+    for (x=0;x<m_nthreads;x++) SetEvent(m_workers[x].wake);
+    DoBands();
+    WaitForSingleObject(m_done,INFINITE);
+
+    m_mutex.Enter();
+    m_busy=false;
+    m_proc=NULL;
+    m_mutex.Leave();
+    return true;
+  }
+
+  int m_nthreads;
+
+private:
+  // band boundaries depend only on nrows/nbands, never on which thread runs them
+  void DoBands()
+  {
+    for (;;)
+    {
+      m_mutex.Enter();
+      if (!m_proc || m_nextband >= m_nbands)
+      {
+        m_mutex.Leave();
+        return;
+      }
+      const int b=m_nextband++;
+      const int y0=(int) (((WDL_INT64)m_nrows*b)/m_nbands);
+      const int y1=(int) (((WDL_INT64)m_nrows*(b+1))/m_nbands);
+      void (*proc)(void *, int, int)=m_proc;
+      void *ctx=m_ctx;
+      m_mutex.Leave();
+
+      if (y1>y0) proc(ctx,y0,y1-y0);
+
+      m_mutex.Enter();
+      if (!--m_bandsleft) SetEvent(m_done);
+      m_mutex.Leave();
+    }
+  }
+
+  struct worker
+  {
+    LICE_ThreadPool *pool;
+    HANDLE thread, wake;
+  };
+
+  static DWORD WINAPI ThreadProc(LPVOID p)
+  {
+    worker *w=(worker *)p;
+    while (!w->pool->m_quit)
+    {
+      WaitForSingleObject(w->wake,INFINITE);
+      if (w->pool->m_quit) break;
+      w->pool->DoBands();
+    }
+    return 0;
+  }
+
+  WDL_Mutex m_mutex;
+  worker m_workers[LICE_PARALLEL_MAX_THREADS];
+  HANDLE m_done;
+  volatile bool m_quit;
+  bool m_busy;
+  void (*m_proc)(void *ctx, int y, int h);
+  void *m_ctx;
+  int m_nrows, m_nbands, m_nextband, m_bandsleft;
+};
+
+static LICE_ThreadPool *s_pool;
+static int s_minpixels = 256*1024;
+
+void LICE_SetThreadCount(int nthreads, int min_pixels)
+{
+  delete s_pool;
+  s_pool=NULL;
+  s_minpixels = min_pixels > 0 ? min_pixels : 1;
+  if (nthreads > 1)
+  {
+    s_pool = new LICE_ThreadPool(nthreads);
+    if (!s_pool->m_nthreads)
+    {
+      delete s_pool;
+      s_pool=NULL;
+    }
+  }
+}
+
+int LICE_GetThreadCount()
+{
+  return s_pool ? s_pool->m_nthreads+1 : 1;
+}
+
+void LICE_RunBands(int nrows, int npixels, void (*proc)(void *ctx, int y, int h), void *ctx)
+{
+  if (nrows < 1 || !proc) return;
+  LICE_ThreadPool *pool = s_pool;
+  if (!pool || nrows < 2 || npixels < s_minpixels || !pool->Run(nrows,proc,ctx)) proc(ctx,0,nrows);
+}
@@ -16,6 +16,61 @@
 #endif
 
 
+// sets up the transforms that make libpng output A,R,G,B bytes whatever the source format, returns the interlace type
+static int LICEPNG_SetupARGB(png_structp png_ptr, png_infop info_ptr, unsigned int *width, unsigned int *height)
+{
+  int bit_depth, color_type, interlace_type, compression_type, filter_method;
+  png_get_IHDR(png_ptr, info_ptr, width, height,
+       &bit_depth, &color_type, &interlace_type,
+       &compression_type, &filter_method);
+
+  //convert whatever it is to RGBA
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+    png_set_palette_to_rgb(png_ptr);
+
+  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) 
+    png_set_expand_gray_1_2_4_to_8(png_ptr);
+
+  if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) 
+  {
+    png_set_tRNS_to_alpha(png_ptr);
+    color_type |= PNG_COLOR_MASK_ALPHA;
+  }
+
+  if (bit_depth == 16)
+    png_set_strip_16(png_ptr);
+
+  if (bit_depth < 8)
+    png_set_packing(png_ptr);
+
+  if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+    png_set_gray_to_rgb(png_ptr);
+
+  if (color_type & PNG_COLOR_MASK_ALPHA)
+    png_set_swap_alpha(png_ptr);
+  else
+    png_set_filler(png_ptr, 0xff, PNG_FILLER_BEFORE);
+
+  return interlace_type;
+}
+
+// A,R,G,B bytes to LICE_pixel, in place
+static void LICEPNG_ARGBToPixels(unsigned char *bmpptr, int width)
+{
+  #if !(LICE_PIXEL_A == 0 && LICE_PIXEL_R == 1 && LICE_PIXEL_G == 2 && LICE_PIXEL_B == 3)
+  int j=width;
+  while (j-->0)
+  {
+    unsigned char a = bmpptr[0];
+    unsigned char r = bmpptr[1];
+    unsigned char g = bmpptr[2];
+    unsigned char b = bmpptr[3];
+    ((LICE_pixel*)bmpptr)[0] = LICE_RGBA(r,g,b,a);
+    bmpptr+=4;
+  }
+  #endif
+}
+
 LICE_IBitmap *LICE_LoadPNG(const char *filename, LICE_IBitmap *bmp)
 {
   FILE *fp = NULL;
@@ -58,37 +113,7 @@ LICE_IBitmap *LICE_LoadPNG(const char *filename, LICE_IBitmap *bmp)
   png_read_info(png_ptr, info_ptr);
 
   unsigned int width, height;
-  int bit_depth, color_type, interlace_type, compression_type, filter_method;
-  png_get_IHDR(png_ptr, info_ptr, &width, &height,
-       &bit_depth, &color_type, &interlace_type,
-       &compression_type, &filter_method);
-
-  //convert whatever it is to RGBA
-  if (color_type == PNG_COLOR_TYPE_PALETTE)
-    png_set_palette_to_rgb(png_ptr);
-
-  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) 
-    png_set_expand_gray_1_2_4_to_8(png_ptr);
-
-  if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) 
-  {
-    png_set_tRNS_to_alpha(png_ptr);
-    color_type |= PNG_COLOR_MASK_ALPHA;
-  }
-
-  if (bit_depth == 16)
-    png_set_strip_16(png_ptr);
-
-  if (bit_depth < 8)
-    png_set_packing(png_ptr);
-
-  if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-    png_set_gray_to_rgb(png_ptr);
-
-  if (color_type & PNG_COLOR_MASK_ALPHA)
-    png_set_swap_alpha(png_ptr);
-  else
-    png_set_filler(png_ptr, 0xff, PNG_FILLER_BEFORE);
+  LICEPNG_SetupARGB(png_ptr, info_ptr, &width, &height);
 
   //get the bits
   if (bmp)
@@ -122,22 +147,7 @@ LICE_IBitmap *LICE_LoadPNG(const char *filename, LICE_IBitmap *bmp)
   fclose(fp);
 
   //put shit in correct order
-  #if !(LICE_PIXEL_A == 0 && LICE_PIXEL_R == 1 && LICE_PIXEL_G == 2 && LICE_PIXEL_B == 3)
-  for(i=0;i<height;i++)
-  {
-    unsigned char *bmpptr = row_pointers[i];
-    int j=width;
-    while (j-->0)
-    {
-      unsigned char a = bmpptr[0];
-      unsigned char r = bmpptr[1];
-      unsigned char g = bmpptr[2];
-      unsigned char b = bmpptr[3];
-      ((LICE_pixel*)bmpptr)[0] = LICE_RGBA(r,g,b,a);
-      bmpptr+=4;
-    }
-  }
-  #endif
+  for(i=0;i<height;i++) LICEPNG_ARGBToPixels(row_pointers[i],width);
   free(row_pointers);
   
   return bmp;
@@ -232,37 +242,7 @@ LICE_IBitmap *LICE_LoadPNGFromMemory(const void *data_in, int buflen, LICE_IBitm
   png_read_info(png_ptr, info_ptr);
 
   unsigned int width, height;
-  int bit_depth, color_type, interlace_type, compression_type, filter_method;
-  png_get_IHDR(png_ptr, info_ptr, &width, &height,
-       &bit_depth, &color_type, &interlace_type,
-       &compression_type, &filter_method);
-
-  //convert whatever it is to RGBA
-  if (color_type == PNG_COLOR_TYPE_PALETTE)
-    png_set_palette_to_rgb(png_ptr);
-
-  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) 
-    png_set_expand_gray_1_2_4_to_8(png_ptr);
-
-  if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) 
-  {
-    png_set_tRNS_to_alpha(png_ptr);
-    color_type |= PNG_COLOR_MASK_ALPHA;
-  }
-
-  if (bit_depth == 16)
-    png_set_strip_16(png_ptr);
-
-  if (bit_depth < 8)
-    png_set_packing(png_ptr);
-
-  if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-    png_set_gray_to_rgb(png_ptr);
-
-  if (color_type & PNG_COLOR_MASK_ALPHA)
-    png_set_swap_alpha(png_ptr);
-  else
-    png_set_filler(png_ptr, 0xff, PNG_FILLER_BEFORE);
+  LICEPNG_SetupARGB(png_ptr, info_ptr, &width, &height);
 
   //get the bits
   if (bmp)
@@ -289,25 +269,73 @@ LICE_IBitmap *LICE_LoadPNGFromMemory(const void *data_in, int buflen, LICE_IBitm
   png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
 
   //put shit in correct order
-  #if !(LICE_PIXEL_A == 0 && LICE_PIXEL_R == 1 && LICE_PIXEL_G == 2 && LICE_PIXEL_B == 3)
-  for(i=0;i<height;i++)
+  for(i=0;i<height;i++) LICEPNG_ARGBToPixels(row_pointers[i],width);
+  free(row_pointers);
+  return bmp;  
+}
+bool LICE_LoadPNGRowsFromMemory(const void *data_in, int buflen, int band_rows, LICE_ReadRowsProc proc, void *ctx, int *srcw_out, int *srch_out)
+{
+  if (buflen<8 || !proc || band_rows < 1) return false;
+  unsigned char *data = (unsigned char *)(void*)data_in;
+  if(png_sig_cmp(data, 0, 8)) return false;
+
+  pngReadStruct readStruct = {data, buflen};
+  LICE_MemBitmap band;
+
+  png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL); 
+  if(!png_ptr) 
   {
-    unsigned char *bmpptr = row_pointers[i];
-    int j=width;
-    while (j-->0)
+    return false;
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr); 
+  if(!info_ptr)
+  {
+    png_destroy_read_struct(&png_ptr, NULL, NULL); 
+    return false;
+  }
+  
+  if (setjmp(png_jmpbuf(png_ptr)))
+  { 
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL); 
+    return false;
+  }
+
+  png_set_read_fn(png_ptr, &readStruct, staticPngReadFunc);
+
+  png_read_info(png_ptr, info_ptr);
+
+  unsigned int width, height;
+  const int interlace_type = LICEPNG_SetupARGB(png_ptr, info_ptr, &width, &height);
+  if (srcw_out) *srcw_out = width;
+  if (srch_out) *srch_out = height;
+
+  // rows of an interlaced image are only complete after the last pass, that needs the whole image
+  bool ok = interlace_type == PNG_INTERLACE_NONE;
+
+  int y;
+  for (y = 0; ok && y < (int)height; y += band.getHeight())
+  {
+    const int h = (int)height - y < band_rows ? (int)height - y : band_rows;
+    band.resize(width,h);
+    if (band.getWidth() != (int)width || band.getHeight() != h) ok = false;
+    else
     {
-      unsigned char a = bmpptr[0];
-      unsigned char r = bmpptr[1];
-      unsigned char g = bmpptr[2];
-      unsigned char b = bmpptr[3];
-      ((LICE_pixel*)bmpptr)[0] = LICE_RGBA(r,g,b,a);
-      bmpptr+=4;
+      int i;
+      for (i = 0; i < h; i ++)
+      {
+        unsigned char *row = (unsigned char *)(band.getBits() + i*band.getRowSpan());
+        png_read_row(png_ptr, row, NULL);
+        LICEPNG_ARGBToPixels(row,width);
+      }
+      ok = proc(ctx,width,height,y,&band);
     }
   }
-  #endif
-  free(row_pointers);
-  return bmp;  
+
+  png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+  return ok;
 }
+
 LICE_IBitmap *LICE_LoadPNGFromResource(HINSTANCE hInst, int resid, LICE_IBitmap *bmp)
 {
 #ifdef _WIN32
@@ -339,6 +367,7 @@ public:
   LICE_PNGLoader() 
   {
     rec.loadfunc = loadfunc;
+    rec.loadfunc_scaled = NULL;
     rec.get_extlist = get_extlist;
     rec._next = LICE_ImageLoader_list;
     LICE_ImageLoader_list = &rec;
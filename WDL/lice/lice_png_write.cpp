@@ -10,11 +10,39 @@
 
 #include <stdio.h>
 #include "../libpng/png.h"
+#include "../heapbuf.h"
 
 
-bool LICE_WritePNG(const char *filename, LICE_IBitmap *bmp, bool wantalpha /*=true*/)
+static void LICEPNG_Abort(png_structp png_ptr)
+{
+#ifdef PNG_ERROR_TEXT_SUPPORTED
+  png_error(png_ptr,"write aborted");
+#else
+  png_err(png_ptr);
+#endif
+}
+
+static void LICEPNG_MemWrite(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+  WDL_HeapBuf *out = (WDL_HeapBuf *)png_get_io_ptr(png_ptr);
+  const int oldsz = out->GetSize();
+  out->Resize(oldsz + (int)length,false);
+  if (out->GetSize() != oldsz + (int)length) LICEPNG_Abort(png_ptr);
+  memcpy((char *)out->Get() + oldsz, data, length);
+}
+static void LICEPNG_MemFlush(png_structp png_ptr) { }
+
+// rows come from bmp, or from proc a band at a time
+struct lice_png_rowsrc {
+  LICE_IBitmap *bmp;
+  int w, h, band_rows;
+  LICE_WriteRowsProc proc;
+  void *ctx;
+};
+
+// writes to fp, or appends to memout if set
+static bool LICE_WritePNG_Int(const lice_png_rowsrc *rows, bool wantalpha, FILE *fp, WDL_HeapBuf *memout)
 {
-  if (!bmp || !filename) return false;
   /*
   **  Joshua Teitelbaum 1/1/2008
   **  Gifted to cockos for toe nail clippings.
@@ -24,48 +52,37 @@ bool LICE_WritePNG(const char *filename, LICE_IBitmap *bmp, bool wantalpha /*=tr
   png_structp png_ptr=NULL;
   png_infop info_ptr=NULL;
   unsigned char *rowbuf=NULL;
-
-  FILE *fp=NULL;
-#ifdef _WIN32
-  if (GetVersion()<0x80000000)
-  {
-    WCHAR wf[2048];
-    if (MultiByteToWideChar(CP_UTF8,MB_ERR_INVALID_CHARS,filename,-1,wf,2048))
-      fp = _wfopen(wf,L"wb");
-  }
-#endif
-  if (!fp) fp = fopen(filename,"wb");
-
-  if (fp == NULL) return false;
+  const int memout_startpos = memout ? memout->GetSize() : 0;
+  LICE_MemBitmap band;
+  LICE_IBitmap *src = rows->bmp;
+  int src_y = 0, src_h = src ? rows->h : 0;
 
   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,NULL, NULL, NULL);
 
   if (png_ptr == NULL) {
-    fclose(fp);
     return false;
   }
 
   info_ptr = png_create_info_struct(png_ptr);
   if (info_ptr == NULL) {
-    fclose(fp);
     png_destroy_write_struct(&png_ptr,  (png_infopp)NULL);
     return false;
   }
 
   if (setjmp(png_jmpbuf(png_ptr))) {
-    /* If we get here, we had a problem reading the file */
-    if (fp) fclose(fp);
-    fp=0;
+    /* If we get here, we had a problem writing the file */
     free(rowbuf);
     rowbuf=0;
     png_destroy_write_struct(&png_ptr, &info_ptr);
+    if (memout) memout->Resize(memout_startpos,false);
     return false;
   }
 
 
-  png_init_io(png_ptr, fp);
-  int width=bmp->getWidth();
-  int height = bmp->getHeight();
+  if (memout) png_set_write_fn(png_ptr, memout, LICEPNG_MemWrite, LICEPNG_MemFlush);
+  else png_init_io(png_ptr, fp);
+  const int width = rows->w;
+  const int height = rows->h;
 
 #define BITDEPTH 8
   png_set_IHDR(png_ptr, info_ptr, width, height, BITDEPTH, wantalpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
@@ -78,20 +95,26 @@ bool LICE_WritePNG(const char *filename, LICE_IBitmap *bmp, bool wantalpha /*=tr
   // kill alpha channel bytes if not wanted
   if (!wantalpha) png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
 
-  LICE_pixel *ptr=(LICE_pixel *)bmp->getBits();
-  int rowspan=bmp->getRowSpan();
-  if (bmp->isFlipped()) 
-  {
-    ptr+=rowspan*(bmp->getHeight()-1); 
-    rowspan=-rowspan;
-  }
-
-
   if (LICE_PIXEL_B != 0 || LICE_PIXEL_G != 1 || LICE_PIXEL_R != 2 || LICE_PIXEL_A != 3)
-  {
     rowbuf=(unsigned char *)malloc(width*4);
-    int k;
-    for (k = 0; k < height; k++)
+
+  int k;
+  for (k = 0; k < height; k++)
+  {
+    if (k >= src_y + src_h)
+    {
+      src_h = min(rows->band_rows, height - k);
+      band.resize(width,src_h);
+      if (band.getWidth() != width || band.getHeight() != src_h ||
+          !rows->proc(rows->ctx,&band,k,src_h)) LICEPNG_Abort(png_ptr);
+      src = &band;
+      src_y = k;
+    }
+    int sy = k - src_y;
+    if (src->isFlipped()) sy = src->getHeight()-1-sy;
+    LICE_pixel *ptr = src->getBits() + sy*src->getRowSpan();
+
+    if (rowbuf)
     {
       int x;
       unsigned char *bout = rowbuf;
@@ -106,26 +129,54 @@ bool LICE_WritePNG(const char *filename, LICE_IBitmap *bmp, bool wantalpha /*=tr
         bin+=4;
       }
       png_write_row(png_ptr, (unsigned char *)rowbuf);
-      ptr += rowspan;
     }
-    free(rowbuf);
-    rowbuf=0;
-  }
-  else
-  {
-    int k;
-    for (k = 0; k < height; k++)
+    else
     {
       png_write_row(png_ptr, (unsigned char *)ptr);
-      ptr += rowspan;
     }
   }
+  free(rowbuf);
+  rowbuf=0;
 
   png_write_end(png_ptr, info_ptr);
   png_destroy_write_struct(&png_ptr, &info_ptr);
 
-  if (fp) fclose(fp);
-  fp=0;
-
   return true;
+}
+
+bool LICE_WritePNG(const char *filename, LICE_IBitmap *bmp, bool wantalpha /*=true*/)
+{
+  if (!bmp || !filename) return false;
+
+  FILE *fp=NULL;
+#ifdef _WIN32
+  if (GetVersion()<0x80000000)
+  {
+    WCHAR wf[2048];
+    if (MultiByteToWideChar(CP_UTF8,MB_ERR_INVALID_CHARS,filename,-1,wf,2048))
+      fp = _wfopen(wf,L"wb");
+  }
+#endif
+  if (!fp) fp = fopen(filename,"wb");
+
+  if (fp == NULL) return false;
+
+  const lice_png_rowsrc rows = { bmp, bmp->getWidth(), bmp->getHeight(), 0, NULL, NULL };
+  const bool rv = LICE_WritePNG_Int(&rows,wantalpha,fp,NULL);
+  fclose(fp);
+  return rv;
+}
+
+bool LICE_WritePNGToMemory(WDL_HeapBuf *out, LICE_IBitmap *bmp, bool wantalpha /*=true*/)
+{
+  if (!bmp || !out) return false;
+  const lice_png_rowsrc rows = { bmp, bmp->getWidth(), bmp->getHeight(), 0, NULL, NULL };
+  return LICE_WritePNG_Int(&rows,wantalpha,NULL,out);
+}
+
+bool LICE_WritePNGRowsToMemory(WDL_HeapBuf *out, int w, int h, int band_rows, LICE_WriteRowsProc proc, void *ctx, bool wantalpha /*=true*/)
+{
+  if (!out || !proc || w < 1 || h < 1 || band_rows < 1) return false;
+  const lice_png_rowsrc rows = { NULL, w, h, band_rows, proc, ctx };
+  return LICE_WritePNG_Int(&rows,wantalpha,NULL,out);
 }
\ No newline at end of file
@@ -0,0 +1,400 @@
+/*
+  Cockos WDL - LICE - Lightweight Image Compositing Engine
+  Copyright (C) 2007 and later, Cockos Incorporated
+  File: lice_resample.cpp (separable filtered resampling for LICE)
+  See lice.h for license and other information
+*/
+
+#include <math.h>
+#include <string.h>
+#include "lice.h"
+#include "../heapbuf.h"
+
+#if !defined(LICE_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LICE_RESAMPLE_SSE2
+#include <emmintrin.h>
+#endif
+
+// weights are 2.14 fixed point, normalized to sum to 1<<14
+// the intermediate (horizontal pass) is stored as signed 16 bit, 8.6 fixed point
+// (signed since mitchell/lanczos have negative lobes that can overshoot)
+#define RS_WBITS 14
+#define RS_IBITS 6
+
+#define RS_TILE 16 // output rows buffered before being written (transposed, if rotating)
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static double rs_filter_support(int filter)
+{
+  switch (filter)
+  {
+    case LICE_RESAMPLE_MITCHELL: return 2.0;
+    case LICE_RESAMPLE_LANCZOS3: return 3.0;
+  }
+  return 0.5;
+}
+
+static double rs_filter(int filter, double x)
+{
+  if (x<0.0) x=-x;
+  switch (filter)
+  {
+    case LICE_RESAMPLE_MITCHELL: // B=C=1/3
+      if (x < 1.0) return (7.0*x*x*x - 12.0*x*x + 16.0/3.0) / 6.0;
+      if (x < 2.0) return ((-7.0/3.0)*x*x*x + 12.0*x*x - 20.0*x + 32.0/3.0) / 6.0;
+    return 0.0;
+    case LICE_RESAMPLE_LANCZOS3:
+      if (x < 1.0e-8) return 1.0;
+      if (x < 3.0)
+      {
+        const double px = M_PI * x;
+        return 3.0 * sin(px) * sin(px/3.0) / (px*px);
+      }
+    return 0.0;
+  }
+  return 0.0;
+}
+
+class LICE_ResampleAxis
+{
+public:
+  LICE_ResampleAxis() { maxcnt=0; }
+
+  WDL_TypedBuf<int> start, cnt; // per output position
+  WDL_TypedBuf<short> w; // maxcnt weights per output position
+  int maxcnt;
+
+  bool Build(int srclen, int outlen, int filter)
+  {
+    const double scale = srclen / (double) outlen;
+    const double fscale = scale > 1.0 ? scale : 1.0; // widen the kernel when reducing
+    const double support = rs_filter_support(filter) * fscale;
+
+    maxcnt = (int) ceil(support*2.0) + 2;
+    if (!start.Resize(outlen,false) || !cnt.Resize(outlen,false) || !w.Resize(outlen*maxcnt,false)) return false;
+
+    WDL_TypedBuf<double> tmpbuf;
+    double *tmp = tmpbuf.Resize(maxcnt,false);
+    if (!tmp) return false;
+
+    for (int i = 0; i < outlen; i ++)
+    {
+      const double center = (i + 0.5) * scale;
+      int lo = (int) floor(center - support);
+      int hi = (int) ceil(center + support);
+      if (lo < 0) lo = 0;
+      if (hi > srclen) hi = srclen;
+      if (hi - lo > maxcnt) hi = lo + maxcnt;
+
+      double tot=0.0;
+      int n=0;
+      for (int k = lo; k < hi; k ++)
+      {
+        double v;
+        if (filter == LICE_RESAMPLE_BOX)
+        {
+          // exact area coverage of source pixel [k,k+1) by the output pixel footprint
+          const double a = center - 0.5*fscale, b = center + 0.5*fscale;
+          v = (k+1.0 < b ? k+1.0 : b) - (k > a ? k : a);
+          if (v < 0.0) v=0.0;
+        }
+        else v = rs_filter(filter, (k + 0.5 - center) / fscale);
+        tmp[n++] = v;
+        tot += v;
+      }
+
+      // trim zero-weight taps
+      int skip=0;
+      while (n > 1 && tmp[skip] == 0.0) { skip++; n--; }
+      while (n > 1 && tmp[skip+n-1] == 0.0) n--;
+
+      short *wo = w.Get() + i*maxcnt;
+      if (n < 1 || fabs(tot) < 1.0e-8)
+      {
+        int c = (int) center;
+        if (c >= srclen) c = srclen-1;
+        start.Get()[i] = c;
+        cnt.Get()[i] = 1;
+        wo[0] = 1<<RS_WBITS;
+        continue;
+      }
+
+      int sum=0, bigidx=0;
+      for (int k = 0; k < n; k ++)
+      {
+        const int v = (int) floor(tmp[skip+k] * (1<<RS_WBITS) / tot + 0.5);
+        wo[k] = (short) v;
+        sum += v;
+        if (v > wo[bigidx]) bigidx=k;
+      }
+      wo[bigidx] += (short) ((1<<RS_WBITS) - sum); // rounding error goes to the largest tap
+
+      start.Get()[i] = lo + skip;
+      cnt.Get()[i] = n;
+    }
+    return true;
+  }
+};
+
+
+// horizontal pass: one source row to intermediate pixels [j0,j1)
+static void rs_hpass(const LICE_pixel *src, short *out, int j0, int j1, const LICE_ResampleAxis *ax)
+{
+  const int *st = ax->start.Get(), *ct = ax->cnt.Get();
+  const short *wt = ax->w.Get();
+  const int maxcnt = ax->maxcnt;
+
+  out -= j0*4;
+  for (int j = j0; j < j1; j ++)
+  {
+    const LICE_pixel *p = src + st[j];
+    const short *w = wt + j*maxcnt;
+    const int n = ct[j];
+    int k=0;
+#ifdef LICE_RESAMPLE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (; k+1 < n; k += 2)
+    {
+      // two source pixels, channels interleaved so that madd applies (w0,w1) per channel
+      __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p+k)),zero);
+      v = _mm_unpacklo_epi16(v,_mm_srli_si128(v,8));
+      acc = _mm_add_epi32(acc,_mm_madd_epi16(v,_mm_set1_epi32((w[k]&0xffff) | (((int)w[k+1])<<16))));
+    }
+    if (k < n)
+    {
+      __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p[k]),zero);
+      v = _mm_unpacklo_epi16(v,zero);
+      acc = _mm_add_epi32(acc,_mm_madd_epi16(v,_mm_set1_epi32(w[k]&0xffff)));
+    }
+    acc = _mm_srai_epi32(_mm_add_epi32(acc,_mm_set1_epi32(1<<(RS_WBITS-RS_IBITS-1))),RS_WBITS-RS_IBITS);
+    _mm_storel_epi64((__m128i *)(out+j*4),_mm_packs_epi32(acc,acc));
+#else
+    int a0=0,a1=0,a2=0,a3=0;
+    for (; k < n; k ++)
+    {
+      const unsigned char *c = (const unsigned char *)(p+k);
+      const int wk = w[k];
+      a0 += wk*c[0];
+      a1 += wk*c[1];
+      a2 += wk*c[2];
+      a3 += wk*c[3];
+    }
+    const int rnd = 1<<(RS_WBITS-RS_IBITS-1);
+    out[j*4+0] = (short) ((a0+rnd) >> (RS_WBITS-RS_IBITS));
+    out[j*4+1] = (short) ((a1+rnd) >> (RS_WBITS-RS_IBITS));
+    out[j*4+2] = (short) ((a2+rnd) >> (RS_WBITS-RS_IBITS));
+    out[j*4+3] = (short) ((a3+rnd) >> (RS_WBITS-RS_IBITS));
+#endif
+  }
+}
+
+// vertical pass: n intermediate rows (of ow pixels, ow padded to even) to one output row
+static void rs_vpass(const short * const *rows, const short *w, int n, LICE_pixel *out, int ow)
+{
+#ifdef LICE_RESAMPLE_SSE2
+  const __m128i rnd = _mm_set1_epi32(1<<(RS_WBITS+RS_IBITS-1));
+  for (int x = 0; x < ow*4; x += 8) // two pixels at a time
+  {
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    int k=0;
+    for (; k+1 < n; k += 2)
+    {
+      const __m128i a = _mm_loadu_si128((const __m128i *)(rows[k]+x));
+      const __m128i b = _mm_loadu_si128((const __m128i *)(rows[k+1]+x));
+      const __m128i wv = _mm_set1_epi32((w[k]&0xffff) | (((int)w[k+1])<<16));
+      lo = _mm_add_epi32(lo,_mm_madd_epi16(_mm_unpacklo_epi16(a,b),wv));
+      hi = _mm_add_epi32(hi,_mm_madd_epi16(_mm_unpackhi_epi16(a,b),wv));
+    }
+    if (k < n)
+    {
+      const __m128i a = _mm_loadu_si128((const __m128i *)(rows[k]+x));
+      const __m128i wv = _mm_set1_epi32(w[k]&0xffff);
+      lo = _mm_add_epi32(lo,_mm_madd_epi16(_mm_unpacklo_epi16(a,_mm_setzero_si128()),wv));
+      hi = _mm_add_epi32(hi,_mm_madd_epi16(_mm_unpackhi_epi16(a,_mm_setzero_si128()),wv));
+    }
+    lo = _mm_srai_epi32(_mm_add_epi32(lo,rnd),RS_WBITS+RS_IBITS);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi,rnd),RS_WBITS+RS_IBITS);
+    const __m128i s = _mm_packs_epi32(lo,hi);
+    _mm_storel_epi64((__m128i *)(out + x/4),_mm_packus_epi16(s,s));
+  }
+#else
+  const int rnd = 1<<(RS_WBITS+RS_IBITS-1);
+  unsigned char *o = (unsigned char *)out;
+  for (int x = 0; x < ow*4; x ++)
+  {
+    int a = rnd;
+    for (int k = 0; k < n; k ++) a += w[k] * rows[k][x];
+    a >>= RS_WBITS+RS_IBITS;
+    o[x] = (unsigned char) (a<0 ? 0 : a>255 ? 255 : a);
+  }
+#endif
+}
+
+LICE_ResampleWeights::LICE_ResampleWeights()
+{
+  m_hax = m_vax = NULL;
+  m_dstw = m_dsth = m_srcw = m_srch = m_filter = m_rot = 0;
+}
+
+LICE_ResampleWeights::~LICE_ResampleWeights()
+{
+  delete m_hax;
+  delete m_vax;
+}
+
+bool LICE_ResampleWeights::Matches(int dstw, int dsth, int srcw, int srch, int filter, int rot) const
+{
+  return m_hax && m_vax && m_dstw == dstw && m_dsth == dsth && m_srcw == srcw && m_srch == srch && 
+         m_filter == filter && m_rot == (rot&3);
+}
+
+bool LICE_ResampleWeights::Build(int dstw, int dsth, int srcw, int srch, int filter, int rot)
+{
+  rot &= 3;
+  if (Matches(dstw,dsth,srcw,srch,filter,rot)) return true;
+
+  m_dstw = m_dsth = 0;
+  if (dstw < 1 || dsth < 1 || srcw < 1 || srch < 1) return false;
+  if (!m_hax) m_hax = new LICE_ResampleAxis;
+  if (!m_vax) m_vax = new LICE_ResampleAxis;
+  if (!m_hax->Build(srcw,(rot&1) ? dsth : dstw,filter) || !m_vax->Build(srch,(rot&1) ? dstw : dsth,filter)) return false;
+
+  m_dstw = dstw;
+  m_dsth = dsth;
+  m_srcw = srcw;
+  m_srch = srch;
+  m_filter = filter;
+  m_rot = rot;
+  return true;
+}
+
+static LICE_pixel *rs_getrow(LICE_IBitmap *bm, int y)
+{
+  LICE_pixel *p = bm->getBits();
+  if (bm->isFlipped()) y = bm->getHeight()-1-y;
+  return p + y*bm->getRowSpan();
+}
+
+bool LICE_Resample(LICE_IBitmap *dest, LICE_IBitmap *src, int dstx, int dsty, int dstw, int dsth,
+                   int srcx, int srcy, int srcw, int srch, int filter, int rot, const RECT *dstclip,
+                   const LICE_ResampleWeights *weights)
+{
+  if (!dest || !src || dstw < 1 || dsth < 1) return false;
+  if (!dest->getBits() || !src->getBits()) return false;
+
+  if (srcx < 0) { srcw += srcx; srcx=0; }
+  if (srcy < 0) { srch += srcy; srcy=0; }
+  if (srcx + srcw > src->getWidth()) srcw = src->getWidth() - srcx;
+  if (srcy + srch > src->getHeight()) srch = src->getHeight() - srcy;
+  if (srcw < 1 || srch < 1) return false;
+
+  // destination pixels that will actually be written
+  int cl = dstx, ct = dsty, cr = dstx+dstw, cb = dsty+dsth;
+  if (cl < 0) cl=0;
+  if (ct < 0) ct=0;
+  if (cr > dest->getWidth()) cr = dest->getWidth();
+  if (cb > dest->getHeight()) cb = dest->getHeight();
+  if (dstclip)
+  {
+    if (cl < dstclip->left) cl = dstclip->left;
+    if (ct < dstclip->top) ct = dstclip->top;
+    if (cr > dstclip->right) cr = dstclip->right;
+    if (cb > dstclip->bottom) cb = dstclip->bottom;
+  }
+  if (cr <= cl || cb <= ct) return true; // nothing visible
+
+  rot &= 3;
+  // ow/oh are the output dimensions in source orientation, [j0,j1) x [i0,i1) the part of it that is visible
+  const int ow = (rot&1) ? dsth : dstw;
+  const int oh = (rot&1) ? dstw : dsth;
+  int j0, j1, i0, i1;
+  switch (rot)
+  {
+    case 0:  j0 = cl-dstx;           j1 = cr-dstx;           i0 = ct-dsty;           i1 = cb-dsty; break;
+    case 1:  j0 = ct-dsty;           j1 = cb-dsty;           i0 = dstx+dstw-cr;      i1 = dstx+dstw-cl; break;
+    case 2:  j0 = dstx+dstw-cr;      j1 = dstx+dstw-cl;      i0 = dsty+dsth-cb;      i1 = dsty+dsth-ct; break;
+    default: j0 = dsty+dsth-cb;      j1 = dsty+dsth-ct;      i0 = cl-dstx;           i1 = cr-dstx; break;
+  }
+
+  LICE_ResampleAxis tmpax[2];
+  const LICE_ResampleAxis *hax, *vax;
+  if (weights && weights->Matches(dstw,dsth,srcw,srch,filter,rot))
+  {
+    hax = weights->m_hax;
+    vax = weights->m_vax;
+  }
+  else
+  {
+    if (!tmpax[0].Build(srcw,ow,filter) || !tmpax[1].Build(srch,oh,filter)) return false;
+    hax = tmpax;
+    vax = tmpax+1;
+  }
+
+  // intermediate rows are kept in a ring, which need only be as tall as the vertical kernel
+  const int jw = j1-j0;
+  const int jwpad = (jw+1)&~1;
+  const int ringsz = vax->maxcnt;
+  WDL_TypedBuf<short> ringbuf;
+  WDL_TypedBuf<LICE_pixel> tilebuf;
+  WDL_TypedBuf<const short *> rowptrs;
+  short *ring = ringbuf.Resize(ringsz*jwpad*4,false);
+  LICE_pixel *tile = tilebuf.Resize(RS_TILE*jwpad,false);
+  const short **rp = rowptrs.Resize(ringsz,false);
+  if (!ring || !tile || !rp) return false;
+  if (jwpad != jw) for (int r = 0; r < ringsz; r ++) memset(ring + (r*jwpad + jw)*4,0,4*sizeof(short));
+
+  int next_row = 0; // next source row (relative to srcy) not yet in the ring
+
+  for (int it = i0; it < i1; it += RS_TILE)
+  {
+    const int ni = i1-it < RS_TILE ? i1-it : RS_TILE;
+    for (int ti = 0; ti < ni; ti ++)
+    {
+      const int i = it + ti;
+      const int st = vax->start.Get()[i], n = vax->cnt.Get()[i];
+      if (next_row < st) next_row = st;
+      while (next_row < st + n)
+      {
+        rs_hpass(rs_getrow(src,srcy+next_row) + srcx, ring + (next_row%ringsz)*jwpad*4, j0, j1, hax);
+        next_row++;
+      }
+      for (int k = 0; k < n; k ++) rp[k] = ring + ((st+k)%ringsz)*jwpad*4;
+      rs_vpass(rp, vax->w.Get() + i*vax->maxcnt, n, tile + ti*jwpad, jwpad);
+    }
+
+    // write the tile, mapping (i,j) to the destination with the rotation applied.
+    // when rotating by 90, walk destination rows so each gets a run of ni pixels
+    if (!(rot&1)) for (int ti = 0; ti < ni; ti ++)
+    {
+      const int i = it + ti;
+      const LICE_pixel *tp = tile + ti*jwpad;
+      if (!rot)
+      {
+        memcpy(rs_getrow(dest,dsty+i) + dstx+j0, tp, jw*sizeof(LICE_pixel));
+      }
+      else
+      {
+        LICE_pixel *drow = rs_getrow(dest,dsty+dsth-1-i) + dstx+dstw-1-j0;
+        for (int j = 0; j < jw; j ++) *drow-- = tp[j];
+      }
+    }
+    else for (int j = 0; j < jw; j ++)
+    {
+      if (rot == 1)
+      {
+        LICE_pixel *drow = rs_getrow(dest,dsty+j0+j) + dstx+dstw-1-it;
+        for (int ti = 0; ti < ni; ti ++) *drow-- = tile[ti*jwpad + j];
+      }
+      else
+      {
+        LICE_pixel *drow = rs_getrow(dest,dsty+dsth-1-(j0+j)) + dstx+it;
+        for (int ti = 0; ti < ni; ti ++) *drow++ = tile[ti*jwpad + j];
+      }
+    }
+  }
+  return true;
+}
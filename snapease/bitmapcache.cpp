@@ -0,0 +1,305 @@
+/*
+    SnapEase
+    bitmapcache.cpp -- byte-budgeted accounting/eviction for ImageRecord bitmaps
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "main.h"
+
+#include "../WDL/lice/lice.h"
+#include "../WDL/ptrlist.h"
+#include "../WDL/heapbuf.h"
+#include "../WDL/wdlcstring.h"
+
+#include "bitmapcache.h"
+
+// per tier, records holding bitmaps in that tier as a binary min-heap on m_bmcache_lastuse 
+// (least recently used at the top), indexed by ImageRecord::m_bmcache_heapidx[tier]
+static WDL_PtrList<ImageRecord> s_heap[BMCACHE_NUMTIERS];
+static WDL_INT64 s_usage[BMCACHE_NUMTIERS];
+static WDL_INT64 s_budget = ((WDL_INT64)768)<<20;
+static int s_evict_cnt;
+static WDL_PtrList<LICE_IBitmap> s_released; // protected by g_images_mutex
+
+// relative rate at which each tier ages since last use
+static const int s_tier_weight[BMCACHE_NUMTIERS] = { 1, 2, 4, 4 };
+
+void BitmapCache_SetBudget(WDL_INT64 bytes) { s_budget = bytes; }
+WDL_INT64 BitmapCache_GetBudget() { return s_budget; }
+
+WDL_INT64 BitmapCache_GetUsage(int tier)
+{
+  if (tier >= 0 && tier < BMCACHE_NUMTIERS) return s_usage[tier];
+
+  WDL_INT64 s = 0;
+  int x;
+  for (x = 0; x < BMCACHE_NUMTIERS; x ++) s += s_usage[x];
+  return s;
+}
+
+int BitmapCache_GetBitmapBytes(LICE_IBitmap *bm)
+{
+  return bm ? bm->getRowSpan() * bm->getHeight() * (int)sizeof(LICE_pixel) : 0;
+}
+
+static bool Heap_Older(const ImageRecord *a, const ImageRecord *b)
+{
+  return (int) (a->m_bmcache_lastuse - b->m_bmcache_lastuse) < 0;
+}
+
+static void Heap_Set(int tier, int idx, ImageRecord *rec)
+{
+  s_heap[tier].Set(idx,rec);
+  rec->m_bmcache_heapidx[tier] = idx;
+}
+
+static void Heap_SiftUp(int tier, int idx)
+{
+  ImageRecord *rec = s_heap[tier].Get(idx);
+  while (idx > 0)
+  {
+    const int parent = (idx-1)/2;
+    ImageRecord *p = s_heap[tier].Get(parent);
+    if (!Heap_Older(rec,p)) break;
+    Heap_Set(tier,idx,p);
+    idx = parent;
+  }
+  Heap_Set(tier,idx,rec);
+}
+
+static void Heap_SiftDown(int tier, int idx)
+{
+  const int n = s_heap[tier].GetSize();
+  ImageRecord *rec = s_heap[tier].Get(idx);
+  for (;;)
+  {
+    int c = idx*2+1;
+    if (c >= n) break;
+    if (c+1 < n && Heap_Older(s_heap[tier].Get(c+1),s_heap[tier].Get(c))) c++;
+    ImageRecord *child = s_heap[tier].Get(c);
+    if (!Heap_Older(child,rec)) break;
+    Heap_Set(tier,idx,child);
+    idx = c;
+  }
+  Heap_Set(tier,idx,rec);
+}
+
+static void Heap_Insert(int tier, ImageRecord *rec)
+{
+  if (rec->m_bmcache_heapidx[tier] >= 0) return;
+  s_heap[tier].Add(rec);
+  Heap_SiftUp(tier,s_heap[tier].GetSize()-1);
+}
+
+static void Heap_Delete(int tier, ImageRecord *rec)
+{
+  const int idx = rec->m_bmcache_heapidx[tier];
+  if (idx < 0) return;
+  rec->m_bmcache_heapidx[tier] = -1;
+
+  // move the last record into this slot and restore the heap order from there
+  const int last = s_heap[tier].GetSize() - 1;
+  ImageRecord *lr = s_heap[tier].Get(last);
+  s_heap[tier].Delete(last);
+  if (idx == last) return;
+  Heap_Set(tier,idx,lr);
+  if (idx > 0 && Heap_Older(lr,s_heap[tier].Get((idx-1)/2))) Heap_SiftUp(tier,idx);
+  else Heap_SiftDown(tier,idx);
+}
+
+// after rec->m_bmcache_lastuse changed
+static void Heap_Update(ImageRecord *rec)
+{
+  int tier;
+  for (tier = 0; tier < BMCACHE_NUMTIERS; tier ++)
+  {
+    const int idx = rec->m_bmcache_heapidx[tier];
+    if (idx < 0) continue;
+    if (idx > 0 && Heap_Older(rec,s_heap[tier].Get((idx-1)/2))) Heap_SiftUp(tier,idx);
+    else Heap_SiftDown(tier,idx);
+  }
+}
+
+void BitmapCache_Add(ImageRecord *rec, int tier, LICE_IBitmap *bm)
+{
+  const int sz = BitmapCache_GetBitmapBytes(bm);
+  if (!sz) return;
+
+  WDL_MutexLock lock(&g_images_mutex);
+  rec->m_bmcache_bytes[tier] += sz;
+  s_usage[tier] += sz;
+  rec->m_bmcache_lastuse = GetTickCount();
+  Heap_Update(rec);
+  Heap_Insert(tier,rec);
+}
+
+void BitmapCache_Remove(ImageRecord *rec, int tier, LICE_IBitmap *bm)
+{
+  const int sz = BitmapCache_GetBitmapBytes(bm);
+  if (!sz) return;
+
+  WDL_MutexLock lock(&g_images_mutex);
+  rec->m_bmcache_bytes[tier] -= sz;
+  s_usage[tier] -= sz;
+  if (!rec->m_bmcache_bytes[tier]) Heap_Delete(tier,rec);
+}
+
+void BitmapCache_Touch(ImageRecord *rec, int age_ms)
+{
+  WDL_MutexLock lock(&g_images_mutex);
+  rec->m_bmcache_lastuse = GetTickCount() - (DWORD)age_ms;
+  Heap_Update(rec);
+}
+
+void BitmapCache_RemoveRecord(ImageRecord *rec)
+{
+  WDL_MutexLock lock(&g_images_mutex);
+  int x;
+  for (x = 0; x < BMCACHE_NUMTIERS; x ++)
+  {
+    s_usage[x] -= rec->m_bmcache_bytes[x];
+    rec->m_bmcache_bytes[x] = 0;
+    Heap_Delete(x,rec);
+  }
+}
+
+void BitmapCache_Release(ImageRecord *rec, int tier, LICE_IBitmap **bm)
+{
+  if (*bm)
+  {
+    BitmapCache_Remove(rec,tier,*bm);
+    s_released.Add(*bm);
+    *bm = NULL;
+  }
+}
+
+void BitmapCache_FreeReleased()
+{
+  g_images_mutex.Enter();
+  if (!s_released.GetSize()) 
+  {
+    g_images_mutex.Leave();
+    return;
+  }
+  WDL_PtrList<LICE_IBitmap> list;
+  int x;
+  for (x = 0; x < s_released.GetSize(); x ++) list.Add(s_released.Get(x));
+  s_released.Empty();
+  g_images_mutex.Leave();
+
+  list.Empty(true);
+}
+
+static void BitmapCache_FreeTier(ImageRecord *rec, int tier)
+{
+  switch (tier)
+  {
+    case BMCACHE_PREVIEW:
+      BitmapCache_Release(rec,tier,&rec->m_preview_image);
+      rec->State() = ImageRecord::IR_STATE_NEEDLOAD;
+      g_images_cnt_ok--;
+    break;
+    case BMCACHE_LEVEL:
+      BitmapCache_Release(rec,tier,&rec->m_mid_image);
+      BitmapCache_Release(rec,tier,&rec->m_screen_image);
+      BitmapCache_Release(rec,tier,&rec->m_fullimage);
+      rec->m_level_failed = 0;
+    break;
+    case BMCACHE_SCALED:
+      BitmapCache_Release(rec,tier,&rec->m_fullimage_scaled);
+      rec->m_fullimage_cachevalid = 0;
+    break;
+    case BMCACHE_FINAL:
+      BitmapCache_Release(rec,tier,&rec->m_fullimage_final);
+      rec->m_fullimage_cachevalid = 0;
+    break;
+  }
+}
+
+WDL_INT64 BitmapCache_Evict(int tiermask, WDL_INT64 target, DWORD used_before)
+{
+  WDL_MutexLock lock(&g_images_mutex);
+  if (BitmapCache_GetUsage() <= target) return 0;
+
+  // records at the top of a heap that cannot be evicted now, reinserted when done
+  static WDL_PtrList<ImageRecord> skipped[BMCACHE_NUMTIERS];
+
+  const DWORD now = GetTickCount();
+  WDL_INT64 freed = 0;
+  int tier;
+  while (BitmapCache_GetUsage() > target)
+  {
+    // the oldest record of each tier is its best candidate, pick the one that aged the most
+    ImageRecord *best = NULL;
+    int best_tier = -1;
+    double best_score = 0.0;
+    for (tier = 0; tier < BMCACHE_NUMTIERS; tier ++)
+    {
+      if (!(tiermask & (1<<tier))) continue;
+
+      ImageRecord *rec;
+      while ((rec = s_heap[tier].Get(0)) && 
+             tier == BMCACHE_PREVIEW && rec->State() != ImageRecord::IR_STATE_LOADED) // provisional preview, being decoded
+      {
+        Heap_Delete(tier,rec);
+        skipped[tier].Add(rec);
+      }
+      if (!rec || (int) (used_before - rec->m_bmcache_lastuse) <= 0) continue;
+
+      const double score = (double) (int) (now - rec->m_bmcache_lastuse) * s_tier_weight[tier];
+      if (!best || score > best_score)
+      {
+        best = rec;
+        best_tier = tier;
+        best_score = score;
+      }
+    }
+    if (!best) break;
+
+    const WDL_INT64 sz = best->m_bmcache_bytes[best_tier];
+    BitmapCache_FreeTier(best, best_tier);
+    freed += sz - best->m_bmcache_bytes[best_tier];
+    s_evict_cnt++;
+
+    if (best->m_bmcache_heapidx[best_tier] >= 0) // bytes still accounted in this tier, don't pick it again
+    {
+      Heap_Delete(best_tier,best);
+      skipped[best_tier].Add(best);
+    }
+  }
+
+  for (tier = 0; tier < BMCACHE_NUMTIERS; tier ++)
+  {
+    int x;
+    for (x = 0; x < skipped[tier].GetSize(); x ++)
+    {
+      ImageRecord *rec = skipped[tier].Get(x);
+      if (rec->m_bmcache_bytes[tier]) Heap_Insert(tier,rec);
+    }
+    skipped[tier].Empty();
+  }
+  return freed;
+}
+
+void BitmapCache_GetStatusString(char *buf, int bufsz)
+{
+  snprintf(buf, bufsz, "cache: %d/%dMB (thumbnails %d, view %d, scaled %d, final %d), %d evicted",
+    (int) (BitmapCache_GetUsage() >> 20), (int) (s_budget >> 20),
+    (int) (s_usage[BMCACHE_PREVIEW] >> 20), (int) (s_usage[BMCACHE_LEVEL] >> 20),
+    (int) (s_usage[BMCACHE_SCALED] >> 20), (int) (s_usage[BMCACHE_FINAL] >> 20),
+    s_evict_cnt);
+}
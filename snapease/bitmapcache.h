@@ -0,0 +1,66 @@
+/*
+    SnapEase
+    bitmapcache.h -- byte-budgeted accounting/eviction for ImageRecord bitmaps
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _BITMAPCACHE_H_
+#define _BITMAPCACHE_H_
+
+#include "../WDL/wdltypes.h"
+
+class ImageRecord;
+class LICE_IBitmap;
+
+// every bitmap owned by an ImageRecord is accounted in one tier. when over the budget, 
+// bitmaps are evicted least recently used first, with each tier aging at its own rate 
+// (cheaply regenerated tiers go first). all functions lock g_images_mutex.
+enum 
+{ 
+  BMCACHE_PREVIEW=0, // m_preview_image
+  BMCACHE_LEVEL, // m_mid_image, m_screen_image, m_fullimage
+  BMCACHE_SCALED, // m_fullimage_scaled
+  BMCACHE_FINAL, // m_fullimage_final
+  BMCACHE_NUMTIERS 
+};
+#define BMCACHE_TIERMASK_ALL ((1<<BMCACHE_NUMTIERS)-1)
+#define BMCACHE_TIERMASK_DECODE ((1<<BMCACHE_PREVIEW)|(1<<BMCACHE_LEVEL)) // the UI thread may be using the others
+
+void BitmapCache_SetBudget(WDL_INT64 bytes);
+WDL_INT64 BitmapCache_GetBudget();
+WDL_INT64 BitmapCache_GetUsage(int tier=-1); // -1 for all tiers
+
+int BitmapCache_GetBitmapBytes(LICE_IBitmap *bm); // actual allocation size
+
+void BitmapCache_Add(ImageRecord *rec, int tier, LICE_IBitmap *bm); // after attaching bm to rec
+void BitmapCache_Remove(ImageRecord *rec, int tier, LICE_IBitmap *bm); // before deleting/detaching bm
+void BitmapCache_Touch(ImageRecord *rec, int age_ms=0); // marks as last used age_ms ago
+void BitmapCache_RemoveRecord(ImageRecord *rec); // when rec is destroyed
+
+// detaches *bm from rec (setting it to NULL) and queues it to be deleted by BitmapCache_FreeReleased(), 
+// so a bitmap that OnPaint got from rec without the lock stays valid until the paint is done. 
+// g_images_mutex must be locked
+void BitmapCache_Release(ImageRecord *rec, int tier, LICE_IBitmap **bm);
+void BitmapCache_FreeReleased(); // UI thread only, outside of painting
+
+// evicts bitmaps in tiermask last used before used_before (a GetTickCount() time), until usage <= target. 
+// evicted bitmaps are released (see BitmapCache_Release) rather than deleted. returns bytes freed
+WDL_INT64 BitmapCache_Evict(int tiermask, WDL_INT64 target, DWORD used_before);
+
+void BitmapCache_GetStatusString(char *buf, int bufsz);
+
+#endif
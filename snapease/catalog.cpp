@@ -0,0 +1,189 @@
+/*
+    SnapEase
+    catalog.cpp -- compact per-image catalog data
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "main.h"
+
+#include "../WDL/wdlcstring.h"
+
+#include "catalog.h"
+
+#define STRBLOCK_SIZE 65536
+
+ImageCatalog g_catalog;
+
+ImageCatalog::ImageCatalog()
+{
+  memset(m_chunks,0,sizeof(m_chunks));
+  m_nchunks = m_count = 0;
+  m_strblock_used = m_strblock_size = 0;
+  m_strhash_cnt = 0;
+}
+
+ImageCatalog::~ImageCatalog()
+{
+  int x;
+  for (x = 0; x < m_nchunks; x ++) free(m_chunks[x]);
+  m_strblocks.Empty(true,free);
+}
+
+int ImageCatalog::Alloc()
+{
+  WDL_MutexLock lock(&m_mutex);
+  int id;
+  if (m_freelist.GetSize())
+  {
+    id = m_freelist.Get()[m_freelist.GetSize()-1];
+    m_freelist.Resize(m_freelist.GetSize()-1,false);
+  }
+  else
+  {
+    if (m_nchunks >= MAX_CHUNKS) return -1;
+    Chunk *c = (Chunk *)calloc(1,sizeof(Chunk));
+    if (!c) return -1;
+
+    // new ids are handed out from the free list, lowest first
+    const int base = m_nchunks << CHUNK_BITS;
+    int *fl = m_freelist.Resize(CHUNK_SIZE,false);
+    if (!fl || m_freelist.GetSize() != CHUNK_SIZE) { free(c); return -1; }
+    for (id = 0; id < CHUNK_SIZE; id ++) fl[id] = base + CHUNK_SIZE-1-id;
+    m_chunks[m_nchunks++] = c;
+
+    id = base;
+    m_freelist.Resize(CHUNK_SIZE-1,false);
+  }
+
+  Chunk *c = C(id);
+  const int i = id&CHUNK_MASK;
+  c->fn[i] = c->outname[i] = "";
+  c->timestamp[i] = 0;
+  memset(&c->crop[i],0,sizeof(c->crop[i]));
+  memset(c->bchsv[i],0,sizeof(c->bchsv[i]));
+  c->srcw[i] = c->srch[i] = 0;
+  c->rot[i] = 0;
+  c->bw[i] = c->need_rotchk[i] = c->has_thumb[i] = false;
+  c->state[i] = 0;
+  c->listidx[i] = -1;
+  if (!c->gen[i]) c->gen[i] = 1;
+  m_count++;
+  return id;
+}
+
+void ImageCatalog::Free(int id)
+{
+  if (id < 0) return;
+  WDL_MutexLock lock(&m_mutex);
+  Chunk *c = C(id);
+  const int i = id&CHUNK_MASK;
+  c->fn[i] = c->outname[i] = "";
+  c->listidx[i] = -1;
+  if (!++c->gen[i]) c->gen[i] = 1; // invalidates outstanding handles
+  m_freelist.Add(id);
+  if (!--m_count) ResetStrings(); // nothing refers to the pool anymore
+}
+
+bool ImageCatalog::IsValid(WDL_UINT64 h) const
+{
+  const int id = HandleToID(h);
+  if (!h || id < 0 || id >= (m_nchunks << CHUNK_BITS)) return false;
+  return C(id)->gen[id&CHUNK_MASK] == (unsigned int) (h >> 32);
+}
+
+void ImageCatalog::ResetStrings()
+{
+  m_strblocks.Empty(true,free);
+  m_strblock_used = m_strblock_size = 0;
+  m_strhash.Resize(0);
+  m_strhash_cnt = 0;
+}
+
+static unsigned int hash_str(const char *str)
+{
+  unsigned int h = 2166136261u;
+  while (*str) h = (h ^ (unsigned char)*str++) * 16777619; // FNV-1a
+  return h;
+}
+
+const char *ImageCatalog::Intern(const char *str)
+{
+  if (!str || !*str) return "";
+
+  WDL_MutexLock lock(&m_mutex);
+  const unsigned int h = hash_str(str);
+
+  int hsz = m_strhash.GetSize();
+  const char **tab = m_strhash.Get();
+  if (hsz)
+  {
+    int pos = h & (hsz-1);
+    while (tab[pos])
+    {
+      if (!strcmp(tab[pos],str)) return tab[pos];
+      pos = (pos+1) & (hsz-1);
+    }
+  }
+
+  // copy to the pool
+  const int len = (int)strlen(str)+1;
+  if (m_strblock_used + len > m_strblock_size)
+  {
+    const int bs = len > STRBLOCK_SIZE ? len : STRBLOCK_SIZE;
+    char *b = (char *)malloc(bs);
+    if (!b) return "";
+    m_strblocks.Add(b);
+    m_strblock_used = 0;
+    m_strblock_size = bs;
+  }
+  char *s = m_strblocks.Get(m_strblocks.GetSize()-1) + m_strblock_used;
+  memcpy(s,str,len);
+  m_strblock_used += len;
+
+  // keep the table at most half full
+  if ((m_strhash_cnt+1)*2 > hsz)
+  {
+    WDL_TypedBuf<const char *> old;
+    old.Resize(hsz,false);
+    if (hsz) memcpy(old.Get(),tab,hsz*sizeof(const char *));
+    const int nsz = hsz ? hsz*2 : 1024;
+    tab = m_strhash.Resize(nsz,false);
+    if (m_strhash.GetSize() != nsz) { m_strhash.Resize(hsz,false); return s; } // not interned, still valid
+    memset(tab,0,nsz*sizeof(const char *));
+    int x;
+    for (x = 0; x < hsz; x ++) if (old.Get()[x])
+    {
+      int pos = hash_str(old.Get()[x]) & (nsz-1);
+      while (tab[pos]) pos = (pos+1) & (nsz-1);
+      tab[pos] = old.Get()[x];
+    }
+    hsz = nsz;
+  }
+  int pos = h & (hsz-1);
+  while (tab[pos]) pos = (pos+1) & (hsz-1);
+  tab[pos] = s;
+  m_strhash_cnt++;
+  return s;
+}
+
+WDL_INT64 ImageCatalog::GetMemUsage() const
+{
+  return (WDL_INT64)m_nchunks * sizeof(Chunk) + 
+         (WDL_INT64)m_strblocks.GetSize() * STRBLOCK_SIZE + 
+         (WDL_INT64)m_strhash.GetSize() * sizeof(const char *) +
+         (WDL_INT64)m_freelist.GetSize() * sizeof(int);
+}
@@ -0,0 +1,110 @@
+/*
+    SnapEase
+    catalog.h -- compact per-image catalog data
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _CATALOG_H_
+#define _CATALOG_H_
+
+#include <time.h>
+
+#include "../WDL/wdltypes.h"
+#include "../WDL/mutex.h"
+#include "../WDL/heapbuf.h"
+#include "../WDL/ptrlist.h"
+
+// what is known about each image independent of the UI: paths, edit parameters, load state.
+// stored as columns in fixed-size chunks, so entries never move when the catalog grows. each image
+// has a compact ImageRecord in g_images referring to its entry (the widget, ImageRecordVwnd, only
+// exists while it is on screen). the fields are protected by g_images_mutex (m_mutex only guards
+// Alloc/Free and the string pool). strings are interned and stay valid until the catalog is empty again.
+//
+// a handle is an id plus the generation it was allocated in, so code that let go of g_images_mutex
+// can check in O(1) whether the entry it was working on still exists without touching the record.
+class ImageCatalog
+{
+public:
+  ImageCatalog();
+  ~ImageCatalog();
+
+  int Alloc(); // returns an id with zeroed fields, -1 if full
+  void Free(int id);
+  int GetCount() const { return m_count; }
+
+  WDL_UINT64 GetHandle(int id) const { return id < 0 ? 0 : (((WDL_UINT64)C(id)->gen[id&CHUNK_MASK])<<32) | (unsigned int)id; }
+  static int HandleToID(WDL_UINT64 h) { return (int) (h & 0xffffffff); }
+  bool IsValid(WDL_UINT64 h) const; // false once the entry was freed, even if its id was reused
+
+  const char *GetFN(int id) const { return C(id)->fn[id&CHUNK_MASK]; }
+  void SetFN(int id, const char *fn) { C(id)->fn[id&CHUNK_MASK] = Intern(fn); }
+  const char *GetOutName(int id) const { return C(id)->outname[id&CHUNK_MASK]; }
+  void SetOutName(int id, const char *name) { C(id)->outname[id&CHUNK_MASK] = Intern(name); }
+
+  time_t &Timestamp(int id) const { return C(id)->timestamp[id&CHUNK_MASK]; }
+  RECT &Crop(int id) const { return C(id)->crop[id&CHUNK_MASK]; }
+  float *BCHSV(int id) const { return C(id)->bchsv[id&CHUNK_MASK]; }
+  int &SrcW(int id) const { return C(id)->srcw[id&CHUNK_MASK]; }
+  int &SrcH(int id) const { return C(id)->srch[id&CHUNK_MASK]; }
+  char &Rot(int id) const { return C(id)->rot[id&CHUNK_MASK]; }
+  bool &BW(int id) const { return C(id)->bw[id&CHUNK_MASK]; }
+  bool &NeedRotChk(int id) const { return C(id)->need_rotchk[id&CHUNK_MASK]; }
+  bool &CacheHasThumbnail(int id) const { return C(id)->has_thumb[id&CHUNK_MASK]; }
+  unsigned char &State(int id) const { return C(id)->state[id&CHUNK_MASK]; }
+  int &ListIndex(int id) const { return C(id)->listidx[id&CHUNK_MASK]; } // position in g_images, -1 if not listed
+
+  WDL_INT64 GetMemUsage() const;
+
+private:
+  enum { CHUNK_BITS=12, CHUNK_SIZE=1<<CHUNK_BITS, CHUNK_MASK=CHUNK_SIZE-1, MAX_CHUNKS=1024 };
+  struct Chunk
+  {
+    const char *fn[CHUNK_SIZE];
+    const char *outname[CHUNK_SIZE];
+    time_t timestamp[CHUNK_SIZE];
+    RECT crop[CHUNK_SIZE];
+    float bchsv[CHUNK_SIZE][5];
+    int srcw[CHUNK_SIZE], srch[CHUNK_SIZE];
+    char rot[CHUNK_SIZE]; // 90deg steps (0..3)
+    bool bw[CHUNK_SIZE];
+    bool need_rotchk[CHUNK_SIZE];
+    bool has_thumb[CHUNK_SIZE];
+    unsigned char state[CHUNK_SIZE]; // ImageRecord::IR_STATE_*
+    int listidx[CHUNK_SIZE];
+    unsigned int gen[CHUNK_SIZE]; // bumped on Free, never 0
+  };
+  Chunk *C(int id) const { return m_chunks[id>>CHUNK_BITS]; }
+
+  const char *Intern(const char *str);
+  void ResetStrings();
+
+  Chunk *m_chunks[MAX_CHUNKS]; // fixed so readers never see the table move
+  int m_nchunks, m_count;
+  WDL_TypedBuf<int> m_freelist;
+
+  // string pool: blocks that are never reallocated, plus an open addressing hash of their strings
+  WDL_PtrList<char> m_strblocks;
+  int m_strblock_used, m_strblock_size;
+  WDL_TypedBuf<const char *> m_strhash;
+  int m_strhash_cnt;
+
+  WDL_Mutex m_mutex; // Alloc/Free/Set*
+};
+
+extern ImageCatalog g_catalog;
+
+#endif
@@ -25,31 +25,130 @@
 #endif
 
 #include "imagerecord.h"
+#include "thumbstore.h"
 
 #include "../WDL/lice/lice.h"
 #include "../WDL/zlib/zlib.h"
 
 #include "../WDL/fnv64.h"
 #include "../WDL/wdlcstring.h"
+#include "../WDL/queue.h"
+#include "../WDL/mergesort.h"
+#include "../WDL/fileread.h"
 
 #define DESIRED_PREVIEW_CACHEDIM 256
 #define FILE_CACHE_BLOB_HEADERSIZE 16
 
-bool g_DecodeDidSomething;
+// cache blob formats:
+//   legacy: deflate of (header + RGB & 0xf8), header: [0] rot, [1] 0, w at +4, h at +8, extra at +12
+//   versioned: uncompressed header, [0] FILE_CACHE_BLOB_MAGIC, [1] format, [2] rot, [3] 0, 
+//   w at +4, h at +8, extra at +12, followed by the encoded image.
+// legacy blobs always begin with a zlib header (0x78), so [0] tells them apart.
+#define FILE_CACHE_BLOB_MAGIC 0xff
+#define FILE_CACHE_BLOB_FORMAT_JPEG 1
+
+static WDL_TypedBuf<WDL_UINT64> s_decode_damage; // handles of records whose on-screen state changed, protected by g_images_mutex
 static bool g_DecodeThreadQuit;
 
-int g_config_maxthumbnail=128<<10; // kb
+// caller must hold g_images_mutex
+static void DecodeThread_PostDamage(ImageRecord *rec)
+{
+  if (!rec->m_damage_posted)
+  {
+    rec->m_damage_posted = true;
+    s_decode_damage.Add(rec->GetHandle());
+  }
+}
 
-static char GetRotationForImage(const char *fn);
+static char GetRotationForImage(const char *fn, WDL_HeapBuf *thumbOut=NULL);
+static char GetRotationForImageData(const unsigned char *data, int len, WDL_HeapBuf *thumbOut=NULL);
+static void SetProvisionalPreview(WDL_UINT64 rec_handle, const char *fn, LICE_IBitmap *bm, const char *calc_rot);
 
 #define FORCE_THREADS 1
-#define MAX_THREADS 4
+#define MAX_THREADS 64 // upper bound, the thread count is getCPUcount()
 
 #ifdef _WIN32
 //#define USE_SEH
 #endif
 
-bool LoadFullBitmap(LICE_IBitmap *bmOut, const char *fn)
+// a source file opened once and mapped (or read whole, if small), so that the EXIF scan and the 
+// decode share one open. JPEG and PNG decode straight from memory, other formats (and files too 
+// large to map) go through the LICE loaders by filename.
+#define IMAGEFILE_READALL_MAXSIZE (64*1024) // smaller files are read rather than mapped
+#define IMAGEFILE_MAP_MAXSIZE (512u*1024*1024)
+
+class ImageFileView
+{
+public:
+  ImageFileView(const char *fn) : m_file(fn,0,0,0,IMAGEFILE_READALL_MAXSIZE,IMAGEFILE_MAP_MAXSIZE)
+  {
+    m_fn = fn;
+    m_data = NULL;
+    m_len = 0;
+    if (m_file.IsOpen() && m_file.GetSize() > 0 && m_file.GetSize() < IMAGEFILE_MAP_MAXSIZE)
+    {
+      m_len = (int)m_file.GetSize();
+      m_data = (const unsigned char *)m_file.GetMappedView(0,&m_len);
+      if (!m_data) m_len = 0;
+    }
+  }
+
+  // if thumbOut is set, it receives the embedded JPEG thumbnail, if any
+  char GetRotation(WDL_HeapBuf *thumbOut=NULL) const
+  {
+    return m_data ? GetRotationForImageData(m_data,m_len,thumbOut) : GetRotationForImage(m_fn,thumbOut);
+  }
+
+  bool Load(LICE_IBitmap *bmOut, int want_w, int want_h, int *srcw, int *srch) const;
+  bool LoadRows(int want_w, int want_h, int band_rows, LICE_ReadRowsProc proc, void *ctx, int *srcw, int *srch) const;
+
+private:
+  WDL_FileRead m_file;
+  const char *m_fn;
+  const unsigned char *m_data;
+  int m_len;
+};
+
+// want_w/want_h of 0 loads full size, otherwise may decode at reduced size (JPEG DCT scaling), 
+// the result still covers want_w x want_h when fit
+bool ImageFileView::Load(LICE_IBitmap *bmOut, int want_w, int want_h, int *srcw, int *srch) const
+{
+  bool success=false;
+#ifdef USE_SEH
+  __try
+  {
+#endif
+
+    if (m_len >= 4 && m_data[0] == 0xff && m_data[1] == 0xd8)
+    {
+      if (LICE_LoadJPGFromMemoryScaled(m_data,m_len,want_w,want_h,bmOut,srcw,srch)) success=true;
+    }
+    else if (m_len >= 8 && !memcmp(m_data,"\x89PNG",4))
+    {
+      if (LICE_LoadPNGFromMemory(m_data,m_len,bmOut))
+      {
+        if (srcw) *srcw = bmOut->getWidth();
+        if (srch) *srch = bmOut->getHeight();
+        success=true;
+      }
+    }
+    else if (want_w > 0 || want_h > 0)
+    {
+      if (LICE_LoadImageScaled(m_fn,want_w,want_h,bmOut,false,srcw,srch)) success=true;
+    }
+    else if (LICE_LoadImage(m_fn,bmOut,false)) success=true;
+
+#ifdef USE_SEH
+  }
+  __except(EXCEPTION_EXECUTE_HANDLER)
+  {
+  }
+#endif
+  return success;
+}
+
+// strip decode of mapped JPEG/PNG files, fails for anything else (and interlaced PNGs)
+bool ImageFileView::LoadRows(int want_w, int want_h, int band_rows, LICE_ReadRowsProc proc, void *ctx, int *srcw, int *srch) const
 {
   bool success=false;
 #ifdef USE_SEH
@@ -57,40 +156,223 @@ bool LoadFullBitmap(LICE_IBitmap *bmOut, const char *fn)
   {
 #endif
 
-    if (LICE_LoadImage(fn,bmOut,false)) success=true;
+    if (m_len >= 4 && m_data[0] == 0xff && m_data[1] == 0xd8)
+    {
+      success = LICE_LoadJPGRowsFromMemory(m_data,m_len,want_w,want_h,band_rows,proc,ctx,srcw,srch);
+    }
+    else if (m_len >= 8 && !memcmp(m_data,"\x89PNG",4))
+    {
+      success = LICE_LoadPNGRowsFromMemory(m_data,m_len,band_rows,proc,ctx,srcw,srch);
+    }
 
 #ifdef USE_SEH
   }
   __except(EXCEPTION_EXECUTE_HANDLER)
   {
+    success=false;
   }
 #endif
   return success;
 }
 
+// fits w x h within DESIRED_PREVIEW_CACHEDIM
+static void GetPreviewSize(int *w, int *h)
+{
+  if (*w > DESIRED_PREVIEW_CACHEDIM)
+  {
+    *h = (*h * DESIRED_PREVIEW_CACHEDIM) / *w;
+    *w = DESIRED_PREVIEW_CACHEDIM;
+  }
+  if (*h > DESIRED_PREVIEW_CACHEDIM)
+  {
+    *w = (*w * DESIRED_PREVIEW_CACHEDIM) / *h;
+    *h = DESIRED_PREVIEW_CACHEDIM;
+  }
+}
+
+// thumbnail generation from a strip decode. images that decode to at most THUMB_STRIP_MAXPIXELS
+// are collected in workBM and resampled as before, larger ones are box-filtered into bmOut as the 
+// bands arrive, so only one output row of sums is kept rather than the whole decoded image.
+#define THUMB_STRIP_MAXPIXELS (4096*1024)
+#define THUMB_STRIP_ROWS 64
+
+class ThumbRowSink
+{
+public:
+  ThumbRowSink(LICE_IBitmap *bmOut, LICE_IBitmap *workBM)
+  {
+    m_bmOut = bmOut;
+    m_workBM = workBM;
+    m_outw = m_outh = m_oy = 0;
+    m_accum = false;
+  }
+
+  static bool Proc(void *ctx, int w, int h, int y, LICE_IBitmap *band) { return ((ThumbRowSink *)ctx)->AddRows(w,h,y,band); }
+
+  // returns true if bmOut holds the preview, false if workBM holds the full decoded image
+  bool Finish()
+  {
+    if (!m_accum) return false;
+    FlushRow();
+    return true;
+  }
+
+private:
+  bool AddRows(int w, int h, int y, LICE_IBitmap *band)
+  {
+    if (!y)
+    {
+      m_outw = w;
+      m_outh = h;
+      GetPreviewSize(&m_outw,&m_outh);
+      if (m_outw < 1 || m_outh < 1) return false;
+
+      m_accum = (WDL_INT64)w*h > THUMB_STRIP_MAXPIXELS;
+      if (!m_accum)
+      {
+        m_workBM->resize(w,h);
+        if (m_workBM->getWidth() != w || m_workBM->getHeight() != h) return false;
+      }
+      else
+      {
+        m_bmOut->resize(m_outw,m_outh);
+        if (m_bmOut->getWidth() != m_outw || m_bmOut->getHeight() != m_outh) return false;
+
+        m_sums.Resize(m_outw*5,false);
+        if (m_sums.GetSize() != m_outw*5) return false;
+        memset(m_sums.Get(),0,m_sums.GetSize()*sizeof(unsigned int));
+        m_oy = 0;
+      }
+    }
+
+    const int nrows = band->getHeight();
+    if (!m_accum)
+    {
+      LICE_Blit(m_workBM,band,0,y,0,0,w,nrows,1.0f,LICE_BLIT_MODE_COPY);
+      return true;
+    }
+
+    int i;
+    for (i = 0; i < nrows; i ++)
+    {
+      const int oy = (int) (((WDL_INT64)(y+i) * m_outh) / h);
+      if (oy != m_oy)
+      {
+        FlushRow();
+        m_oy = oy;
+      }
+
+      const LICE_pixel_chan *rd = (const LICE_pixel_chan *)(band->getBits() + band->getRowSpan()*i);
+      unsigned int *sum = m_sums.Get();
+      int x, frac = 0;
+      for (x = 0; x < w; x ++)
+      {
+        sum[0] += rd[LICE_PIXEL_B];
+        sum[1] += rd[LICE_PIXEL_G];
+        sum[2] += rd[LICE_PIXEL_R];
+        sum[3] += rd[LICE_PIXEL_A];
+        sum[4] ++;
+        rd += 4;
+
+        // output column is x*outw/w
+        frac += m_outw;
+        if (frac >= w)
+        {
+          frac -= w;
+          sum += 5;
+        }
+      }
+    }
+    return true;
+  }
+
+  void FlushRow()
+  {
+    LICE_pixel *wr = m_bmOut->getBits() + m_bmOut->getRowSpan()*m_oy;
+    unsigned int *sum = m_sums.Get();
+    int x;
+    for (x = 0; x < m_outw; x ++)
+    {
+      const unsigned int n = sum[4], r = n/2;
+      if (n) wr[x] = LICE_RGBA((sum[2]+r)/n,(sum[1]+r)/n,(sum[0]+r)/n,(sum[3]+r)/n);
+      else wr[x] = x ? wr[x-1] : 0;
+      sum += 5;
+    }
+    memset(m_sums.Get(),0,m_sums.GetSize()*sizeof(unsigned int));
+  }
+
+  LICE_IBitmap *m_bmOut, *m_workBM;
+  WDL_TypedBuf<unsigned int> m_sums; // B,G,R,A,count per output column of output row m_oy
+  int m_outw, m_outh, m_oy;
+  bool m_accum;
+};
+
+// cache key: filename (without path, case-insensitive), modification time and size
+static WDL_UINT64 GetCacheHash(const char *fn, const struct stat *statbuf)
+{
+  WDL_UINT64 fnhash = WDL_FNV64_IV;
+  const char *p = fn;
+  while (*p) p++;
+  while (p >= fn && *p != '\\' && *p != '/') p--;
+  p++;
+  while (*p)
+  {
+    unsigned char c = (unsigned char)tolower(*p);
+    fnhash = WDL_FNV64(fnhash, &c, 1);
+    p++;
+  }
+  WDL_INT64 t = statbuf->st_mtime;
+  fnhash = WDL_FNV64(fnhash, (const unsigned char *)&t, sizeof(t));
+  t = statbuf->st_size;
+  fnhash = WDL_FNV64(fnhash, (const unsigned char *)&t, sizeof(t));
+  return fnhash;
+}
+
+// decodes a versioned cache blob, returns false if it is a legacy blob (or invalid)
+static bool ReadCacheBlob(const void *blob, int blob_bytes, LICE_IBitmap *bmOut, char *rotOut)
+{
+  const unsigned char *rd = (const unsigned char *)blob;
+  if (blob_bytes <= FILE_CACHE_BLOB_HEADERSIZE || rd[0] != FILE_CACHE_BLOB_MAGIC) return false;
+
+  const int w = *(const int *)(rd + 4);
+  const int h = *(const int *)(rd + 8);
+  if (rd[1] != FILE_CACHE_BLOB_FORMAT_JPEG || w<1 || h<1 ||
+      !LICE_LoadJPGFromMemory(rd + FILE_CACHE_BLOB_HEADERSIZE, blob_bytes - FILE_CACHE_BLOB_HEADERSIZE, bmOut) ||
+      bmOut->getWidth() != w || bmOut->getHeight() != h) return false;
+
+  if (rotOut) *rotOut = (char)rd[2];
+  return true;
+}
+
+static bool WriteCacheBlob(IThumbStoreConnection *thumbdb, WDL_UINT64 hash, LICE_IBitmap *bm, char rot, WDL_HeapBuf *workspace)
+{
+  workspace->Resize(FILE_CACHE_BLOB_HEADERSIZE,false);
+  if (workspace->GetSize() != FILE_CACHE_BLOB_HEADERSIZE) return false;
+
+  unsigned char *hdr = (unsigned char *)workspace->Get();
+  hdr[0] = FILE_CACHE_BLOB_MAGIC;
+  hdr[1] = FILE_CACHE_BLOB_FORMAT_JPEG;
+  hdr[2] = rot;
+  hdr[3] = 0;
+  *(int *)(hdr + 4) = bm->getWidth();
+  *(int *)(hdr + 8) = bm->getHeight();
+  *(int *)(hdr + 12) = 0;
+
+  return LICE_WriteJPGToMemory(workspace,bm,min(max(g_config_thumbcache_quality,1),100)) &&
+         thumbdb->Store(hash, workspace->Get(), workspace->GetSize());
+}
+
 static int DoProcessBitmap(LICE_IBitmap *bmOut, const char *fn, LICE_IBitmap *workBM, char *want_rot_calc, 
-                           sqlite3 *database, WDL_HeapBuf *workspace, sqlite3_stmt **stmts, int load_mode, struct stat *statbuf)
+                           IThumbStoreConnection *thumbdb, WDL_HeapBuf *workspace, int load_mode, struct stat *statbuf,
+                           int *srcw_out, int *srch_out, WDL_UINT64 provisional_rec)
 {
   WDL_UINT64 fnhash = WDL_FNV64_IV;
   bool fnhash_valid = false;
-  if (database)
+  if (thumbdb)
   {
     if (statbuf)
     {
-      const char *p = fn;
-      while (*p) p++;
-      while (p >= fn && *p != '\\' && *p != '/') p--;
-      p++;
-      while (*p)
-      {
-        unsigned char c = (unsigned char)tolower(*p);
-        fnhash = WDL_FNV64(fnhash, &c, 1);
-        p++;
-      }
-      WDL_INT64 t = statbuf->st_mtime;
-      fnhash = WDL_FNV64(fnhash, (const unsigned char *)&t, sizeof(t));
-      t = statbuf->st_size;
-      fnhash = WDL_FNV64(fnhash, (const unsigned char *)&t, sizeof(t));
+      fnhash = GetCacheHash(fn,statbuf);
       fnhash_valid = true;
     }
 
@@ -98,97 +380,72 @@ static int DoProcessBitmap(LICE_IBitmap *bmOut, const char *fn, LICE_IBitmap *wo
     if (fnhash_valid)
     {
       bool got_res = false;
-	    sqlite3_stmt *stmt = stmts ? stmts[0] : NULL;
-      bool stmt_needrel = false;
-
-      if (!stmt) 
+      int blob_bytes = 0;
+      const void *blob = thumbdb->Lookup(fnhash, load_mode < 0 ? NULL : &blob_bytes);
+      if (blob)
       {
-        if (sqlite3_prepare_v2(database, "SELECT DATA FROM THUMB WHERE HASH = ?1", -1, &stmt, NULL) == SQLITE_OK)
+        if (load_mode < 0) got_res = true;
+        else if (blob_bytes > FILE_CACHE_BLOB_HEADERSIZE && *(const unsigned char *)blob == FILE_CACHE_BLOB_MAGIC)
         {
-          stmt_needrel = true;
+          got_res = ReadCacheBlob(blob,blob_bytes,bmOut,want_rot_calc);
         }
-      }
-      if (stmt)
-      {
-        sqlite3_bind_int64(stmt, 1, fnhash);
-        int res,try_cnt=0;
-        do
-        {
-          res = sqlite3_step(stmt);
-          if (res != SQLITE_BUSY) break;
-          Sleep(1);
-        } while (!g_DecodeThreadQuit && try_cnt++ < 2000);
-
-        if (res==SQLITE_ROW)
+        else if (blob_bytes>0)
         {
-          const void *blob = sqlite3_column_blob(stmt, 0);
-          const int blob_bytes = sqlite3_column_bytes(stmt, 0);
-
-          if (load_mode < 0) got_res = true;
-          else if (blob && blob_bytes>0)
+          z_stream stream;
+          memset(&stream, 0, sizeof(stream));
+          if (inflateInit(&stream) == Z_OK)
           {
-            z_stream stream;
-            memset(&stream, 0, sizeof(stream));
-            if (inflateInit(&stream) == Z_OK)
+            stream.avail_in = blob_bytes;
+            stream.next_in = (unsigned char *)blob;
+            int wroffs = 0;
+            for (;;)
             {
-              stream.avail_in = blob_bytes;
-              stream.next_in = (unsigned char *)blob;
-              int wroffs = 0;
-              for (;;)
-              {
-                const int chunksz = 256 * 1024;
-                workspace->Resize(wroffs + chunksz, false);
-                if (workspace->GetSize() != wroffs + chunksz) break;
-
-                stream.total_out = 0;
-                stream.avail_out = workspace->GetSize()-wroffs;
-                stream.next_out = (unsigned char*)workspace->Get() + wroffs;
-                int res=inflate(&stream, Z_SYNC_FLUSH);
-                wroffs += stream.total_out;
-                if (res != Z_OK||!stream.total_out) break;                
-              }
-              if (workspace->GetSize()>=wroffs && wroffs > FILE_CACHE_BLOB_HEADERSIZE)
+              const int chunksz = 256 * 1024;
+              workspace->Resize(wroffs + chunksz, false);
+              if (workspace->GetSize() != wroffs + chunksz) break;
+
+              stream.total_out = 0;
+              stream.avail_out = workspace->GetSize()-wroffs;
+              stream.next_out = (unsigned char*)workspace->Get() + wroffs;
+              int res=inflate(&stream, Z_SYNC_FLUSH);
+              wroffs += stream.total_out;
+              if (res != Z_OK||!stream.total_out) break;                
+            }
+            if (workspace->GetSize()>=wroffs && wroffs > FILE_CACHE_BLOB_HEADERSIZE)
+            {
+              const char *rd = (const char *)workspace->Get();
+              if (want_rot_calc) *want_rot_calc = *rd;
+              
+              const int w = *(int *)(rd + 4);
+              const int h = *(int *)(rd + 8);
+              const int extra = *(int *)(rd + 12);
+              if (!rd[1] && w>0&&h>0 && wroffs >= FILE_CACHE_BLOB_HEADERSIZE + w*h*3)
               {
-                const char *rd = (const char *)workspace->Get();
-                if (want_rot_calc) *want_rot_calc = *rd;
-                
-                const int w = *(int *)(rd + 4);
-                const int h = *(int *)(rd + 8);
-                const int extra = *(int *)(rd + 12);
-                if (!rd[1] && w>0&&h>0 && wroffs >= FILE_CACHE_BLOB_HEADERSIZE + w*h*3)
+                rd += FILE_CACHE_BLOB_HEADERSIZE;
+                bmOut->resize(w, h);
+                if (bmOut->getWidth() == w && bmOut->getHeight()==h)
                 {
-                  rd += FILE_CACHE_BLOB_HEADERSIZE;
-                  bmOut->resize(w, h);
-                  if (bmOut->getWidth() == w && bmOut->getHeight()==h)
+                  int y;
+                  for (y = 0; y < h; y ++)
                   {
-                    int y;
-                    for (y = 0; y < h; y ++)
+                    LICE_pixel_chan *po = (LICE_pixel_chan *)(bmOut->getBits() + bmOut->getRowSpan()*y);
+                    int x;
+                    for (x = 0; x < w; x ++)
                     {
-                      LICE_pixel_chan *po = (LICE_pixel_chan *)(bmOut->getBits() + bmOut->getRowSpan()*y);
-                      int x;
-                      for (x = 0; x < w; x ++)
-                      {
-                        po[LICE_PIXEL_R] = *rd++;
-                        po[LICE_PIXEL_G] = *rd++;
-                        po[LICE_PIXEL_B] = *rd++;
-                        po[LICE_PIXEL_A] = 0;
-                        po += 4;
-                      }
-
+                      po[LICE_PIXEL_R] = *rd++;
+                      po[LICE_PIXEL_G] = *rd++;
+                      po[LICE_PIXEL_B] = *rd++;
+                      po[LICE_PIXEL_A] = 0;
+                      po += 4;
                     }
-                    got_res = true;
+
                   }
+                  got_res = true;
                 }
               }
-              inflateEnd(&stream);
             }
+            inflateEnd(&stream);
           }
-        }        
-        if (stmt_needrel) sqlite3_finalize(stmt);
-        else 
-        {
-          sqlite3_reset(stmt);
-          sqlite3_clear_bindings(stmt);
         }
       }
       if (got_res)
@@ -198,35 +455,61 @@ static int DoProcessBitmap(LICE_IBitmap *bmOut, const char *fn, LICE_IBitmap *wo
     }
   }
 
-  if (!LoadFullBitmap(workBM,fn)) return 0;
+  ImageFileView src(fn);
 
-  int outw = workBM->getWidth();
-  int outh = workBM->getHeight();
-  if (outw > DESIRED_PREVIEW_CACHEDIM)
-  {
-    outh = (outh * DESIRED_PREVIEW_CACHEDIM) / outw;
-    outw=DESIRED_PREVIEW_CACHEDIM;
-  }
-  if (outh > DESIRED_PREVIEW_CACHEDIM)
+  bool got_rot = false;
+  if (provisional_rec && load_mode > 0)
   {
-    outw = (outw * DESIRED_PREVIEW_CACHEDIM) / outh;
-    outh = DESIRED_PREVIEW_CACHEDIM;
+    // not cached: show the embedded EXIF thumbnail (if any) while we generate the real one
+    workspace->Resize(0,false);
+    const char rot = src.GetRotation(workspace);
+    if (want_rot_calc)
+    {
+      *want_rot_calc = rot;
+      got_rot = true;
+    }
+    if (workspace->GetSize() > 0)
+    {
+      LICE_MemBitmap *bm = new LICE_MemBitmap;
+      if (LICE_LoadJPGFromMemory(workspace->Get(),workspace->GetSize(),bm))
+        SetProvisionalPreview(provisional_rec,fn,bm,want_rot_calc);
+      else
+        delete bm;
+    }
   }
+
+  // strip decode where possible, so oversized images never need a full-size bitmap
+  bool streamed = false;
+  ThumbRowSink sink(bmOut,workBM);
+  if (src.LoadRows(DESIRED_PREVIEW_CACHEDIM,DESIRED_PREVIEW_CACHEDIM,THUMB_STRIP_ROWS,ThumbRowSink::Proc,&sink,srcw_out,srch_out))
+    streamed = sink.Finish();
+  else if (!src.Load(workBM,DESIRED_PREVIEW_CACHEDIM,DESIRED_PREVIEW_CACHEDIM,srcw_out,srch_out)) return 0;
+
+  int outw = streamed ? bmOut->getWidth() : workBM->getWidth();
+  int outh = streamed ? bmOut->getHeight() : workBM->getHeight();
+  GetPreviewSize(&outw,&outh);
   if (outw > 0 && outh > 0)
   {
-    bmOut->resize(outw,outh);
-    outw = bmOut->getWidth();
-    outh = bmOut->getHeight();
+    if (!streamed)
+    {
+      bmOut->resize(outw,outh);
+      outw = bmOut->getWidth();
+      outh = bmOut->getHeight();
 
-    LICE_ScaledBlit(bmOut,workBM,0,0,outw,outh,0,0,(float)workBM->getWidth(),(float)workBM->getHeight(),1.0f,LICE_BLIT_MODE_COPY|LICE_BLIT_FILTER_BILINEAR);
+      LICE_Resample(bmOut,workBM,0,0,outw,outh,0,0,workBM->getWidth(),workBM->getHeight(),LICE_RESAMPLE_BOX);
+    }
 
-    if (want_rot_calc)
+    if (want_rot_calc && !got_rot)
     {
-      *want_rot_calc = GetRotationForImage(fn);
+      *want_rot_calc = src.GetRotation();
     }
 
     int rv = -1;
-    if (database && fnhash_valid)
+    if (thumbdb && fnhash_valid && g_config_thumbcache_quality > 0)
+    {
+      if (WriteCacheBlob(thumbdb,fnhash,bmOut,want_rot_calc?*want_rot_calc:0,workspace)) rv = 1;
+    }
+    else if (thumbdb && fnhash_valid)
     {
       // compress to buffer
       z_stream stream;
@@ -270,41 +553,7 @@ static int DoProcessBitmap(LICE_IBitmap *bmOut, const char *fn, LICE_IBitmap *wo
      
         deflateEnd(&stream);
 
-	      sqlite3_stmt *stmt = stmts ? stmts[1] : NULL;
-        bool stmt_needrel = false;
-        if (!stmt)
-        {
-  	      if (sqlite3_prepare_v2(database, "INSERT OR REPLACE INTO THUMB (HASH, DATA) VALUES(?1, ?2)", -1, &stmt, NULL) == SQLITE_OK)
-          {
-            stmt_needrel = true;
-          }
-        }
-
-        if (stmt)
-        {
-          sqlite3_bind_int64(stmt, 1, fnhash);
-          sqlite3_bind_blob(stmt, 2, workspace->Get(), blob_sz,SQLITE_STATIC);
-          int res,try_cnt=0;
-          do
-          {
-            res = sqlite3_step(stmt);
-            if (res != SQLITE_BUSY) break;
-            Sleep(1);
-          } while (!g_DecodeThreadQuit && try_cnt++ < 2000);
-          
-          if (res != SQLITE_BUSY)
-          {
-            rv = 1;
-          }
-
-          if (stmt_needrel)
-            sqlite3_finalize(stmt);
-          else
-          {
-            sqlite3_reset(stmt);
-            sqlite3_clear_bindings(stmt);
-          }
-        }        
+        if (thumbdb->Store(fnhash, workspace->Get(), blob_sz)) rv = 1;
       }
     }
 
@@ -313,20 +562,316 @@ static int DoProcessBitmap(LICE_IBitmap *bmOut, const char *fn, LICE_IBitmap *wo
   return 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// preview pyramid: m_preview_image (256), m_mid_image (1024), m_screen_image (fits full view), m_fullimage
+// the larger levels are only loaded around the full view item, in LoadLevelImage().
+
+#define PYRAMID_MID_DIM 1024
+
+static LICE_IBitmap **GetLevelImagePtr(ImageRecord *rec, int level)
+{
+  switch (level)
+  {
+    case ImageRecord::IR_LEVEL_MID: return &rec->m_mid_image;
+    case ImageRecord::IR_LEVEL_SCREEN: return &rec->m_screen_image;
+  }
+  return &rec->m_fullimage;
+}
+
+// frees levels below upto_level, g_images_mutex must be locked
+static void FreeLevelImages(ImageRecord *rec, int upto_level=ImageRecord::IR_NUM_LEVELS)
+{
+  int level;
+  for (level = 0; level < upto_level; level ++)
+  {
+    BitmapCache_Release(rec,BMCACHE_LEVEL,GetLevelImagePtr(rec,level)); // may be being painted
+  }
+  if (upto_level == ImageRecord::IR_NUM_LEVELS) rec->m_level_failed = 0;
+}
+
+// fits w x h in the view in either orientation (so rotating does not need a reload), never enlarges
+static void GetScreenLevelSize(int srcw, int srch, int vieww, int viewh, int *w, int *h)
+{
+  double sc1 = min(vieww / (double)srcw, viewh / (double)srch);
+  double sc2 = min(vieww / (double)srch, viewh / (double)srcw);
+  double sc = min(max(sc1,sc2),1.0);
+  *w = max((int)(srcw * sc + 0.5),1);
+  *h = max((int)(srch * sc + 0.5),1);
+}
+
+// fills bmOut with level, using workBM for the decode if it needs downscaling. 
+// isFull is set if the result is the full size image (the source was small enough): its size is
+// the source size, so only if that is known. srcw/srch are the source size if known (0 if not), 
+// and are updated when decoding. rotOut (if set) receives the EXIF rotation
+static bool LoadLevelImage(LICE_IBitmap *bmOut, LICE_IBitmap *workBM, const char *fn, int level, int vieww, int viewh,
+                           IThumbStoreConnection *thumbdb, WDL_HeapBuf *workspace, int *srcw, int *srch, bool *isFull, char *rotOut)
+{
+  *isFull = false;
+  if (level == ImageRecord::IR_LEVEL_FULL)
+  {
+    ImageFileView src(fn);
+    if (!src.Load(bmOut,0,0,NULL,NULL)) return false;
+    if (rotOut) *rotOut = src.GetRotation();
+    *srcw = bmOut->getWidth();
+    *srch = bmOut->getHeight();
+    *isFull = true;
+    return true;
+  }
+
+  WDL_UINT64 cachehash = 0;
+  struct stat sb = { 0, };
+  const bool use_cache = level == ImageRecord::IR_LEVEL_MID && thumbdb && !statUTF8(fn,&sb);
+  if (use_cache)
+  {
+    const char lvl[] = "pyramid1024";
+    cachehash = WDL_FNV64(GetCacheHash(fn,&sb), (const unsigned char *)lvl, sizeof(lvl)-1);
+
+    int blob_bytes = 0;
+    const void *blob = thumbdb->Lookup(cachehash, &blob_bytes);
+    if (blob && ReadCacheBlob(blob,blob_bytes,bmOut,NULL))
+    {
+      // a source that fits PYRAMID_MID_DIM is stored at full size, same test as after decoding below
+      *isFull = *srcw == bmOut->getWidth() && *srch == bmOut->getHeight();
+      if (rotOut) *rotOut = GetRotationForImage(fn);
+      return true;
+    }
+  }
+
+  int want_w = PYRAMID_MID_DIM, want_h = PYRAMID_MID_DIM;
+  if (level == ImageRecord::IR_LEVEL_SCREEN)
+  {
+    if (*srcw > 0 && *srch > 0) GetScreenLevelSize(*srcw,*srch,vieww,viewh,&want_w,&want_h);
+    else want_w = want_h = max(vieww,viewh);
+  }
+
+  ImageFileView src(fn);
+  if (!src.Load(workBM,want_w,want_h,srcw,srch)) return false;
+  if (rotOut) *rotOut = src.GetRotation();
+
+  int outw = workBM->getWidth(), outh = workBM->getHeight();
+  if (level == ImageRecord::IR_LEVEL_SCREEN && *srcw > 0 && *srch > 0) 
+  {
+    GetScreenLevelSize(*srcw,*srch,vieww,viewh,&want_w,&want_h);
+  }
+  if (outw * want_h > want_w * outh) // fit want_w x want_h
+  {
+    if (outw > want_w) { outh = max((outh * want_w) / outw,1); outw = want_w; }
+  }
+  else
+  {
+    if (outh > want_h) { outw = max((outw * want_h) / outh,1); outh = want_h; }
+  }
+
+  bmOut->resize(outw,outh);
+  if (bmOut->getWidth() != outw || bmOut->getHeight() != outh) return false;
+  if (outw == workBM->getWidth() && outh == workBM->getHeight())
+    LICE_Copy(bmOut,workBM);
+  else // the screen level is shown nearly 1:1, so it gets the better filter
+    LICE_Resample(bmOut,workBM,0,0,outw,outh,0,0,workBM->getWidth(),workBM->getHeight(),
+                  level == ImageRecord::IR_LEVEL_SCREEN ? LICE_RESAMPLE_MITCHELL : LICE_RESAMPLE_BOX);
+
+  *isFull = *srcw == outw && *srch == outh;
+
+  if (use_cache) WriteCacheBlob(thumbdb,cachehash,bmOut,0,workspace);
+  return true;
+}
+
 class DecodeThreadContext
 {
 public:
-  DecodeThreadContext() { bmOut=NULL; }
+  DecodeThreadContext() { bmOut=NULL; queue_idx=0; }
   ~DecodeThreadContext() { delete bmOut; }
   LICE_MemBitmap bm;
   WDL_FastString curfn;
   LICE_IBitmap *bmOut;
-  int last_visstart;
-  int last_listsize;
-  int last_listorderrev;
-  int scanpos;
+  int queue_idx;
+};
+
+
+// Thumbnail decode scheduling: a change of the visible range or list only resets the schedule 
+// (empties the per-thread queues, restarts the walk). Queues are then refilled a batch at a time by 
+// walking g_images outward from the visible range, merging the two directions by distance, which 
+// yields the records needing load nearest first without sorting; each refill holds g_images_mutex
+// for at most DECODESCHED_SCAN items. A thread takes jobs from the front of its own queue, and when
+// it runs dry, steals the nearest job from another thread's queue. Taking jobs only locks the queues,
+// a job's record is checked by handle afterwards (it may be gone or loaded by then).
+// Lock order is g_images_mutex, s_sched_mutex, then queue.
+
+struct DecodeJob
+{
+  WDL_UINT64 rec; // ImageRecord::GetHandle(), the record may be gone by the time the job runs
+  int dist; // distance from the visible range, weighted to favor items after it
+};
+
+class DecodeJobQueue
+{
+public:
+  DecodeJobQueue() { }
+  ~DecodeJobQueue() { }
+
+  WDL_Mutex m_mutex;
+  WDL_TypedQueue<DecodeJob> m_jobs; // nearest first
 };
 
+static DecodeJobQueue s_sched_queues[MAX_THREADS];
+static int s_sched_nqueues=1; // one per decode thread
+
+#define DECODESCHED_SCAN 256 // records looked at per refill
+#define DECODESCHED_BATCH 64 // jobs queued per refill, at most
+#define DECODESCHED_RESCAN_MS 1000 // once the walk is done, walk again after this long in case something needs loading again
+
+// the s_sched_* state is protected by s_sched_mutex
+static WDL_Mutex s_sched_mutex;
+static int s_sched_last_visstart=-1, s_sched_last_visend, s_sched_last_listsize, s_sched_last_listorderrev;
+static int s_sched_fwd, s_sched_back; // next indices of the walk, forward from the start of the visible range and back from before it
+static int s_sched_deal; // round-robin queue position
+static DWORD s_sched_lastbuild; // when the walk started, also read unlocked for cache ages
+
+// loaded thumbnails are marked as used this long before the walk started per item of distance, so eviction goes farthest first
+#define DECODESCHED_DIST_MS 100
+
+static int DecodeSched_GetDistance(int idx, int vis_start, int vis_end)
+{
+  // items before the visible range count triple, which favors loading ahead when scrolling down
+  if (idx < vis_start) return (vis_start - idx) * 3;
+  if (idx > vis_end) return idx - vis_end;
+  return 0;
+}
+
+// restarts the walk if the visible range or list changed. call with g_images_mutex held
+static void DecodeSched_CheckReset()
+{
+  const int vis_start = min(max(g_firstvisible_startitem,0),g_images.GetSize());
+  int vis_end = g_lastvisible_startitem;
+  if (vis_end < vis_start) vis_end = vis_start;
+  if (vis_end > g_images.GetSize() - 1) vis_end = g_images.GetSize() - 1;
+
+  WDL_MutexLock lock(&s_sched_mutex);
+  if (s_sched_last_visstart == vis_start && s_sched_last_visend == vis_end &&
+      s_sched_last_listsize == g_images.GetSize() && s_sched_last_listorderrev == g_images_listorderrev) return;
+
+  s_sched_last_visstart = vis_start;
+  s_sched_last_visend = vis_end;
+  s_sched_last_listsize = g_images.GetSize();
+  s_sched_last_listorderrev = g_images_listorderrev;
+  s_sched_lastbuild = GetTickCount();
+  s_sched_fwd = vis_start;
+  s_sched_back = vis_start - 1;
+
+  int x;
+  for (x = 0; x < s_sched_nqueues; x ++)
+  {
+    DecodeJobQueue *q = s_sched_queues + x;
+    q->m_mutex.Enter();
+    q->m_jobs.Clear();
+    q->m_mutex.Leave();
+  }
+}
+
+// queues the next records needing load, nearest first. returns false if the walk is done (and
+// not due to start over)
+static bool DecodeSched_Refill()
+{
+  WDL_MutexLock lock(&g_images_mutex);
+  DecodeSched_CheckReset();
+
+  WDL_MutexLock lock2(&s_sched_mutex);
+  const int n = g_images.GetSize(), vis_start = s_sched_last_visstart, vis_end = s_sched_last_visend;
+  if (s_sched_fwd >= n && s_sched_back < 0)
+  {
+    if (GetTickCount() - s_sched_lastbuild < DECODESCHED_RESCAN_MS) return false;
+    s_sched_lastbuild = GetTickCount();
+    s_sched_fwd = vis_start;
+    s_sched_back = vis_start - 1;
+  }
+
+  DecodeJob jobs[DECODESCHED_BATCH];
+  int njobs = 0, scanned;
+  const int age = (int) (GetTickCount() - s_sched_lastbuild);
+  for (scanned = 0; scanned < DECODESCHED_SCAN && njobs < DECODESCHED_BATCH; scanned ++)
+  {
+    const int df = s_sched_fwd < n ? DecodeSched_GetDistance(s_sched_fwd,vis_start,vis_end) : -1;
+    const int db = s_sched_back >= 0 ? DecodeSched_GetDistance(s_sched_back,vis_start,vis_end) : -1;
+    if (df < 0 && db < 0) break;
+
+    int idx, dist;
+    if (df >= 0 && (db < 0 || df <= db)) { idx = s_sched_fwd++; dist = df; }
+    else { idx = s_sched_back--; dist = db; }
+
+    ImageRecord *rec = g_images.Get(idx);
+    if (!rec) continue;
+    if (rec->State() == ImageRecord::IR_STATE_NEEDLOAD)
+    {
+      jobs[njobs].rec = rec->GetHandle();
+      jobs[njobs++].dist = dist;
+    }
+    else if (rec->State() == ImageRecord::IR_STATE_LOADED && rec->m_preview_image) 
+    {
+      BitmapCache_Touch(rec, age + dist * DECODESCHED_DIST_MS);
+    }
+  }
+
+  // deal out round-robin, the walk is nearest first so each queue stays nearest first
+  const int nq = s_sched_nqueues;
+  int x;
+  for (x = 0; x < njobs; x ++)
+  {
+    DecodeJobQueue *q = s_sched_queues + (s_sched_deal++ % nq);
+    q->m_mutex.Enter();
+    q->m_jobs.Add(jobs + x, 1);
+    q->m_mutex.Leave();
+  }
+  if (s_sched_deal >= nq) s_sched_deal %= nq;
+  return true;
+}
+
+static bool DecodeSched_GetJob(int queue_idx, DecodeJob *jobOut)
+{
+  const int nq = s_sched_nqueues;
+  if (queue_idx < 0 || queue_idx >= nq) queue_idx = 0;
+
+  DecodeJobQueue *q = s_sched_queues + queue_idx;
+  q->m_mutex.Enter();
+  DecodeJob *j = q->m_jobs.Get();
+  if (j)
+  {
+    *jobOut = *j;
+    q->m_jobs.Advance(1);
+    q->m_jobs.Compact();
+  }
+  q->m_mutex.Leave();
+  if (j) return true;
+
+  // steal: find the queue with the nearest pending job
+  int x, best = -1, bestdist = 0;
+  for (x = 0; x < nq; x ++)
+  {
+    if (x == queue_idx) continue;
+    q = s_sched_queues + x;
+    q->m_mutex.Enter();
+    j = q->m_jobs.Get();
+    if (j && (best < 0 || j->dist < bestdist))
+    {
+      best = x;
+      bestdist = j->dist;
+    }
+    q->m_mutex.Leave();
+  }
+  if (best < 0) return false;
+
+  q = s_sched_queues + best;
+  q->m_mutex.Enter();
+  j = q->m_jobs.Get();
+  if (j)
+  {
+    *jobOut = *j;
+    q->m_jobs.Advance(1);
+    q->m_jobs.Compact();
+  }
+  q->m_mutex.Leave();
+  return !!j;
+}
+
 static unsigned int __exif_getint(const unsigned char *buf, int sz, unsigned char byteorder)
 {
   unsigned int res = 0;
@@ -383,7 +928,7 @@ static bool __exif_process_dir(const unsigned char *base, int len, const unsigne
     if (tag == 0x8769 || tag == 0xa005)
     {
       const unsigned char *d = base + __exif_getint(val, 4, byteorder);
-      if (d >= base && d < base + len)
+      if (d >= base && d + 2 <= base + len)
         if (__exif_process_dir(base, len, d, byteorder, rotOut)) return true;
     }
     
@@ -392,7 +937,38 @@ static bool __exif_process_dir(const unsigned char *base, int len, const unsigne
   return false;
 }
 
-static bool __exif_process_tag(const unsigned char *buf, int buflen, char *rotOut)
+static bool __exif_get_thumbnail(const unsigned char *base, int len, const unsigned char *ifd0, unsigned char byteorder, WDL_HeapBuf *thumbOut)
+{
+  // IFD1 follows IFD0, and holds JPEGInterchangeFormat/JPEGInterchangeFormatLength for the embedded thumbnail
+  if (ifd0 + 2 > base + len) return false;
+  const int nument0 = __exif_getint(ifd0, 2, byteorder);
+  const unsigned char *p = ifd0 + 2 + nument0 * 12;
+  if (p + 4 > base + len) return false;
+
+  const unsigned int ifd1 = __exif_getint(p, 4, byteorder);
+  if (!ifd1 || ifd1 + 2 > (unsigned int)len) return false;
+
+  const unsigned char *cur = base + ifd1;
+  int nument = __exif_getint(cur, 2, byteorder);
+  if (cur + 2 + nument * 12 > base + len) return false;
+  cur += 2;
+
+  unsigned int toffs = 0, tlen = 0;
+  while (nument-- > 0)
+  {
+    const int tag = __exif_getint(cur, 2, byteorder);
+    if (tag == 0x0201) toffs = __exif_getint(cur + 8, 4, byteorder);
+    else if (tag == 0x0202) tlen = __exif_getint(cur + 8, 4, byteorder);
+    cur += 12;
+  }
+  if (!toffs || tlen < 4 || toffs >= (unsigned int)len || tlen > (unsigned int)len - toffs) return false;
+  if (base[toffs] != 0xff || base[toffs+1] != 0xd8) return false; // not a JPEG thumbnail
+
+  memcpy(thumbOut->Resize(tlen,false), base + toffs, tlen);
+  return thumbOut->GetSize() == (int)tlen;
+}
+
+static bool __exif_process_tag(const unsigned char *buf, int buflen, char *rotOut, WDL_HeapBuf *thumbOut)
 {
   const unsigned char sig[] = { 0x45, 0x78, 0x69, 0x66, 0x00, 0x00 };
   unsigned char byteorder = buf[6];
@@ -402,12 +978,37 @@ static bool __exif_process_tag(const unsigned char *buf, int buflen, char *rotOu
     __exif_getint(buf + 8, 2, byteorder) == 0x2a &&
     __exif_getint(buf + 10, 4, byteorder) == 0x8)
   {
-    return __exif_process_dir(buf + 6, buflen - 4, buf + 14, byteorder, rotOut);
+    if (thumbOut && !thumbOut->GetSize()) __exif_get_thumbnail(buf + 6, buflen - 6, buf + 14, byteorder, thumbOut);
+    return __exif_process_dir(buf + 6, buflen - 6, buf + 14, byteorder, rotOut); // bounded to the segment, buf may be a file mapping
   }
   return false;
 }
 
-char GetRotationForImage(const char *fn)
+// as GetRotationForImage(), parsing the file contents in memory
+char GetRotationForImageData(const unsigned char *data, int len, WDL_HeapBuf *thumbOut)
+{
+  char ret = 0;
+  if (len < 4 || data[0] != 0xff || data[1] != 0xd8) return 0;
+
+  const unsigned char *p = data + 2, *end = data + len;
+  int cnt;
+  for (cnt = 0; cnt < 3; cnt++)
+  {
+    int scan;
+    int type = 0xff;
+    for (scan = 0; scan < 7 && p < end && 0xff == (type = *p++); scan++);
+    if (type == 0xff || type == 0xda || type == 0xd9 || end - p < 2) break;
+    const int l = ((p[0] << 8) | p[1]) - 2;
+    p += 2;
+    if (l < 0 || l > end - p) break;
+    if (type == 0xe1 && l > 16 && __exif_process_tag(p, l, &ret, thumbOut)) break;
+    p += l;
+  }
+  return ret;
+}
+
+// if thumbOut is set, it receives the embedded JPEG thumbnail, if any (thumbOut->GetSize()==0 if none)
+char GetRotationForImage(const char *fn, WDL_HeapBuf *thumbOut)
 {
   FILE *fp = fopenUTF8(fn, "rb");
   if (!fp) return 0;
@@ -430,7 +1031,7 @@ char GetRotationForImage(const char *fn)
         unsigned char buf[65534];
         if (fread(buf, 1, l, fp) != l) break;
 
-        if (__exif_process_tag(buf, l, &ret)) break;
+        if (__exif_process_tag(buf, l, &ret, thumbOut)) break;
       }
       else
         fseek(fp, l, SEEK_CUR);
@@ -441,269 +1042,342 @@ char GetRotationForImage(const char *fn)
   return ret;
 }
 
-
-static int RunWork(DecodeThreadContext &ctx, bool allowFullMode, sqlite3 *database, WDL_HeapBuf *workspace, sqlite3_stmt **stmts)
+static void SetProvisionalPreview(WDL_UINT64 rec_handle, const char *fn, LICE_IBitmap *bm, const char *calc_rot)
 {
-  int sleepAmt=1;
   g_images_mutex.Enter();
-
-  const int vsi = g_firstvisible_startitem;
-  const int vlor = g_images_listorderrev;
-  if (ctx.last_visstart != vsi || 
-      ctx.last_listsize != g_images.GetSize()||
-      ctx.last_listorderrev != vlor)
+  ImageRecord *rec = ImageList_Resolve(rec_handle);
+  if (rec && 
+      rec->State() == ImageRecord::IR_STATE_DECODING && 
+      !rec->m_preview_image && 
+      !strcmp(rec->GetFN(),fn))
   {
-    ctx.last_listorderrev = vlor;
-    ctx.last_listsize = g_images.GetSize();
-    ctx.last_visstart=vsi;
-    ctx.scanpos=0;
+    if (calc_rot && rec->NeedRotChk())
+    {
+      rec->NeedRotChk() = false;
+      rec->Rot() = *calc_rot;
+    }
+    rec->m_preview_image = bm;
+    BitmapCache_Add(rec,BMCACHE_PREVIEW,bm);
+    DecodeThread_PostDamage(rec);
+    bm = NULL;
   }
-  bool didProc=false;
+  g_images_mutex.Leave();
 
-  int fmi;
-  if (allowFullMode && g_fullmode_item && (fmi = g_images.Find(g_fullmode_item)) >= 0) // prioritize any full image loads
+  delete bm;
+}
+
+static void FreeProvisionalPreview(ImageRecord *rec)
+{
+  BitmapCache_Release(rec,BMCACHE_PREVIEW,&rec->m_preview_image); // may be being painted
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// full view prefetch: follows the direction and rate of navigation. previously viewed images 
+// stay loaded until the bitmap cache evicts them. all state is protected by g_images_mutex.
+
+#define PREFETCH_NAV_TIMEOUT 1500 // ms without navigation before the user is considered stopped
+#define PREFETCH_LOOKAHEAD_SEC 1.0 // prefetch this far ahead at the current rate
+#define PREFETCH_MAX_AHEAD 16
+#define PREFETCH_DIST_MS 50 // images in the window are marked as used this long ago per image of distance
+#define PREFETCH_PROTECT_MS 1000 // more than the oldest mark in the window, so the window is not evicted
+
+int g_prefetch_hits, g_prefetch_misses;
+
+static ImageRecord *s_nav_item;
+static int s_nav_idx, s_nav_dir=1;
+static double s_nav_rate; // images/sec, 0 if not moving
+static DWORD s_nav_time;
+
+static bool Prefetch_WantScreenLevel(ImageRecord *rec, int vieww, int viewh)
+{
+  if (rec->SrcImageW() < 1 || rec->SrcImageH() < 1) return true;
+  int sw, sh;
+  GetScreenLevelSize(rec->SrcImageW(),rec->SrcImageH(),vieww,viewh,&sw,&sh);
+  return sw > PYRAMID_MID_DIM || sh > PYRAMID_MID_DIM; // otherwise the mid level will do
+}
+
+static void Prefetch_UpdateNav(int fmi, int vieww, int viewh)
+{
+  const DWORD now = GetTickCount();
+  if (s_nav_item != g_fullmode_item)
   {
-    int x;
-    const int divpt1 = fmi-2,divpt2=fmi+2; // try to keep 5 images loaded, plus allow another 10 of history (before/after current 5), but don't actively try to load them
-    for (x=0;x<divpt1 - 5;x++)
+    if (s_nav_item)
     {
-      ImageRecord *it = g_images.Get(x);
-      if (it && it->m_fullimage)
+      ImageRecord *it = g_fullmode_item;
+      if (it->m_fullimage || it->m_screen_image || (it->m_mid_image && !Prefetch_WantScreenLevel(it,vieww,viewh))) 
+        g_prefetch_hits++;
+      else 
+        g_prefetch_misses++;
+
+      const int delta = fmi - s_nav_idx;
+      if (delta && abs(delta) <= 2 && (delta > 0) == (s_nav_dir > 0) && now - s_nav_time < PREFETCH_NAV_TIMEOUT)
       {
-        g_ram_use_full -= get_lice_bitmap_size(it->m_fullimage);
-        delete it->m_fullimage;
-        it->m_fullimage=0;
+        const double r = abs(delta) * 1000.0 / max(now - s_nav_time, 1);
+        s_nav_rate = s_nav_rate > 0.0 ? (s_nav_rate + r) * 0.5 : r;
       }
-    }
-    for (x=divpt1;x<=divpt2; x++)
-    {
-      const int dpos = x - divpt1;
-      ImageRecord *it = g_images.Get(fmi + ((dpos&1)?(dpos+1)/2 : -(dpos/2))); // +0, +1, -1, +2, -2
-      if (it && !it->m_fullimage)
+      else
       {
-        ctx.curfn.Set(it->m_fn.Get());
-        const bool calc_rot = it->m_need_rotchk;
-        char calculated_rot = 0;
+        // changed direction or jumped, start over
+        if (delta) s_nav_dir = delta > 0 ? 1 : -1;
+        s_nav_rate = 0.0;
+      }
+    }
+    s_nav_item = g_fullmode_item;
+    s_nav_time = now;
+  }
+  else if (now - s_nav_time > PREFETCH_NAV_TIMEOUT) 
+  {
+    s_nav_rate = 0.0;
+  }
+  s_nav_idx = fmi;
+}
 
-        g_images_mutex.Leave();
+static int RunWork(DecodeThreadContext &ctx, bool allowFullMode, IThumbStoreConnection *thumbdb, WDL_HeapBuf *workspace)
+{
+  int sleepAmt=1;
+  g_images_mutex.Enter();
 
-        if (!ctx.bmOut) ctx.bmOut = new LICE_MemBitmap(0,0,0);
+  DecodeSched_CheckReset();
+  bool didProc=false;
 
-        bool suc = LoadFullBitmap(ctx.bmOut,ctx.curfn.Get());
-        if (suc && calc_rot) calculated_rot = GetRotationForImage(ctx.curfn.Get());
+  int fmi;
+  if (allowFullMode && g_fullmode_item && (fmi = ImageList_IndexOf(g_fullmode_item)) >= 0) // prioritize any full view loads
+  {
+    int x;
+    const RECT vr = g_fullmode_rect;
+    const int vieww = max(vr.right-vr.left-4,1), viewh = max(vr.bottom-vr.top-4,1);
 
-        g_images_mutex.Enter();
+    Prefetch_UpdateNav(fmi,vieww,viewh);
 
-        if (suc && g_images.Find(it)>=0 && !strcmp(it->m_fn.Get(),ctx.curfn.Get()))
-        {
-          if (it->m_need_rotchk && calc_rot)
-          {
-            it->m_rot = calculated_rot;
-            it->m_need_rotchk = false;
-          }
-          it->m_srcimage_w = ctx.bmOut->getWidth();
-          it->m_srcimage_h = ctx.bmOut->getHeight();
-          it->m_fullimage = ctx.bmOut;
-          g_ram_use_full += get_lice_bitmap_size(it->m_fullimage);
-          it->m_fullimage_cachevalid = 0;
-          ctx.bmOut=NULL;
-          didProc=true;
-        }
+    int ahead = 2, behind = 2;
+    if (s_nav_rate > 0.0)
+    {
+      ahead = 2 + (int) (s_nav_rate * PREFETCH_LOOKAHEAD_SEC + 0.5);
+      behind = 1;
+    }
+    // don't prefetch more than fits in half the cache budget, estimating each image at the view size
+    const int maxwin = (int) min(BitmapCache_GetBudget() / 2 / ((WDL_INT64)vieww*viewh*4), (WDL_INT64)1000);
+    ahead = max(min(min(ahead,PREFETCH_MAX_AHEAD), maxwin - 1 - behind), 1);
 
-        g_DecodeDidSomething=true;
-      }
+    for (x = -behind; x <= ahead; x ++)
+    {
+      ImageRecord *it = g_images.Get(fmi + s_nav_dir*x);
+      if (it) BitmapCache_Touch(it, (x < 0 ? -x*2 : x) * PREFETCH_DIST_MS);
     }
-    x+=5;
-    for (;x<g_images.GetSize();x++)
+    if (BitmapCache_GetUsage() > BitmapCache_GetBudget())
+      BitmapCache_Evict(BMCACHE_TIERMASK_DECODE, BitmapCache_GetBudget() * 9 / 10, GetTickCount() - PREFETCH_PROTECT_MS);
+
+    // in order of need: the current image first, then its neighbors (nearest first). full size only if the current image is cropped
+    int need_order[2 + (PREFETCH_MAX_AHEAD+2)*4 + 1][2];
+    int need_cnt = 0;
+#define ADD_NEED(offs, level) { need_order[need_cnt][0] = (offs); need_order[need_cnt++][1] = (level); }
+    ADD_NEED(0, ImageRecord::IR_LEVEL_MID)
+    ADD_NEED(0, ImageRecord::IR_LEVEL_SCREEN)
+    for (x = 1; x <= max(ahead,behind); x ++)
     {
-      ImageRecord *it = g_images.Get(x);
-      if (it && it->m_fullimage)
-      {
-        g_ram_use_full -= get_lice_bitmap_size(it->m_fullimage);
-        delete it->m_fullimage;
-        it->m_fullimage=0;
-      }
+      if (x <= ahead) ADD_NEED(s_nav_dir*x, ImageRecord::IR_LEVEL_MID)
+      if (x <= behind) ADD_NEED(-s_nav_dir*x, ImageRecord::IR_LEVEL_MID)
+      if (x <= ahead) ADD_NEED(s_nav_dir*x, ImageRecord::IR_LEVEL_SCREEN)
+      if (x <= behind) ADD_NEED(-s_nav_dir*x, ImageRecord::IR_LEVEL_SCREEN)
     }
-  }
+    ADD_NEED(0, ImageRecord::IR_LEVEL_FULL)
+#undef ADD_NEED
 
-  int i;
-  for (i= 0; i < 100 && !didProc; i ++)
-  {
-    if (ctx.scanpos>=g_images.GetSize()*2)
+    for (x = 0; x < need_cnt && !didProc; x ++)
     {
-      ctx.scanpos=0;
-      sleepAmt=30;
-      didProc=true;
-    }
+      ImageRecord *it = g_images.Get(fmi + need_order[x][0]);
+      const int level = need_order[x][1];
+      if (!it || it->m_fullimage || *GetLevelImagePtr(it,level) || 
+          ((it->m_level_loading|it->m_level_failed) & (1<<level))) continue;
 
+      if (level == ImageRecord::IR_LEVEL_SCREEN && !Prefetch_WantScreenLevel(it,vieww,viewh)) continue;
+      if (level == ImageRecord::IR_LEVEL_FULL && 
+          (it->CropRect().right <= it->CropRect().left || it->CropRect().bottom <= it->CropRect().top)) continue;
 
-    const int vis_start = min(max(ctx.last_visstart,0),g_images.GetSize());
-    int vis_end = g_lastvisible_startitem;
-    if (vis_end < vis_start) vis_end = vis_start;
-    if (vis_end > g_images.GetSize() - 1) vis_end = g_images.GetSize() - 1;
-    int center = vis_start;
+      it->m_level_loading |= 1<<level;
+      const WDL_UINT64 it_handle = it->GetHandle();
+      ctx.curfn.Set(it->GetFN());
+      const bool calc_rot = it->NeedRotChk();
+      char calculated_rot = 0;
+      int srcw = it->SrcImageW(), srch = it->SrcImageH();
 
-    if (1)
-    {
-      if ((ctx.scanpos&3)==3) // every 4th, go backwards
-        center -= (ctx.scanpos+1)/4;
-      else
-        center += ctx.scanpos - (ctx.scanpos+1)/4;
-    }
-    else center+=ctx.scanpos;
-  
-    ctx.scanpos++;
+      g_images_mutex.Leave();
 
-    ImageRecord *rec = g_images.Get(center);
+      if (!ctx.bmOut) ctx.bmOut = new LICE_MemBitmap(0,0,0);
 
-    if (rec && rec->m_state == ImageRecord::IR_STATE_NEEDLOAD) 
-    {
-      int load_mode = 1;
-      if (g_config_maxthumbnail)
-      {
-        int dist = center - vis_start;
-        if (dist < 0) dist = -dist;
-        int x;
-        const int max1 = vis_start - dist - 2;        
-        const int max2 = vis_end + dist + 2;
-        if (g_ram_use_preview >= g_config_maxthumbnail) for (x = 0; x <max1 || g_images.GetSize()-1-(x/2) > max2; x ++)
-        {          
-          ImageRecord *tr = x < max1 ? g_images.Get(x) : NULL;
-          ImageRecord *tr1 = tr;
-          if (tr && tr->m_preview_image && tr->m_state == ImageRecord::IR_STATE_LOADED)
-          {
-            g_ram_use_preview -= get_lice_bitmap_size(tr->m_preview_image);
-            delete tr->m_preview_image;
-            tr->m_preview_image=0;
-            tr->m_state = ImageRecord::IR_STATE_NEEDLOAD;
-            g_images_cnt_ok--;
+      bool isFull = false;
+      const bool suc = LoadLevelImage(ctx.bmOut,&ctx.bm,ctx.curfn.Get(),level,vieww,viewh,thumbdb,workspace,&srcw,&srch,&isFull,
+                                      calc_rot ? &calculated_rot : NULL);
 
-            if (g_ram_use_preview < g_config_maxthumbnail) break;
-          }
-          if (x & 1) continue;
+      g_images_mutex.Enter();
 
-          const int x2 = g_images.GetSize() - 1 - x/2;
-          tr = x2 > max2 ? g_images.Get(x2) : NULL;
-          if (tr && tr->m_preview_image && tr->m_state == ImageRecord::IR_STATE_LOADED)
+      it = ImageList_Resolve(it_handle);
+      if (it)
+      {
+        it->m_level_loading &= ~(1<<level);
+        if (!suc) it->m_level_failed |= 1<<level;
+        else if (!strcmp(it->GetFN(),ctx.curfn.Get()))
+        {
+          if (it->NeedRotChk() && calc_rot)
           {
-            g_ram_use_preview -= get_lice_bitmap_size(tr->m_preview_image);
-            delete tr->m_preview_image;
-            tr->m_preview_image=0;
-            tr->m_state = ImageRecord::IR_STATE_NEEDLOAD;
-            g_images_cnt_ok--;
-
-            if (g_ram_use_preview < g_config_maxthumbnail) break;
+            it->Rot() = calculated_rot;
+            it->NeedRotChk() = false;
           }
-          if (!tr && !tr1) break;
-        }
-        if (g_ram_use_preview >= g_config_maxthumbnail) for (x = g_images.GetSize()-1; x > max2; x--)
-        {
-          ImageRecord *tr=g_images.Get(x);
-          if (tr && tr->m_preview_image && tr->m_state == ImageRecord::IR_STATE_LOADED)
+          if (srcw > 0 && srch > 0)
           {
-            g_ram_use_preview -= get_lice_bitmap_size(tr->m_preview_image);
-            delete tr->m_preview_image;
-            tr->m_preview_image=0;
-            tr->m_state = ImageRecord::IR_STATE_NEEDLOAD;
-            g_images_cnt_ok--;
+            it->SrcImageW() = srcw;
+            it->SrcImageH() = srch;
+          }
 
-            if (g_ram_use_preview < g_config_maxthumbnail) break;
+          LICE_IBitmap **p = GetLevelImagePtr(it, isFull ? ImageRecord::IR_LEVEL_FULL : level);
+          if (!*p)
+          {
+            *p = ctx.bmOut;
+            BitmapCache_Add(it,BMCACHE_LEVEL,*p);
+            it->m_fullimage_cachevalid = 0; // repaint from the better level
+            ctx.bmOut=NULL;
           }
+          if (it->m_fullimage) FreeLevelImages(it,ImageRecord::IR_LEVEL_FULL); // no longer needed
         }
-        if (g_ram_use_preview >= g_config_maxthumbnail)
-        {
-          if (!database || rec->m_cache_has_thumbnail) load_mode = 0;
-          else load_mode = -1;
-        }
-        // see if there's something farther from center than we are with ImageRecord::IR_STATE_LOADED
+        DecodeThread_PostDamage(it);
+      }
+      didProc=true;
+    }
+  }
+  else if (!g_fullmode_item)
+  {
+    s_nav_item = NULL; // don't count opening the full view as navigation
+  }
+
+  if (!didProc)
+  {
+    DecodeJob job = { 0, 0 };
+    ImageRecord *rec = NULL;
+    int load_mode = 0;
+
+    // queues are popped without g_images_mutex, it is only taken to check and claim the record
+    g_images_mutex.Leave();
+
+    int i;
+    for (i = 0; i < 100 && !rec; i ++)
+    {
+      if (!DecodeSched_GetJob(ctx.queue_idx, &job))
+      {
+        if (DecodeSched_Refill()) continue;
+        break;
       }
 
-      if (load_mode == 0) sleepAmt = 30;
-      if (load_mode != 0)
+      g_images_mutex.Enter();
+      ImageRecord *jobrec = ImageList_Resolve(job.rec);
+      if (jobrec && jobrec->State() == ImageRecord::IR_STATE_NEEDLOAD)
       {
-        LICE_IBitmap *bmDel = NULL;
-        if (rec->m_preview_image)
+        load_mode = 1;
+        const WDL_INT64 budget = BitmapCache_GetBudget();
+        if (BitmapCache_GetUsage() >= budget) 
         {
-          g_ram_use_preview -= get_lice_bitmap_size(rec->m_preview_image);
+          // make room by evicting what is farther away than this item
+          BitmapCache_Evict(BMCACHE_TIERMASK_DECODE, budget * 9 / 10, s_sched_lastbuild - (job.dist + 2) * DECODESCHED_DIST_MS);
 
-          bmDel = ctx.bmOut;
-          ctx.bmOut = rec->m_preview_image;
-          rec->m_preview_image=0;
+          if (BitmapCache_GetUsage() >= budget)
+          {
+            if (!thumbdb || jobrec->CacheHasThumbnail()) load_mode = 0;
+            else load_mode = -1;
+          }
         }
+        if (load_mode != 0) rec = jobrec;
+      }
+      if (!rec) g_images_mutex.Leave();
+    }
+
+    if (!rec) return 30; // g_images_mutex not held
+
+    // the old preview may be being painted, so it is released rather than decoded into
+    BitmapCache_Release(rec,BMCACHE_PREVIEW,&rec->m_preview_image);
+
+    rec->State()=ImageRecord::IR_STATE_DECODING;
+    const WDL_UINT64 rec_handle = rec->GetHandle();
+    ctx.curfn.Set(rec->GetFN());
 
-        rec->m_state=ImageRecord::IR_STATE_DECODING;
-        ctx.curfn.Set(rec->m_fn.Get());
+    const bool calc_rot = rec->NeedRotChk();
+    char calculated_rot = 0;
+    DecodeThread_PostDamage(rec);
 
-        const bool calc_rot = rec->m_need_rotchk;
-        char calculated_rot = 0;
-        g_DecodeDidSomething=true;
+    g_images_mutex.Leave();
 
-        g_images_mutex.Leave();
+    if (!ctx.bmOut) ctx.bmOut = new LICE_MemBitmap(0,0,0);
 
-        if (!ctx.bmOut) ctx.bmOut = new LICE_MemBitmap(0,0,0);
-        delete bmDel;
+    struct stat sb = { 0, };
+    const int sb_valid = !statUTF8(ctx.curfn.Get(), &sb);
+
+    // load/process image
+    int srcw=0, srch=0; // full source dimensions, only set if decoded (ctx.bm may be scaled down)
+    const int success = DoProcessBitmap(ctx.bmOut, ctx.curfn.Get(),&ctx.bm, calc_rot ? &calculated_rot : NULL,thumbdb, workspace,load_mode,sb_valid ? &sb : NULL,
+                                        &srcw,&srch, load_mode > 0 ? rec_handle : 0);
+
+    if (load_mode < 0 && success >= 2)
+    {
+      // if generating/checking thumbnails, and in cache, then we can go fast fast
+    }
+    else
+    {
+      didProc=true;
+    }
 
-        struct stat sb = { 0, };
-        const int sb_valid = !statUTF8(ctx.curfn.Get(), &sb);
+    g_images_mutex.Enter();
 
-        // load/process image
-        const int success = DoProcessBitmap(ctx.bmOut, ctx.curfn.Get(),&ctx.bm, calc_rot ? &calculated_rot : NULL,database, workspace,stmts,load_mode,sb_valid ? &sb : NULL);
+    rec = ImageList_Resolve(rec_handle);
+    if (rec && rec->State() == ImageRecord::IR_STATE_DECODING)
+    {
+      if (sb_valid)
+        rec->FileTimestamp() = sb.st_mtime;
 
-        if (load_mode < 0 && success >= 2)
+      if (load_mode>0)
+      {
+        if (rec->NeedRotChk() && calc_rot)
         {
-          // if generating/checking thumbnails, and in cache, then we can go fast fast
+          rec->NeedRotChk() = false;
+          rec->Rot() = calculated_rot;
         }
-        else
+        if (srcw > 0 && srch > 0)
         {
-          didProc=true;
+          rec->SrcImageW() = srcw;
+          rec->SrcImageH() = srch;
         }
+      }
 
-        g_images_mutex.Enter();
+      if (!success)
+      {
+        FreeProvisionalPreview(rec);
+        rec->State() = ImageRecord::IR_STATE_ERROR;
+        g_images_cnt_err++;
+      }
+      else if (strcmp(rec->GetFN(),ctx.curfn.Get())) 
+      {
+        FreeProvisionalPreview(rec);
+        rec->State() = ImageRecord::IR_STATE_ERROR;
+      }
+      else
+      {
+        if (success>0 && !rec->CacheHasThumbnail()) g_images_cnt_indb++;
+        rec->CacheHasThumbnail() = success > 0;
 
-        if (g_images.Find(rec)>=0 && rec->m_state == ImageRecord::IR_STATE_DECODING)
+        g_images_statcnt++;
+        if (load_mode>0)
         {
-          if (sb_valid)
-            rec->m_file_timestamp = sb.st_mtime;
-
-          if (load_mode>0)
-          {
-            if (rec->m_need_rotchk && calc_rot)
-            {
-              rec->m_need_rotchk = false;
-              rec->m_rot = calculated_rot;
-            }
-            rec->m_srcimage_w = ctx.bm.getWidth();
-            rec->m_srcimage_h = ctx.bm.getHeight();
-          }
-
-          if (!success)
-          {
-            rec->m_state = ImageRecord::IR_STATE_ERROR;
-            g_images_cnt_err++;
-          }
-          else if (strcmp(rec->m_fn.Get(),ctx.curfn.Get())) rec->m_state = ImageRecord::IR_STATE_ERROR;
-          else
-          {
-            if (success>0 && !rec->m_cache_has_thumbnail) g_images_cnt_indb++;
-            rec->m_cache_has_thumbnail = success > 0;
-
-            g_images_statcnt++;
-            if (load_mode>0)
-            {
-              g_images_cnt_ok++;
-              rec->m_state = ImageRecord::IR_STATE_LOADED;
-              rec->m_preview_image = ctx.bmOut;
-              g_ram_use_preview += get_lice_bitmap_size(rec->m_preview_image);
-              ctx.bmOut = 0;
-            }
-            else
-            {
-              rec->m_state = ImageRecord::IR_STATE_NEEDLOAD; // load_mode=-1, calculated and cached thumbnail
-            }
-          }
-          g_DecodeDidSomething=true;
+          g_images_cnt_ok++;
+          rec->State() = ImageRecord::IR_STATE_LOADED;
+          FreeProvisionalPreview(rec); // replaced by the real thumbnail
+          rec->m_preview_image = ctx.bmOut;
+          BitmapCache_Add(rec,BMCACHE_PREVIEW,rec->m_preview_image);
+          BitmapCache_Touch(rec, (int) (GetTickCount() - s_sched_lastbuild) + job.dist * DECODESCHED_DIST_MS);
+          ctx.bmOut = 0;
+        }
+        else
+        {
+          rec->State() = ImageRecord::IR_STATE_NEEDLOAD; // load_mode=-1, calculated and cached thumbnail
         }
       }
+      DecodeThread_PostDamage(rec);
     }
   }
   g_images_mutex.Leave();
@@ -715,35 +1389,17 @@ static DWORD WINAPI DecodeThreadProc(LPVOID v)
 {
   DecodeThreadContext ctx;
 
-  sqlite3 *thisdb = NULL;
-
-  if (!g_config_nodb) sqlite3_open(g_db_file.Get(), &thisdb);
-
-  ctx.last_visstart=g_firstvisible_startitem;
-  ctx.scanpos=0;
+  IThumbStoreConnection *thisdb = g_thumbstore ? g_thumbstore->Connect(&g_DecodeThreadQuit) : NULL;
 
-  sqlite3_stmt *stmts[2]={0,};
+  ctx.queue_idx = (int) (INT_PTR) v;
 
-  if (thisdb)
-  {
-    if (sqlite3_prepare_v2(thisdb, "SELECT DATA FROM THUMB WHERE HASH = ?1", -1, &stmts[0], NULL) != SQLITE_OK)
-      stmts[0] = 0;
-    if (sqlite3_prepare_v2(thisdb, "INSERT OR REPLACE INTO THUMB (HASH, DATA) VALUES(?1, ?2)", -1, &stmts[1], NULL) != SQLITE_OK)
-      stmts[1] = 0;
-  }
-          
   WDL_HeapBuf hb;
   while (!g_DecodeThreadQuit)
   {
-    Sleep(RunWork(ctx,!v, thisdb,&hb,stmts));
+    Sleep(RunWork(ctx,!v, thisdb,&hb));
   }
 
-  if (thisdb) 
-  {
-    if (stmts[0]) sqlite3_finalize(stmts[0]);
-    if (stmts[1]) sqlite3_finalize(stmts[1]);
-    sqlite3_close(thisdb);
-  }
+  delete thisdb;
 
   return 0;
 }
@@ -751,29 +1407,17 @@ static DWORD WINAPI DecodeThreadProc(LPVOID v)
 
 static HANDLE hThread[MAX_THREADS]={0,};
 
-static int getCPUcount()
+int getCPUcount()
 {
 
 #ifdef WIN32
-  const int max_cpus = 16;
-
-  static int init = 0;
-  static int nbcpu = 1;
-  if (init) return nbcpu;
-  HKEY k;
-  if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, "Hardware\\Description\\System\\CentralProcessor", 0, KEY_READ, &k) == ERROR_SUCCESS)
+  static int nbcpu = 0;
+  if (!nbcpu)
   {
-    int i;
-    for (i = 0; i<max_cpus; i++)
-    {
-      char keyname[512];
-      if (RegEnumKey(k, i, keyname, 511) != ERROR_SUCCESS) break;
-    }
-    if (i>0) nbcpu = i;
-    RegCloseKey(k);
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    nbcpu = si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
   }
-
-  init = 1;
   return nbcpu;
 #elif defined(__APPLE__)
 
@@ -787,11 +1431,18 @@ static int getCPUcount()
 
 void DecodeThread_Init()
 {
+  BitmapCache_SetBudget(((WDL_INT64)max(config_readint("ramcache_mb", 768),64)) << 20);
+
   int numCPU = g_config_smp ? getCPUcount() : 1;
 
   if (numCPU<1) numCPU = 1;
   if (numCPU>sizeof(hThread)/sizeof(hThread[0])) numCPU=sizeof(hThread)/sizeof(hThread[0]);
 
+  s_sched_mutex.Enter();
+  s_sched_nqueues = numCPU;
+  s_sched_last_visstart = -1; // force the queues to be reset for the new thread count
+  s_sched_mutex.Leave();
+
   int x;
   for(x=0;x<numCPU;x++)
   {
@@ -818,6 +1469,11 @@ void DecodeThread_Quit()
     }
   }
   g_DecodeThreadQuit = false;
+
+  s_sched_mutex.Enter();
+  s_sched_nqueues = 1; // DecodeThread_RunTimer() uses the first queue
+  s_sched_last_visstart = -1;
+  s_sched_mutex.Leave();
 }
 
 void DecodeThread_RunTimer(void *db)
@@ -832,9 +1488,27 @@ void DecodeThread_RunTimer(void *db)
       static DecodeThreadContext *p;
       if (!p) p=new DecodeThreadContext;
       static WDL_HeapBuf hb;
-      if (p) RunWork(*p,true, (sqlite3*)db,&hb,NULL);
+      if (p) RunWork(*p,true, (IThumbStoreConnection*)db,&hb);
 
       reent=false;
     }
   }
 }
+
+int DecodeThread_GetDamage(WDL_PtrList<ImageRecord> *list)
+{
+  g_images_mutex.Enter();
+  int x;
+  for(x=0;x<s_decode_damage.GetSize();x++)
+  {
+    ImageRecord *rec = ImageList_Resolve(s_decode_damage.Get()[x]);
+    if (rec) // may have been removed since
+    {
+      rec->m_damage_posted = false;
+      list->Add(rec);
+    }
+  }
+  s_decode_damage.Resize(0,false);
+  g_images_mutex.Leave();
+  return list->GetSize();
+}
@@ -19,11 +19,15 @@
 */
 
 
+#include <math.h>
+
 #include "main.h"
 
 #include "resource.h"
 
 #include "uploader.h"
+#include "jpegtransform.h"
+#include "render.h"
 
 #include "../WDL/lice/lice.h"
 #include "../WDL/wdlcstring.h"
@@ -194,22 +198,72 @@ static void DoImageOutputFileCalculation(const char *infn, const char *outname,
 }
 
 
+#define MAX_EXPORT_THREADS 64
+
+// jobs are only started while the estimated memory of the jobs in process stays within 
+// imageExporter::m_mem_budget (one job always runs), so large images don't all get decoded at once
+// next to the decode threads' bitmaps. the budget is the export_mem_mb setting, by default the same
+// as the bitmap cache's ramcache_mb
+#define EXPORT_MEM_UNKNOWN_PIXELS (24*1024*1024) // if the source size is not known yet
+
+class exportJob
+{
+public:
+  exportJob() { index=0; state=STATE_QUEUED; preventDiskOutput=false; bytes_out=0; mem_estimate=0; memset(&params,0,sizeof(params)); }
+  ~exportJob() { }
+
+  enum { STATE_QUEUED=0, STATE_PROCESSING, STATE_DONE, STATE_ERROR };
+
+  // copied from the record when queued, the workers never touch the ImageRecord
+  WDL_FastString srcfn;
+  RenderParams params;
+  WDL_INT64 mem_estimate; // decoded source + encoded output, in bytes
+
+  int index; // position in the export order
+  bool preventDiskOutput;
+
+  WDL_FastString outname; // without any leading path, with extension
+  WDL_FastString tmpfn; // empty if not writing to disk
+
+  // encoded by the worker thread, uploaded from memory and written to tmpfn
+  WDL_HeapBuf encoded;
+
+  // set by worker threads, protected by imageExporter::m_jobs_mutex
+  int state;
+  WDL_FastString errmsg;
+  WDL_INT64 bytes_out;
+};
+
 class imageExporter
 {
 public:
-  imageExporter() { m_uploader=0; Reset(); }
-  ~imageExporter() { delete m_uploader; }
+  imageExporter() 
+  { 
+    m_uploader=0; 
+    m_nthreads=0; 
+    m_threads_quit=false; 
+    m_mem_inflight=0;
+    m_mem_budget=0;
+    memset(m_threads,0,sizeof(m_threads));
+    Reset(); 
+  }
+  ~imageExporter() { StopWorkers(); delete m_uploader; m_jobs.Empty(true); }
 
   void DisplayMessage(HWND hwndDlg, bool isLog, const char *fmt, ...);
-  void RunExportTimer(HWND hwndDlg);
+  bool RunExportTimer(HWND hwndDlg); // returns false if waiting on the workers
 
   void Reset()
   {
+    StopWorkers();
+    int x;
+    for (x=0;x<m_jobs.GetSize();x++) if (m_jobs.Get(x)->tmpfn.GetLength()) DeleteFile(m_jobs.Get(x)->tmpfn.Get());
+    m_jobs.Empty(true);
+
     m_upload_statustext[0]=0;
-    m_preventDiskOutput=false;
     m_state=0;
     m_messages.Set("");
     m_runpos=0;
+    m_queuepos=0;
     m_isFinished=0;
     m_total_files_out=0;
     m_total_bytes_out=0;
@@ -224,6 +278,7 @@ public:
   int m_fmt;
   bool m_jpg_baseline;
   int m_jpg_level;
+  bool m_jpg_lossless; // rotate/crop JPEGs without re-encoding when nothing else changed. those keep the source's quality, m_jpg_level is not applied
   bool m_png_alpha;
   char m_formatstr[256];
 
@@ -236,9 +291,19 @@ public:
   bool m_isFinished;
 
 private:
-  int m_state;
-  int m_runpos;
-  bool m_preventDiskOutput;
+  ImageRecord *GetImageForPosition(int pos);
+  int GetImageCount();
+  bool QueueNextJob(HWND hwndDlg); // returns false if no more images
+  bool IsOutputNamePending(const char *outname);
+
+  void StartWorkers();
+  void StopWorkers();
+  static DWORD WINAPI WorkerThreadProc(LPVOID p);
+  void ProcessJob(exportJob *job);
+
+  int m_state; // state of the first job: 0=waiting for processing, 1=uploading, 2=moving, 3=cleanup
+  int m_runpos; // index of first job
+  int m_queuepos; // index of next image to queue
 
   IFileUploader *m_uploader;
 
@@ -247,12 +312,14 @@ private:
   int m_total_files_out;
   WDL_INT64 m_total_bytes_out;
 
-
-  // cur state
-  WDL_FastString m_outname; // without any leading path
-  WDL_FastString m_tmpfn;
-
-
+  // images are loaded/processed/encoded by worker threads, and completed in order by RunExportTimer
+  WDL_Mutex m_jobs_mutex;
+  WDL_PtrList<exportJob> m_jobs; // in export order, added/removed only by the UI thread
+  HANDLE m_threads[MAX_EXPORT_THREADS];
+  int m_nthreads;
+  bool m_threads_quit;
+  WDL_INT64 m_mem_inflight; // mem_estimate of jobs in STATE_PROCESSING, protected by m_jobs_mutex
+  WDL_INT64 m_mem_budget; // set before the workers start
 };
 
 void imageExporter::DisplayMessage(HWND hwndDlg, bool isLog, const char *fmt, ...)
@@ -282,108 +349,317 @@ void imageExporter::DisplayMessage(HWND hwndDlg, bool isLog, const char *fmt, ..
   UpdateWindow(hwndDlg);
 }
 
+void imageExporter::StartWorkers()
+{
+  int n = g_config_smp ? getCPUcount() : 1;
+  if (n < 1) n = 1;
+  if (n > MAX_EXPORT_THREADS) n = MAX_EXPORT_THREADS;
+
+  const int ram_mb = max(config_readint("ramcache_mb", 768),64); // see DecodeThread_Init()
+  m_mem_budget = ((WDL_INT64)max(config_readint("export_mem_mb", ram_mb),64)) << 20;
+
+  m_threads_quit=false;
+  for (m_nthreads=0;m_nthreads<n;m_nthreads++)
+  {
+    DWORD tid;
+    m_threads[m_nthreads] = CreateThread(NULL,0,WorkerThreadProc,this,0,&tid);
+    if (!m_threads[m_nthreads]) break;
+  }
+}
 
-void imageExporter::RunExportTimer(HWND hwndDlg)
+void imageExporter::StopWorkers()
 {
-  if (m_state == 0)
+  m_threads_quit=true;
+  int x;
+  for (x=0;x<m_nthreads;x++)
   {
-    ImageRecord *rec;
-  
-    if (g_fullmode_item && g_images.Find(g_fullmode_item)>=0) rec = m_runpos ? 0 : g_fullmode_item;
-    else rec = g_images.Get(m_runpos);
-    if (!rec)
+    if (m_threads[x])
     {
-      DisplayMessage(hwndDlg,false,"Processing %d/%d images completed!\r\n"
-          "Total size: %.2fMB, average image size: %.2fMB",
-          m_total_files_out,m_runpos,
-        (m_total_bytes_out/1024.0/1024.0),
-        (m_total_bytes_out/1024.0/1024.0)/(double)max(1,m_total_files_out)
-        );
-      SetDlgItemText(hwndDlg,IDCANCEL,"Close");
-      m_isFinished=true;
-      return;
+      WaitForSingleObject(m_threads[x],INFINITE);
+      CloseHandle(m_threads[x]);
+      m_threads[x]=0;
     }
-  
-    const char *extension = m_fmt == FORMAT_JPG ? ".jpg" : m_fmt == FORMAT_PNG ? ".png" : ".unknown";
-    // calculate output file
-  
-    DoImageOutputFileCalculation(rec->m_fn.Get(),
-                                 rec->m_outname.Get(),
-                                 g_images.Find(rec)+1,
-                                 g_imagelist_fn.Get()[0] ? g_imagelist_fn.Get() : "Untitled",
-                                 m_disk_out,
-                                 m_formatstr[0]?m_formatstr:"<",
-                                 &m_outname);
-
-    m_preventDiskOutput=false;
+  }
+  m_nthreads=0;
+  m_threads_quit=false;
+}
 
-    if (m_overwrite!=1 && m_disk_out[0]) // change if needed
+DWORD WINAPI imageExporter::WorkerThreadProc(LPVOID p)
+{
+  imageExporter *_this = (imageExporter *)p;
+  while (!_this->m_threads_quit)
+  {
+    exportJob *job = NULL;
+    _this->m_jobs_mutex.Enter();
+    int x;
+    for (x=0;x<_this->m_jobs.GetSize();x++)
     {
-      int x;
-      const int maxtries=1000;
-      WDL_FastString s;
-    
-      for (x=0;x<maxtries;x++)
+      exportJob *j = _this->m_jobs.Get(x);
+      if (j->state == exportJob::STATE_QUEUED)
       {
-        s.Set(m_disk_out);
-        s.Append(PREF_DIRSTR);
-        s.Append(m_outname.Get());
-        char apstr[256];            
-        if (x) sprintf(apstr," (%d)",x+1);
-        else apstr[0]=0;
-
-        s.Append(apstr);
-        s.Append(extension);
-        if (!file_exists(s.Get()))
-        {
-          m_outname.Append(apstr);
-          break;
-        }
-        if (m_overwrite==0)
-        {
-          m_preventDiskOutput=true;
-          break;
-        }
+        // in export order, so a big image waits for memory rather than being overtaken indefinitely
+        if (_this->m_mem_inflight > 0 && _this->m_mem_inflight + j->mem_estimate > _this->m_mem_budget) break;
+
+        j->state = exportJob::STATE_PROCESSING;
+        _this->m_mem_inflight += j->mem_estimate;
+        job = j;
+        break;
       }
+    }
+    _this->m_jobs_mutex.Leave();
 
-      if (x>=maxtries&&m_overwrite>1)
-      {
+    if (job) _this->ProcessJob(job);
+    else Sleep(10);
+  }
+  return 0;
+}
+
+// only rotation and cropping can be done in the DCT domain, the output size is checked by JPEG_LosslessTransform()
+static bool CanExportLossless(const RenderParams *params)
+{
+  if (params->bw) return false;
+  int x;
+  for (x = 0; x < 5; x ++) if (fabs(params->bchsv[x]) >= KNOB_EPS) return false;
+  return true;
+}
 
-        DisplayMessage(hwndDlg,true,"Could not find suitable unused output filename for:\r\n"
-                                    "\t%.200s\r\n"
-                                    "Last try was: %.200s\r\n",
-                                    rec->m_fn.Get(),
-                                    s.Get());
+// the output is rendered a band at a time as the encoder asks for rows, so a full size 
+// output bitmap never exists alongside the source
+#define EXPORT_BAND_ROWS 128
 
-        m_preventDiskOutput=true;
+struct exportRowsCtx
+{
+  RenderRecipe *recipe;
+  int w, h;
+  const bool *quit; // imageExporter::m_threads_quit, stops the encoder between bands
+};
+
+static bool ExportRowsProc(void *_ctx, LICE_IBitmap *band, int y, int nrows)
+{
+  const exportRowsCtx *ctx = (const exportRowsCtx *)_ctx;
+  if (*(volatile const bool *)ctx->quit) return false;
+  // lanczos3 with the rotation and adjustments done in the same pass
+  return ctx->recipe->RenderRows(band,ctx->w,ctx->h,y,nrows,LICE_RESAMPLE_LANCZOS3);
+}
+
+// runs in a worker thread, the job is not touched by the UI thread until its state changes
+void imageExporter::ProcessJob(exportJob *job)
+{
+  WDL_FastString err;
+  WDL_INT64 bytes_out=0;
+
+  LICE_IBitmap *srcimage = NULL;
+  // lossless output keeps the source's quality rather than m_jpg_level, and is only used when it 
+  // is as baseline as asked for
+  if (m_fmt == FORMAT_JPG && m_jpg_lossless && CanExportLossless(&job->params) &&
+      JPEG_LosslessTransform(job->srcfn.Get(),&job->encoded,job->params.rot,&job->params.crop,
+                             m_jpg_baseline,m_constrain_w,m_constrain_h))
+  {
+  }
+  else if (!(srcimage = LICE_LoadImage(job->srcfn.Get(),NULL,false)))
+  {
+    err.SetFormatted(1024,"Failed loading image:\r\n\t%.200s\r\n",job->srcfn.Get());
+  }
+  else if (!m_threads_quit)
+  {
+    RenderRecipe recipe;
+    exportRowsCtx ctx = { &recipe, 0, 0, &m_threads_quit };
+    if (!recipe.Compile(&job->params,srcimage) ||
+        !recipe.GetOutputSize(m_constrain_w,m_constrain_h,&ctx.w,&ctx.h))
+    {
+      err.SetFormatted(1024,"Failed processing image:\r\n\t%.200s\r\n",job->srcfn.Get());
+    }          
+    else
+    {            
+      bool hadError=false;
+      if (m_fmt == FORMAT_JPG)
+      {
+        hadError = !LICE_WriteJPGRowsToMemory(&job->encoded,ctx.w,ctx.h,EXPORT_BAND_ROWS,ExportRowsProc,&ctx,m_jpg_level,m_jpg_baseline);
       }
+      else if (m_fmt == FORMAT_PNG)
+      {
+        hadError = !LICE_WritePNGRowsToMemory(&job->encoded,ctx.w,ctx.h,EXPORT_BAND_ROWS,ExportRowsProc,&ctx,m_png_alpha);
+      }
+      else
+      {
+        err.Set("Unknown format selected\r\n");
+        hadError=true;
+      }
+
+      if (hadError) err.AppendFormatted(1024,"Failed encoding image:\r\n\t%.200s\r\n",job->srcfn.Get());
     }
+  }
+  delete srcimage;
 
+  if (m_threads_quit)
+  {
+    // aborted (possibly partway through encoding), Reset() discards the job
+    job->encoded.Resize(0);
+    if (!err.GetLength()) err.Set("Aborted\r\n");
+  }
+  else if (!err.GetLength())
+  {
+    bytes_out = job->encoded.GetSize();
+    if (job->tmpfn.GetLength())
+    {
+      FILE *fp = fopenUTF8(job->tmpfn.Get(),"wb");
+      bool ok = fp && (int)fwrite(job->encoded.Get(),1,job->encoded.GetSize(),fp) == job->encoded.GetSize();
+      if (fp && fclose(fp)) ok = false;
+      if (!ok) err.SetFormatted(1024,"Failed writing image to:\r\n\t%.200s\r\n",job->tmpfn.Get());
+    }
+  }
 
-    if (m_disk_out[0])
+  m_jobs_mutex.Enter();
+  job->errmsg.Set(err.Get());
+  job->bytes_out = bytes_out;
+  job->state = err.GetLength() ? exportJob::STATE_ERROR : exportJob::STATE_DONE;
+  m_mem_inflight -= job->mem_estimate;
+  m_jobs_mutex.Leave();
+}
+
+ImageRecord *imageExporter::GetImageForPosition(int pos)
+{
+  if (g_fullmode_item && ImageList_IndexOf(g_fullmode_item)>=0) return pos ? 0 : g_fullmode_item;
+  return g_images.Get(pos);
+}
+
+int imageExporter::GetImageCount()
+{
+  return g_fullmode_item && ImageList_IndexOf(g_fullmode_item)>=0 ? 1 : g_images.GetSize();
+}
+
+bool imageExporter::IsOutputNamePending(const char *outname)
+{
+  int x;
+  for (x=0;x<m_jobs.GetSize();x++)
+  {
+    exportJob *job = m_jobs.Get(x);
+    if (!job->preventDiskOutput && !stricmp(job->outname.Get(),outname)) return true;
+  }
+  return false;
+}
+
+bool imageExporter::QueueNextJob(HWND hwndDlg)
+{
+  ImageRecord *rec = GetImageForPosition(m_queuepos);
+  if (!rec) return false;
+
+  exportJob *job = new exportJob;
+  job->index = m_queuepos++;
+
+  // the decode threads update records' parameters, the workers only see this copy
+  g_images_mutex.Enter();
+  job->srcfn.Set(rec->GetFN());
+  job->params.Set(rec);
+  g_images_mutex.Leave();
+
+  const WDL_INT64 srcpix = job->params.srcw > 0 && job->params.srch > 0 ? 
+    (WDL_INT64)job->params.srcw * job->params.srch : EXPORT_MEM_UNKNOWN_PIXELS;
+  job->mem_estimate = srcpix * 5; // 4 bytes/pixel decoded, plus room for the encoded output
+
+  const char *extension = m_fmt == FORMAT_JPG ? ".jpg" : m_fmt == FORMAT_PNG ? ".png" : ".unknown";
+  // calculate output file
+
+  DoImageOutputFileCalculation(rec->GetFN(),
+                               rec->GetOutName(),
+                               ImageList_IndexOf(rec)+1,
+                               g_imagelist_fn.Get()[0] ? g_imagelist_fn.Get() : "Untitled",
+                               m_disk_out,
+                               m_formatstr[0]?m_formatstr:"<",
+                               &job->outname);
+
+  if (m_overwrite!=1 && m_disk_out[0]) // change if needed
+  {
+    int x;
+    const int maxtries=1000;
+    WDL_FastString s;
+  
+    for (x=0;x<maxtries;x++)
     {
-      m_tmpfn.Set(m_disk_out);
-      m_tmpfn.Append(PREF_DIRSTR);
-      m_tmpfn.Append(m_outname.Get());
-      m_tmpfn.Append(".SnapEase-temp");
+      s.Set(m_disk_out);
+      s.Append(PREF_DIRSTR);
+      s.Append(job->outname.Get());
+      char apstr[256];            
+      if (x) sprintf(apstr," (%d)",x+1);
+      else apstr[0]=0;
+
+      s.Append(apstr);
+      s.Append(extension);
+
+      // earlier images still being processed have not been written yet, so check their names too
+      if (!file_exists(s.Get()) && !IsOutputNamePending(s.Get() + strlen(m_disk_out) + strlen(PREF_DIRSTR)))
+      {
+        job->outname.Append(apstr);
+        break;
+      }
+      if (m_overwrite==0)
+      {
+        job->preventDiskOutput=true;
+        break;
+      }
     }
-    else
+
+    if (x>=maxtries&&m_overwrite>1)
     {
-      char fn[2048];
-      GetTempPath(sizeof(fn)-128, fn);
 
-      snprintf_append(fn,sizeof(fn),"snapease-temp-%08x-%08x.tmp",
-  #ifdef _WIN32
-        GetCurrentProcessId(),
-  #else
-        (int)getpid(),
-  #endif
-        GetTickCount());
+      DisplayMessage(hwndDlg,true,"Could not find suitable unused output filename for:\r\n"
+                                  "\t%.200s\r\n"
+                                  "Last try was: %.200s\r\n",
+                                  rec->GetFN(),
+                                  s.Get());
 
-      m_tmpfn.Set(fn);
+      job->preventDiskOutput=true;
     }
+  }
+
+  // the image is encoded to memory, and only goes through a temp file when written to disk (so a 
+  // partial file never has the final name). temp names include the index, as several images are in flight at once
+  if (m_disk_out[0] && !job->preventDiskOutput)
+  {
+    job->tmpfn.Set(m_disk_out);
+    job->tmpfn.Append(PREF_DIRSTR);
+    job->tmpfn.Append(job->outname.Get());
+    job->tmpfn.AppendFormatted(64,"-%d.SnapEase-temp",job->index);
+  }
+
+  job->outname.Append(extension);
+
+  m_jobs_mutex.Enter();
+  m_jobs.Add(job);
+  m_jobs_mutex.Leave();
+  return true;
+}
+
 
-    m_outname.Append(extension);
+bool imageExporter::RunExportTimer(HWND hwndDlg)
+{
+  if (!m_nthreads) StartWorkers();
+
+  // keep the workers busy, but don't get too far ahead of the uploader
+  while (m_jobs.GetSize() < m_nthreads*2 && QueueNextJob(hwndDlg));
+
+  exportJob *job = m_jobs.Get(0);
+  if (!job)
+  {
+    DisplayMessage(hwndDlg,false,"Processing %d/%d images completed!\r\n"
+        "Total size: %.2fMB, average image size: %.2fMB",
+        m_total_files_out,m_runpos,
+      (m_total_bytes_out/1024.0/1024.0),
+      (m_total_bytes_out/1024.0/1024.0)/(double)max(1,m_total_files_out)
+      );
+    SetDlgItemText(hwndDlg,IDCANCEL,"Close");
+    m_isFinished=true;
+    StopWorkers();
+    return true;
+  }
+
+  if (m_state == 0)
+  {
+    m_jobs_mutex.Enter();
+    const int jobstate = job->state;
+    m_jobs_mutex.Leave();
+
+    if (jobstate == exportJob::STATE_QUEUED || jobstate == exportJob::STATE_PROCESSING) return false;
 
     m_upload_statustext[0]=0;
     double avg_imgsize=(m_total_bytes_out/1024.0/1024.0)/(double)max(1,m_total_files_out);
@@ -392,77 +668,25 @@ void imageExporter::RunExportTimer(HWND hwndDlg)
                                  "Destination: %.100s%s%.100s%s\r\n"
                                  ,
                                  m_runpos + 1,
-                                 g_fullmode_item && g_images.Find(g_fullmode_item)>=0 ? 1 : g_images.GetSize(),
+                                 GetImageCount(),
 
                                   (m_total_bytes_out/1024.0/1024.0),
-                                  avg_imgsize * (g_fullmode_item && g_images.Find(g_fullmode_item)>=0 ? 1 : g_images.GetSize()),
+                                  avg_imgsize * GetImageCount(),
                                   avg_imgsize,
 
-                                 rec->m_fn.Get(),
+                                 job->srcfn.Get(),
                                  m_disk_out[0] ? m_disk_out : m_upload_mode>=0 ? "<upload>:" : "<nul>/",
                                  m_disk_out[0] ? PREF_DIRSTR: "",
-                                 m_outname.Get(),
+                                 job->outname.Get(),
                                  m_disk_out[0] && m_upload_mode>=0 ? " + upload" : ""
                                
                                  );
 
-
-    bool hadError=false;
-
-    LICE_IBitmap *srcimage = LICE_LoadImage(rec->m_fn.Get(),NULL,false);
-    if (!srcimage)
+    if (jobstate == exportJob::STATE_DONE) 
     {
-      hadError=true;
-      DisplayMessage(hwndDlg,true,"Failed loading image:\r\n\t%.200s\r\n",rec->m_fn.Get());
-    }
+      m_total_files_out++;
+      m_total_bytes_out += job->bytes_out;
 
-    if (!hadError)
-    {
-      LICE_MemBitmap tempimage;
-      if (!rec->ProcessImageToBitmap(srcimage,&tempimage,
-                                m_constrain_w,
-                                m_constrain_h))
-      {
-        DisplayMessage(hwndDlg,true,"Failed processing image:\r\n\t%.200s\r\n",rec->m_fn.Get());
-        hadError=true;
-      }          
-      else
-      {            
-        if (m_fmt == FORMAT_JPG)
-        {
-          if (!LICE_WriteJPG(m_tmpfn.Get(),&tempimage,m_jpg_level,m_jpg_baseline))
-            hadError=true;
-          else 
-          {
-            m_total_files_out++;
-            m_total_bytes_out += file_size(m_tmpfn.Get());
-          }
-        }
-        else if (m_fmt == FORMAT_PNG)
-        {
-          if (!LICE_WritePNG(m_tmpfn.Get(),&tempimage,m_png_alpha))
-            hadError=true;
-          else 
-          {
-            m_total_files_out++;
-            m_total_bytes_out += file_size(m_tmpfn.Get());
-          }
-        }
-        else
-        {
-          DisplayMessage(hwndDlg,true,"Unknown format selected");
-          hadError=true;
-        }
-        if (hadError) DisplayMessage(hwndDlg,true,"Failed writing image to:\r\n\t%.200s\r\n",m_tmpfn.Get());
-      }
-    }
-
-
-  
-    delete srcimage;
-
-    if (!hadError) 
-    {
       m_state++;
       delete m_uploader;
 
@@ -470,16 +694,19 @@ void imageExporter::RunExportTimer(HWND hwndDlg)
       // optionally create the uploader here
       if (m_uploader)
       {
-        if (!m_uploader->SendFile(m_tmpfn.Get(),m_outname.Get()))
+        if (!m_uploader->SendData(job->encoded.Get(),job->encoded.GetSize(),job->outname.Get()))
         {
-          DisplayMessage(hwndDlg,true,"Failed requesting upload of image:\r\n\t%.200s\r\nDest name: %.200s\r\n",m_tmpfn.Get(),m_outname.Get());
+          DisplayMessage(hwndDlg,true,"Failed requesting upload of image:\r\n\t%.200s\r\nDest name: %.200s\r\n",job->srcfn.Get(),job->outname.Get());
           delete m_uploader;
           m_uploader=0;
         }
       }
     }
-    else m_state=3; // go straight to cleanup pass
-
+    else 
+    {
+      DisplayMessage(hwndDlg,true,"%s",job->errmsg.Get());
+      m_state=3; // go straight to cleanup pass
+    }
   }
   else if (m_state==1)
   {
@@ -490,7 +717,7 @@ void imageExporter::RunExportTimer(HWND hwndDlg)
       if (a)
       {
         if (a<0)
-          DisplayMessage(hwndDlg,true,"Failed uploading image:\r\n\t%.200s\r\nReason: %.200s\r\n",m_tmpfn.Get(),m_upload_statustext);
+          DisplayMessage(hwndDlg,true,"Failed uploading image:\r\n\t%.200s\r\nReason: %.200s\r\n",job->outname.Get(),m_upload_statustext);
         m_state++;
       }
     }
@@ -500,16 +727,16 @@ void imageExporter::RunExportTimer(HWND hwndDlg)
   {
     delete m_uploader;
     m_uploader=0;
-    if (m_disk_out[0] && !m_preventDiskOutput)
+    if (job->tmpfn.GetLength())
     {
       WDL_FastString s;
       s.Set(m_disk_out);
       s.Append(PREF_DIRSTR);
-      s.Append(m_outname.Get());
+      s.Append(job->outname.Get());
       if (m_overwrite==1) DeleteFile(s.Get());
-      if (!MoveFile(m_tmpfn.Get(),s.Get()))
+      if (!MoveFile(job->tmpfn.Get(),s.Get()))
       {
-        DisplayMessage(hwndDlg,true,"Failed moving:\r\n\t%.200s\r\nto:\r\n\t%.200s\r\n",m_tmpfn.Get(),s.Get());
+        DisplayMessage(hwndDlg,true,"Failed moving:\r\n\t%.200s\r\nto:\r\n\t%.200s\r\n",job->tmpfn.Get(),s.Get());
       }
     }
     m_state++;
@@ -518,11 +745,16 @@ void imageExporter::RunExportTimer(HWND hwndDlg)
   if (m_state==3)
   {
     m_upload_statustext[0]=0;
-    DeleteFile(m_tmpfn.Get());
+    if (job->tmpfn.GetLength()) DeleteFile(job->tmpfn.Get());
     m_runpos++;
 
+    m_jobs_mutex.Enter();
+    m_jobs.Delete(0,true);
+    m_jobs_mutex.Leave();
+
     m_state=0;
   }
+  return true;
 }
 
 static imageExporter exportConfig;
@@ -553,7 +785,7 @@ static WDL_DLGRET ExportRunDialogProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LP
           DWORD tc = GetTickCount()+50;
           do
           {
-            exportConfig.RunExportTimer(hwndDlg);
+            if (!exportConfig.RunExportTimer(hwndDlg)) break; // workers are busy, check back next timer
           }
           while (!exportConfig.m_isFinished && GetTickCount()<tc);
           reent=false;
@@ -598,7 +830,7 @@ static WDL_DLGRET ExportConfigDialogProc(HWND hwndDlg, UINT uMsg, WPARAM wParam,
     case WM_INITDIALOG:
       s_uploaderCfg=0;
 
-      SetWindowText(hwndDlg,g_fullmode_item&&g_images.Find(g_fullmode_item)>=0?"Export one image" : "Export all images");
+      SetWindowText(hwndDlg,g_fullmode_item&&ImageList_IndexOf(g_fullmode_item)>=0?"Export one image" : "Export all images");
 
       WDL_UTF8_HookComboBox(GetDlgItem(hwndDlg,IDC_COMBO1));
       WDL_UTF8_HookComboBox(GetDlgItem(hwndDlg,IDC_COMBO2));
@@ -621,6 +853,8 @@ static WDL_DLGRET ExportConfigDialogProc(HWND hwndDlg, UINT uMsg, WPARAM wParam,
 
       if (config_readint("export_jpg_baseline",0))
         CheckDlgButton(hwndDlg,IDC_CHECK5,BST_CHECKED);
+      if (config_readint("export_jpg_lossless",1))
+        CheckDlgButton(hwndDlg,IDC_JPGLOSSLESS,BST_CHECKED);
       SetDlgItemInt(hwndDlg,IDC_EDIT3,config_readint("export_jpg_level",90),FALSE);
 
       if (config_readint("export_png_alpha",0))
@@ -719,6 +953,7 @@ static WDL_DLGRET ExportConfigDialogProc(HWND hwndDlg, UINT uMsg, WPARAM wParam,
             ShowWindow(GetDlgItem(hwndDlg,IDC_JPGLBL),fmt==FORMAT_JPG);
             ShowWindow(GetDlgItem(hwndDlg,IDC_EDIT3),fmt==FORMAT_JPG);
             ShowWindow(GetDlgItem(hwndDlg,IDC_CHECK5),fmt==FORMAT_JPG);
+            ShowWindow(GetDlgItem(hwndDlg,IDC_JPGLOSSLESS),fmt==FORMAT_JPG);
             ShowWindow(GetDlgItem(hwndDlg,IDC_CHECK6),fmt==FORMAT_PNG);
           }
         break;
@@ -759,6 +994,7 @@ static WDL_DLGRET ExportConfigDialogProc(HWND hwndDlg, UINT uMsg, WPARAM wParam,
             if (exportConfig.m_fmt>=0) config_writeint("export_fmt",exportConfig.m_fmt);
 
             config_writeint("export_jpg_baseline",exportConfig.m_jpg_baseline = !!IsDlgButtonChecked(hwndDlg,IDC_CHECK5));
+            config_writeint("export_jpg_lossless",exportConfig.m_jpg_lossless = !!IsDlgButtonChecked(hwndDlg,IDC_JPGLOSSLESS));
 
             exportConfig.m_jpg_level = GetDlgItemInt(hwndDlg,IDC_EDIT3,&t,FALSE);
             if (!t) exportConfig.m_jpg_level=75;
@@ -847,10 +1083,6 @@ void DoExportDialog(HWND hwndDlg)
 {
   if (DialogBox(g_hInst,MAKEINTRESOURCE(IDD_EXPORT_CONFIG),hwndDlg,ExportConfigDialogProc))
   {
-    DecodeThread_Quit();
-
     DialogBox(g_hInst,MAKEINTRESOURCE(IDD_EXPORT_RUN),hwndDlg,ExportRunDialogProc);
-
-    DecodeThread_Init();
   }
 }
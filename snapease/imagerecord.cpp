@@ -25,6 +25,7 @@
 #include "../WDL/lice/lice_combine.h"
 #include "../WDL/lice/lice_text.h"
 #include "../WDL/wingui/virtwnd-controls.h"
+#include "../WDL/wdlcstring.h"
 
 #ifdef ENABLE_FUN_TRANSFORM_TEST
 #include "../WDL/plush2/plush.h"
@@ -32,6 +33,8 @@
 
 
 #include "imagerecord.h"
+#include "render.h"
+#include "thumbatlas.h"
 
 
 #include "resource.h"
@@ -78,7 +81,6 @@ static const char *knob_labels[]={
 };
 
 
-#define KNOB_EPS 0.001
 #define KNOB_MESSAGE 0xf00db00f
 // used for H,S,V, B, C
 static int s_knob_capx,s_knob_capy;
@@ -191,95 +193,83 @@ static void UpdateAllButtonStates(WDL_VWnd *sf)
     if (!vw) break;
     if (!strcmp(vw->GetType(),"ImageRecord"))
     {
-      ((ImageRecord*)vw)->UpdateButtonStates();
+      ((ImageRecordVwnd*)vw)->UpdateButtonStates();
     }
   }
   par->RequestRedraw(NULL);
 }
 
 
-static int GetNearestVWndToPoint(WDL_VWnd *par, int x, int y)
+// index in g_images that rec dragged to x,y (g_vwnd coordinates) would be inserted at, -1 if none
+static int GetDragInsertIndex(ImageRecord *rec, int x, int y)
 {
-  RECT parr;
-  par->GetPosition(&parr);
-  if (x<parr.left||y<parr.top || x>=parr.right || y>=parr.bottom) return -1;
-
-  int n=par->GetNumChildren(),a;
-  int nearest1=-1, nearest1_xdiff=1<<20;
-  int nearest2=-1, nearest2_diff=1<<30;
-
-  for(a=0;a<n;a++)
+  int newidx = GetGridIndexFromPoint(x,y);
+  if (newidx>=0)
   {
-    WDL_VWnd *vw = par->EnumChildren(a);
-    if (vw)
-    {
-      RECT r;
-      vw->GetPosition(&r);
-      int ydiff=0;
-      if (y < r.top) ydiff=r.top-y;
-      else if (y>r.bottom) ydiff=y-r.bottom;
-      
-      if (!ydiff)
-      {
-        int xdiff;
-        if (x < r.left) xdiff=r.left-x;
-        else if (x>r.right)xdiff=x-r.right;
-        else return a;
-
-        if (xdiff < nearest1_xdiff) { nearest1 = a; nearest1_xdiff=xdiff; }
-      }
-      else
-      {
-        int xdiff=0;
-        if (x < r.left) xdiff=r.left-x;
-        else if (x>r.right)xdiff=x-r.right;
-
-        int diff = ydiff*ydiff + xdiff*xdiff;
-        if (diff < nearest2_diff) 
-        { 
-          nearest2 = a; 
-          nearest2_diff=diff;
-        }
-      }
-    }
-  }   
-  if (nearest1>=0) return nearest1;
-  return nearest2;
+    RECT r;
+    if (g_images.Get(newidx)==rec) newidx=-1;
+    else if (GetGridItemRect(newidx,&r) && x >= r.left+(r.right-r.left)/2) newidx++;
+  }
+  return newidx;
 }
 
 ImageRecord::ImageRecord(const char *fn, time_t timestamp)
 {
-  memset(&m_lastlbl_rect,0,sizeof(m_lastlbl_rect));
-  memset(&m_last_drawrect,0,sizeof(m_last_drawrect));
-  memset(&m_last_crop_drawrect,0,sizeof(m_last_crop_drawrect));
-  memset(&m_crop_capmode_lastpos,0,sizeof(m_crop_capmode_lastpos));
-  memset(&m_croprect,0,sizeof(m_croprect));
-
-  m_is_fs=false;
+  m_wnd=NULL;
+  m_atlas_slot=-1;
+  m_damage_posted=false;
   m_fullimage_scaled=m_fullimage_final=NULL;
   m_fullimage_cachevalid=0;
+  memset(m_bmcache_heapidx,0xff,sizeof(m_bmcache_heapidx));
+  m_bmcache_lastuse=0;
+  memset(m_bmcache_bytes,0,sizeof(m_bmcache_bytes));
   m_fullimage=0;
-  memset(m_bchsv,0,sizeof(m_bchsv));
-  m_bw=false;
-  m_need_rotchk = true;
-  m_cache_has_thumbnail = false;
-  m_rot=0;
-  m_state=IR_STATE_NEEDLOAD;
+  m_mid_image=m_screen_image=NULL;
+  m_level_loading=m_level_failed=0;
   m_preview_image=NULL;
-  m_srcimage_w=m_srcimage_h=0;
-  m_fn.Set(fn);
+
+  // catalog fields start zeroed
+  m_cat = g_catalog.Alloc();
+  NeedRotChk() = true;
+  g_catalog.SetFN(m_cat,fn);
   SetDefaultTitle();
 
-  m_file_timestamp = timestamp;
+  FileTimestamp() = timestamp;
   if (!timestamp)
   {
     struct stat sb = { 0, };
     if (!statUTF8(fn,&sb))
     {
-      m_file_timestamp = sb.st_mtime;
+      FileTimestamp() = sb.st_mtime;
     }
   }
-  // add our button children
+}
+
+ImageRecordVwnd::ImageRecordVwnd(ImageRecord *rec)
+{
+  memset(&m_lastlbl_rect,0,sizeof(m_lastlbl_rect));
+  memset(&m_last_drawrect,0,sizeof(m_last_drawrect));
+  memset(&m_last_crop_drawrect,0,sizeof(m_last_crop_drawrect));
+  memset(&m_crop_capmode_lastpos,0,sizeof(m_crop_capmode_lastpos));
+
+  m_is_fs=false;
+  m_materialized_gen=0;
+  m_capture_state=-1;
+
+  m_rec=rec;
+  rec->m_wnd=this;
+
+  CreateControls();
+}
+
+ImageRecordVwnd::~ImageRecordVwnd()
+{
+  if (m_rec && m_rec->m_wnd == this) m_rec->m_wnd=NULL;
+  m_transform.Empty(true);
+}
+
+void ImageRecordVwnd::CreateControls()
+{
   int x;
   for(x=BUTTONID_BASE;x<BUTTONID_END;x++)
   {
@@ -290,17 +280,18 @@ ImageRecord::ImageRecord(const char *fn, time_t timestamp)
   char ctab[]={'B','C','H','S','V'};
   for (x=KNOBBUTTON_BASE;x<KNOBBUTTON_END;x++)
   {
-    KnobButton *b = new KnobButton(m_bchsv+x-KNOBBUTTON_BASE,
+    KnobButton *b = new KnobButton(m_rec->BCHSV()+x-KNOBBUTTON_BASE,
       x==KNOBBUTTON_H ? 0.5 : 1.0,x==KNOBBUTTON_H ? 1.0:0.85,
       ctab[x-KNOBBUTTON_BASE]);
     b->SetID(x);
     AddChild(b);
   }
 
+  LayoutControls(m_position.right-m_position.left);
   UpdateButtonStates();
 }
 
-void ImageRecord::UpdateButtonStates()
+void ImageRecordVwnd::UpdateButtonStates()
 {
   int x;
   for(x=BUTTONID_BASE;x<BUTTONID_END;x++)
@@ -311,7 +302,7 @@ void ImageRecord::UpdateButtonStates()
       char st=0;
       switch (x)
       {
-        case BUTTONID_BW: st = !!m_bw; break;
+        case BUTTONID_BW: st = !!m_rec->BW(); break;
         case BUTTONID_CROP: st = g_edit_mode==EDIT_MODE_CROP; break;
         case BUTTONID_FULLSCREEN: st = m_is_fs; break;
       }
@@ -331,42 +322,47 @@ void ImageRecord::UpdateButtonStates()
 ImageRecord::~ImageRecord()
 {
   EditImageLabelEnd();
-  g_ram_use_preview -= get_lice_bitmap_size(m_preview_image);
-  g_ram_use_full -= get_lice_bitmap_size(m_fullimage);
-  g_ram_use_fullscaled -= get_lice_bitmap_size(m_fullimage_scaled);
-  g_ram_use_fullfinal -= get_lice_bitmap_size(m_fullimage_final);
+  if (m_wnd)
+  {
+    WDL_VWnd *par = m_wnd->GetParent();
+    if (par) par->RemoveChild(m_wnd,false);
+    delete m_wnd;
+  }
+  BitmapCache_RemoveRecord(this);
+  ThumbAtlas_Invalidate(this);
   delete m_preview_image;
   delete m_fullimage;
+  delete m_mid_image;
+  delete m_screen_image;
   delete m_fullimage_scaled;
   delete m_fullimage_final;
-  m_transform.Empty(true);
+  g_catalog.Free(m_cat);
 }
 
 ImageRecord *ImageRecord ::Duplicate()
 {
-  ImageRecord  *rec = new ImageRecord(m_fn.Get(),m_file_timestamp);
-  rec->m_outname.Set(m_outname.Get());
-  if (m_state==IR_STATE_LOADED && m_preview_image)
+  ImageRecord  *rec = new ImageRecord(GetFN(),FileTimestamp());
+  rec->SetOutName(GetOutName());
+  if (State()==IR_STATE_LOADED && m_preview_image)
   {
-    rec->m_state=m_state;   
+    rec->State()=State();   
     LICE_Copy((rec->m_preview_image = new LICE_MemBitmap(0,0,0)),m_preview_image);
-    g_ram_use_preview += get_lice_bitmap_size(rec->m_preview_image);
+    BitmapCache_Add(rec,BMCACHE_PREVIEW,rec->m_preview_image);
   }
-  rec->m_cache_has_thumbnail = m_cache_has_thumbnail;
-  rec->m_srcimage_w=m_srcimage_w;
-  rec->m_srcimage_h=m_srcimage_h;
-  memcpy(rec->m_bchsv,m_bchsv,sizeof(m_bchsv));
-  rec->m_bw = m_bw;
-  rec->m_need_rotchk = m_need_rotchk;
-  rec->m_rot=m_rot;
-  rec->m_croprect=m_croprect;
-
-  rec->UpdateButtonStates();
+  rec->CacheHasThumbnail() = CacheHasThumbnail();
+  rec->SrcImageW()=SrcImageW();
+  rec->SrcImageH()=SrcImageH();
+  memcpy(rec->BCHSV(),BCHSV(),5*sizeof(float));
+  rec->BW() = BW();
+  rec->NeedRotChk() = NeedRotChk();
+  rec->Rot()=Rot();
+  rec->CropRect()=CropRect();
+
   return rec;
 
 }
 
-void ImageRecord::SetIsFullscreen(bool isFS)
+void ImageRecordVwnd::SetIsFullscreen(bool isFS)
 {
   if (isFS != m_is_fs)
   {
@@ -379,8 +375,9 @@ void ImageRecord::SetIsFullscreen(bool isFS)
 
 void ImageRecord::SetDefaultTitle()
 {
-  m_outname.Set(m_fn.get_filepart());
-  m_outname.remove_fileext();
+  WDL_FastString s(WDL_get_filepart(GetFN()));
+  s.remove_fileext();
+  SetOutName(s.Get());
 }
 
 
@@ -462,14 +459,14 @@ static WDL_VirtualIconButton_SkinConfig *GetButtonIcon(int idx, char state)
 
 
 
-INT_PTR ImageRecord::SendCommand(int command, INT_PTR parm1, INT_PTR parm2, WDL_VWnd *src)
+INT_PTR ImageRecordVwnd::SendCommand(int command, INT_PTR parm1, INT_PTR parm2, WDL_VWnd *src)
 {
   if (command == KNOB_MESSAGE) // knob
   {
     int idx=src ? src->GetID() : 0;
     if (idx>=KNOBBUTTON_BASE && idx<KNOBBUTTON_END && !strcmp(src->GetType(),"KnobButton"))
     {
-      float v = m_bchsv[idx-KNOBBUTTON_BASE]+parm1/100.0;
+      float v = m_rec->BCHSV()[idx-KNOBBUTTON_BASE]+parm1/100.0;
       float maxknob = ((KnobButton*)src)->m_knobmax;
 
       if (idx == KNOBBUTTON_H)
@@ -482,8 +479,8 @@ INT_PTR ImageRecord::SendCommand(int command, INT_PTR parm1, INT_PTR parm2, WDL_
         if (v<-maxknob) v=-maxknob;
         else if (v>maxknob) v=maxknob;
       }
-      m_bchsv[idx-KNOBBUTTON_BASE]=v;
-      m_fullimage_cachevalid&=~1;
+      m_rec->BCHSV()[idx-KNOBBUTTON_BASE]=v;
+      m_rec->m_fullimage_cachevalid&=~1;
       RequestRedraw(NULL);
       SetImageListIsDirty();
     }
@@ -497,13 +494,13 @@ INT_PTR ImageRecord::SendCommand(int command, INT_PTR parm1, INT_PTR parm2, WDL_
         if (g_edit_mode==EDIT_MODE_CROP) g_edit_mode=EDIT_MODE_NONE;
         else g_edit_mode=EDIT_MODE_CROP;
 
-        m_fullimage_cachevalid=0;
+        m_rec->m_fullimage_cachevalid=0;
         UpdateAllButtonStates(this);
       break;
 
       case BUTTONID_BW:
-        m_bw=!m_bw;
-        m_fullimage_cachevalid&=~1;
+        m_rec->BW()=!m_rec->BW();
+        m_rec->m_fullimage_cachevalid&=~1;
         UpdateButtonStates();
         RequestRedraw(NULL);
         SetImageListIsDirty();
@@ -517,8 +514,8 @@ INT_PTR ImageRecord::SendCommand(int command, INT_PTR parm1, INT_PTR parm2, WDL_
       case BUTTONID_ROTCCW:
       case BUTTONID_ROTCW:
 
-        m_rot= (m_rot+ (src->GetID() == BUTTONID_ROTCCW ? -1 : 1 ))&3;
-        m_fullimage_cachevalid=0;
+        m_rec->Rot()= (m_rec->Rot()+ (src->GetID() == BUTTONID_ROTCCW ? -1 : 1 ))&3;
+        m_rec->m_fullimage_cachevalid=0;
 
         RequestRedraw(NULL);
 
@@ -528,7 +525,7 @@ INT_PTR ImageRecord::SendCommand(int command, INT_PTR parm1, INT_PTR parm2, WDL_
         {
           if (!RemoveFullItemView())
           {
-            OpenFullItemView(this);
+            OpenFullItemView(m_rec);
           }
         }
       break;
@@ -537,18 +534,21 @@ INT_PTR ImageRecord::SendCommand(int command, INT_PTR parm1, INT_PTR parm2, WDL_
           WDL_VWnd *par = GetParent();
           if (par)
           {
-            const int fmi=this == g_fullmode_item ? g_images.Find(g_fullmode_item) : -1;
+            const int fmi=m_rec == g_fullmode_item ? ImageList_IndexOf(g_fullmode_item) : -1;
 
-            if (m_cache_has_thumbnail) g_images_cnt_indb--;
+            if (m_rec->CacheHasThumbnail()) g_images_cnt_indb--;
 
             g_images_mutex.Enter();
-            g_images.Delete(g_images.Find(this));
-            if (m_state == ImageRecord::IR_STATE_ERROR) g_images_cnt_err--;
-            else if (m_state == ImageRecord::IR_STATE_LOADED) g_images_cnt_ok--;
+            const int idx = ImageList_IndexOf(m_rec);
+            g_images.Delete(idx);
+            ImageList_Reindex(idx);
+            if (m_rec == g_fullmode_item) g_fullmode_item=0;
+            if (m_rec->State() == ImageRecord::IR_STATE_ERROR) g_images_cnt_err--;
+            else if (m_rec->State() == ImageRecord::IR_STATE_LOADED) g_images_cnt_ok--;
             g_images_mutex.Leave();
 
 
-            par->RemoveChild(this,true);
+            delete m_rec; // removes and deletes this view too
             // do nothing after this, "this" not valid anymore!
             ImageRecord *r=g_images.Get(fmi < g_images.GetSize() ? fmi : fmi-1);
             if (r) 
@@ -568,13 +568,13 @@ INT_PTR ImageRecord::SendCommand(int command, INT_PTR parm1, INT_PTR parm2, WDL_
         if (src->GetID()>=KNOBBUTTON_BASE && src->GetID()<KNOBBUTTON_END)
         {
           int w = src->GetID();
-          float v = m_bchsv[w-KNOBBUTTON_BASE];
+          float v = m_rec->BCHSV()[w-KNOBBUTTON_BASE];
           
           if (fabs(v)>KNOB_EPS)v=0.0;
           else if (w == KNOBBUTTON_S && fabs(v-(-1.0))>KNOB_EPS) v=-1.0;
 
-          m_bchsv[w-KNOBBUTTON_BASE] = v;
-          m_fullimage_cachevalid&=~1;
+          m_rec->BCHSV()[w-KNOBBUTTON_BASE] = v;
+          m_rec->m_fullimage_cachevalid&=~1;
           RequestRedraw(NULL);
           SetImageListIsDirty();
         }
@@ -585,99 +585,75 @@ INT_PTR ImageRecord::SendCommand(int command, INT_PTR parm1, INT_PTR parm2, WDL_
   return 0; // WDL_VWnd::SendCommand(command,parm1,parm2,src);
 }
 
-void ImageRecord::SetPosition(const RECT *r)
+void ImageRecordVwnd::LayoutControls(int w)
 {
-  if ((r->right-r->left) != (m_position.right-m_position.left) ||
-      (r->bottom-r->top) != (m_position.bottom-m_position.top))
+  int x;
+  int xpos = 6;
+  int toppos = 2;
+  for (x = BUTTONID_BASE; x < BUTTONID_END; x ++)
   {
-    // reposition images on size change
-    int x;
-    int xpos = 6;
-    int toppos = 2;
-    for (x = BUTTONID_BASE; x < BUTTONID_END; x ++)
+    WDL_VWnd *b = GetChildByID(x);
+    if (b)
     {
-      WDL_VWnd *b = GetChildByID(x);
-      if (b)
+      if (x==BUTTONID_REMOVE) 
       {
-        if (x==BUTTONID_REMOVE) 
-        {
-          RECT tr={r->right-r->left - 4 - BUTTON_SIZE, 2, 
-            r->right-r->left - 4 , 2+BUTTON_SIZE};
-          b->SetPosition(&tr);
-        }
-        else
+        RECT tr={w - 4 - BUTTON_SIZE, 2, 
+          w - 4 , 2+BUTTON_SIZE};
+        b->SetPosition(&tr);
+      }
+      else
+      {
+        if (xpos>6 && xpos+BUTTON_SIZE >= w - 4 - (toppos==2 ? BUTTON_SIZE-4 : 0))
         {
-          if (xpos>6 && xpos+BUTTON_SIZE >= r->right-r->left - 4 - (toppos==2 ? BUTTON_SIZE-4 : 0))
-          {
-            xpos = 2;
-            toppos += BUTTON_SIZE+2;
-          }
-          RECT tr={xpos, toppos, xpos+BUTTON_SIZE, toppos+BUTTON_SIZE};
-          b->SetPosition(&tr);
-          if (x == BUTTONID_FULLSCREEN) xpos += 8;
-          xpos += BUTTON_SIZE+2;
+          xpos = 2;
+          toppos += BUTTON_SIZE+2;
         }
+        RECT tr={xpos, toppos, xpos+BUTTON_SIZE, toppos+BUTTON_SIZE};
+        b->SetPosition(&tr);
+        if (x == BUTTONID_FULLSCREEN) xpos += 8;
+        xpos += BUTTON_SIZE+2;
       }
     }
-    toppos += BUTTON_SIZE+2;
-    xpos = 6+BUTTON_SIZE+2+8; 
+  }
+  toppos += BUTTON_SIZE+2;
+  xpos = 6+BUTTON_SIZE+2+8; 
 
-    int cw=(KNOBBUTTON_END-KNOBBUTTON_BASE)*(BUTTON_SIZE+2)-2;
-    if (xpos + cw >= r->right-r->left)
-      xpos=r->right-r->left-cw;
-        
-    if (xpos<0)xpos=0;
-    for (x=KNOBBUTTON_BASE;x<KNOBBUTTON_END;x++)
+  int cw=(KNOBBUTTON_END-KNOBBUTTON_BASE)*(BUTTON_SIZE+2)-2;
+  if (xpos + cw >= w)
+    xpos=w-cw;
+      
+  if (xpos<0)xpos=0;
+  for (x=KNOBBUTTON_BASE;x<KNOBBUTTON_END;x++)
+  {
+    WDL_VWnd *b = GetChildByID(x);
+    if (b)
     {
-      WDL_VWnd *b = GetChildByID(x);
-      if (b)
-      {
-        RECT tr={xpos,toppos,xpos+BUTTON_SIZE,toppos+BUTTON_SIZE};
-        b->SetPosition(&tr);
-        xpos+=BUTTON_SIZE+2;
-      }
+      RECT tr={xpos,toppos,xpos+BUTTON_SIZE,toppos+BUTTON_SIZE};
+      b->SetPosition(&tr);
+      xpos+=BUTTON_SIZE+2;
     }
   }
-
-  WDL_VWnd::SetPosition(r);
 }
 
-static void BWfunc(LICE_pixel *p, void *parm)
+void ImageRecordVwnd::SetPosition(const RECT *r)
 {
-  LICE_pixel pix=*p;
-  unsigned char s = (LICE_GETR(pix)+LICE_GETG(pix)+LICE_GETB(pix))/3;
-  *p = LICE_RGBA(s,s,s,LICE_GETA(pix));
-}
-
-static void BCfunc(LICE_pixel *p, void *parm)
-{
-  unsigned char *tab = (unsigned char *)parm;
-  LICE_pixel_chan *pp = (LICE_pixel_chan*)p;
-  pp[LICE_PIXEL_R] = tab[pp[LICE_PIXEL_R]];
-  pp[LICE_PIXEL_G] = tab[pp[LICE_PIXEL_G]];
-  pp[LICE_PIXEL_B] = tab[pp[LICE_PIXEL_B]];
-  
-}
+  // reposition buttons on size change
+  if ((r->right-r->left) != (m_position.right-m_position.left))
+    LayoutControls(r->right-r->left);
 
-static void BCBWfunc(LICE_pixel *p, void *parm)
-{
-  unsigned char *tab = (unsigned char *)parm;
-  LICE_pixel pix=*p;
-  unsigned char s = tab[(LICE_GETR(pix)+LICE_GETG(pix)+LICE_GETB(pix))/3];
-  *p = LICE_RGBA(s,s,s,LICE_GETA(pix));  
+  WDL_VWnd::SetPosition(r);
 }
 
-
 bool ImageRecord::SetCropRectFromScreen(int w, int h, const RECT *cr)
 {
   if (w<1) w=1;
   if (h<1) h=1;
 
-  int sw=m_srcimage_w;
-  int sh=m_srcimage_h;
+  int sw=SrcImageW();
+  int sh=SrcImageH();
   RECT tr;
 
-  switch (m_rot & 3)
+  switch (Rot() & 3)
   {
     case 0:
       tr.left = (cr->left * (double)sw) / w + 0.5;
@@ -710,9 +686,9 @@ bool ImageRecord::SetCropRectFromScreen(int w, int h, const RECT *cr)
   if (tr.top<0) tr.top=0; else if (tr.top > sh) tr.top = sh;
   if (tr.bottom<0) tr.bottom=0; else if (tr.bottom > sh) tr.bottom = sh;
 
-  if (memcmp(&tr,&m_croprect,sizeof(RECT)))
+  if (memcmp(&tr,&CropRect(),sizeof(RECT)))
   {
-    m_croprect = tr;
+    CropRect() = tr;
     return true;
   }
   return false;
@@ -721,22 +697,22 @@ bool ImageRecord::SetCropRectFromScreen(int w, int h, const RECT *cr)
 
 void ImageRecord::GetCropRectForScreen(int w, int h, RECT *cr)
 {
-  RECT inrect = m_croprect;
+  RECT inrect = CropRect();
   if (inrect.left >= inrect.right)
   {
-    inrect.right = m_srcimage_w;
+    inrect.right = SrcImageW();
     if (inrect.left >= inrect.right) inrect.left=0;
   }
   if (inrect.top >= inrect.bottom)
   {
-    inrect.bottom =m_srcimage_h;
+    inrect.bottom =SrcImageH();
     if (inrect.top >= inrect.bottom) inrect.top=0;
   }
 
   // rotate
-  int sw=max(m_srcimage_w,1);
-  int sh=max(m_srcimage_h,1);
-  switch  (m_rot&3)
+  int sw=max(SrcImageW(),1);
+  int sh=max(SrcImageH(),1);
+  switch  (Rot()&3)
   {
     case 0: 
       cr->left = (inrect.left * (double)w) / sw + 0.5;
@@ -785,7 +761,7 @@ enum
 };
 
 
-bool ImageRecord::GetToolTipString(int xpos, int ypos, char *bufOut, int bufOutSz)
+bool ImageRecordVwnd::GetToolTipString(int xpos, int ypos, char *bufOut, int bufOutSz)
 {
   if (WDL_VWnd::GetToolTipString(xpos,ypos,bufOut,bufOutSz)) return true;
 
@@ -809,7 +785,7 @@ bool ImageRecord::GetToolTipString(int xpos, int ypos, char *bufOut, int bufOutS
           WDL_FastString s;
           s.Set(g_edit_mode==EDIT_MODE_CROP ? "Leave crop mode" : "Crop");
           char buf[512];
-          GetSizeInfoString(buf,sizeof(buf));
+          m_rec->GetSizeInfoString(buf,sizeof(buf));
           s.Append(" [image: ");
           s.Append(buf);
           s.Append("]");
@@ -817,7 +793,7 @@ bool ImageRecord::GetToolTipString(int xpos, int ypos, char *bufOut, int bufOutS
         }
       return true;
       case BUTTONID_BW:
-        lstrcpyn(bufOut,m_bw? "Black and white" : "Click to set black and white",bufOutSz);
+        lstrcpyn(bufOut,m_rec->BW()? "Black and white" : "Click to set black and white",bufOutSz);
       return true;
       case BUTTONID_COLORCORRECTION:
         lstrcpyn(bufOut,g_edit_mode==EDIT_MODE_BCHSV? "Leave BC/HSV adjust mode" : "BC/HSV adjust mode",bufOutSz);
@@ -833,8 +809,8 @@ bool ImageRecord::GetToolTipString(int xpos, int ypos, char *bufOut, int bufOutS
         {
           char buf[512];
           sprintf(buf,"%s: %s%.2f",knob_labels[idx-KNOBBUTTON_BASE],
-            m_bchsv[idx-KNOBBUTTON_BASE]>=0?"+":"",
-            m_bchsv[idx-KNOBBUTTON_BASE]);
+            m_rec->BCHSV()[idx-KNOBBUTTON_BASE]>=0?"+":"",
+            m_rec->BCHSV()[idx-KNOBBUTTON_BASE]);
           lstrcpyn(bufOut,buf,bufOutSz);
         }
       return true;
@@ -847,9 +823,9 @@ bool ImageRecord::GetToolTipString(int xpos, int ypos, char *bufOut, int bufOutS
     {
       WDL_FastString tmp;
       char buf[512];
-      GetSizeInfoString(buf,sizeof(buf));
-      tmp.SetFormatted(1024,"Image #%d/%d [%s], source filename:",g_images.Find(this)+1,g_images.GetSize(),buf);
-      tmp.Append(m_fn.Get());
+      m_rec->GetSizeInfoString(buf,sizeof(buf));
+      tmp.SetFormatted(1024,"Image #%d/%d [%s], source filename:",ImageList_IndexOf(m_rec)+1,g_images.GetSize(),buf);
+      tmp.Append(m_rec->GetFN());
       lstrcpyn(bufOut,tmp.Get(),bufOutSz);
       return true;
     }
@@ -858,7 +834,7 @@ bool ImageRecord::GetToolTipString(int xpos, int ypos, char *bufOut, int bufOutS
   return false;
 }
 
-int ImageRecord::UpdateCursor(int xpos, int ypos)
+int ImageRecordVwnd::UpdateCursor(int xpos, int ypos)
 {
   int r = WDL_VWnd::UpdateCursor(xpos,ypos);
 
@@ -907,19 +883,19 @@ int ImageRecord::UpdateCursor(int xpos, int ypos)
   return -1;
 }
 
-bool ImageRecord::OnMouseDblClick(int xpos, int ypos)
+bool ImageRecordVwnd::OnMouseDblClick(int xpos, int ypos)
 {
   if (WDL_VWnd::OnMouseDblClick(xpos,ypos)) return true;
 
   if (!RemoveFullItemView())
   {
-    OpenFullItemView(this);
+    OpenFullItemView(m_rec);
   }
 
   return true;
 }
 
-int ImageRecord::OnMouseDown(int xpos, int ypos)
+int ImageRecordVwnd::OnMouseDown(int xpos, int ypos)
 {
   int a = WDL_VWnd::OnMouseDown(xpos,ypos);
   if (!a)
@@ -927,7 +903,7 @@ int ImageRecord::OnMouseDown(int xpos, int ypos)
     POINT p ={xpos,ypos};
     if (PtInRect(&m_lastlbl_rect,p))
     {
-      EditImageLabel(this);
+      EditImageLabel(m_rec);
       
       return 1;
     }
@@ -940,8 +916,8 @@ int ImageRecord::OnMouseDown(int xpos, int ypos)
       m_captureidx= LOCAL_CAP_TRANSFORM;
 
       int capcnt = 0;
-      double wscale = (m_last_drawrect.right-m_last_drawrect.left) / (double) m_srcimage_w;
-      double hscale = (m_last_drawrect.bottom-m_last_drawrect.top) / (double) m_srcimage_h;
+      double wscale = (m_last_drawrect.right-m_last_drawrect.left) / (double) m_rec->SrcImageW();
+      double hscale = (m_last_drawrect.bottom-m_last_drawrect.top) / (double) m_rec->SrcImageH();
       int i;
 
       for(i=0;i<m_transform.GetSize();i++)
@@ -1085,7 +1061,7 @@ int ImageRecord::OnMouseDown(int xpos, int ypos)
               t->cap_offs[0].x=t->cap_offs[0].y=0;
             }
 
-            m_fullimage_cachevalid=0;
+            m_rec->m_fullimage_cachevalid=0;
           }
 
         }
@@ -1135,7 +1111,7 @@ int ImageRecord::OnMouseDown(int xpos, int ypos)
   return a;
 }
 
-int ImageRecord::UserIsDraggingImageToPosition(int *typeOut)
+int ImageRecordVwnd::UserIsDraggingImageToPosition(int *typeOut)
 {
   if (!m_is_fs && m_captureidx==LOCAL_CAP_DRAGIMAGE)
   {
@@ -1146,15 +1122,15 @@ int ImageRecord::UserIsDraggingImageToPosition(int *typeOut)
   return -1;
 }
 
-void ImageRecord::OnMouseMove(int xpos, int ypos)
+void ImageRecordVwnd::OnMouseMove(int xpos, int ypos)
 {
   switch (m_captureidx)
   {
     case LOCAL_CAP_TRANSFORM:
 #ifdef ENABLE_FUN_TRANSFORM_TEST
       {
-        double uwscale = m_srcimage_w / (double) (m_last_drawrect.right-m_last_drawrect.left);
-        double uhscale = m_srcimage_h / (double) (m_last_drawrect.bottom-m_last_drawrect.top);
+        double uwscale = m_rec->SrcImageW() / (double) (m_last_drawrect.right-m_last_drawrect.left);
+        double uhscale = m_rec->SrcImageH() / (double) (m_last_drawrect.bottom-m_last_drawrect.top);
         int cnt=0,i;
         for(i=0;i<m_transform.GetSize();i++)
         {
@@ -1172,7 +1148,7 @@ void ImageRecord::OnMouseMove(int xpos, int ypos)
         }
         if (cnt)
         {
-          m_fullimage_cachevalid=0;
+          m_rec->m_fullimage_cachevalid=0;
           RequestRedraw(NULL);
         }
       }
@@ -1194,21 +1170,7 @@ void ImageRecord::OnMouseMove(int xpos, int ypos)
           if (p.y < r.top || p.y > r.bottom)
             SetMainScrollPosition(p.y > r.bottom ? 0.3 : -0.3,2);
         }
-        int newidx= GetNearestVWndToPoint(GetParent(),xpos+m_position.left,ypos+m_position.top);
-        if (newidx>=0)
-        {
-          WDL_VWnd *vw = GetParent()->EnumChildren(newidx);
-          if (vw)
-          {
-            if (vw==this) newidx=-1;
-            else
-            {
-              RECT r;
-              vw->GetPosition(&r);
-              if (xpos+m_position.left >= r.left+(r.right-r.left)/2) newidx++;
-            }
-          }
-        }
+        int newidx= GetDragInsertIndex(m_rec,xpos+m_position.left,ypos+m_position.top);
 
         if (newidx!=m_capture_state)
         {
@@ -1221,7 +1183,7 @@ void ImageRecord::OnMouseMove(int xpos, int ypos)
       if (m_capture_state)
       {
         RECT r;
-        GetCropRectForScreen(m_last_drawrect.right-m_last_drawrect.left,m_last_drawrect.bottom-m_last_drawrect.top,&r);
+        m_rec->GetCropRectForScreen(m_last_drawrect.right-m_last_drawrect.left,m_last_drawrect.bottom-m_last_drawrect.top,&r);
 
 
         if (m_capture_state==0xf) // move all
@@ -1246,7 +1208,7 @@ void ImageRecord::OnMouseMove(int xpos, int ypos)
           if (m_capture_state&2) r.top = ypos - m_crop_capmode_lastpos.y - m_last_drawrect.top;
           if (m_capture_state&8) r.bottom = ypos - m_crop_capmode_lastpos.y - m_last_drawrect.top;
         }
-        if (SetCropRectFromScreen(m_last_drawrect.right-m_last_drawrect.left,m_last_drawrect.bottom-m_last_drawrect.top,&r))
+        if (m_rec->SetCropRectFromScreen(m_last_drawrect.right-m_last_drawrect.left,m_last_drawrect.bottom-m_last_drawrect.top,&r))
         {
           RequestRedraw(NULL);
           SetImageListIsDirty();
@@ -1258,7 +1220,7 @@ void ImageRecord::OnMouseMove(int xpos, int ypos)
   WDL_VWnd::OnMouseMove(xpos,ypos);
 }
 
-void ImageRecord::OnMouseUp(int xpos, int ypos)
+void ImageRecordVwnd::OnMouseUp(int xpos, int ypos)
 {
   switch (m_captureidx)
   {
@@ -1278,45 +1240,29 @@ void ImageRecord::OnMouseUp(int xpos, int ypos)
       m_capture_state=-1;
       if (!m_is_fs && GetParent()) 
       {
-        int newidx= GetNearestVWndToPoint(GetParent(),xpos+m_position.left,ypos+m_position.top);
-        if (newidx>=0)
-        {
-          WDL_VWnd *vw = GetParent()->EnumChildren(newidx);
-          if (vw)
-          {
-            if (vw==this) newidx=-1;
-            else
-            { 
-              RECT r;
-              vw->GetPosition(&r);
-              if (xpos+m_position.left >= r.left+(r.right-r.left)/2) newidx++;
-            }
-          }
-        }
+        int newidx= GetDragInsertIndex(m_rec,xpos+m_position.left,ypos+m_position.top);
 
         bool didmove=false;
         if (newidx>=0)
         {
           // reorder self to newidx
-          int idx=g_images.Find(this);
+          int idx=ImageList_IndexOf(m_rec);
           bool doCopy = !!(GetAsyncKeyState(VK_CONTROL)&0x8000);
           if (newidx!=idx||doCopy)
           {
             ImageRecord *newrec=NULL;
             if (doCopy)
             {
-              newrec = Duplicate();
+              newrec = m_rec->Duplicate();
               AddImageRec(newrec,newidx);
             }
             else
             {
               if (newidx>idx) newidx--;
-              WDL_VWnd *par=GetParent();
-              par->RemoveChild(this,false);
-              par->AddChild(this,newidx);
               g_images_mutex.Enter();
               g_images.Delete(idx);
-              g_images.Insert(newidx,this);
+              g_images.Insert(newidx,m_rec);
+              ImageList_Reindex(min(idx,newidx));
               g_images_mutex.Leave();
             }
 
@@ -1324,7 +1270,7 @@ void ImageRecord::OnMouseUp(int xpos, int ypos)
             SetImageListIsDirty(true);
 
             UpdateMainWindowWithSizeChanged();
-            EnsureImageRecVisible(newrec ? newrec : this);
+            EnsureImageRecVisible(newrec ? newrec : m_rec);
             didmove=true;
           }
         }
@@ -1337,90 +1283,30 @@ void ImageRecord::OnMouseUp(int xpos, int ypos)
 }
 
 
+bool ImageRecord::PrepareOutput(RenderRecipe *recipe, LICE_IBitmap *srcimage, int max_w, int max_h, int *w, int *h)
+{
+  return srcimage && recipe->Compile(this,srcimage) && recipe->GetOutputSize(max_w,max_h,w,h);
+}
+
 bool ImageRecord::ProcessImageToBitmap(LICE_IBitmap *srcimage, LICE_IBitmap *destimage, int max_w, int max_h)
 {
   if (!srcimage || !destimage) return false;
 
-  LICE_SubBitmap subbm(srcimage, m_croprect.left,m_croprect.top,m_croprect.right-m_croprect.left,m_croprect.bottom-m_croprect.top); 
-  if (m_croprect.right-m_croprect.left>0&&m_croprect.bottom-m_croprect.top>0)
-  {
-    if (subbm.getWidth()<1||subbm.getHeight()<1) return false; // this would catch if it exceeds the bounds of the image, perhaps?
-    srcimage=&subbm;
-  }
-
-  int srcw=srcimage->getWidth();
-  int srch=srcimage->getHeight();
-
-
-  int rot = m_rot&3;
-  if (rot&1)
-  {
-    int a= srcw;
-    srcw=srch;
-    srch=a;
-  }
-
-  double out_w = srcw;
-  double out_h = srch;
-  if (max_w && out_w > max_w) 
-  {
-    out_h = (out_h * max_w) / out_w;
-    out_w = max_w;
-  }
-  if (max_h && out_h > max_h)
-  {
-    out_w = (out_w * max_h) / out_h;
-    out_h = max_h;
-  }
-
-  int w = (int) (out_w+0.5);
-  int h = (int) (out_h+0.5);
-
-  if (w<1 || h < 1) return false;
+  RenderRecipe recipe;
+  int w, h;
+  if (!PrepareOutput(&recipe,srcimage,max_w,max_h,&w,&h)) return false;
 
   destimage->resize(w,h);
+  if (destimage->getWidth() != w || destimage->getHeight() != h) return false;
 
-  // todo: better filtering perhaps? this is used for final image generation ,bleh
-
-  if (!rot) LICE_ScaledBlit(destimage,srcimage,0,0,w,h,0,0,srcimage->getWidth(),srcimage->getHeight(),1.0f,LICE_BLIT_MODE_COPY|LICE_BLIT_FILTER_BILINEAR);
-  else
-  {
-
-    double dsdx=0, dsdy=0,dtdx=0,dtdy=0;
-
-    int sx = rot != 1 ? srcimage->getWidth() - 1 : 0;
-    int sy = rot != 3 ? srcimage->getHeight() - 1 : 0;
-
-    if (rot!=2)
-    {
-      dtdx = srcimage->getHeight() / (double) w;
-      dsdy = srcimage->getWidth() / (double) h;
-      if (rot==1) dtdx=-dtdx;
-      else dsdy=-dsdy;
-    }
-    else // flip
-    {
-      dsdx=-srcimage->getWidth() / (double) w;
-      dtdy=-srcimage->getHeight() / (double) h;
-    }
-
-    LICE_DeltaBlit(destimage,srcimage,0,0,w,h,
-              sx,sy, // start x,y
-          srcimage->getWidth(),srcimage->getHeight(),
-            dsdx, dtdx,
-            dsdy, dtdy,
-            0,0,false,1.0f,LICE_BLIT_MODE_COPY|LICE_BLIT_FILTER_BILINEAR);
-
-  }
-
-  ProcessRect(destimage,0,0,w,h);
-
+  // final image generation: lanczos3 with the rotation and adjustments done in the same pass
+  if (!recipe.Render(destimage,0,0,w,h,RenderRecipe::STAGE_ALL,LICE_RESAMPLE_LANCZOS3)) return false;
 
   return true;
 }
 
 
-void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT *cliprect)
+void ImageRecordVwnd::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT *cliprect)
 {
   if (!g_imagerecord_font.GetHFont())
   {
@@ -1456,42 +1342,17 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
   g_imagerecord_font.SetTextColor(LICE_RGBA(255,255,255,0));
   g_imagerecord_font.SetEffectColor(LICE_RGBA(0,0,0,0));
 
-  const bool usedFullImage=!!m_fullimage;
-
-//  WDL_MutexLock tmp(usedFullImage ? &g_images_mutex : NULL);
-  LICE_IBitmap *srcimage = usedFullImage ? m_fullimage : m_preview_image;
+  // best level of the pyramid so far, the decode threads reset m_fullimage_cachevalid when a better one arrives
+  LICE_IBitmap *srcimage = m_rec->GetBestImage();
+  const bool usedFullImage = srcimage && srcimage != m_rec->m_preview_image;
+  if (srcimage) BitmapCache_Touch(m_rec);
   if (srcimage)
   {
-    int cropw=0,croph=0,cropl=0,cropt=0;
-
-    if (g_edit_mode!=EDIT_MODE_CROP && m_croprect.right > m_croprect.left && m_croprect.bottom > m_croprect.top)
-    {
-      // scale coordinates to match this image
-
-      cropl = (m_croprect.left * srcimage->getWidth()) / max(m_srcimage_w,1);
-      cropt = (m_croprect.top * srcimage->getHeight()) / max(m_srcimage_h,1);
-      cropw = ((m_croprect.right * srcimage->getWidth()) / max(m_srcimage_w,1)) - cropl;
-      croph = ((m_croprect.bottom * srcimage->getHeight()) / max(m_srcimage_h,1)) - cropt;
-
-      if (cropw < 1) cropw=1;
-      if (croph < 1) croph=1;
-
-    }
-
-    LICE_SubBitmap subbm(srcimage, cropl,cropt,cropw,croph); //unused if not cropping
-    if (cropw>0&&croph>0)srcimage=&subbm;
-
-    int srcw=srcimage->getWidth();
-    int srch=srcimage->getHeight();
-
+    RenderRecipe recipe;
+    recipe.Compile(m_rec,srcimage,g_edit_mode!=EDIT_MODE_CROP);
 
-    int rot = m_rot&3;
-    if (rot&1)
-    {
-      int a= srcw;
-      srcw=srch;
-      srch=a;
-    }
+    int srcw=recipe.GetWidth();
+    int srch=recipe.GetHeight();
 
     int destw = r.right-r.left-4;
     int desth = r.bottom-r.top-4;
@@ -1521,17 +1382,17 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
     {
       g_edit_mode=EDIT_MODE_TRANSFORM;
       UpdateButtonStates();
-      m_transform.Add(new TransformTriangle(0,0,      m_srcimage_w,0,0,m_srcimage_h));
-      m_transform.Add(new TransformTriangle(m_srcimage_w,m_srcimage_h,m_srcimage_w,0,0,m_srcimage_h));
+      m_transform.Add(new TransformTriangle(0,0,      m_rec->SrcImageW(),0,0,m_rec->SrcImageH()));
+      m_transform.Add(new TransformTriangle(m_rec->SrcImageW(),m_rec->SrcImageH(),m_rec->SrcImageW(),0,0,m_rec->SrcImageH()));
     }
 #endif
 
-    // todo: cache scaled/rotated version in global cache if srcimage == m_fullimage?
+    // todo: cache scaled/rotated version in global cache if srcimage is a pyramid level?
 
     LICE_IBitmap *cacheSrc=NULL;
     if (usedFullImage &&
-        m_fullimage_cachevalid==3 &&
-        (cacheSrc = m_fullimage_final?m_fullimage_final:m_fullimage_scaled) &&
+        m_rec->m_fullimage_cachevalid==3 &&
+        (cacheSrc = m_rec->m_fullimage_final?m_rec->m_fullimage_final:m_rec->m_fullimage_scaled) &&
         cacheSrc->getWidth() == w && 
         cacheSrc->getHeight() == h)
     {
@@ -1540,10 +1401,10 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
     else
     {
       if (!usedFullImage || 
-          !m_fullimage_scaled || 
-          !(m_fullimage_cachevalid&2) || 
-          m_fullimage_scaled->getWidth()!=w||
-          m_fullimage_scaled->getHeight()!=h)
+          !m_rec->m_fullimage_scaled || 
+          !(m_rec->m_fullimage_cachevalid&2) || 
+          m_rec->m_fullimage_scaled->getWidth()!=w||
+          m_rec->m_fullimage_scaled->getHeight()!=h)
       {
   #ifdef ENABLE_FUN_TRANSFORM_TEST
         if (m_transform.GetSize())
@@ -1552,13 +1413,15 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
           cam.WantZBuffer=false;
           cam.Begin(drawbm);
 
-          double xsc = w / (double)m_srcimage_w;
-          double ysc = h / (double)m_srcimage_h;
-          double wsc = 1.0 / (double)m_srcimage_w;
-          double hsc = 1.0 / (double)m_srcimage_h;
+          double xsc = w / (double)m_rec->SrcImageW();
+          double ysc = h / (double)m_rec->SrcImageH();
+          double wsc = 1.0 / (double)m_rec->SrcImageW();
+          double hsc = 1.0 / (double)m_rec->SrcImageH();
           pl_Mat mat;
           mat.SolidOpacity=0.0;
-          mat.Texture = srcimage;
+          LICE_SubBitmap cropbm(srcimage,recipe.GetCrop()->left,recipe.GetCrop()->top,
+                                recipe.GetCrop()->right-recipe.GetCrop()->left,recipe.GetCrop()->bottom-recipe.GetCrop()->top);
+          mat.Texture = &cropbm;
           mat.TexCombineMode=LICE_BLIT_MODE_COPY|LICE_BLIT_FILTER_BILINEAR;
 
           pl_Face tmp;
@@ -1590,82 +1453,66 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
         }
         else 
   #endif  
-        if (!rot)
-          LICE_ScaledBlit(drawbm,srcimage,xoffs,yoffs,w,h,0,0,srcimage->getWidth(),srcimage->getHeight(),1.0f,LICE_BLIT_MODE_COPY|LICE_BLIT_FILTER_BILINEAR);
+        if (usedFullImage) 
+        {
+          // geometry is kept in m_fullimage_scaled so slider moves only redo the adjust stage
+          m_rec->m_fullimage_cachevalid|=2;
+          BitmapCache_Remove(m_rec,BMCACHE_SCALED,m_rec->m_fullimage_scaled);
+          if (!m_rec->m_fullimage_scaled) m_rec->m_fullimage_scaled = new LICE_MemBitmap;
+          m_rec->m_fullimage_scaled->resize(w,h);
+          BitmapCache_Add(m_rec,BMCACHE_SCALED,m_rec->m_fullimage_scaled);
+          recipe.Render(m_rec->m_fullimage_scaled,0,0,w,h,RenderRecipe::STAGE_GEOMETRY,LICE_RESAMPLE_MITCHELL);
+          recipe.RenderFromGeometry(drawbm,xoffs,yoffs,m_rec->m_fullimage_scaled);
+        }
         else
         {
-
-          double dsdx=0, dsdy=0,dtdx=0,dtdy=0;
-
-          int sx = rot != 1 ? srcimage->getWidth() - 1 : 0;
-          int sy = rot != 3 ? srcimage->getHeight() - 1 : 0;
-
-          if (rot!=2)
+          // grid thumbnails are retained at the tile size, so a scroll is only a blit
+          RECT slot;
+          bool needRender = false;
+          LICE_IBitmap *page = m_is_fs ? NULL : ThumbAtlas_GetTile(m_rec,recipe.GetHash(),w,h,&slot,&needRender);
+          if (page)
           {
-            dtdx = srcimage->getHeight() / (double) w;
-            dsdy = srcimage->getWidth() / (double) h;
-            if (rot==1) dtdx=-dtdx;
-            else dsdy=-dsdy;
+            if (needRender) recipe.Render(page,slot.left,slot.top,w,h,RenderRecipe::STAGE_ALL,LICE_RESAMPLE_MITCHELL);
+            LICE_Blit(drawbm,page,xoffs,yoffs,slot.left,slot.top,w,h,1.0f,LICE_BLIT_MODE_COPY);
           }
-          else // flip
-          {
-            dsdx=-srcimage->getWidth() / (double) w;
-            dtdy=-srcimage->getHeight() / (double) h;
-          }
-
-          LICE_DeltaBlit(drawbm,srcimage,xoffs,yoffs,w,h,
-                    sx,sy, // start x,y
-                srcimage->getWidth(),srcimage->getHeight(),
-                  dsdx, dtdx,
-                  dsdy, dtdy,
-                  0,0,false,1.0f,LICE_BLIT_MODE_COPY|LICE_BLIT_FILTER_BILINEAR);
-
-        }
-
-        if (usedFullImage)
-        {
-          m_fullimage_cachevalid|=2;
-          g_ram_use_fullscaled -= get_lice_bitmap_size(m_fullimage_scaled);
-          if (!m_fullimage_scaled) m_fullimage_scaled = new LICE_MemBitmap;
-          m_fullimage_scaled->resize(w,h);
-          g_ram_use_fullscaled += get_lice_bitmap_size(m_fullimage_scaled);
-          LICE_Blit(m_fullimage_scaled, drawbm, 0, 0, xoffs, yoffs, w, h, 1.0f, LICE_BLIT_MODE_COPY);
+          else
+            recipe.Render(drawbm,xoffs,yoffs,w,h,RenderRecipe::STAGE_ALL,RenderRecipe::FILTER_BILINEAR);
         }
       } // end of scaling process
       else
       {
-        LICE_Blit(drawbm,m_fullimage_scaled,xoffs,yoffs,0,0,w,h,1.0f,LICE_BLIT_MODE_COPY);
+        recipe.RenderFromGeometry(drawbm,xoffs,yoffs,m_rec->m_fullimage_scaled);
       }
 
-      bool didProcess = ProcessRect(drawbm,xoffs,yoffs,w,h);
+      const bool didProcess = recipe.HasAdjust();
 
       if (usedFullImage)
       {
-        m_fullimage_cachevalid=3;
+        m_rec->m_fullimage_cachevalid=3;
         if (didProcess)
         {
-          g_ram_use_fullfinal -= get_lice_bitmap_size(m_fullimage_final);
-          if (!m_fullimage_final) m_fullimage_final = new LICE_MemBitmap;
-          m_fullimage_final->resize(w,h);
-          g_ram_use_fullfinal += get_lice_bitmap_size(m_fullimage_final);
-          LICE_Blit(m_fullimage_final, drawbm, 0, 0, xoffs, yoffs, w, h, 1.0f, LICE_BLIT_MODE_COPY);
+          BitmapCache_Remove(m_rec,BMCACHE_FINAL,m_rec->m_fullimage_final);
+          if (!m_rec->m_fullimage_final) m_rec->m_fullimage_final = new LICE_MemBitmap;
+          m_rec->m_fullimage_final->resize(w,h);
+          BitmapCache_Add(m_rec,BMCACHE_FINAL,m_rec->m_fullimage_final);
+          LICE_Blit(m_rec->m_fullimage_final, drawbm, 0, 0, xoffs, yoffs, w, h, 1.0f, LICE_BLIT_MODE_COPY);
         }
         else
         {
-          g_ram_use_fullfinal -= get_lice_bitmap_size(m_fullimage_final);
-          delete m_fullimage_final;
-          m_fullimage_final=0;
+          BitmapCache_Remove(m_rec,BMCACHE_FINAL,m_rec->m_fullimage_final);
+          delete m_rec->m_fullimage_final;
+          m_rec->m_fullimage_final=0;
         }
       }
       else
       {
-        g_ram_use_fullscaled -= get_lice_bitmap_size(m_fullimage_scaled);
-        g_ram_use_fullfinal -= get_lice_bitmap_size(m_fullimage_final);
-        m_fullimage_cachevalid = 0;
-        delete m_fullimage_scaled;
-        m_fullimage_scaled=0;
-        delete m_fullimage_final;
-        m_fullimage_final=0;
+        BitmapCache_Remove(m_rec,BMCACHE_SCALED,m_rec->m_fullimage_scaled);
+        BitmapCache_Remove(m_rec,BMCACHE_FINAL,m_rec->m_fullimage_final);
+        m_rec->m_fullimage_cachevalid = 0;
+        delete m_rec->m_fullimage_scaled;
+        m_rec->m_fullimage_scaled=0;
+        delete m_rec->m_fullimage_final;
+        m_rec->m_fullimage_final=0;
       }
 
     }
@@ -1679,8 +1526,8 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
       float al = 0.5;
       int mode=LICE_BLIT_MODE_COPY;
       bool aa=true;
-      double wscale = w / (double) m_srcimage_w;
-      double hscale = h / (double) m_srcimage_h;
+      double wscale = w / (double) m_rec->SrcImageW();
+      double hscale = h / (double) m_rec->SrcImageH();
       double cr=TRANSFORM_PT_RADIUS;
 
       if (g_edit_mode!=EDIT_MODE_CROP) for(x=0;x<m_transform.GetSize();x++)
@@ -1719,7 +1566,7 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
     {
 
       RECT cr;
-      GetCropRectForScreen(w,h,&cr);
+      m_rec->GetCropRectForScreen(w,h,&cr);
 
       cr.left += xoffs;
       cr.right += xoffs;
@@ -1754,12 +1601,12 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
       g_imagerecord_font.SetCombineMode(LICE_BLIT_MODE_COPY,1.0f);
 
       {
-        int w=m_croprect.right-m_croprect.left;
-        int h=m_croprect.bottom-m_croprect.top;
-        if (w<1) w= m_srcimage_w;
-        if (h<1) h=m_srcimage_h;
+        int w=m_rec->CropRect().right-m_rec->CropRect().left;
+        int h=m_rec->CropRect().bottom-m_rec->CropRect().top;
+        if (w<1) w= m_rec->SrcImageW();
+        if (h<1) h=m_rec->SrcImageH();
 
-        if (m_rot&1) 
+        if (m_rec->Rot()&1) 
         {
           int a=w;
           w=h;
@@ -1804,15 +1651,15 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
 
   }
 
-  if (m_state != IR_STATE_LOADED && !srcimage)
+  if (m_rec->State() != ImageRecord::IR_STATE_LOADED && !srcimage)
   {
     const char *str= "ERROR";
-    switch (m_state)
+    switch (m_rec->State())
     {
-      case IR_STATE_NEEDLOAD:
+      case ImageRecord::IR_STATE_NEEDLOAD:
         str="loading";
       break;
-      case IR_STATE_DECODING:
+      case ImageRecord::IR_STATE_DECODING:
         str="decoding";
       break;
     }
@@ -1828,7 +1675,7 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
   g_imagerecord_font.SetCombineMode(LICE_BLIT_MODE_COPY,0.5f);
 
   RECT tr={0,};
-  g_imagerecord_font.DrawText(drawbm,m_outname.Get(),-1,&tr,DT_CALCRECT|DT_SINGLELINE);
+  g_imagerecord_font.DrawText(drawbm,m_rec->GetOutName(),-1,&tr,DT_CALCRECT|DT_SINGLELINE);
 
   if (tr.right-tr.left<8) tr.right=tr.left+8;
   if (tr.right-tr.left > r.right-r.left) tr.right=r.left + (r.right-r.left);
@@ -1838,7 +1685,7 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
   tr.left += xp;
   tr.right += xp;
 
-  g_imagerecord_font.DrawText(drawbm,m_outname.Get(),-1,&tr,DT_CENTER|DT_SINGLELINE);
+  g_imagerecord_font.DrawText(drawbm,m_rec->GetOutName(),-1,&tr,DT_CENTER|DT_SINGLELINE);
 
   tr.left-=origin_x + m_position.left;
   tr.right-=origin_x + m_position.left;
@@ -1865,8 +1712,8 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
         {
           char buf[512];
           sprintf(buf,"%s: %s%.2f",knob_labels[idx-KNOBBUTTON_BASE],
-            m_bchsv[idx-KNOBBUTTON_BASE]>=0?"+":"",
-            m_bchsv[idx-KNOBBUTTON_BASE]);
+            m_rec->BCHSV()[idx-KNOBBUTTON_BASE]>=0?"+":"",
+            m_rec->BCHSV()[idx-KNOBBUTTON_BASE]);
 
           RECT r={
             origin_x+m_position.left+r1.left,
@@ -1899,14 +1746,14 @@ void ImageRecord::OnPaint(LICE_IBitmap *drawbm, int origin_x, int origin_y, RECT
 void ImageRecord::GetSizeInfoString(char *buf, int bufsz) // WxH or WxH cropped to WxH
 {
   char str[1024];
-  int w=m_croprect.right-m_croprect.left;
-  int h=m_croprect.bottom-m_croprect.top;
-  int srcw=m_srcimage_w;
-  int srch=m_srcimage_h;
+  int w=CropRect().right-CropRect().left;
+  int h=CropRect().bottom-CropRect().top;
+  int srcw=SrcImageW();
+  int srch=SrcImageH();
   if (w<1) w=srcw;
   if (h<1) h=srch;
 
-  if (m_rot&1)
+  if (Rot()&1)
   {
     int a=w; w=h; h=a;
     a=srcw; srcw=srch; srch=a;
@@ -1918,42 +1765,3 @@ void ImageRecord::GetSizeInfoString(char *buf, int bufsz) // WxH or WxH cropped
   lstrcpyn(buf,str,bufsz);
 }
 
-bool ImageRecord::ProcessRect(LICE_IBitmap *destimage, int x, int y, int w, int h)
-{
-
-  bool hsvmode = fabs(m_bchsv[2])>=KNOB_EPS || fabs(m_bchsv[4])>=KNOB_EPS || fabs(m_bchsv[3])>=KNOB_EPS;
-
-  if (hsvmode)
-    LICE_AlterRectHSV(destimage,x,y,w,h,m_bchsv[2],m_bchsv[3],m_bchsv[4]);
-
-  bool want_bc=fabs(m_bchsv[0])>=KNOB_EPS || fabs(m_bchsv[1])>=KNOB_EPS;
-  if (want_bc)
-  {
-    unsigned char tab[256];
-    int a;
-    double sc=pow(10.0,m_bchsv[1]*m_bchsv[1]*m_bchsv[1]*3.0);
-    double offs=m_bchsv[0] * 256.0f;
-    for(a=0;a<256;a++)
-    {
-      int aa = (int) (((a-128)+offs)*sc + 128.5f);
-      if (aa<0)aa=0;
-      else if (aa>255)aa=255;
-      tab[a]=aa;
-    }
-    
-    if (m_bw)
-      LICE_ProcessRect(destimage,x,y,w,h,BCBWfunc,tab);
-    else
-      LICE_ProcessRect(destimage,x,y,w,h,BCfunc,tab);
-  }
-  else if (m_bw)
-    LICE_ProcessRect(destimage,x,y,w,h,BWfunc,NULL);
- 
-  return want_bc||hsvmode||m_bw;
-
-}
-
-int get_lice_bitmap_size(LICE_IBitmap *bm)
-{
-  return bm ? (bm->getWidth()*bm->getHeight())/256 : 0;
-}
@@ -22,17 +22,105 @@
 #define _IMAGERECORD_H_
 
 #include "../WDL/wdlstring.h"
+#include "bitmapcache.h"
+#include "catalog.h"
+
+#define KNOB_EPS 0.001 // BCHSV() values closer than this to 0 are treated as off
 
 enum { EDIT_MODE_NONE=0, EDIT_MODE_CROP, EDIT_MODE_TRANSFORM, EDIT_MODE_BCHSV}; 
 extern int g_edit_mode;
 
-class ImageRecord : public WDL_VWnd
+class RenderRecipe;
+class ImageRecordVwnd;
+
+// one per image in g_images: the catalog entry plus the bitmaps the decode threads load for it.
+// deliberately not a widget, so a list of 100k images costs little more than the catalog; the
+// buttons/label/editing live in an ImageRecordVwnd, which only exists while the record is on screen
+class ImageRecord
 {
 public:
   ImageRecord(const char *srcfn, time_t timestamp=0);
   ~ImageRecord();
 
   ImageRecord *Duplicate();
+
+  bool ProcessImageToBitmap(LICE_IBitmap *srcimage, LICE_IBitmap *destimage, int max_w, int max_h); // resizes destimage, return false on error
+  // compiles recipe for the final output, and its size fit to max_w x max_h (0=unconstrained). 
+  // render with LICE_RESAMPLE_LANCZOS3, a band at a time (RenderRows) for large outputs. return false on error
+  bool PrepareOutput(RenderRecipe *recipe, LICE_IBitmap *srcimage, int max_w, int max_h, int *w, int *h);
+
+  void GetCropRectForScreen(int w, int h, RECT *cr); // scales + rotates CropRect() for output to w,h
+  bool SetCropRectFromScreen(int w, int h, const RECT *cr); // return true on update
+
+  void GetSizeInfoString(char *buf, int bufsz); // WxH or WxH cropped to WxH
+
+  void SetDefaultTitle();
+
+  ///
+
+  enum { IR_STATE_NEEDLOAD=0, IR_STATE_DECODING, IR_STATE_LOADED, IR_STATE_ERROR };
+
+  // catalog data lives in g_catalog (see catalog.h), these refer to this record's entry
+  int m_cat;
+  WDL_UINT64 GetHandle() const { return g_catalog.GetHandle(m_cat); } // see ImageList_Resolve()
+  const char *GetFN() const { return g_catalog.GetFN(m_cat); }
+  const char *GetOutName() const { return g_catalog.GetOutName(m_cat); }
+  void SetOutName(const char *name) { g_catalog.SetOutName(m_cat,name); }
+  float *BCHSV() const { return g_catalog.BCHSV(m_cat); }
+  char &Rot() const { return g_catalog.Rot(m_cat); } // 90deg steps (0..3)
+  bool &BW() const { return g_catalog.BW(m_cat); }
+  bool &NeedRotChk() const { return g_catalog.NeedRotChk(m_cat); } // check file for rotation EXIF info
+  bool &CacheHasThumbnail() const { return g_catalog.CacheHasThumbnail(m_cat); }
+  RECT &CropRect() const { return g_catalog.Crop(m_cat); }
+  unsigned char &State() const { return g_catalog.State(m_cat); }
+  int &SrcImageW() const { return g_catalog.SrcW(m_cat); }
+  int &SrcImageH() const { return g_catalog.SrcH(m_cat); }
+  time_t &FileTimestamp() const { return g_catalog.Timestamp(m_cat); }
+
+  ImageRecordVwnd *m_wnd; // while on screen (see MainWindowVwnd::SetMaterialized), UI thread only
+
+  LICE_IBitmap *m_preview_image;
+
+  // larger levels of the preview pyramid, loaded by the decode threads around the full view item
+  enum { IR_LEVEL_MID=0, IR_LEVEL_SCREEN, IR_LEVEL_FULL, IR_NUM_LEVELS };
+  LICE_IBitmap *m_mid_image; // fits 1024x1024, also stored in the thumbnail cache
+  LICE_IBitmap *m_screen_image; // fits the full view
+  LICE_IBitmap *m_fullimage;
+
+  LICE_IBitmap *GetBestImage() 
+  { 
+    return m_fullimage ? m_fullimage : m_screen_image ? m_screen_image : m_mid_image ? m_mid_image : m_preview_image; 
+  }
+
+  LICE_IBitmap *m_fullimage_scaled, 
+               *m_fullimage_final;
+
+  // bitmap cache accounting, see bitmapcache.h
+  int m_bmcache_heapidx[BMCACHE_NUMTIERS]; // index in each tier's LRU heap, -1 if no bitmaps in that tier
+  int m_bmcache_bytes[BMCACHE_NUMTIERS];
+  DWORD m_bmcache_lastuse;
+
+  int m_atlas_slot; // see thumbatlas.h, -1 if none
+  char m_level_loading, m_level_failed; // 1<<IR_LEVEL_x, protected by g_images_mutex
+  char m_fullimage_cachevalid; // 1=final, 2=intermediate(scaled)
+  bool m_damage_posted; // queued for repaint by the decode threads, protected by g_images_mutex
+
+  static int sortByFN(const void *a, const void *b)
+  {
+    ImageRecord *r1 = *(ImageRecord**)a;
+    ImageRecord *r2 = *(ImageRecord**)b;
+    return stricmp(r1->GetFN(),r2->GetFN());
+  }
+};
+
+// the on-screen view of an ImageRecord: thumbnail/full view drawing, buttons/knobs, label, crop and drag editing.
+// created and deleted by the main window as records scroll on and off screen
+class ImageRecordVwnd : public WDL_VWnd
+{
+public:
+  ImageRecordVwnd(ImageRecord *rec);
+  ~ImageRecordVwnd();
+
   ////// WDL_VWnd impl
 
   virtual const char *GetType() { return "ImageRecord"; }
@@ -50,33 +138,14 @@ public:
 
   int UserIsDraggingImageToPosition(int *typeOut); // typeOut=0 for none, 1 for move, 2 for copy
 
-  bool ProcessImageToBitmap(LICE_IBitmap *srcimage, LICE_IBitmap *destimage, int max_w, int max_h); // resizes destimage, return false on error
-
   void SetIsFullscreen(bool isFS);
-
-  void GetCropRectForScreen(int w, int h, RECT *cr); // scales + rotates m_croprect for output to w,h
-  bool SetCropRectFromScreen(int w, int h, const RECT *cr); // return true on update
-
-  void GetSizeInfoString(char *buf, int bufsz); // WxH or WxH cropped to WxH
-
-  void SetDefaultTitle();
   void UpdateButtonStates();
 
-  bool ProcessRect(LICE_IBitmap *destimage, int x, int y, int w, int h);
-  ///
-
-  WDL_FastString m_fn;
-  WDL_FastString m_outname;
-
-  enum { IR_STATE_NEEDLOAD=0, IR_STATE_DECODING, IR_STATE_LOADED, IR_STATE_ERROR };
-
-  float m_bchsv[5];
-  char m_rot; // 90deg steps (0..3)
-  bool m_bw;
-  bool m_need_rotchk; // check file for rotation EXIF info
-  bool m_cache_has_thumbnail;
+  // buttons/knobs
+  void CreateControls();
+  void LayoutControls(int w);
 
-  RECT m_croprect;
+  ImageRecord *m_rec;
 
   class TransformTriangle
   {
@@ -102,18 +171,8 @@ public:
   };
   WDL_PtrList<TransformTriangle> m_transform;
 
-  // state
-  int m_state;
-  int m_srcimage_w, m_srcimage_h;
-
-  LICE_IBitmap *m_preview_image;
-
-  LICE_IBitmap *m_fullimage;
-
-  LICE_IBitmap *m_fullimage_scaled, 
-               *m_fullimage_final;
-  char m_fullimage_cachevalid; // 1=final, 2=intermediate(scaled)
   bool m_is_fs;
+  int m_materialized_gen; // used by the main window to track which records are on screen
 
   RECT m_last_drawrect; // set by drawing
   RECT m_last_crop_drawrect; // set by drawing, read by UI code
@@ -125,17 +184,6 @@ public:
   int m_capture_state; 
   
   RECT m_lastlbl_rect; // last rect of text label (for editing)
-
-  time_t m_file_timestamp;
-
-  static int sortByFN(const void *a, const void *b)
-  {
-    ImageRecord *r1 = *(ImageRecord**)a;
-    ImageRecord *r2 = *(ImageRecord**)b;
-    return stricmp(r1->m_fn.Get(),r2->m_fn.Get());
-  }
 };
 
-int get_lice_bitmap_size(LICE_IBitmap *); //kb
-
 #endif
@@ -0,0 +1,309 @@
+/*
+    SnapEase
+    ingest.cpp -- background folder scanning
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "main.h"
+
+#include "../WDL/lice/lice.h"
+#include "../WDL/ptrlist.h"
+#include "../WDL/heapbuf.h"
+#include "../WDL/dirscan.h"
+#include "../WDL/mergesort.h"
+#include "../WDL/wdlcstring.h"
+
+#include "imagerecord.h"
+#include "ingest.h"
+
+#define INGEST_MAX_THREADS 8
+#define INGEST_MIN_BATCH 256 // files found before merging into the list...
+#define INGEST_MAX_WAIT_MS 250 // ...unless this much time has passed
+
+static WDL_Mutex s_mutex; // protects the state shared with the threads
+static WDL_PtrList<char> s_dirs; // folders waiting to be scanned, malloc()ed
+static WDL_PtrList<char> s_found; // supported files not yet added, malloc()ed, sorted per folder
+static int s_nrunning; // threads that have not exited
+static int s_nbusy; // threads scanning a folder (others may add subfolders until it is 0)
+static int s_dirs_done, s_files_found;
+static bool s_cancel;
+
+// UI thread only
+static HANDLE s_threads[INGEST_MAX_THREADS];
+static int s_nthreads;
+static int s_region_start, s_region_cnt, s_region_rev; // the sorted tail of g_images added by this scan
+static DWORD s_lastmerge;
+static bool s_added;
+
+static int sortFN(const void *a, const void *b)
+{
+  return stricmp(*(const char **)a, *(const char **)b);
+}
+
+static DWORD WINAPI IngestThreadProc(LPVOID p)
+{
+  WDL_PtrList<char> files;
+  WDL_String tmp;
+  WDL_DirScan ds;
+  for (;;)
+  {
+    s_mutex.Enter();
+    char *dir = NULL;
+    if (!s_cancel && s_dirs.GetSize())
+    {
+      dir = s_dirs.Get(s_dirs.GetSize()-1);
+      s_dirs.Delete(s_dirs.GetSize()-1);
+      s_nbusy++;
+    }
+    else if (s_cancel || !s_nbusy) // nothing left, and nobody scanning who could add more
+    {
+      s_nrunning--;
+      s_mutex.Leave();
+      break;
+    }
+    s_mutex.Leave();
+
+    if (!dir)
+    {
+      Sleep(10);
+      continue;
+    }
+
+    if (!ds.First(dir))
+    {
+      do
+      {
+        if (s_cancel) break;
+        if (ds.GetCurrentFN()[0] == '.') continue;
+
+        ds.GetCurrentFullFN(&tmp);
+        if (ds.GetCurrentIsDirectory())
+        {
+          s_mutex.Enter();
+          s_dirs.Add(strdup(tmp.Get()));
+          s_mutex.Leave();
+        }
+        else if (LICE_ImageIsSupported(tmp.Get()))
+        {
+          files.Add(strdup(tmp.Get()));
+        }
+      }
+      while (!ds.Next());
+      ds.Close();
+    }
+    free(dir);
+
+    if (files.GetSize()>1) qsort(files.GetList(),files.GetSize(),sizeof(char *),sortFN);
+
+    s_mutex.Enter();
+    s_nbusy--;
+    s_dirs_done++;
+    if (!s_cancel)
+    {
+      int x;
+      for (x = 0; x < files.GetSize(); x ++) s_found.Add(files.Get(x));
+      s_files_found += files.GetSize();
+      files.Empty();
+    }
+    s_mutex.Leave();
+    files.Empty(true,free);
+  }
+  return 0;
+}
+
+static void Ingest_JoinThreads()
+{
+  int x;
+  for (x = 0; x < s_nthreads; x ++)
+  {
+    WaitForSingleObject(s_threads[x],INFINITE);
+    CloseHandle(s_threads[x]);
+    s_threads[x] = 0;
+  }
+  s_nthreads = 0;
+
+  s_mutex.Enter();
+  s_dirs.Empty(true,free);
+  s_cancel = false;
+  s_mutex.Leave();
+}
+
+void Ingest_AddFolder(const char *path)
+{
+  if (!path || !*path) return;
+
+  s_mutex.Enter();
+  const bool cancelling = s_cancel;
+  s_mutex.Leave();
+  if (cancelling) Ingest_JoinThreads();
+
+  if (!s_nthreads)
+  {
+    s_region_start = g_images.GetSize();
+    s_region_cnt = 0;
+    s_region_rev = g_images_listorderrev;
+    s_lastmerge = GetTickCount();
+    s_added = false;
+  }
+
+  // scanning is mostly waiting on the filesystem (often a network share), so this is not tied to the CPU count
+  const int nt = min(max(config_readint("ingest_threads",4),1),INGEST_MAX_THREADS);
+
+  s_mutex.Enter();
+  if (!s_nthreads) s_dirs_done = s_files_found = 0;
+  s_dirs.Add(strdup(path));
+  const bool start = !s_nrunning;
+  if (start) s_nrunning = nt;
+  s_mutex.Leave();
+
+  if (start)
+  {
+    int x;
+    for (x = 0; x < s_nthreads; x ++) // exited, but not reaped yet
+    {
+      WaitForSingleObject(s_threads[x],INFINITE);
+      CloseHandle(s_threads[x]);
+    }
+    for (x = 0; x < nt; x ++)
+    {
+      DWORD tid;
+      s_threads[x] = CreateThread(NULL,0,IngestThreadProc,NULL,0,&tid);
+      SetThreadPriority(s_threads[x],THREAD_PRIORITY_BELOW_NORMAL);
+    }
+    s_nthreads = nt;
+  }
+}
+
+bool Ingest_IsBusy()
+{
+  return s_nthreads > 0;
+}
+
+void Ingest_Cancel()
+{
+  s_mutex.Enter();
+  if (s_nrunning) s_cancel = true;
+  s_dirs.Empty(true,free);
+  s_found.Empty(true,free);
+  s_mutex.Leave();
+}
+
+void Ingest_Quit()
+{
+  Ingest_Cancel();
+  Ingest_JoinThreads();
+}
+
+// merge the sorted recs into the sorted tail of g_images
+static void Ingest_Merge(ImageRecord **recs, int n)
+{
+  WDL_TypedBuf<ImageRecord *> merged;
+  if (s_region_cnt) merged.Resize(s_region_cnt + n,false);
+
+  // if the user changed the list meanwhile (or there is no memory to merge), sort from here on
+  if (merged.GetSize() != s_region_cnt + n ||
+      s_region_start + s_region_cnt != g_images.GetSize() || 
+      s_region_rev != g_images_listorderrev)
+  {
+    s_region_start = g_images.GetSize();
+    s_region_cnt = 0;
+    s_region_rev = g_images_listorderrev;
+  }
+
+  ImageRecord **out = recs;
+  if (s_region_cnt)
+  {
+    ImageRecord **old = g_images.GetList() + s_region_start;
+    ImageRecord **wr = out = merged.Get();
+    int a = 0, b = 0;
+    while (a < s_region_cnt && b < n)
+    {
+      // equal names keep the images already in the list first
+      if (stricmp(recs[b]->GetFN(),old[a]->GetFN()) < 0) *wr++ = recs[b++];
+      else *wr++ = old[a++];
+    }
+    while (a < s_region_cnt) *wr++ = old[a++];
+    while (b < n) *wr++ = recs[b++];
+  }
+
+  g_images_mutex.Enter();
+  int x;
+  for (x = 0; x < n; x ++) g_images.Add(NULL);
+  memcpy(g_images.GetList() + s_region_start, out, (s_region_cnt + n) * sizeof(ImageRecord *));
+  ImageList_Reindex(s_region_start);
+  g_images_mutex.Leave();
+
+  s_region_cnt += n;
+}
+
+bool Ingest_Run()
+{
+  if (!s_nthreads) return false;
+
+  const DWORD now = GetTickCount();
+  WDL_PtrList<char> batch;
+
+  s_mutex.Enter();
+  const bool done = !s_nrunning;
+  const int npend = s_found.GetSize();
+  if (npend && (done || npend >= max(INGEST_MIN_BATCH, s_region_cnt/4) || now - s_lastmerge >= INGEST_MAX_WAIT_MS))
+  {
+    // batches grow with the list, so the merges add up to O(N log N)
+    int x;
+    for (x = 0; x < npend; x ++) batch.Add(s_found.Get(x));
+    s_found.Empty();
+  }
+  s_mutex.Leave();
+
+  if (done) Ingest_JoinThreads();
+
+  if (!batch.GetSize()) return false;
+  s_lastmerge = now;
+
+  if (batch.GetSize() > 1) 
+  {
+    WDL_HeapBuf tmp;
+    char *tmpspace = (char *)tmp.Resize(batch.GetSize() * sizeof(char *),false);
+    if (tmp.GetSize() == batch.GetSize() * (int)sizeof(char *))
+      WDL_mergesort(batch.GetList(),batch.GetSize(),sizeof(char *),sortFN,tmpspace);
+    else
+      qsort(batch.GetList(),batch.GetSize(),sizeof(char *),sortFN);
+  }
+
+  WDL_PtrList<ImageRecord> recs;
+  int x;
+  for (x = 0; x < batch.GetSize(); x ++) recs.Add(new ImageRecord(batch.Get(x)));
+  batch.Empty(true,free);
+
+  Ingest_Merge(recs.GetList(),recs.GetSize());
+
+  if (g_fullmode_item && !s_added) EnsureImageRecVisible(recs.Get(0));
+  s_added = true;
+  return true;
+}
+
+void Ingest_GetStatusString(char *buf, int bufsz)
+{
+  if (!s_nthreads) 
+  {
+    if (bufsz>0) buf[0]=0;
+    return;
+  }
+  s_mutex.Enter();
+  snprintf(buf,bufsz,"scanning: %d folders, %d images",s_dirs_done,s_files_found);
+  s_mutex.Leave();
+}
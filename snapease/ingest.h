@@ -0,0 +1,36 @@
+/*
+    SnapEase
+    ingest.h -- background folder scanning
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _INGEST_H_
+#define _INGEST_H_
+
+// folders are walked by a few background threads. the UI thread merges what they find into
+// the end of g_images from Ingest_Run(), in sorted batches, so the grid fills in while
+// the scan continues.
+
+void Ingest_AddFolder(const char *path);
+bool Ingest_Run(); // from the UI timer, returns true if images were added
+bool Ingest_IsBusy();
+void Ingest_Cancel(); // stops scanning, images already added stay in the list
+void Ingest_Quit(); // cancels and waits for the threads
+
+void Ingest_GetStatusString(char *buf, int bufsz); // empty if idle
+
+#endif
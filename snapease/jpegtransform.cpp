@@ -0,0 +1,324 @@
+/*
+    SnapEase
+    jpegtransform.cpp -- lossless JPEG rotate/crop
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "main.h"
+
+#include <setjmp.h>
+
+extern "C" {
+#include "../WDL/jpeglib/jpeglib.h"
+};
+
+#include "jpegtransform.h"
+
+struct jt_error_mgr 
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+};
+static void JT_Error(j_common_ptr cinfo)
+{
+  longjmp(((jt_error_mgr*)cinfo->err)->setjmp_buffer,1);
+}
+static void JT_EmitMsg(j_common_ptr cinfo, int msg_level) { }
+static void JT_OutMsg(j_common_ptr cinfo) { }
+
+// compressed output is appended to a WDL_HeapBuf
+struct jt_memdest
+{
+  struct jpeg_destination_mgr pub;
+  WDL_HeapBuf *out;
+  int startpos;
+};
+
+static void JT_MemDest_Init(j_compress_ptr cinfo)
+{
+  jt_memdest *dest = (jt_memdest *)cinfo->dest;
+  const int sz = dest->startpos + 65536;
+  dest->out->Resize(sz,false);
+  if (dest->out->GetSize() != sz) cinfo->err->error_exit((j_common_ptr)cinfo);
+  dest->pub.next_output_byte = (JOCTET *)dest->out->Get() + dest->startpos;
+  dest->pub.free_in_buffer = sz - dest->startpos;
+}
+static boolean JT_MemDest_Empty(j_compress_ptr cinfo)
+{
+  jt_memdest *dest = (jt_memdest *)cinfo->dest;
+  const int oldsz = dest->out->GetSize();
+  const int sz = oldsz + oldsz/2 + 65536;
+  dest->out->Resize(sz,false);
+  if (dest->out->GetSize() != sz) cinfo->err->error_exit((j_common_ptr)cinfo);
+  dest->pub.next_output_byte = (JOCTET *)dest->out->Get() + oldsz;
+  dest->pub.free_in_buffer = sz - oldsz;
+  return TRUE;
+}
+static void JT_MemDest_Term(j_compress_ptr cinfo)
+{
+  jt_memdest *dest = (jt_memdest *)cinfo->dest;
+  dest->out->Resize(dest->out->GetSize() - (int)dest->pub.free_in_buffer,false);
+}
+
+struct jt_state
+{
+  jt_error_mgr jerr;
+  struct jpeg_decompress_struct src;
+  struct jpeg_compress_struct dst;
+  jt_memdest memdest;
+};
+
+// one 8x8 block, coefficients in natural order. transposing the block transposes its coefficients,
+// mirroring it negates the odd frequencies along that axis.
+static void JT_TransformBlock(const JCOEF *s, JCOEF *d, int rot)
+{
+  int i, j;
+  switch (rot)
+  {
+    case 0:
+      memcpy(d,s,sizeof(JBLOCK));
+    break;
+    case 1: // transpose, mirror horizontally
+      for (i = 0; i < DCTSIZE; i ++) for (j = 0; j < DCTSIZE; j ++)
+        d[i*DCTSIZE+j] = (j&1) ? -s[j*DCTSIZE+i] : s[j*DCTSIZE+i];
+    break;
+    case 2: // mirror both ways
+      for (i = 0; i < DCTSIZE; i ++) for (j = 0; j < DCTSIZE; j ++)
+        d[i*DCTSIZE+j] = ((i+j)&1) ? -s[i*DCTSIZE+j] : s[i*DCTSIZE+j];
+    break;
+    case 3: // transpose, mirror vertically
+      for (i = 0; i < DCTSIZE; i ++) for (j = 0; j < DCTSIZE; j ++)
+        d[i*DCTSIZE+j] = (i&1) ? -s[j*DCTSIZE+i] : s[j*DCTSIZE+i];
+    break;
+  }
+}
+
+static unsigned int JT_GetInt(const JOCTET *p, int sz, bool motorola)
+{
+  unsigned int res = 0;
+  int x;
+  if (motorola) for (x = 0; x < sz; x ++) res = (res << 8) | p[x];
+  else for (x = sz-1; x >= 0; x --) res = (res << 8) | p[x];
+  return res;
+}
+
+// the pixels are rotated now, so viewers must not rotate them again
+static void JT_ResetExifOrientation(JOCTET *buf, unsigned int len)
+{
+  if (len < 6+8 || memcmp(buf,"Exif\0\0",6)) return;
+  JOCTET *tiff = buf + 6;
+  const unsigned int tlen = len - 6;
+  const bool mm = tiff[0] == 'M';
+  if (tiff[0] != tiff[1] || (tiff[0] != 'M' && tiff[0] != 'I')) return;
+
+  const unsigned int ifd0 = JT_GetInt(tiff+4,4,mm);
+  if (ifd0 > tlen - 2) return;
+  int n = JT_GetInt(tiff+ifd0,2,mm);
+  unsigned int pos = ifd0 + 2;
+  while (n-- > 0 && pos + 12 <= tlen)
+  {
+    JOCTET *e = tiff + pos;
+    if (JT_GetInt(e,2,mm) == 0x0112 && JT_GetInt(e+2,2,mm) == 3) // orientation, a SHORT stored in the entry
+    {
+      e[8] = mm ? 0 : 1;
+      e[9] = mm ? 1 : 0;
+      return;
+    }
+    pos += 12;
+  }
+}
+
+// runs with st->jerr armed, libjpeg errors longjmp out of here
+static bool JT_Transform(jt_state *st, FILE *infp, int rot, const RECT *crop, bool baseline, int max_w, int max_h)
+{
+  j_decompress_ptr src = &st->src;
+  j_compress_ptr dst = &st->dst;
+
+  jpeg_stdio_src(src,infp);
+  jpeg_save_markers(src,JPEG_COM,0xffff);
+  int x;
+  for (x = 0; x < 16; x ++) jpeg_save_markers(src,JPEG_APP0+x,0xffff);
+
+  if (jpeg_read_header(src,TRUE) != JPEG_HEADER_OK) return false;
+
+  if (baseline)
+  {
+    // the output is written in the source's mode with its tables, so it is only baseline if the source is
+    if (src->progressive_mode) return false;
+    for (x = 0; x < NUM_QUANT_TBLS; x ++)
+    {
+      const JQUANT_TBL *q = src->quant_tbl_ptrs[x];
+      int i;
+      if (q) for (i = 0; i < DCTSIZE2; i ++) if (q->quantval[i] > 255) return false;
+    }
+  }
+
+  const int w = src->image_width, h = src->image_height;
+  const int mcuw = src->max_h_samp_factor * DCTSIZE, mcuh = src->max_v_samp_factor * DCTSIZE;
+  int x0 = 0, y0 = 0, x1 = w, y1 = h;
+  if (crop && crop->right > crop->left && crop->bottom > crop->top)
+  {
+    x0 = max(crop->left,0);
+    y0 = max(crop->top,0);
+    x1 = min(crop->right,w);
+    y1 = min(crop->bottom,h);
+    if (x1 <= x0 || y1 <= y0) return false;
+  }
+
+  // blocks can only move whole MCUs, so the source edges that become the output's left and top 
+  // have to be on MCU boundaries. the far edges (the image's own right/bottom) can be partial.
+  rot &= 3;
+  const bool src_right_first = rot == 2 || rot == 3, src_bottom_first = rot == 1 || rot == 2;
+  if (!src_right_first) x0 -= x0 % mcuw;
+  else if ((x1 = (x1 + mcuw - 1) / mcuw * mcuw) > w) return false;
+  if (!src_bottom_first) y0 -= y0 % mcuh;
+  else if ((y1 = (y1 + mcuh - 1) / mcuh * mcuh) > h) return false;
+
+  const int ow = (rot&1) ? y1-y0 : x1-x0, oh = (rot&1) ? x1-x0 : y1-y0;
+  if ((max_w && ow > max_w) || (max_h && oh > max_h)) return false;
+
+  // output coefficient arrays, whole iMCUs like the compressor reads them
+  const int omcuw = (rot&1) ? mcuh : mcuw, omcuh = (rot&1) ? mcuw : mcuh;
+  jvirt_barray_ptr dst_coef[MAX_COMPONENTS];
+  for (x = 0; x < src->num_components; x ++)
+  {
+    const jpeg_component_info *sc = src->comp_info + x;
+    const int ohs = (rot&1) ? sc->v_samp_factor : sc->h_samp_factor;
+    const int ovs = (rot&1) ? sc->h_samp_factor : sc->v_samp_factor;
+    dst_coef[x] = (*src->mem->request_virt_barray)((j_common_ptr)src, JPOOL_IMAGE, TRUE,
+                                                   (ow + omcuw - 1) / omcuw * ohs,
+                                                   (oh + omcuh - 1) / omcuh * ovs,
+                                                   ovs);
+  }
+
+  jvirt_barray_ptr *src_coef = jpeg_read_coefficients(src); // realizes dst_coef too
+  if (!src_coef) return false;
+
+  for (x = 0; x < src->num_components; x ++)
+  {
+    const jpeg_component_info *sc = src->comp_info + x;
+    const int hs = sc->h_samp_factor, vs = sc->v_samp_factor;
+    const int ohs = (rot&1) ? vs : hs, ovs = (rot&1) ? hs : vs;
+    const int dbw = (ow + omcuw - 1) / omcuw * ohs, dbh = (oh + omcuh - 1) / omcuh * ovs;
+
+    // the crop in this component's blocks, exact for the edges aligned above
+    const int bx0 = x0 * hs / mcuw, by0 = y0 * vs / mcuh;
+    const int bx1 = x1 * hs / mcuw, by1 = y1 * vs / mcuh;
+
+    int dx, dy;
+    for (dy = 0; dy < dbh; dy ++)
+    {
+      JBLOCKROW drow = (*src->mem->access_virt_barray)((j_common_ptr)src, dst_coef[x], dy, 1, TRUE)[0];
+      for (dx = 0; dx < dbw; dx ++)
+      {
+        int sx, sy;
+        switch (rot)
+        {
+          case 0: sx = bx0 + dx; sy = by0 + dy; break;
+          case 1: sx = bx0 + dy; sy = by1 - 1 - dx; break;
+          case 2: sx = bx1 - 1 - dx; sy = by1 - 1 - dy; break;
+          default: sx = bx1 - 1 - dy; sy = by0 + dx; break;
+        }
+        // past the image: padding the decoder never shows, left zeroed
+        if (sx < 0 || sy < 0 || sx >= (int)sc->width_in_blocks || sy >= (int)sc->height_in_blocks) continue;
+
+        JBLOCKROW srow = (*src->mem->access_virt_barray)((j_common_ptr)src, src_coef[x], sy, 1, FALSE)[0];
+        JT_TransformBlock(srow[sx],drow[dx],rot);
+      }
+    }
+  }
+
+  jpeg_copy_critical_parameters(src,dst);
+  dst->image_width = ow;
+  dst->image_height = oh;
+  if (rot&1)
+  {
+    for (x = 0; x < dst->num_components; x ++)
+    {
+      jpeg_component_info *dc = dst->comp_info + x;
+      const int tmp = dc->h_samp_factor;
+      dc->h_samp_factor = dc->v_samp_factor;
+      dc->v_samp_factor = tmp;
+    }
+    for (x = 0; x < NUM_QUANT_TBLS; x ++)
+    {
+      JQUANT_TBL *q = dst->quant_tbl_ptrs[x];
+      if (!q) continue;
+      int i, j;
+      for (i = 0; i < DCTSIZE; i ++) for (j = i+1; j < DCTSIZE; j ++)
+      {
+        const UINT16 tmp = q->quantval[i*DCTSIZE+j];
+        q->quantval[i*DCTSIZE+j] = q->quantval[j*DCTSIZE+i];
+        q->quantval[j*DCTSIZE+i] = tmp;
+      }
+    }
+  }
+  if (src->progressive_mode) jpeg_simple_progression(dst);
+  // standard Huffman tables: optimizing them needs another pass over every block, ~25% of the time for a few % of size
+  dst->optimize_coding = FALSE;
+
+  st->memdest.pub.init_destination = JT_MemDest_Init;
+  st->memdest.pub.empty_output_buffer = JT_MemDest_Empty;
+  st->memdest.pub.term_destination = JT_MemDest_Term;
+  dst->dest = &st->memdest.pub;
+  jpeg_write_coefficients(dst,dst_coef);
+
+  jpeg_saved_marker_ptr m;
+  for (m = src->marker_list; m; m = m->next)
+  {
+    // the compressor writes its own JFIF/Adobe headers
+    if (dst->write_JFIF_header && m->marker == JPEG_APP0 && 
+        m->data_length >= 5 && !memcmp(m->data,"JFIF",5)) continue;
+    if (dst->write_Adobe_marker && m->marker == JPEG_APP0+14 &&
+        m->data_length >= 5 && !memcmp(m->data,"Adobe",5)) continue;
+
+    if (m->marker == JPEG_APP0+1) JT_ResetExifOrientation(m->data,m->data_length);
+    jpeg_write_marker(dst,m->marker,m->data,m->data_length);
+  }
+
+  jpeg_finish_compress(dst);
+  jpeg_finish_decompress(src);
+  return true;
+}
+
+bool JPEG_LosslessTransform(const char *srcfn, WDL_HeapBuf *out, int rot, const RECT *crop, bool baseline, int max_w, int max_h)
+{
+  FILE *infp = fopenUTF8(srcfn,"rb");
+  if (!infp) return false;
+
+  jt_state st;
+  memset(&st,0,sizeof(st));
+  st.memdest.out = out;
+  st.memdest.startpos = out->GetSize();
+  st.src.err = st.dst.err = jpeg_std_error(&st.jerr.pub);
+  st.jerr.pub.error_exit = JT_Error;
+  st.jerr.pub.emit_message = JT_EmitMsg;
+  st.jerr.pub.output_message = JT_OutMsg;
+
+  bool rv = false;
+  if (!setjmp(st.jerr.setjmp_buffer))
+  {
+    jpeg_create_decompress(&st.src);
+    jpeg_create_compress(&st.dst);
+    rv = JT_Transform(&st,infp,rot,crop,baseline,max_w,max_h);
+  }
+  jpeg_destroy_compress(&st.dst);
+  jpeg_destroy_decompress(&st.src);
+  fclose(infp);
+  if (!rv) out->Resize(st.memdest.startpos,false);
+  return rv;
+}
@@ -0,0 +1,40 @@
+/*
+    SnapEase
+    jpegtransform.h -- lossless JPEG rotate/crop
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _JPEGTRANSFORM_H_
+#define _JPEGTRANSFORM_H_
+
+// rotates (rot = 90 degree steps clockwise, like ImageRecord::Rot()) and crops a JPEG file by 
+// moving its DCT coefficient blocks around, so nothing is decoded or requantized. crop is in 
+// source pixels, NULL or empty for the whole image. the crop edges that end up at the output's
+// left/top are moved outward to the nearest MCU boundary, so the output may be a few pixels
+// larger than asked. APPn/COM markers are copied, with the EXIF orientation reset.
+// 
+// the output keeps the source's quantization (so its quality) and its progressive/sequential
+// mode. if baseline is set, progressive sources and sources with 16-bit quantization tables are
+// refused, as the output would not be baseline either.
+//
+// returns false if the file can't be transformed this way: not a JPEG, not baseline (see above),
+// the output would be larger than max_w x max_h (0=unlimited), or a partial MCU at the image 
+// edge would have to become the output's left or top. the caller should re-encode instead. the 
+// output is appended to out, which is left as it was on failure.
+bool JPEG_LosslessTransform(const char *srcfn, WDL_HeapBuf *out, int rot, const RECT *crop, bool baseline, int max_w, int max_h);
+
+#endif
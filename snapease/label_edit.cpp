@@ -39,7 +39,7 @@ int EditImageProcessMessage(MSG *msg)
       }
       else if (msg->wParam == VK_TAB)
       {
-        int a = g_images.Find(s_rec);
+        int a = ImageList_IndexOf(s_rec);
         if (a>=0)
         {
           a += (GetAsyncKeyState(VK_SHIFT)&0x8000) ? -1 : 1;
@@ -74,12 +74,13 @@ void EditImageLabel(ImageRecord *rec)
   EnsureImageRecVisible(rec);
 
   UpdateWindow(g_hwnd); // make sure our rect is valid
+  if (!rec->m_wnd) return;
 
   s_rec=rec;
 
   RECT r;
-  rec->GetPosition(&r);
-  RECT tr=rec->m_lastlbl_rect;
+  rec->m_wnd->GetPosition(&r);
+  RECT tr=rec->m_wnd->m_lastlbl_rect;
   
   tr.left=r.left;
   tr.right=r.right;
@@ -100,7 +101,7 @@ void EditImageLabel(ImageRecord *rec)
   SWELL_MakeSetCurParms(1,1,0,0,NULL,false,false);
   
 #endif
-  SetWindowText(s_wnd,rec->m_outname.Get());
+  SetWindowText(s_wnd,rec->GetOutName());
 
   SendMessage(s_wnd,EM_SETSEL,0,-1);
   ShowWindow(s_wnd,SW_SHOW);
@@ -119,7 +120,7 @@ void EditImageLabelEnd(bool ignoreData)
       GetWindowText(s_wnd,buf,sizeof(buf));
       if (s_rec)
       {
-        if (buf[0]) s_rec->m_outname.Set(buf);
+        if (buf[0]) s_rec->SetOutName(buf);
         else s_rec->SetDefaultTitle();
       }
       s_rec=0;
@@ -22,6 +22,7 @@
 #include <math.h>
 #include "../WDL/projectcontext.h"
 #include "../WDL/lineparse.h"
+#include "ingest.h"
 
 bool g_imagelist_fn_dirty; // need save
 WDL_FastString g_imagelist_fn;
@@ -154,26 +155,24 @@ bool importImageListFromFile(const char *fn, bool addToCurrent)
             char resfn[4096];
             resolve_fn_fromrelative(leadpath.Get(),lp.gettoken_str(1),resfn,sizeof(resfn));
             ImageRecord *rec= new ImageRecord(resfn, lp.getnumtokens()>16 ? (time_t) lp.gettoken_float(16) : 0);
-            rec->m_outname.Set(lp.gettoken_str(2));
-            rec->m_bw = !!lp.gettoken_int(3);
-            rec->m_rot = lp.gettoken_int(4)&3;
+            rec->SetOutName(lp.gettoken_str(2));
+            rec->BW() = !!lp.gettoken_int(3);
+            rec->Rot() = lp.gettoken_int(4)&3;
             if (activate) g_edit_mode = lp.gettoken_int(5);
-            rec->m_croprect.left = lp.gettoken_int(6);
-            rec->m_croprect.top = lp.gettoken_int(7);
-            rec->m_croprect.right = lp.gettoken_int(8);
-            rec->m_croprect.bottom = lp.gettoken_int(9);
+            rec->CropRect().left = lp.gettoken_int(6);
+            rec->CropRect().top = lp.gettoken_int(7);
+            rec->CropRect().right = lp.gettoken_int(8);
+            rec->CropRect().bottom = lp.gettoken_int(9);
             if (lp.getnumtokens()>14)
             {
-              rec->m_bchsv[0] = (float)lp.gettoken_float(10);
-              rec->m_bchsv[1] = (float)lp.gettoken_float(11);
-              rec->m_bchsv[2] = (float)lp.gettoken_float(12);
-              rec->m_bchsv[3] = (float)lp.gettoken_float(13);
-              rec->m_bchsv[4] = (float)lp.gettoken_float(14);
+              rec->BCHSV()[0] = (float)lp.gettoken_float(10);
+              rec->BCHSV()[1] = (float)lp.gettoken_float(11);
+              rec->BCHSV()[2] = (float)lp.gettoken_float(12);
+              rec->BCHSV()[3] = (float)lp.gettoken_float(13);
+              rec->BCHSV()[4] = (float)lp.gettoken_float(14);
             }
-            if (lp.getnumtokens() > 15) rec->m_need_rotchk = !!lp.gettoken_int(15);
-            else rec->m_need_rotchk = false;
-
-            rec->UpdateButtonStates();
+            if (lp.getnumtokens() > 15) rec->NeedRotChk() = !!lp.gettoken_int(15);
+            else rec->NeedRotChk() = false;
 
             AddImageRec(rec);
 
@@ -217,7 +216,7 @@ bool importImageListFromFile(const char *fn, bool addToCurrent)
   {
     g_imagelist_fn_dirty = !!itemsAdded;
   }
-  if (activitem&&g_images.Find(activitem)>=0) OpenFullItemView(activitem);
+  if (activitem&&ImageList_IndexOf(activitem)>=0) OpenFullItemView(activitem);
   else
     RemoveFullItemView(false);
   UpdateMainWindowWithSizeChanged();
@@ -243,27 +242,27 @@ bool saveImageListToFile(const char *fn)
   {
     ImageRecord *rec = g_images.Get(x);
     char buf[4096];
-    make_fn_relative(leadpath.Get(),rec->m_fn.Get(),buf,sizeof(buf));
-    makeEscapedConfigString(rec->m_outname.Get(),&tbuf);
+    make_fn_relative(leadpath.Get(),rec->GetFN(),buf,sizeof(buf));
+    makeEscapedConfigString(rec->GetOutName(),&tbuf);
 
     ctx->AddLine("%s \"%s\" %s %d %d %d %d %d %d %d %f %f %f %f %f %d %.0f",
         rec == g_fullmode_item ? "IMAGE_FULL" : "IMAGE", 
         buf,
         tbuf.Get(),
-        rec->m_bw,
-        rec->m_rot,
+        rec->BW(),
+        rec->Rot(),
         g_edit_mode,
-        rec->m_croprect.left,
-        rec->m_croprect.top,
-        rec->m_croprect.right,
-        rec->m_croprect.bottom,
-        rec->m_bchsv[0],
-        rec->m_bchsv[1],
-        rec->m_bchsv[2],
-        rec->m_bchsv[3],
-        rec->m_bchsv[4],
-        rec->m_need_rotchk,
-        (double)rec->m_file_timestamp
+        rec->CropRect().left,
+        rec->CropRect().top,
+        rec->CropRect().right,
+        rec->CropRect().bottom,
+        rec->BCHSV()[0],
+        rec->BCHSV()[1],
+        rec->BCHSV()[2],
+        rec->BCHSV()[3],
+        rec->BCHSV()[4],
+        rec->NeedRotChk(),
+        (double)rec->FileTimestamp()
         );
         
   }
@@ -385,6 +384,7 @@ void SetImageListIsDirty(bool isDirty)
 void UpdateCaption()
 {
   static WDL_FastString tmp;
+  tmp.Set("");
   if (g_imagelist_fn.GetLength())
   {
     tmp.Set(g_imagelist_fn.get_filepart());
@@ -401,6 +401,10 @@ void UpdateCaption()
 
   tmp.Append("SnapEase");
 
+  char buf[128];
+  Ingest_GetStatusString(buf,sizeof(buf));
+  if (buf[0]) tmp.AppendFormatted(256," [%s, Esc to stop]",buf);
+
   SetWindowText(g_hwnd,tmp.Get());
 
   #ifndef _WIN32
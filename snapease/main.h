@@ -25,7 +25,9 @@ class ImageRecord;
 extern HINSTANCE g_hInst;
 extern WDL_FastString g_ini_file;
 extern WDL_FastString g_list_path;
-extern WDL_FastString g_db_file;
+extern WDL_FastString g_db_file; // sqlite3 file, or directory for pack files (see g_config_thumbstore)
+class IThumbStore;
+extern IThumbStore *g_thumbstore;
 extern char g_exepath[4096];
 extern HWND g_hwnd;
 
@@ -34,10 +36,11 @@ extern HWND g_hwnd;
 WDL_DLGRET MainWindowProc(HWND, UINT, WPARAM, LPARAM);
 
 
-extern bool g_DecodeDidSomething;
 void DecodeThread_Init();
 void DecodeThread_Quit();
 void DecodeThread_RunTimer(void *db);
+int DecodeThread_GetDamage(WDL_PtrList<ImageRecord> *list); // appends records that changed since the last call
+int getCPUcount();
 
 void UpdateMainWindowWithSizeChanged();
 bool RemoveFullItemView(bool refresh=true); // if in full view, removes full view (and returns true)
@@ -56,16 +59,21 @@ void DoExportDialog(HWND hwndDlg);
 
 extern WDL_PtrList<ImageRecord> g_images;
 extern int g_images_cnt_err, g_images_cnt_ok, g_images_statcnt, g_images_cnt_indb;
-extern int g_ram_use_preview, g_ram_use_full, g_ram_use_fullscaled, g_ram_use_fullfinal;
 extern int g_images_listorderrev;
 extern WDL_Mutex g_images_mutex;
 extern ImageRecord *g_fullmode_item;
+extern RECT g_fullmode_rect; // position of g_fullmode_item's view, protected by g_images_mutex
+extern int g_prefetch_hits, g_prefetch_misses; // full view navigation found the image loaded/not loaded
 
 
-extern int g_config_smp, g_config_statusline,g_config_nodb;
+extern int g_config_smp, g_config_statusline,g_config_nodb,g_config_thumbstore,g_config_thumbcache_quality;
 
 extern int g_firstvisible_startitem,g_lastvisible_startitem;
 
+// grid view layout (see OrganizeWindow), coordinates are relative to the main window's client area
+bool GetGridItemRect(int idx, RECT *r); // where g_images[idx] is (or would be) drawn
+int GetGridIndexFromPoint(int x, int y); // nearest record index, -1 if outside the window
+
 void config_readstr(const char *what, char *out, int outsz);
 int config_readint(const char *what, int def);
 void config_writestr(const char *what, const char *value);
@@ -83,6 +91,12 @@ void UpdateCaption();
 
 void AddImageRec(ImageRecord *rec, int idx=-1);
 
+// each record's position in g_images is kept in the catalog, so finding a record is O(1).
+// changes need g_images_mutex, the UI thread can read without it.
+void ImageList_Reindex(int start=0); // call after g_images changed from position start on
+int ImageList_IndexOf(const ImageRecord *rec); // -1 if not in g_images, rec must not be deleted
+ImageRecord *ImageList_Resolve(WDL_UINT64 handle); // NULL if the record was removed or deleted since
+
 extern bool g_imagelist_fn_dirty; // need save
 extern WDL_FastString g_imagelist_fn;
 
@@ -52,7 +52,6 @@ allow entering a list of terms, with tolerances for equality, such as $type $dat
 
 #include "../WDL/ptrlist.h"
 #include "../WDL/lice/lice.h"
-#include "../WDL/dirscan.h"
 #include "../WDL/lice/lice_text.h"
 #include "../WDL/wdlcstring.h"
 
@@ -60,6 +59,9 @@ allow entering a list of terms, with tolerances for equality, such as $type $dat
 #include "../WDL/mergesort.h"
 
 #include "resource.h"
+#include "thumbstore.h"
+#include "thumbatlas.h"
+#include "ingest.h"
 
 WDL_FastString g_ini_file;
 WDL_FastString g_list_path;
@@ -68,13 +70,12 @@ WDL_FastString g_db_file;
 
 WDL_PtrList<ImageRecord> g_images;
 int g_images_cnt_err, g_images_cnt_ok, g_images_statcnt, g_images_cnt_indb;
-int g_ram_use_preview, g_ram_use_full, g_ram_use_fullscaled, g_ram_use_fullfinal;
 WDL_Mutex g_images_mutex;
 
 HWND g_hwnd;
 WDL_VWnd_Painter g_hwnd_painter;
 
-int g_config_smp, g_config_statusline, g_config_nodb;
+int g_config_smp, g_config_statusline, g_config_nodb, g_config_thumbstore, g_config_thumbcache_quality;
 
 class MainWindowVwnd : public WDL_VWnd
 {
@@ -87,24 +88,23 @@ public:
     WDL_VWnd::OnPaint(drawbm,origin_x,origin_y,cliprect);
     if (!m_children) return;
 
-    WDL_VWnd *capwnd = m_children->Get(m_captureidx);
-    if (capwnd && !strcmp(capwnd->GetType(),"ImageRecord"))
+    ImageRecordVwnd *capwnd = GetCaptureRecord();
+    if (capwnd)
     {
       int to=0;
-      int a = ((ImageRecord*)capwnd)->UserIsDraggingImageToPosition(&to);
+      int a = capwnd->UserIsDraggingImageToPosition(&to);
       if (to>0 && a>=0)
       {
         bool doright=false;
-        WDL_VWnd *nextwnd = m_children->Get(a);
-        if (!nextwnd) 
+        ImageRecord *nextrec = g_images.Get(a);
+        if (!nextrec) 
         {
-          nextwnd = m_children->Get(a-1);
+          nextrec = g_images.Get(--a);
           doright=true;
         }
-        if (nextwnd)
+        RECT r;
+        if (nextrec && GetGridItemRect(a,&r))
         {
-          RECT r;
-          nextwnd->GetPosition(&r);
           int xp = doright ? r.right : r.left;
 
           if (!doright && xp > 4) xp-=4;
@@ -113,9 +113,9 @@ public:
 
           if (to != 2)
           {
-            if (nextwnd==capwnd) wantDraw=false;
+            if (nextrec==capwnd->m_rec) wantDraw=false;
             else
-              if (m_children->Get(a+ (doright?1:-1))==capwnd) wantDraw=false;
+              if (g_images.Get(a+ (doright?1:-1))==capwnd->m_rec) wantDraw=false;
           }
 
           if (wantDraw)
@@ -141,9 +141,48 @@ public:
     if (WDL_VWnd::OnMouseDblClick(xpos,ypos)) return true;
     return RemoveFullItemView();
   }
+
+  ImageRecordVwnd *GetCaptureRecord() 
+  { 
+    WDL_VWnd *w = m_children ? m_children->Get(m_captureidx) : NULL;
+    return w && !strcmp(w->GetType(),"ImageRecord") ? (ImageRecordVwnd *)w : NULL;
+  }
+
+  // gives recs (and any record holding capture) views and deletes all other views, in O(children+n)
+  void SetMaterialized(ImageRecord **recs, int n)
+  {
+    static int s_gen;
+    ImageRecordVwnd *cap = GetCaptureRecord();
+    const int gen = ++s_gen;
+    int x;
+    for (x = 0; x < n; x ++) if (recs[x]->m_wnd) recs[x]->m_wnd->m_materialized_gen = gen;
+    if (cap) cap->m_materialized_gen = gen;
+
+    if (m_children) for (x = m_children->GetSize()-1; x >= 0; x --)
+    {
+      ImageRecordVwnd *w = (ImageRecordVwnd *)m_children->Get(x);
+      if (w->m_materialized_gen != gen) 
+      {
+        RemoveChild(w,false);
+        delete w;
+      }
+    }
+    for (x = 0; x < n; x ++)
+    {
+      if (!recs[x]->m_wnd)
+      {
+        ImageRecordVwnd *w = new ImageRecordVwnd(recs[x]);
+        w->m_materialized_gen = gen;
+        AddChild(w);
+      }
+    }
+    // child indices moved
+    m_captureidx = cap && m_children ? m_children->Find(cap) : -1;
+    m_lastmouseidx = -1;
+  }
 };
 
-MainWindowVwnd g_vwnd; // owns all children windows
+MainWindowVwnd g_vwnd; // children are the views of the records on screen, g_images owns all records
 
 int g_firstvisible_startitem,g_lastvisible_startitem;
 int g_images_listorderrev;
@@ -160,13 +199,15 @@ POINT g_hwnd_tooltip_pt;
 void ClearImageList()
 {
   int x;
+  Ingest_Cancel();
   WDL_PtrList<ImageRecord> r = g_images;
   g_images_mutex.Enter();
-  g_images.Empty(); // does not free -- g_vwnd owns all images!
+  g_images.Empty();
+  g_fullmode_item=0;
   g_images_mutex.Leave();
 
-  for(x=0;x<r.GetSize();x++)
-    g_vwnd.RemoveChild(r.Get(x),true);
+  g_vwnd.RemoveAllChildren(false);
+  for(x=0;x<r.GetSize();x++) delete r.Get(x);
   g_images_cnt_err = g_images_cnt_ok = 0;
 }
 
@@ -234,9 +275,44 @@ void DrawTooltipForPoint(LICE_IBitmap *bm, POINT mousePt, RECT *wndr, const char
 
 
 ImageRecord *g_fullmode_item;
+RECT g_fullmode_rect;
 
 int g_vwnd_scrollpos;
 
+// grid layout computed by OrganizeWindow(), positions of records are arithmetic
+static int s_grid_cols=1, s_grid_tile_w, s_grid_tile_h, s_grid_pitch_x, s_grid_pitch_y, s_grid_x0, s_grid_y0;
+
+bool GetGridItemRect(int idx, RECT *r)
+{
+  if (idx < 0 || idx >= g_images.GetSize()) return false;
+  r->left = s_grid_x0 + (idx % s_grid_cols) * s_grid_pitch_x;
+  r->top = s_grid_y0 + (idx / s_grid_cols) * s_grid_pitch_y - g_vwnd_scrollpos;
+  r->right = r->left + s_grid_tile_w;
+  r->bottom = r->top + s_grid_tile_h;
+  return true;
+}
+
+int GetGridIndexFromPoint(int x, int y)
+{
+  RECT parr;
+  g_vwnd.GetPosition(&parr);
+  const int n = g_images.GetSize();
+  if (!n || s_grid_pitch_x < 1 || s_grid_pitch_y < 1) return -1;
+  if (x<parr.left||y<parr.top || x>=parr.right || y>=parr.bottom) return -1;
+
+  // nearest row, then nearest column (gaps split halfway)
+  const int rows = (n + s_grid_cols - 1) / s_grid_cols;
+  int row = (y + g_vwnd_scrollpos - s_grid_y0 + (s_grid_pitch_y - s_grid_tile_h)/2) / s_grid_pitch_y;
+  if (row < 0) row = 0;
+  else if (row >= rows) row = rows-1;
+  int col = (x - s_grid_x0 + (s_grid_pitch_x - s_grid_tile_w)/2) / s_grid_pitch_x;
+  if (col < 0) col = 0;
+  else if (col >= s_grid_cols) col = s_grid_cols-1;
+
+  const int idx = row * s_grid_cols + col;
+  return idx < n ? idx : n-1;
+}
+
 int OrganizeWindow(HWND hwndDlg)
 {
   RECT r;
@@ -252,68 +328,90 @@ int OrganizeWindow(HWND hwndDlg)
   if (preview_w < 32) preview_w = 32;
 
   int preview_h = (preview_w*3) / 4;
+  ThumbAtlas_SetTileSize(preview_w, preview_h);
 
-  int xpos=border_size_x/2, ypos=border_size_y/2;
-  int x;
-  bool hadFullItem=false;
-  bool hadVis=false;
-  for (x = 0; x < g_images.GetSize(); x ++)
+  s_grid_tile_w = preview_w;
+  s_grid_tile_h = preview_h;
+  s_grid_pitch_x = preview_w + border_size_x;
+  s_grid_pitch_y = preview_h + border_size_y;
+  s_grid_x0 = border_size_x/2;
+  s_grid_y0 = border_size_y/2;
+  s_grid_cols = (r.right - s_grid_x0 - preview_w) / s_grid_pitch_x + 1;
+  if (s_grid_cols < 1) s_grid_cols = 1;
+
+  const int n = g_images.GetSize();
+
+  if (g_fullmode_item)
   {
-    ImageRecord *rec = g_images.Get(x);
-    if (rec)
+    const int x = ImageList_IndexOf(g_fullmode_item);
+    if (x < 0)
     {
-      if (g_fullmode_item&&g_fullmode_item!=rec)
-      {
-        rec->SetVisible(false);
-      }
-      else
-      {
-        rec->SetVisible(true);
-        if (g_fullmode_item)
-        {
-          hadFullItem=true;
-          rec->SetIsFullscreen(true);
+      g_images_mutex.Enter();
+      g_fullmode_item=0;
+      g_images_mutex.Leave();
+      return OrganizeWindow(hwndDlg);
+    }
 
-          RECT rr={12,12,r.right-12,r.bottom-12};
-          rec->SetPosition(&rr);
+    ImageRecord *rec = g_fullmode_item;
+    g_vwnd.SetMaterialized(&rec,1);
+    rec->m_wnd->SetVisible(true);
+    rec->m_wnd->SetIsFullscreen(true);
 
-          g_firstvisible_startitem = max(0,x-5); 
-          g_lastvisible_startitem = min(x + 5, g_images.GetSize() - 1);
-        }
-        else
-        {
-          rec->SetIsFullscreen(false);
+    RECT rr={12,12,r.right-12,r.bottom-12};
+    rec->m_wnd->SetPosition(&rr);
+    g_images_mutex.Enter();
+    g_fullmode_rect = rr;
+    g_images_mutex.Leave();
 
-          if (xpos + preview_w > r.right)
-          {
-            xpos=border_size_x/2;
-            ypos += preview_h + border_size_y;
-          }   
+    g_firstvisible_startitem = max(0,x-5); 
+    g_lastvisible_startitem = min(x + 5, n - 1);
+    return r.bottom - 4;
+  }
 
-          RECT rr = {xpos,ypos - g_vwnd_scrollpos,xpos+preview_w,ypos+preview_h - g_vwnd_scrollpos};
-          if (!hadVis && rr.top + (rr.bottom-rr.top)*2/3 >=0 )
-          {
-            hadVis=true;
-            g_firstvisible_startitem=x;
-          }
-          if (rr.top < r.bottom) g_lastvisible_startitem = x;
-          rec->SetPosition(&rr);
-        }
-      }
-    }
-    xpos += preview_w + border_size_x;
+  // only the rows on screen get views
+  const int rows = (n + s_grid_cols - 1) / s_grid_cols;
+  int row0 = g_vwnd_scrollpos - s_grid_y0 - preview_h;
+  row0 = row0 >= 0 ? row0 / s_grid_pitch_y + 1 : 0;
+  int row1 = (g_vwnd_scrollpos + r.bottom - s_grid_y0 - 1) / s_grid_pitch_y;
+  if (row1 >= rows) row1 = rows-1;
+
+  // decode scheduling wants the first row at least 1/3 visible
+  int rowf = g_vwnd_scrollpos - s_grid_y0 - (preview_h*2)/3;
+  rowf = rowf > 0 ? (rowf + s_grid_pitch_y - 1) / s_grid_pitch_y : 0;
+  if (rowf * s_grid_cols < n) g_firstvisible_startitem = rowf * s_grid_cols;
+  g_lastvisible_startitem = min(max(row1,0) * s_grid_cols + s_grid_cols - 1, n - 1);
+
+  WDL_TypedBuf<ImageRecord *> vis;
+  const int i0 = row0 * s_grid_cols, i1 = min((row1+1) * s_grid_cols, n);
+  if (i1 > i0)
+  {
+    ImageRecord **v = vis.Resize(i1-i0,false);
+    int x;
+    for (x = i0; x < i1; x ++) v[x-i0] = g_images.Get(x);
   }
-  if (!hadFullItem&&g_fullmode_item)
+  g_vwnd.SetMaterialized(vis.Get(),vis.GetSize());
+
+  int x;
+  for (x = i0; x < i1; x ++)
   {
-    g_images_mutex.Enter();
-    g_fullmode_item=0;
-    g_images_mutex.Leave();
-    return OrganizeWindow(hwndDlg);
+    ImageRecordVwnd *w = g_images.Get(x)->m_wnd;
+    RECT rr;
+    GetGridItemRect(x,&rr);
+    w->SetVisible(true);
+    w->SetIsFullscreen(false);
+    w->SetPosition(&rr);
   }
 
-  if (hadFullItem) return r.bottom - 4;
+  // a record being dragged keeps its view when scrolled off, keep it at its grid position
+  ImageRecordVwnd *cap = g_vwnd.GetCaptureRecord();
+  if (cap)
+  {
+    const int ci = ImageList_IndexOf(cap->m_rec);
+    RECT rr;
+    if ((ci < i0 || ci >= i1) && GetGridItemRect(ci,&rr)) cap->SetPosition(&rr);
+  }
 
-  int maxPos = ypos + preview_h + border_size_y/2;
+  int maxPos = s_grid_y0 + (max(rows,1) - 1) * s_grid_pitch_y + preview_h + border_size_y/2;
   if (maxPos < 0) maxPos=0;
 
   return maxPos;
@@ -369,8 +467,8 @@ void OpenFullItemView(ImageRecord *w)
   g_images_mutex.Enter();
   g_fullmode_item=w;
   g_images_mutex.Leave();
-  g_ram_use_fullscaled -= get_lice_bitmap_size(w->m_fullimage_scaled);
-  g_ram_use_fullfinal -= get_lice_bitmap_size(w->m_fullimage_final);
+  BitmapCache_Remove(w,BMCACHE_SCALED,w->m_fullimage_scaled);
+  BitmapCache_Remove(w,BMCACHE_FINAL,w->m_fullimage_final);
   delete w->m_fullimage_scaled;
   w->m_fullimage_scaled=0;
   delete w->m_fullimage_final;
@@ -386,10 +484,10 @@ bool RemoveFullItemView(bool refresh)
   {
     g_images_mutex.Enter();
     ImageRecord *r = g_fullmode_item;
-    if (g_images.Find(g_fullmode_item)>=0)
+    if (ImageList_IndexOf(g_fullmode_item)>=0)
     {
-      g_ram_use_fullfinal -= get_lice_bitmap_size(g_fullmode_item->m_fullimage_final);
-      g_ram_use_fullscaled -= get_lice_bitmap_size(g_fullmode_item->m_fullimage_scaled);
+      BitmapCache_Remove(g_fullmode_item,BMCACHE_FINAL,g_fullmode_item->m_fullimage_final);
+      BitmapCache_Remove(g_fullmode_item,BMCACHE_SCALED,g_fullmode_item->m_fullimage_scaled);
       delete g_fullmode_item->m_fullimage_scaled;
       delete g_fullmode_item->m_fullimage_final;
       g_fullmode_item->m_fullimage_scaled=0;
@@ -400,7 +498,7 @@ bool RemoveFullItemView(bool refresh)
     if (refresh) 
     {
       UpdateMainWindowWithSizeChanged();
-      if (g_images.Find(r)>=0) EnsureImageRecVisible(r);
+      if (ImageList_IndexOf(r)>=0) EnsureImageRecVisible(r);
     }
     return true;
   }
@@ -441,7 +539,7 @@ void EnsureImageRecVisible(ImageRecord *rec)
   {
     RECT cr,r;
     GetClientRect(g_hwnd,&r);
-    rec->GetPosition(&cr);
+    if (!GetGridItemRect(ImageList_IndexOf(rec),&cr)) return;
 
     int pos = g_vwnd_scrollpos;
     if (cr.bottom > r.bottom) pos += cr.bottom-r.bottom;
@@ -456,13 +554,39 @@ void EnsureImageRecVisible(ImageRecord *rec)
 
 void AddImageRec(ImageRecord *rec, int idx)
 {
-  g_vwnd.AddChild(rec,idx);
   g_images_mutex.Enter();
-  if (idx<0) g_images.Add(rec);
+  if (idx<0 || idx >= g_images.GetSize()) 
+  {
+    idx = g_images.GetSize();
+    g_images.Add(rec);
+  }
   else g_images.Insert(idx,rec);
+  ImageList_Reindex(idx);
   g_images_mutex.Leave();
 }
 
+void ImageList_Reindex(int start)
+{
+  if (start<0) start=0;
+  const int n = g_images.GetSize();
+  ImageRecord **list = g_images.GetList();
+  for (; start < n; start ++) g_catalog.ListIndex(list[start]->m_cat) = start;
+}
+
+int ImageList_IndexOf(const ImageRecord *rec)
+{
+  if (!rec) return -1;
+  const int idx = g_catalog.ListIndex(rec->m_cat);
+  return g_images.Get(idx) == rec ? idx : -1;
+}
+
+ImageRecord *ImageList_Resolve(WDL_UINT64 handle)
+{
+  if (!g_catalog.IsValid(handle)) return NULL;
+  ImageRecord *rec = g_images.Get(g_catalog.ListIndex(ImageCatalog::HandleToID(handle)));
+  return rec && rec->m_cat == ImageCatalog::HandleToID(handle) ? rec : NULL;
+}
+
 void AddImage(const char *fn)
 {
   ImageRecord *w = new ImageRecord(fn);
@@ -475,30 +599,37 @@ void AddImage(const char *fn)
 
 static RECT g_lastSplashRect;
 
-static sqlite3 *g_thumbnail_db; // read database connection for UI thread
+IThumbStore *g_thumbstore;
+static IThumbStoreConnection *g_thumbnail_db; // connection for UI thread
 static void quit_db()
 {
-  if (g_thumbnail_db)
-  {
-    sqlite3_close(g_thumbnail_db);
-    g_thumbnail_db=0;
-  }
+  delete g_thumbnail_db;
+  g_thumbnail_db=0;
+  delete g_thumbstore;
+  g_thumbstore=0;
+}
+static void set_db_file()
+{
+  g_db_file.Set(g_ini_file.Get());
+  int p = g_db_file.GetLength()-1;
+  while (p > 0 && g_db_file.Get()[p] != '\\' && g_db_file.Get()[p] != '/') p--;
+  g_db_file.SetLen(p);
+  g_db_file.Append(g_config_thumbstore == THUMBSTORE_PACK ? PREF_DIRSTR "snapease_thumbnails" : PREF_DIRSTR "snapease_thumbnails.sqlite3");
 }
 static void init_db()
 {
-  sqlite3_open(g_db_file.Get(), &g_thumbnail_db);
-  if (g_thumbnail_db)
-  {
-    char *errMsg = NULL;
-    if (sqlite3_exec(g_thumbnail_db,
-      "CREATE TABLE IF NOT EXISTS THUMB ("
-      "HASH INTEGER PRIMARY KEY NOT NULL,"
-      "DATA BLOB NOT NULL);", NULL, NULL, &errMsg) != SQLITE_OK)
-    {
-//      OutputDebugString("Error creating SQLite table:");
-  //    if (errMsg) OutputDebugString(errMsg);
-    }
-  }
+  set_db_file();
+  g_thumbstore = ThumbStore_Create(g_config_thumbstore,g_db_file.Get());
+  if (g_thumbstore) g_thumbnail_db = g_thumbstore->Connect();
+}
+
+// full view redraws (scaling, HSV/BC adjustments) are split across cores once they get big. 
+// LICE_SetThreadCount() replaces the pool, so it must not be in use: its users are painting 
+// (on this thread) and the export workers (only while the modal export dialog runs). the 
+// decode threads don't use it, they only call LICE_Resample directly
+static void set_paint_threads()
+{
+  LICE_SetThreadCount(g_config_smp ? config_readint("paint_threads", getCPUcount()) : 1);
 }
 
 static void DrawAboutWindow(WDL_VWnd_Painter *painter, RECT r)
@@ -588,22 +719,87 @@ static int filenameCompare(const void *a, const void *b)
 {
   const ImageRecord *r1 = *(const ImageRecord **)a;
   const ImageRecord *r2 = *(const ImageRecord **)b;
-  return stricmp(r1->m_fn.Get(), r2->m_fn.Get());
+  return stricmp(r1->GetFN(), r2->GetFN());
 }
 
 static int dateCompare(const void *a, const void *b)
 {
   const ImageRecord *r1 = *(const ImageRecord **)a;
   const ImageRecord *r2 = *(const ImageRecord **)b;
-  if (r1->m_file_timestamp < r2->m_file_timestamp) return -1;
-  if (r1->m_file_timestamp > r2->m_file_timestamp) return 1;
+  if (r1->FileTimestamp() < r2->FileTimestamp()) return -1;
+  if (r1->FileTimestamp() > r2->FileTimestamp()) return 1;
   return 0;
 }
 
 
+#define DAMAGE_MAX_RECTS 16 // past this many separate repaints, one repaint of the whole window is cheaper
+
+static int sortDamageRects(const void *a, const void *b)
+{
+  const RECT *r1 = (const RECT *)a, *r2 = (const RECT *)b;
+  if (r1->top != r2->top) return r1->top < r2->top ? -1 : 1;
+  if (r1->left != r2->left) return r1->left < r2->left ? -1 : 1;
+  return 0;
+}
+
+// repaints only the on-screen records in list (and extra if set), merging neighbours in the same row.
+// each rect is painted on its own so the painter's clip (the bounding box of the update region) stays tight
+static void RepaintDamage(HWND hwndDlg, WDL_PtrList<ImageRecord> *list, const RECT *extra)
+{
+  RECT cr;
+  GetClientRect(hwndDlg,&cr);
+
+  WDL_TypedBuf<RECT> rects;
+  int x;
+  for(x=0;x<list->GetSize();x++)
+  {
+    ImageRecord *rec = list->Get(x);
+    if (g_fullmode_item && rec != g_fullmode_item) continue;
+    ImageRecordVwnd *w = rec->m_wnd;
+    if (!w || !w->IsVisible()) continue;
+
+    RECT r;
+    w->GetPositionPaintExtent(&r);
+    if (r.left < cr.left) r.left=cr.left;
+    if (r.top < cr.top) r.top=cr.top;
+    if (r.right > cr.right) r.right=cr.right;
+    if (r.bottom > cr.bottom) r.bottom=cr.bottom;
+    if (r.right > r.left && r.bottom > r.top) rects.Add(r); // scrolled off: nothing to paint
+  }
+  if (extra && extra->right > extra->left && extra->bottom > extra->top) rects.Add(*extra);
+
+  const int n = rects.GetSize();
+  if (!n) return;
+
+  RECT *r = rects.Get();
+  qsort(r,n,sizeof(RECT),sortDamageRects);
+  int nout=0;
+  for(x=0;x<n;x++)
+  {
+    RECT *last = nout ? r+nout-1 : NULL;
+    if (last && last->top == r[x].top && last->bottom == r[x].bottom && r[x].left <= last->right + 16)
+    {
+      if (r[x].right > last->right) last->right = r[x].right;
+    }
+    else r[nout++] = r[x];
+  }
+
+  if (nout > DAMAGE_MAX_RECTS)
+  {
+    InvalidateRect(hwndDlg,NULL,FALSE);
+    return;
+  }
+  for(x=0;x<nout;x++)
+  {
+    InvalidateRect(hwndDlg,r+x,FALSE);
+    UpdateWindow(hwndDlg);
+  }
+}
+
 WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
-  static char s_status_text[256];
+  static char s_status_text[512];
+  static RECT s_status_rect; // client coordinates of the last status line, repainted when the text changes
 #ifdef _WIN32
   if (Scroll_Message && uMsg == Scroll_Message)
   {
@@ -638,17 +834,11 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
       g_config_smp = config_readint("smp", 1);
       g_config_statusline = config_readint("status", 1);
       g_config_nodb = config_readint("nodb", 0);
+      g_config_thumbstore = config_readint("thumbstore", THUMBSTORE_SQLITE);
+      g_config_thumbcache_quality = config_readint("thumbcache_quality", 85); // 0=legacy deflate blobs
 
-
-      {
-        g_db_file.Set(g_ini_file.Get());
-        int p = g_db_file.GetLength()-1;
-        while (p > 0 && g_db_file.Get()[p] != '\\' && g_db_file.Get()[p] != '/') p--;
-        g_db_file.SetLen(p);
-        g_db_file.Append(PREF_DIRSTR "snapease_thumbnails.sqlite3");
-        
-        if (!g_config_nodb) init_db();
-      }
+      set_db_file();
+      if (!g_config_nodb) init_db();
 
       {
         RECT r={config_readint("wndx",15),config_readint("wndy",15),};
@@ -667,7 +857,9 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
 #endif
         ShowWindow(hwndDlg,SW_SHOW);
  
+      set_paint_threads();
       DecodeThread_Init();
+      ThumbAtlas_SetBudget(((WDL_INT64)max(config_readint("thumbatlas_mb", 64),4)) << 20);
 
       SetTimer(hwndDlg,GENERAL_TIMER,30,NULL);
 
@@ -687,6 +879,9 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
     case WM_DESTROY:
 
       DecodeThread_Quit();
+      LICE_SetThreadCount(0);
+      BitmapCache_FreeReleased();
+      ThumbAtlas_Clear();
       quit_db();
       config_writestr("lastlist",g_imagelist_fn.Get());
 
@@ -706,11 +901,8 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
       }
 
-      g_images_mutex.Enter();
-      g_images.Empty(); // does not free -- g_vwnd owns all images!
-      g_images_mutex.Leave();
-
-      g_vwnd.RemoveAllChildren(true);
+      Ingest_Quit();
+      ClearImageList();
 
       g_images_cnt_err = g_images_cnt_ok = g_images_cnt_indb = 0;
 
@@ -751,7 +943,28 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
       {
         DecodeThread_RunTimer(g_thumbnail_db);
 
-        bool wantInvalidate = false;
+        if (Ingest_Run())
+        {
+          SetImageListIsDirty(true);
+          UpdateMainWindowWithSizeChanged();
+        }
+        {
+          static char s_ingest_status[128];
+          char buf[128];
+          Ingest_GetStatusString(buf,sizeof(buf));
+          if (strcmp(buf,s_ingest_status))
+          {
+            lstrcpyn(s_ingest_status,buf,sizeof(s_ingest_status));
+            UpdateCaption();
+          }
+        }
+
+        // the decode threads only evict previews and pyramid levels, the UI thread can evict anything
+        if (BitmapCache_GetUsage() > BitmapCache_GetBudget())
+          BitmapCache_Evict(BMCACHE_TIERMASK_ALL, BitmapCache_GetBudget() * 9 / 10, GetTickCount() - 2000);
+        BitmapCache_FreeReleased(); // including those evicted by the decode threads
+
+        bool wantStatus = false;
         if (!g_images.GetSize() || g_aboutwindow_open)
         {
           InvalidateRect(hwndDlg, &g_lastSplashRect, FALSE);
@@ -764,7 +977,7 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
             const DWORD now = GetTickCount();
             if (now > last_status_time + 1000)
             {
-              char newbuf[256];
+              char newbuf[512];
               
               snprintf(newbuf, sizeof(newbuf),
                 "%d/%d/%d", g_images_cnt_ok + g_images_cnt_err, g_images_cnt_indb,g_images.GetSize());
@@ -776,30 +989,36 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
                 snprintf_append(newbuf, sizeof(newbuf), " [%.1f load/sec]", (double)g_images_statcnt * 1000.0 / (now - last_status_time));
                 g_images_statcnt = 0;
               }
-              snprintf_append(newbuf, sizeof(newbuf), " [%dMB thumbnails, fullcache: %d/%d/%dMB]", (g_ram_use_preview / 1024),
-                (g_ram_use_full / 1024),
-                (g_ram_use_fullscaled / 1024),
-                (g_ram_use_fullfinal / 1024)
-                );
+              char cachebuf[256];
+              BitmapCache_GetStatusString(cachebuf, sizeof(cachebuf));
+              snprintf_append(newbuf, sizeof(newbuf), " [%s]", cachebuf);
+              ThumbAtlas_GetStatusString(cachebuf, sizeof(cachebuf));
+              snprintf_append(newbuf, sizeof(newbuf), " [%s]", cachebuf);
+              snprintf_append(newbuf, sizeof(newbuf), " [catalog: %dKB]", (int) (g_catalog.GetMemUsage() >> 10));
+              if (g_prefetch_hits || g_prefetch_misses)
+                snprintf_append(newbuf, sizeof(newbuf), " [prefetch: %d hit, %d miss]", g_prefetch_hits, g_prefetch_misses);
 
               last_status_time = now;
 
               if (strcmp(newbuf, s_status_text))
               {
                 lstrcpyn(s_status_text, newbuf, sizeof(s_status_text));
-                wantInvalidate = true;
+                wantStatus = true;
               }
             }
           }
         }
 
         EditImageRunTimer();
-        if (g_DecodeDidSomething)
+
+        WDL_PtrList<ImageRecord> damaged;
+        if (DecodeThread_GetDamage(&damaged))
         {
-          wantInvalidate = true;
-          g_DecodeDidSomething=false;
+          int x;
+          for (x = 0; x < damaged.GetSize(); x ++) ThumbAtlas_Invalidate(damaged.Get(x));
         }
-        if (wantInvalidate) InvalidateRect(hwndDlg, NULL, FALSE);
+        if (wantStatus && s_status_rect.bottom <= s_status_rect.top) InvalidateRect(hwndDlg, NULL, FALSE);
+        else if (g_images.GetSize() && !g_aboutwindow_open) RepaintDamage(hwndDlg, &damaged, wantStatus ? &s_status_rect : NULL);
       }
     return 0;
     case WM_CLOSE:
@@ -813,6 +1032,9 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
         CheckMenuItem(hm, ID_SMP, g_config_smp ? MF_CHECKED : MF_UNCHECKED);
         CheckMenuItem(hm, ID_STATUS_LINE, g_config_statusline ? MF_CHECKED : MF_UNCHECKED);
         CheckMenuItem(hm, ID_CACHE_THUMBNAILS, g_config_nodb ? MF_UNCHECKED : MF_CHECKED);
+        CheckMenuItem(hm, ID_THUMBSTORE_PACK, g_config_thumbstore == THUMBSTORE_PACK ? MF_CHECKED : MF_UNCHECKED);
+        EnableMenuItem(hm, ID_THUMBSTORE_PACK, MF_BYCOMMAND|(g_config_nodb ? MF_GRAYED : MF_ENABLED));
+        EnableMenuItem(hm, ID_COMPACT_THUMBNAILS, MF_BYCOMMAND|(g_thumbstore ? MF_ENABLED : MF_GRAYED));
       }
     break;
 #ifdef _WIN32
@@ -936,13 +1158,13 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
                 if (newimages.GetSize()>1) qsort(newimages.GetList(),newimages.GetSize(),sizeof(ImageRecord *),ImageRecord::sortByFN);
 
                 g_images_mutex.Enter();
+                const int oldsz = g_images.GetSize();
                 int x;
                 for(x=0;x<newimages.GetSize();x++)
                 {
-                  ImageRecord *w = newimages.Get(x);
-                  g_vwnd.AddChild(w);
-                  g_images.Add(w);
+                  g_images.Add(newimages.Get(x));
                 }
+                ImageList_Reindex(oldsz);
                 g_images_mutex.Leave();
   
                 if (g_fullmode_item && newimages.Get(0)) EnsureImageRecVisible(newimages.Get(0));
@@ -965,13 +1187,13 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
           if (g_config_nodb)
           {
             quit_db();
-            if (file_exists(g_db_file.Get()))
+            if (g_config_thumbstore == THUMBSTORE_PACK || file_exists(g_db_file.Get()))
             {
               if (MessageBox(hwndDlg,"Remove thumbnail cache database file?","SnapEase thumbnails",MB_YESNO) == IDYES)
               {
                 for (;;)
                 {
-                  if (DeleteFile(g_db_file.Get())) break;
+                  if (ThumbStore_DeleteFiles(g_config_thumbstore,g_db_file.Get())) break;
                   if (MessageBox(hwndDlg, "Could not remove cache database file, try again?", "SnapEase thumbnails", MB_YESNO) == IDNO) break;
                 }
               }
@@ -983,10 +1205,35 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
           }          
           DecodeThread_Init();
         break;
+        case ID_THUMBSTORE_PACK:
+          DecodeThread_Quit();
+          quit_db();
+          g_config_thumbstore = g_config_thumbstore == THUMBSTORE_PACK ? THUMBSTORE_SQLITE : THUMBSTORE_PACK;
+          config_writeint("thumbstore", g_config_thumbstore);
+          if (!g_config_nodb) init_db();
+          else set_db_file();
+          DecodeThread_Init();
+        break;
+        case ID_COMPACT_THUMBNAILS:
+          if (g_thumbstore)
+          {
+            DecodeThread_Quit();
+            delete g_thumbnail_db;
+            g_thumbnail_db=0;
+
+            // thumbcache_maxmb limits the size of pack file caches (oldest thumbnails are removed first)
+            const bool ok = g_thumbstore->Compact((WDL_INT64)config_readint("thumbcache_maxmb",0) << 20);
+
+            g_thumbnail_db = g_thumbstore->Connect();
+            DecodeThread_Init();
+            if (!ok) MessageBox(hwndDlg,"Error compacting thumbnail cache","SnapEase thumbnails",MB_OK);
+          }
+        break;
         case ID_SMP:
           g_config_smp = !g_config_smp;
           config_writeint("smp", g_config_smp);
-          DecodeThread_Quit();
+          set_paint_threads();
+          DecodeThread_Quit(); // the number of decode threads depends on g_config_smp
           DecodeThread_Init();
         break;
         case ID_STATUS_LINE:
@@ -1015,6 +1262,7 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
             hb.Resize(sizeof(void *)* g_images.GetSize());
             WDL_mergesort(g_images.GetList(), g_images.GetSize(), sizeof(void *), LOWORD(wParam) == ID_SORT_PATH ? filenameCompare : dateCompare, (char*)hb.Get());
           }
+          ImageList_Reindex();
           g_images_mutex.Leave();
 
           g_images_listorderrev++;
@@ -1139,6 +1387,10 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
             tmpfont.DrawText(bm, s_status_text, -1, &sz, DT_CALCRECT | DT_SINGLELINE|DT_NOPREFIX);
 
             LICE_FillRect(bm, xo, yo + r.bottom - sz.bottom-4, r.right, sz.bottom+4, LICE_RGBA(128, 128, 128, 255), 0.5, 0);
+            s_status_rect.left = 0;
+            s_status_rect.top = r.bottom - sz.bottom-4;
+            s_status_rect.right = r.right;
+            s_status_rect.bottom = r.bottom;
 
             sz.left = xo + r.right - 4 - sz.right;
             sz.right = xo + r.right;
@@ -1227,46 +1479,7 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
             }
             else if (!LICE_ImageIsSupported(buf))
             {
-              WDL_String tmp;
-              WDL_DirScan ds;
-              if (!ds.First(buf))
-              {
-                WDL_PtrList<WDL_String> dirstack;
-                for (;;)
-                {
-                  if (ds.GetCurrentFN()[0] != '.')
-                  {
-                    ds.GetCurrentFullFN(&tmp);
-                    if (ds.GetCurrentIsDirectory())
-                    {
-                      WDL_String *s = new WDL_String;
-                      s->Set(tmp.Get());
-                      dirstack.Add(s);
-                    }
-                    else if (LICE_ImageIsSupported(tmp.Get()))
-                    {
-                      newimages.Add(new ImageRecord(tmp.Get()));
-                    }
-                  }
-
-                  if (!ds.Next()) continue;
-
-                  bool didNew = false;
-
-                  while (dirstack.GetSize() && !didNew)
-                  {
-                    WDL_String *s = dirstack.Get(0);
-                    dirstack.Delete(0);
-
-                    didNew = !ds.First(s->Get());
-
-                    delete s;
-                  }
-                  
-                  if (!didNew) break;
-                }
-              
-              }
+              Ingest_AddFolder(buf); // images show up from the timer as they are found
             }
             else // image
             {
@@ -1280,12 +1493,12 @@ WDL_DLGRET MainWindowProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
         if (newimages.GetSize()>1) qsort(newimages.GetList(),newimages.GetSize(),sizeof(ImageRecord *),ImageRecord::sortByFN);
 
         g_images_mutex.Enter();
+        const int oldsz = g_images.GetSize();
         for(x=0;x<newimages.GetSize();x++)
         {
-          ImageRecord *w = newimages.Get(x);
-          g_vwnd.AddChild(w);
-          g_images.Add(w);
+          g_images.Add(newimages.Get(x));
         }
+        ImageList_Reindex(oldsz);
         g_images_mutex.Leave();
 
         if (newimages.GetSize())
@@ -1387,6 +1600,12 @@ int MainProcessMessage(MSG *msg)
       }
 
 
+      if (msg->wParam == VK_ESCAPE && !g_fullmode_item && Ingest_IsBusy())
+      {
+        Ingest_Cancel();
+        return 1;
+      }
+
       if (g_fullmode_item)
       {
         if (msg->wParam == VK_ESCAPE)
@@ -1397,7 +1616,7 @@ int MainProcessMessage(MSG *msg)
 
         if (msg->wParam == VK_NEXT || msg->wParam == VK_PRIOR)
         {
-          int a = g_images.Find(g_fullmode_item);
+          int a = ImageList_IndexOf(g_fullmode_item);
           if (a>=0)
           {
             a += (msg->wParam == VK_PRIOR) ? -1 : 1;
@@ -0,0 +1,273 @@
+/*
+    SnapEase
+    render.cpp -- crop/rotate/scale/adjust pipeline shared by the full view and export
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "main.h"
+#include <math.h>
+
+#include "../WDL/lice/lice.h"
+
+#include "imagerecord.h"
+#include "render.h"
+
+#define RENDER_BAND_ROWS 32 // rows resampled+adjusted at a time, small enough to stay in cache
+
+RenderRecipe::RenderRecipe()
+{
+  m_src=NULL;
+  memset(&m_crop,0,sizeof(m_crop));
+  m_rot=0;
+  m_bw=m_hsv=m_lut_used=false;
+  m_dh=m_ds=m_dv=0.0f;
+}
+
+void RenderParams::Set(const ImageRecord *rec)
+{
+  crop = rec->CropRect();
+  srcw = rec->SrcImageW();
+  srch = rec->SrcImageH();
+  rot = rec->Rot();
+  bw = rec->BW();
+  memcpy(bchsv,rec->BCHSV(),sizeof(bchsv));
+}
+
+bool RenderRecipe::Compile(const ImageRecord *rec, LICE_IBitmap *src, bool apply_crop)
+{
+  RenderParams params;
+  params.Set(rec);
+  return Compile(&params,src,apply_crop);
+}
+
+bool RenderRecipe::Compile(const RenderParams *params, LICE_IBitmap *src, bool apply_crop)
+{
+  m_src = src;
+  const int sw = src ? src->getWidth() : 0, sh = src ? src->getHeight() : 0;
+  m_crop.left = m_crop.top = 0;
+  m_crop.right = sw;
+  m_crop.bottom = sh;
+
+  const RECT *cr = &params->crop;
+  if (apply_crop && cr->right > cr->left && cr->bottom > cr->top)
+  {
+    // the crop is in source image pixels, src may be a smaller level
+    const int fw = params->srcw > 0 ? params->srcw : sw;
+    const int fh = params->srch > 0 ? params->srch : sh;
+    RECT c;
+    c.left = (int) (((WDL_INT64)cr->left * sw) / max(fw,1));
+    c.top = (int) (((WDL_INT64)cr->top * sh) / max(fh,1));
+    c.right = (int) (((WDL_INT64)cr->right * sw) / max(fw,1));
+    c.bottom = (int) (((WDL_INT64)cr->bottom * sh) / max(fh,1));
+    if (c.right <= c.left) c.right = c.left+1;
+    if (c.bottom <= c.top) c.bottom = c.top+1;
+    if (c.left < 0) c.left=0;
+    if (c.top < 0) c.top=0;
+    if (c.right > sw) c.right=sw;
+    if (c.bottom > sh) c.bottom=sh;
+    m_crop = c;
+  }
+
+  m_rot = params->rot&3;
+  m_bw = params->bw;
+
+  const float *bchsv = params->bchsv;
+  m_hsv = fabs(bchsv[2])>=KNOB_EPS || fabs(bchsv[3])>=KNOB_EPS || fabs(bchsv[4])>=KNOB_EPS;
+  m_dh = m_hsv ? bchsv[2] : 0.0f;
+  m_ds = m_hsv ? bchsv[3] : 0.0f;
+  m_dv = m_hsv ? bchsv[4] : 0.0f;
+
+  m_lut_used = fabs(bchsv[0])>=KNOB_EPS || fabs(bchsv[1])>=KNOB_EPS;
+  if (m_lut_used)
+  {
+    int a;
+    double sc=pow(10.0,bchsv[1]*bchsv[1]*bchsv[1]*3.0);
+    double offs=bchsv[0] * 256.0f;
+    for(a=0;a<256;a++)
+    {
+      int aa = (int) (((a-128)+offs)*sc + 128.5f);
+      if (aa<0)aa=0;
+      else if (aa>255)aa=255;
+      m_lut[a]=aa;
+    }
+  }
+
+  return m_crop.right > m_crop.left && m_crop.bottom > m_crop.top;
+}
+
+bool RenderRecipe::GetOutputSize(int max_w, int max_h, int *w, int *h) const
+{
+  double out_w = GetWidth();
+  double out_h = GetHeight();
+  if (max_w && out_w > max_w) 
+  {
+    out_h = (out_h * max_w) / out_w;
+    out_w = max_w;
+  }
+  if (max_h && out_h > max_h)
+  {
+    out_w = (out_w * max_h) / out_h;
+    out_h = max_h;
+  }
+
+  *w = (int) (out_w+0.5);
+  *h = (int) (out_h+0.5);
+
+  return *w >= 1 && *h >= 1;
+}
+
+static unsigned int hash_bytes(unsigned int h, const void *p, int len)
+{
+  const unsigned char *b = (const unsigned char *)p;
+  while (len-- > 0) h = (h ^ *b++) * 16777619; // FNV-1a
+  return h;
+}
+
+unsigned int RenderRecipe::GetHash() const
+{
+  unsigned int h = 2166136261u;
+  const int srcdim[2] = { m_src ? m_src->getWidth() : 0, m_src ? m_src->getHeight() : 0 };
+  const float adj[3] = { m_dh, m_ds, m_dv };
+  const char flags[3] = { (char)m_rot, (char)m_bw, (char)m_hsv };
+  h = hash_bytes(h,&m_src,sizeof(m_src));
+  h = hash_bytes(h,srcdim,sizeof(srcdim));
+  h = hash_bytes(h,&m_crop,sizeof(m_crop));
+  h = hash_bytes(h,flags,sizeof(flags));
+  h = hash_bytes(h,adj,sizeof(adj));
+  if (m_lut_used) h = hash_bytes(h,m_lut,sizeof(m_lut));
+  return h;
+}
+
+void RenderRecipe::Adjust(LICE_IBitmap *dest, int x, int y, int w, int h)
+{
+  // HSV, then BW, then the brightness/contrast table, in one pass
+  if (HasAdjust()) LICE_AdjustRect(dest,x,y,w,h,m_dh,m_ds,m_dv,m_bw,m_lut_used ? m_lut : NULL);
+}
+
+void RenderRecipe::RenderBands(void *_ctx, int by, int bh)
+{
+  const bandctx *ctx = (const bandctx *)_ctx;
+  RenderRecipe *_this = ctx->recipe;
+  const int x=ctx->x, y=ctx->y, w=ctx->w, h=ctx->h;
+
+  int sy;
+  for (sy = ctx->row0+by; sy < ctx->row0+by+bh; sy += RENDER_BAND_ROWS)
+  {
+    const int sh = min(RENDER_BAND_ROWS, ctx->row0+by+bh-sy);
+    if (ctx->geom)
+    {
+      LICE_Blit(ctx->dest,ctx->geom,x,y+sy,0,sy,w,sh,1.0f,LICE_BLIT_MODE_COPY);
+    }
+    else if (ctx->stages & STAGE_GEOMETRY)
+    {
+      const RECT clip = { x, y+sy, x+w, y+sy+sh };
+      LICE_Resample(ctx->dest,ctx->src,x,y,w,h,0,0,ctx->src->getWidth(),ctx->src->getHeight(),ctx->filter,_this->m_rot,&clip,&_this->m_weights);
+    }
+    if (ctx->stages & STAGE_ADJUST) _this->Adjust(ctx->dest,x,y+sy,w,sh);
+  }
+}
+
+void RenderRecipe::RenderColumns(void *_ctx, int bx, int bw)
+{
+  const bandctx *ctx = (const bandctx *)_ctx;
+  RenderRecipe *_this = ctx->recipe;
+  const RECT clip = { ctx->x+bx, ctx->y+ctx->row0, ctx->x+bx+bw, ctx->y+ctx->row0+ctx->nrows };
+  LICE_Resample(ctx->dest,ctx->src,ctx->x,ctx->y,ctx->w,ctx->h,0,0,ctx->src->getWidth(),ctx->src->getHeight(),ctx->filter,_this->m_rot,&clip,&_this->m_weights);
+  if (ctx->stages & STAGE_ADJUST) _this->Adjust(ctx->dest,clip.left,clip.top,bw,ctx->nrows);
+}
+
+bool RenderRecipe::Render(LICE_IBitmap *dest, int x, int y, int w, int h, int stages, int filter)
+{
+  if (!dest || !m_src || w<1 || h<1) return false;
+
+  LICE_SubBitmap cropbm(m_src,m_crop.left,m_crop.top,m_crop.right-m_crop.left,m_crop.bottom-m_crop.top);
+  LICE_IBitmap *src = &cropbm;
+  if (!HasAdjust()) stages &= ~STAGE_ADJUST;
+
+  if ((stages & STAGE_GEOMETRY) && filter == FILTER_BILINEAR)
+  {
+    // not worth banding, the blitters split themselves across threads
+    if (!m_rot)
+      LICE_ScaledBlit(dest,src,x,y,w,h,0,0,src->getWidth(),src->getHeight(),1.0f,LICE_BLIT_MODE_COPY|LICE_BLIT_FILTER_BILINEAR);
+    else
+    {
+      double dsdx=0, dsdy=0,dtdx=0,dtdy=0;
+
+      int sx = m_rot != 1 ? src->getWidth() - 1 : 0;
+      int sy = m_rot != 3 ? src->getHeight() - 1 : 0;
+
+      if (m_rot!=2)
+      {
+        dtdx = src->getHeight() / (double) w;
+        dsdy = src->getWidth() / (double) h;
+        if (m_rot==1) dtdx=-dtdx;
+        else dsdy=-dsdy;
+      }
+      else // flip
+      {
+        dsdx=-src->getWidth() / (double) w;
+        dtdy=-src->getHeight() / (double) h;
+      }
+
+      LICE_DeltaBlit(dest,src,x,y,w,h,
+                sx,sy, // start x,y
+                src->getWidth(),src->getHeight(),
+                dsdx, dtdx,
+                dsdy, dtdy,
+                0,0,false,1.0f,LICE_BLIT_MODE_COPY|LICE_BLIT_FILTER_BILINEAR);
+    }
+    if (stages & STAGE_ADJUST) Adjust(dest,x,y,w,h);
+    return true;
+  }
+
+  if (!stages) return true;
+  if (stages & STAGE_GEOMETRY) m_weights.Build(w,h,src->getWidth(),src->getHeight(),filter,m_rot); // on failure each band builds its own
+
+  // bands that miss dest are rejected cheaply by LICE_Resample's clip
+  bandctx ctx = { this, dest, src, NULL, x, y, w, h, stages, filter, 0 };
+  LICE_RunBands(h,w*h,RenderBands,&ctx);
+  return true;
+}
+
+bool RenderRecipe::RenderRows(LICE_IBitmap *dest, int w, int h, int row, int nrows, int filter)
+{
+  if (!dest || !m_src || w<1 || h<1 || row<0 || nrows<1 || row+nrows>h || filter == FILTER_BILINEAR) return false;
+
+  LICE_SubBitmap cropbm(m_src,m_crop.left,m_crop.top,m_crop.right-m_crop.left,m_crop.bottom-m_crop.top);
+  m_weights.Build(w,h,cropbm.getWidth(),cropbm.getHeight(),filter,m_rot); // once for all of the rows of an output
+  // the output is placed so that row lands at the top of dest, only rows that hit dest are computed
+  bandctx ctx = { this, dest, &cropbm, NULL, 0, -row, w, h, HasAdjust() ? STAGE_ALL : STAGE_GEOMETRY, filter, row, nrows };
+  // the vertical kernel reaches past the ends of a band of rows, so splitting these few rows into smaller row bands would
+  // redo the horizontal pass of those source rows in each band. unless rotated 90, split into columns, which share nothing
+  // (when rotated, output rows come from source columns and are already independent)
+  if (!(m_rot&1)) LICE_RunBands(w,w*nrows,RenderColumns,&ctx);
+  else LICE_RunBands(nrows,w*nrows,RenderBands,&ctx);
+  return true;
+}
+
+void RenderRecipe::RenderFromGeometry(LICE_IBitmap *dest, int x, int y, LICE_IBitmap *geom)
+{
+  if (!dest || !geom) return;
+  const int w = geom->getWidth(), h = geom->getHeight();
+  if (!HasAdjust())
+  {
+    LICE_Blit(dest,geom,x,y,0,0,w,h,1.0f,LICE_BLIT_MODE_COPY);
+    return;
+  }
+  bandctx ctx = { this, dest, NULL, geom, x, y, w, h, STAGE_ADJUST, 0, 0 };
+  LICE_RunBands(h,w*h,RenderBands,&ctx);
+}
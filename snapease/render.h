@@ -0,0 +1,97 @@
+/*
+    SnapEase
+    render.h -- crop/rotate/scale/adjust pipeline shared by the full view and export
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+#include "../WDL/lice/lice.h"
+
+class ImageRecord;
+
+// a record's edit parameters. copied (with g_images_mutex held) by code that renders without the record, such as the export workers
+struct RenderParams
+{
+  RECT crop; // in source image pixels, empty for none
+  int srcw, srch; // source image size, 0 if not known yet
+  int rot; // 90deg steps
+  bool bw;
+  float bchsv[5];
+
+  void Set(const ImageRecord *rec);
+};
+
+// crop -> rotate -> scale -> adjust, compiled from an ImageRecord's m_croprect, m_rot, m_bw and m_bchsv.
+// Render() produces the output in bands of rows: each band is resampled and then adjusted while it is
+// still in cache, and the bands are spread over LICE's thread pool (see LICE_SetThreadCount).
+class RenderRecipe
+{
+public:
+  enum { STAGE_GEOMETRY=1, STAGE_ADJUST=2, STAGE_ALL=3 };
+  enum { FILTER_BILINEAR=-1 }; // fast path for throwaway draws, otherwise LICE_RESAMPLE_*
+
+  RenderRecipe();
+
+  // src is what will be rendered from (any level of the pyramid, the crop is scaled to it).
+  // returns false if the crop is outside src
+  bool Compile(const ImageRecord *rec, LICE_IBitmap *src, bool apply_crop=true);
+  bool Compile(const RenderParams *params, LICE_IBitmap *src, bool apply_crop=true);
+
+  // output size fit to max_w x max_h (0=unconstrained), returns false if empty
+  bool GetOutputSize(int max_w, int max_h, int *w, int *h) const;
+
+  // size after crop and rotation, in src pixels
+  int GetWidth() const { return (m_rot&1) ? m_crop.bottom-m_crop.top : m_crop.right-m_crop.left; }
+  int GetHeight() const { return (m_rot&1) ? m_crop.right-m_crop.left : m_crop.bottom-m_crop.top; }
+  const RECT *GetCrop() const { return &m_crop; }
+  bool HasAdjust() const { return m_hsv || m_bw || m_lut_used; }
+  unsigned int GetHash() const; // identifies the output of Render() for a given size and filter, for caching
+
+  // renders the w x h output to dest at x,y. STAGE_ADJUST alone adjusts what is already there
+  bool Render(LICE_IBitmap *dest, int x, int y, int w, int h, int stages=STAGE_ALL, int filter=LICE_RESAMPLE_MITCHELL);
+  // renders rows [row,row+nrows) of the w x h output to the top of dest, so a large output can be produced a band at a time.
+  // not for FILTER_BILINEAR
+  bool RenderRows(LICE_IBitmap *dest, int w, int h, int row, int nrows, int filter=LICE_RESAMPLE_MITCHELL);
+  // copies an earlier STAGE_GEOMETRY result (sized w x h) to dest at x,y, adjusting each band as it goes
+  void RenderFromGeometry(LICE_IBitmap *dest, int x, int y, LICE_IBitmap *geom);
+
+private:
+  struct bandctx
+  {
+    RenderRecipe *recipe;
+    LICE_IBitmap *dest, *src, *geom;
+    int x, y, w, h, stages, filter;
+    int row0; // first output row of the bands
+    int nrows; // rows from row0, for RenderColumns
+  };
+  static void RenderBands(void *ctx, int y, int h);
+  static void RenderColumns(void *ctx, int x, int w);
+  void Adjust(LICE_IBitmap *dest, int x, int y, int w, int h);
+
+  LICE_IBitmap *m_src;
+  RECT m_crop; // in m_src coordinates
+  int m_rot;
+  bool m_bw, m_hsv, m_lut_used;
+  float m_dh, m_ds, m_dv;
+  unsigned char m_lut[256]; // brightness/contrast
+
+  LICE_ResampleWeights m_weights; // for the last output size, shared by all bands and by successive RenderRows() calls
+};
+
+#endif
@@ -40,6 +40,7 @@
 #define IDC_STATUS                      1020
 #define IDC_COMBO4                      1020
 #define IDC_UPLOADSTATUS                1021
+#define IDC_JPGLOSSLESS                 1022
 #define ID_IMPORT                       40001
 #define ID_ABOUT                        40002
 #define ID_NEWLIST                      40003
@@ -55,13 +56,15 @@
 #define ID_SORT_PATH                    40015
 #define ID_SORT_DATE                    40016
 #define ID_SORT_REVERSE                 40017
+#define ID_THUMBSTORE_PACK              40018
+#define ID_COMPACT_THUMBNAILS           40019
 // Next default values for new objects
 // 
 #ifdef APSTUDIO_INVOKED
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        117
-#define _APS_NEXT_COMMAND_VALUE         40018
-#define _APS_NEXT_CONTROL_VALUE         1021
+#define _APS_NEXT_COMMAND_VALUE         40020
+#define _APS_NEXT_CONTROL_VALUE         1023
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
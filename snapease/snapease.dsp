@@ -722,6 +722,14 @@ SOURCE=..\WDL\lice\lice_jpg_write.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\WDL\lice\lice_resample.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\WDL\lice\lice_parallel.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\WDL\lice\lice_line.cpp
 # End Source File
 # Begin Source File
@@ -900,6 +908,34 @@ SOURCE=.\sqlite3.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\thumbstore.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\bitmapcache.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\render.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\thumbatlas.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\catalog.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\ingest.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\jpegtransform.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\upload_post.cpp
 # End Source File
 # End Group
@@ -964,6 +1000,34 @@ SOURCE=.\main.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\thumbstore.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\bitmapcache.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\render.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\thumbatlas.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\catalog.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\ingest.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\jpegtransform.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\uploader.h
 # End Source File
 # End Group
@@ -0,0 +1,163 @@
+/*
+    SnapEase
+    thumbatlas.cpp -- retained pre-scaled grid thumbnails
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "main.h"
+
+#include "../WDL/lice/lice.h"
+#include "../WDL/ptrlist.h"
+#include "../WDL/heapbuf.h"
+#include "../WDL/wdlcstring.h"
+
+#include "imagerecord.h"
+#include "thumbatlas.h"
+
+#define ATLAS_PAGE_SIZE 2048 // pages are at most this wide/tall
+
+struct ThumbAtlasSlot
+{
+  ImageRecord *owner; // NULL if free
+  unsigned int key;
+  DWORD lastuse;
+  int w, h;
+};
+
+static WDL_PtrList<LICE_MemBitmap> s_pages;
+static WDL_TypedBuf<ThumbAtlasSlot> s_slots; // indexed by ImageRecord::m_atlas_slot
+static WDL_INT64 s_budget = ((WDL_INT64)64)<<20;
+static int s_tile_w, s_tile_h, s_tile_cols, s_tile_rows; // slots per page
+static int s_hits, s_misses;
+
+void ThumbAtlas_SetBudget(WDL_INT64 bytes) { s_budget = bytes; }
+
+void ThumbAtlas_Clear()
+{
+  int x;
+  ThumbAtlasSlot *s = s_slots.Get();
+  for (x = 0; x < s_slots.GetSize(); x ++) if (s[x].owner) s[x].owner->m_atlas_slot = -1;
+  s_slots.Resize(0);
+  s_pages.Empty(true);
+}
+
+void ThumbAtlas_SetTileSize(int w, int h)
+{
+  if (w == s_tile_w && h == s_tile_h) return;
+
+  ThumbAtlas_Clear();
+  s_tile_w = w;
+  s_tile_h = h;
+  s_tile_cols = w > 0 ? max(ATLAS_PAGE_SIZE / w, 1) : 0;
+  s_tile_rows = h > 0 ? max(ATLAS_PAGE_SIZE / h, 1) : 0;
+}
+
+void ThumbAtlas_Invalidate(ImageRecord *rec)
+{
+  const int idx = rec->m_atlas_slot;
+  if (idx < 0) return;
+  if (idx < s_slots.GetSize()) 
+  {
+    ThumbAtlasSlot *s = s_slots.Get() + idx;
+    s->owner = NULL;
+    s->lastuse = 0;
+  }
+  rec->m_atlas_slot = -1;
+}
+
+static void SlotRect(int idx, RECT *r)
+{
+  const int pi = idx % (s_tile_cols * s_tile_rows);
+  r->left = (pi % s_tile_cols) * s_tile_w;
+  r->top = (pi / s_tile_cols) * s_tile_h;
+  r->right = r->left + s_tile_w;
+  r->bottom = r->top + s_tile_h;
+}
+
+static int AllocSlot()
+{
+  const int perpage = s_tile_cols * s_tile_rows;
+  ThumbAtlasSlot *s = s_slots.Get();
+  int x, best = -1;
+  for (x = 0; x < s_slots.GetSize(); x ++)
+  {
+    if (!s[x].owner) return x;
+    if (best < 0 || (int)(s[x].lastuse - s[best].lastuse) < 0) best = x;
+  }
+
+  // add a page if within budget (always allow one)
+  const WDL_INT64 pagebytes = (WDL_INT64)s_tile_cols * s_tile_w * s_tile_rows * s_tile_h * sizeof(LICE_pixel);
+  if (!s_pages.GetSize() || (s_pages.GetSize()+1) * pagebytes <= s_budget)
+  {
+    LICE_MemBitmap *bm = new LICE_MemBitmap(s_tile_cols * s_tile_w, s_tile_rows * s_tile_h);
+    if (bm->getWidth() == s_tile_cols * s_tile_w)
+    {
+      s_pages.Add(bm);
+      const int first = s_slots.GetSize();
+      s = s_slots.Resize(first + perpage, false);
+      if (s && s_slots.GetSize() == first + perpage)
+      {
+        memset(s + first, 0, perpage * sizeof(ThumbAtlasSlot));
+        return first;
+      }
+      s_pages.Delete(s_pages.GetSize()-1, true);
+      s_slots.Resize(first);
+    }
+    else delete bm;
+  }
+
+  if (best >= 0) s[best].owner->m_atlas_slot = -1; // steal the least recently drawn
+  return best;
+}
+
+LICE_IBitmap *ThumbAtlas_GetTile(ImageRecord *rec, unsigned int key, int w, int h, RECT *slot, bool *needRender)
+{
+  if (w < 1 || h < 1 || w > s_tile_w || h > s_tile_h) return NULL;
+
+  int idx = rec->m_atlas_slot;
+  ThumbAtlasSlot *s = idx >= 0 && idx < s_slots.GetSize() ? s_slots.Get() + idx : NULL;
+  if (s && s->owner == rec && s->key == key && s->w == w && s->h == h)
+  {
+    *needRender = false;
+    s_hits++;
+  }
+  else
+  {
+    if (!s || s->owner != rec)
+    {
+      idx = AllocSlot();
+      if (idx < 0) return NULL;
+      s = s_slots.Get() + idx;
+      s->owner = rec;
+      rec->m_atlas_slot = idx;
+    }
+    s->key = key;
+    s->w = w;
+    s->h = h;
+    *needRender = true;
+    s_misses++;
+  }
+  s->lastuse = GetTickCount();
+
+  SlotRect(idx,slot);
+  return s_pages.Get(idx / (s_tile_cols * s_tile_rows));
+}
+
+void ThumbAtlas_GetStatusString(char *buf, int bufsz)
+{
+  snprintf(buf, bufsz, "atlas: %d pages, %d hit, %d miss", s_pages.GetSize(), s_hits, s_misses);
+}
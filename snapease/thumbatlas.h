@@ -0,0 +1,45 @@
+/*
+    SnapEase
+    thumbatlas.h -- retained pre-scaled grid thumbnails
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _THUMBATLAS_H_
+#define _THUMBATLAS_H_
+
+#include "../WDL/wdltypes.h"
+
+class ImageRecord;
+class LICE_IBitmap;
+
+// grid thumbnails, rendered once at the grid's tile size and kept in fixed-size slots of a few 
+// large pages, so that scrolling only blits. slots are reused least recently drawn first when 
+// the budget is reached. UI thread only.
+
+void ThumbAtlas_SetBudget(WDL_INT64 bytes);
+void ThumbAtlas_SetTileSize(int w, int h); // from OrganizeWindow(), a new size drops every slot
+void ThumbAtlas_Clear();
+
+// returns the page holding rec's w x h tile at slot->left,top, or NULL if it will not fit a slot.
+// key identifies the rendered content (see RenderRecipe::GetHash()), *needRender is set if the
+// slot is new or was stale, in which case the caller must render into it
+LICE_IBitmap *ThumbAtlas_GetTile(ImageRecord *rec, unsigned int key, int w, int h, RECT *slot, bool *needRender);
+void ThumbAtlas_Invalidate(ImageRecord *rec); // when its images change, or it is destroyed
+
+void ThumbAtlas_GetStatusString(char *buf, int bufsz);
+
+#endif
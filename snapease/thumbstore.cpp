@@ -0,0 +1,941 @@
+/*
+    SnapEase
+    thumbstore.cpp -- thumbnail cache storage (SQLite table, or memory-mapped pack files)
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "main.h"
+
+#include "thumbstore.h"
+
+#include "../WDL/mergesort.h"
+#include "../WDL/assocarray.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+// SQLite: THUMB(HASH INTEGER PRIMARY KEY, DATA BLOB), one database connection per thread for reads.
+//
+// Writes are queued and committed by a single writer thread, in transactions of up to 
+// THUMBSQL_BATCH_ROWS rows (or whatever is queued after THUMBSQL_BATCH_MS). Until an entry is 
+// committed, lookups find it in the queue, so nothing gets generated twice.
+
+#define THUMBSQL_BATCH_ROWS 200
+#define THUMBSQL_BATCH_MS 250
+#define THUMBSQL_MAX_QUEUED 2000 // writers wait if the queue gets this far behind
+
+#define THUMBSQL_BUSY_TRIES 2000 // 1ms sleeps
+
+// retries while the database is busy, but gives up early once *abortflag is set (shutdown)
+static int thumbsql_busy(void *abortflag, int cnt)
+{
+  if (cnt >= THUMBSQL_BUSY_TRIES || (abortflag && *(volatile bool *)abortflag)) return 0;
+  Sleep(1);
+  return 1;
+}
+
+static int thumbsql_open(const char *fn, sqlite3 **db, const bool *abortflag=NULL)
+{
+  *db = NULL;
+  sqlite3_open(fn, db);
+  if (!*db) return SQLITE_ERROR;
+  sqlite3_busy_handler(*db, thumbsql_busy, (void *)abortflag);
+  return SQLITE_OK;
+}
+
+class thumbStoreSQLite : public IThumbStore
+{
+public:
+  thumbStoreSQLite(const char *fn);
+  virtual ~thumbStoreSQLite();
+
+  bool Init();
+
+  virtual IThumbStoreConnection *Connect(const bool *abortflag);
+  virtual bool Compact(WDL_INT64 maxbytes);
+
+  void QueueWrite(WDL_UINT64 hash, const void *data, int len);
+  bool LookupQueued(WDL_UINT64 hash, WDL_HeapBuf *out); // if out is NULL, only checks existence
+
+private:
+  struct queuedEnt
+  {
+    WDL_UINT64 hash;
+    WDL_HeapBuf data;
+  };
+
+  static int cmp_hash(WDL_UINT64 *a, WDL_UINT64 *b) { return *a < *b ? -1 : *a > *b ? 1 : 0; }
+  static DWORD WINAPI WriterThreadProc(LPVOID p);
+  void WriteBatch(sqlite3 *db, sqlite3_stmt *stmt, bool force);
+  void WaitForWrites();
+
+  WDL_FastString m_fn;
+
+  WDL_Mutex m_queue_mutex;
+  WDL_PtrList<queuedEnt> m_queue; // oldest first, includes the batch being written
+  WDL_AssocArray<WDL_UINT64, queuedEnt *> m_queue_lookup; // newest entry for each hash
+  DWORD m_queue_oldest_time;
+
+  HANDLE m_thread;
+  bool m_thread_quit;
+};
+
+class thumbStoreSQLiteConnection : public IThumbStoreConnection
+{
+public:
+  thumbStoreSQLiteConnection(thumbStoreSQLite *store, sqlite3 *db) 
+  { 
+    m_store = store;
+    m_db = db;
+    m_stmt_pending = false;
+    if (sqlite3_prepare_v2(m_db, "SELECT DATA FROM THUMB WHERE HASH = ?1", -1, &m_stmt, NULL) != SQLITE_OK)
+      m_stmt = 0;
+  }
+  virtual ~thumbStoreSQLiteConnection()
+  {
+    EndLookup();
+    if (m_stmt) sqlite3_finalize(m_stmt);
+    sqlite3_close(m_db);
+  }
+
+  virtual const void *Lookup(WDL_UINT64 hash, int *lenOut)
+  {
+    EndLookup();
+
+    if (m_store->LookupQueued(hash, lenOut ? &m_queued_buf : NULL))
+    {
+      if (lenOut) *lenOut = m_queued_buf.GetSize();
+      return lenOut ? m_queued_buf.Get() : (const void *)"";
+    }
+
+    if (!m_stmt) return NULL;
+
+    sqlite3_bind_int64(m_stmt, 1, hash);
+    m_stmt_pending = true;
+    if (sqlite3_step(m_stmt) != SQLITE_ROW) return NULL;
+
+    const void *blob = sqlite3_column_blob(m_stmt, 0);
+    const int blob_bytes = sqlite3_column_bytes(m_stmt, 0);
+    if (lenOut) *lenOut = blob_bytes;
+    return blob ? blob : (const void *)"";
+  }
+
+  virtual bool Store(WDL_UINT64 hash, const void *data, int len)
+  {
+    m_store->QueueWrite(hash, data, len);
+    return true;
+  }
+
+private:
+  void EndLookup()
+  {
+    if (m_stmt_pending && m_stmt)
+    {
+      sqlite3_reset(m_stmt);
+      sqlite3_clear_bindings(m_stmt);
+    }
+    m_stmt_pending = false;
+  }
+
+  thumbStoreSQLite *m_store;
+  sqlite3 *m_db;
+  sqlite3_stmt *m_stmt;
+  bool m_stmt_pending;
+  WDL_HeapBuf m_queued_buf;
+};
+
+thumbStoreSQLite::thumbStoreSQLite(const char *fn) : m_fn(fn), m_queue_lookup(cmp_hash)
+{
+  m_queue_oldest_time = 0;
+  m_thread = NULL;
+  m_thread_quit = false;
+}
+
+thumbStoreSQLite::~thumbStoreSQLite()
+{
+  if (m_thread)
+  {
+    m_thread_quit = true; // writer commits anything still queued before exiting
+    WaitForSingleObject(m_thread,INFINITE);
+    CloseHandle(m_thread);
+    m_thread = NULL;
+  }
+  m_queue.Empty(true);
+}
+
+bool thumbStoreSQLite::Init()
+{
+  sqlite3 *db = NULL;
+  if (thumbsql_open(m_fn.Get(), &db) != SQLITE_OK) return false;
+
+  char *errMsg = NULL;
+  const bool ok = sqlite3_exec(db,
+    "CREATE TABLE IF NOT EXISTS THUMB ("
+    "HASH INTEGER PRIMARY KEY NOT NULL,"
+    "DATA BLOB NOT NULL);", NULL, NULL, &errMsg) == SQLITE_OK;
+  if (errMsg) sqlite3_free(errMsg);
+
+  // WAL lets the readers run alongside the writer (and is persistent in the database file)
+  sqlite3_exec(db, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  if (ok)
+  {
+    DWORD tid;
+    m_thread = CreateThread(NULL,0,WriterThreadProc,this,0,&tid);
+  }
+  return ok && m_thread;
+}
+
+IThumbStoreConnection *thumbStoreSQLite::Connect(const bool *abortflag)
+{
+  sqlite3 *db = NULL;
+  if (thumbsql_open(m_fn.Get(), &db, abortflag) != SQLITE_OK) return NULL;
+  return new thumbStoreSQLiteConnection(this, db);
+}
+
+void thumbStoreSQLite::QueueWrite(WDL_UINT64 hash, const void *data, int len)
+{
+  for (;;)
+  {
+    m_queue_mutex.Enter();
+    const int qs = m_queue.GetSize();
+    m_queue_mutex.Leave();
+    if (qs < THUMBSQL_MAX_QUEUED || !m_thread) break;
+    Sleep(10);
+  }
+
+  queuedEnt *ent = new queuedEnt;
+  ent->hash = hash;
+  memcpy(ent->data.Resize(len,false), data, len);
+
+  m_queue_mutex.Enter();
+  if (!m_queue.GetSize()) m_queue_oldest_time = GetTickCount();
+  m_queue.Add(ent);
+  m_queue_lookup.Insert(hash,ent);
+  m_queue_mutex.Leave();
+}
+
+bool thumbStoreSQLite::LookupQueued(WDL_UINT64 hash, WDL_HeapBuf *out)
+{
+  WDL_MutexLock lock(&m_queue_mutex);
+  queuedEnt *ent = m_queue_lookup.Get(hash);
+  if (ent && out) memcpy(out->Resize(ent->data.GetSize(),false), ent->data.Get(), ent->data.GetSize());
+  return !!ent;
+}
+
+void thumbStoreSQLite::WriteBatch(sqlite3 *db, sqlite3_stmt *stmt, bool force)
+{
+  // entries stay in the queue (and visible to lookups) until committed. only this thread removes
+  // entries, so the batch's entries stay valid, but QueueWrite() may reallocate m_queue's list at 
+  // any time, so the pointers are copied while locked
+  WDL_PtrList<queuedEnt> batch;
+  int x;
+  m_queue_mutex.Enter();
+  const int cnt = min(m_queue.GetSize(), THUMBSQL_BATCH_ROWS);
+  const bool want = cnt > 0 && (force || cnt >= THUMBSQL_BATCH_ROWS || GetTickCount() - m_queue_oldest_time >= THUMBSQL_BATCH_MS);
+  if (want) for (x = 0; x < cnt; x ++) batch.Add(m_queue.Get(x));
+  m_queue_mutex.Leave();
+  if (!want) return;
+
+  bool ok = sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) == SQLITE_OK;
+  for (x = 0; x < cnt && ok; x ++)
+  {
+    queuedEnt *ent = batch.Get(x);
+    sqlite3_bind_int64(stmt, 1, ent->hash);
+    sqlite3_bind_blob(stmt, 2, ent->data.Get(), ent->data.GetSize(), SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_DONE) ok = false;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+  }
+  if (ok) ok = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK;
+  if (!ok) sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL); // these thumbnails will just be regenerated next time
+
+  m_queue_mutex.Enter();
+  for (x = 0; x < cnt; x ++)
+  {
+    queuedEnt *ent = m_queue.Get(0);
+    if (m_queue_lookup.Get(ent->hash) == ent) m_queue_lookup.Delete(ent->hash);
+    m_queue.Delete(0);
+    delete ent;
+  }
+  m_queue_oldest_time = GetTickCount();
+  m_queue_mutex.Leave();
+}
+
+DWORD WINAPI thumbStoreSQLite::WriterThreadProc(LPVOID p)
+{
+  thumbStoreSQLite *_this = (thumbStoreSQLite *)p;
+
+  sqlite3 *db = NULL;
+  sqlite3_stmt *stmt = NULL;
+  if (thumbsql_open(_this->m_fn.Get(), &db) == SQLITE_OK)
+  {
+    sqlite3_exec(db, "PRAGMA synchronous=NORMAL;", NULL, NULL, NULL); // with WAL, only syncs on checkpoints
+    if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO THUMB (HASH, DATA) VALUES(?1, ?2)", -1, &stmt, NULL) != SQLITE_OK)
+      stmt = NULL;
+  }
+
+  for (;;)
+  {
+    const bool quit = _this->m_thread_quit;
+    if (stmt) _this->WriteBatch(db, stmt, quit);
+
+    _this->m_queue_mutex.Enter();
+    const int qs = _this->m_queue.GetSize();
+    if (!stmt) 
+    {
+      // no database, discard
+      while (_this->m_queue.GetSize()) _this->m_queue.Delete(0,true);
+      _this->m_queue_lookup.DeleteAll();
+    }
+    _this->m_queue_mutex.Leave();
+
+    if (quit && (!qs || !stmt)) break;
+    if (qs < THUMBSQL_BATCH_ROWS) Sleep(10);
+  }
+
+  if (stmt) sqlite3_finalize(stmt);
+  if (db) sqlite3_close(db);
+  return 0;
+}
+
+void thumbStoreSQLite::WaitForWrites()
+{
+  for (;;)
+  {
+    m_queue_mutex.Enter();
+    const int qs = m_queue.GetSize();
+    if (qs) m_queue_oldest_time -= THUMBSQL_BATCH_MS; // don't wait for the batch to fill
+    m_queue_mutex.Leave();
+    if (!qs || !m_thread) break;
+    Sleep(10);
+  }
+}
+
+bool thumbStoreSQLite::Compact(WDL_INT64 maxbytes)
+{
+  WaitForWrites();
+
+  // entries are keyed by hash, so there is no age to trim by -- just reclaim free pages
+  sqlite3 *db = NULL;
+  if (thumbsql_open(m_fn.Get(), &db) != SQLITE_OK) return false;
+  const bool ok = sqlite3_exec(db, "VACUUM;", NULL, NULL, NULL) == SQLITE_OK;
+  sqlite3_close(db);
+  return ok;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Pack files: thumbnails are appended to one of THUMBPACK_SHARDS memory-mapped pack files, 
+// and located via an in-memory hash table loaded from a small append-only index file.
+//
+// Lookups do not take any locks: the hash table and mapped segments are only ever added to 
+// (a table that is outgrown is kept until close), and an entry's hash is published after its 
+// location. Stores are serialized per shard, and index file writes are batched.
+
+#define THUMBPACK_SHARDS 16
+#define THUMBPACK_SEGSIZE (4<<20) // files are grown and mapped in segments of this size
+#define THUMBPACK_MAXSEGS 4096
+#define THUMBPACK_HDRSIZE 4096
+#define THUMBPACK_RECHDRSIZE 16 // hash, length, magic
+#define THUMBPACK_MAXBLOB ((1<<24)-1)
+#define THUMBPACK_IDX_BATCH 64
+#define THUMBPACK_MAGIC "SETP"
+#define THUMBPACK_RECMAGIC 0x6b6e7573
+
+#ifdef _WIN32
+static WDL_UINT64 thumbpack_load(volatile WDL_UINT64 *p) { return (WDL_UINT64) InterlockedCompareExchange64((volatile LONGLONG *)p,0,0); }
+static void thumbpack_store(volatile WDL_UINT64 *p, WDL_UINT64 v) 
+{
+  LONGLONG o = *p;
+  for (;;)
+  {
+    const LONGLONG r = InterlockedCompareExchange64((volatile LONGLONG *)p,(LONGLONG)v,o);
+    if (r == o) break;
+    o = r;
+  }
+}
+static void *thumbpack_loadptr(void * volatile *p) { return InterlockedCompareExchangePointer(p,NULL,NULL); }
+static void thumbpack_storeptr(void * volatile *p, void *v) { InterlockedExchangePointer(p,v); }
+#else
+static WDL_UINT64 thumbpack_load(volatile WDL_UINT64 *p) { return __atomic_load_n(p,__ATOMIC_ACQUIRE); }
+static void thumbpack_store(volatile WDL_UINT64 *p, WDL_UINT64 v) { __atomic_store_n(p,v,__ATOMIC_RELEASE); }
+static void *thumbpack_loadptr(void * volatile *p) { return __atomic_load_n(p,__ATOMIC_ACQUIRE); }
+static void thumbpack_storeptr(void * volatile *p, void *v) { __atomic_store_n(p,v,__ATOMIC_RELEASE); }
+#endif
+
+// index entry: loc is (data offset/16)<<24 | length. hash of 0 marks an empty slot
+struct thumbPackEnt
+{
+  volatile WDL_UINT64 hash;
+  volatile WDL_UINT64 loc;
+};
+
+struct thumbPackTable
+{
+  int mask;
+  int used;
+  thumbPackEnt ents[1];
+};
+
+static WDL_UINT64 thumbpack_fixhash(WDL_UINT64 hash) { return hash ? hash : 1; }
+static WDL_INT64 thumbpack_loc_offs(WDL_UINT64 loc) { return (WDL_INT64) (loc >> 24) * 16; }
+static int thumbpack_loc_len(WDL_UINT64 loc) { return (int) (loc & THUMBPACK_MAXBLOB); }
+
+class thumbPackShard
+{
+public:
+  thumbPackShard()
+  {
+#ifdef _WIN32
+    m_fh = INVALID_HANDLE_VALUE;
+#else
+    m_fd = -1;
+#endif
+    m_idxfp = NULL;
+    m_tab = NULL;
+    m_nsegs = 0;
+    m_wrpos = 0;
+    memset((void *)m_segs,0,sizeof(m_segs));
+  }
+  ~thumbPackShard() { Close(); }
+
+  bool Open(const char *packfn, const char *idxfn);
+  void Close();
+
+  const void *Lookup(WDL_UINT64 hash, int *lenOut); // lock-free
+  bool Store(WDL_UINT64 hash, const void *data, int len);
+  void FlushIndex();
+
+  bool CopyLiveTo(thumbPackShard *dest, WDL_INT64 maxbytes); // oldest dropped first
+
+private:
+  bool MapSegment(int seg);
+  void TableInsert(WDL_UINT64 hash, WDL_UINT64 loc); // writer only
+  const unsigned char *GetData(WDL_UINT64 hash, WDL_UINT64 loc);
+
+#ifdef _WIN32
+  HANDLE m_fh;
+#else
+  int m_fd;
+#endif
+  FILE *m_idxfp;
+
+  WDL_Mutex m_wrmutex;
+  WDL_TypedBuf<thumbPackEnt> m_idx_pending;
+  WDL_PtrList<void> m_oldtabs;
+
+  thumbPackTable * volatile m_tab;
+  unsigned char * volatile m_segs[THUMBPACK_MAXSEGS];
+  int m_nsegs;
+  WDL_INT64 m_wrpos;
+};
+
+bool thumbPackShard::MapSegment(int seg)
+{
+  if (seg < 0 || seg >= THUMBPACK_MAXSEGS) return false;
+  if (seg < m_nsegs) return true;
+
+  const WDL_INT64 offs = (WDL_INT64)seg * THUMBPACK_SEGSIZE;
+  const WDL_INT64 end = offs + THUMBPACK_SEGSIZE;
+  void *p = NULL;
+#ifdef _WIN32
+  HANDLE hmap = CreateFileMapping(m_fh,NULL,PAGE_READWRITE,(DWORD)(end>>32),(DWORD)end,NULL); // extends the file if needed
+  if (!hmap) return false;
+  p = MapViewOfFile(hmap,FILE_MAP_WRITE,(DWORD)(offs>>32),(DWORD)offs,THUMBPACK_SEGSIZE);
+  CloseHandle(hmap); // the view keeps a reference
+#else
+  struct stat sb;
+  if (fstat(m_fd,&sb) || sb.st_size < end) 
+  {
+    if (ftruncate(m_fd,end)) return false;
+  }
+  p = mmap(NULL,THUMBPACK_SEGSIZE,PROT_READ|PROT_WRITE,MAP_SHARED,m_fd,offs);
+  if (p == MAP_FAILED) p = NULL;
+#endif
+  if (!p) return false;
+
+  thumbpack_storeptr((void * volatile *)&m_segs[seg], p);
+  m_nsegs = seg+1;
+  return true;
+}
+
+bool thumbPackShard::Open(const char *packfn, const char *idxfn)
+{
+  Close();
+
+  WDL_INT64 fsize = 0;
+#ifdef _WIN32
+  // no sharing, so a second instance will fall back to not caching rather than corrupting things
+  m_fh = CreateFile(packfn,GENERIC_READ|GENERIC_WRITE,0,NULL,OPEN_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+  if (m_fh == INVALID_HANDLE_VALUE) return false;
+  DWORD h=0;
+  const DWORD l = GetFileSize(m_fh,&h);
+  fsize = (((WDL_INT64)h)<<32) | l;
+#else
+  m_fd = open(packfn,O_RDWR|O_CREAT,0644);
+  if (m_fd < 0) return false;
+  if (flock(m_fd,LOCK_EX|LOCK_NB) < 0)
+  {
+    close(m_fd);
+    m_fd = -1;
+    return false;
+  }
+  struct stat sb;
+  if (!fstat(m_fd,&sb)) fsize = sb.st_size;
+#endif
+
+  const bool isNew = fsize < THUMBPACK_HDRSIZE;
+  const int nsegs = isNew ? 1 : (int) ((fsize + THUMBPACK_SEGSIZE - 1) / THUMBPACK_SEGSIZE);
+  int x;
+  for (x = 0; x < nsegs; x ++)
+  {
+    if (!MapSegment(x)) 
+    {
+      Close();
+      return false;
+    }
+  }
+
+  if (isNew || memcmp(m_segs[0],THUMBPACK_MAGIC,4))
+  {
+    // new (or unrecognized) pack file, discard any index
+    memset(m_segs[0],0,THUMBPACK_HDRSIZE);
+    memcpy(m_segs[0],THUMBPACK_MAGIC,4);
+    m_segs[0][4] = 1; // version
+    FILE *fp = fopenUTF8(idxfn,"wb");
+    if (fp) fclose(fp);
+  }
+
+  m_wrpos = THUMBPACK_HDRSIZE;
+
+  int tabsz = 4096;
+  WDL_TypedBuf<thumbPackEnt> idx;
+  bool idx_dirty = false;
+  FILE *fp = fopenUTF8(idxfn,"rb");
+  if (fp)
+  {
+    fseek(fp,0,SEEK_END);
+    const long len = ftell(fp);
+    fseek(fp,0,SEEK_SET);
+    if (len > 0 && idx.Resize((int) (len / sizeof(thumbPackEnt)),false))
+    {
+      idx.Resize((int)fread(idx.Get(),sizeof(thumbPackEnt),idx.GetSize(),fp),false);
+    }
+    if (len != (long) (idx.GetSize() * sizeof(thumbPackEnt))) idx_dirty = true; // truncated write
+    fclose(fp);
+  }
+  while (tabsz < idx.GetSize() * 2) tabsz *= 2;
+
+  thumbPackTable *tab = (thumbPackTable *)calloc(1,sizeof(thumbPackTable) + sizeof(thumbPackEnt)*(tabsz-1));
+  if (!tab)
+  {
+    Close();
+    return false;
+  }
+  tab->mask = tabsz-1;
+  m_tab = tab;
+
+  for (x = 0; x < idx.GetSize(); x ++)
+  {
+    const thumbPackEnt *e = idx.Get() + x;
+    if (!e->hash || !GetData(e->hash,e->loc)) 
+    {
+      // points past what was written (or at garbage), probably from a crash
+      idx_dirty = true;
+      continue;
+    }
+    TableInsert(e->hash,e->loc);
+    const WDL_INT64 end = thumbpack_loc_offs(e->loc) + ((thumbpack_loc_len(e->loc) + 15) & ~15);
+    if (end > m_wrpos) m_wrpos = end;
+  }
+
+  if (idx_dirty)
+  {
+    // rewrite the index with only the valid entries, so appends stay aligned
+    fp = fopenUTF8(idxfn,"wb");
+    if (fp)
+    {
+      for (x = 0; x <= m_tab->mask; x ++)
+      {
+        const thumbPackEnt *e = m_tab->ents + x;
+        if (e->hash) fwrite(e,sizeof(thumbPackEnt),1,fp);
+      }
+      fclose(fp);
+    }
+  }
+
+  m_idxfp = fopenUTF8(idxfn,"ab");
+  if (!m_idxfp)
+  {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void thumbPackShard::Close()
+{
+  FlushIndex();
+  if (m_idxfp) fclose(m_idxfp);
+  m_idxfp = NULL;
+
+  int x;
+  for (x = 0; x < m_nsegs; x ++)
+  {
+#ifdef _WIN32
+    if (m_segs[x]) UnmapViewOfFile(m_segs[x]);
+#else
+    if (m_segs[x]) munmap(m_segs[x],THUMBPACK_SEGSIZE);
+#endif
+    m_segs[x] = NULL;
+  }
+  m_nsegs = 0;
+
+#ifdef _WIN32
+  if (m_fh != INVALID_HANDLE_VALUE) CloseHandle(m_fh);
+  m_fh = INVALID_HANDLE_VALUE;
+#else
+  if (m_fd >= 0) close(m_fd); // releases flock
+  m_fd = -1;
+#endif
+
+  free(m_tab);
+  m_tab = NULL;
+  for (x = 0; x < m_oldtabs.GetSize(); x ++) free(m_oldtabs.Get(x));
+  m_oldtabs.Empty();
+  m_wrpos = 0;
+}
+
+const unsigned char *thumbPackShard::GetData(WDL_UINT64 hash, WDL_UINT64 loc)
+{
+  const WDL_INT64 offs = thumbpack_loc_offs(loc);
+  const int len = thumbpack_loc_len(loc);
+  if (offs < THUMBPACK_HDRSIZE + THUMBPACK_RECHDRSIZE) return NULL;
+
+  const int seg = (int) (offs / THUMBPACK_SEGSIZE);
+  const int segoffs = (int) (offs % THUMBPACK_SEGSIZE);
+  if (seg >= THUMBPACK_MAXSEGS || segoffs < THUMBPACK_RECHDRSIZE || segoffs + len > THUMBPACK_SEGSIZE) return NULL;
+
+  const unsigned char *p = (const unsigned char *)thumbpack_loadptr((void * volatile *)&m_segs[seg]);
+  if (!p) return NULL;
+  p += segoffs;
+
+  // verify the record header
+  WDL_UINT64 rhash;
+  int rlen, rmagic;
+  memcpy(&rhash, p - 16, 8);
+  memcpy(&rlen, p - 8, 4);
+  memcpy(&rmagic, p - 4, 4);
+  if (rhash != hash || rlen != len || rmagic != THUMBPACK_RECMAGIC) return NULL;
+  return p;
+}
+
+const void *thumbPackShard::Lookup(WDL_UINT64 hash, int *lenOut)
+{
+  hash = thumbpack_fixhash(hash);
+  const thumbPackTable *tab = (const thumbPackTable *)thumbpack_loadptr((void * volatile *)&m_tab);
+  if (!tab) return NULL;
+
+  int i = (int) (hash & tab->mask);
+  for (;;)
+  {
+    thumbPackEnt *e = (thumbPackEnt *)tab->ents + i;
+    const WDL_UINT64 h = thumbpack_load(&e->hash);
+    if (!h) return NULL;
+    if (h == hash)
+    {
+      const WDL_UINT64 loc = thumbpack_load(&e->loc);
+      const unsigned char *p = GetData(hash,loc);
+      if (p && lenOut) *lenOut = thumbpack_loc_len(loc);
+      return p;
+    }
+    i = (i+1) & tab->mask;
+  }
+}
+
+void thumbPackShard::TableInsert(WDL_UINT64 hash, WDL_UINT64 loc)
+{
+  thumbPackTable *tab = m_tab;
+  if ((tab->used+1) * 2 > tab->mask+1)
+  {
+    // grow: fill a new table and publish it, readers may still be using the old one
+    const int newsz = (tab->mask+1) * 2;
+    thumbPackTable *ntab = (thumbPackTable *)calloc(1,sizeof(thumbPackTable) + sizeof(thumbPackEnt)*(newsz-1));
+    if (ntab)
+    {
+      ntab->mask = newsz-1;
+      int x;
+      for (x = 0; x <= tab->mask; x ++)
+      {
+        const thumbPackEnt *e = tab->ents + x;
+        if (!e->hash) continue;
+        int i = (int) (e->hash & ntab->mask);
+        while (ntab->ents[i].hash) i = (i+1) & ntab->mask;
+        ntab->ents[i].hash = e->hash;
+        ntab->ents[i].loc = e->loc;
+        ntab->used++;
+      }
+      thumbpack_storeptr((void * volatile *)&m_tab, ntab);
+      m_oldtabs.Add(tab);
+      tab = ntab;
+    }
+  }
+
+  int i = (int) (hash & tab->mask);
+  for (;;)
+  {
+    thumbPackEnt *e = tab->ents + i;
+    if (e->hash == hash)
+    {
+      thumbpack_store(&e->loc,loc);
+      return;
+    }
+    if (!e->hash)
+    {
+      thumbpack_store(&e->loc,loc);
+      thumbpack_store(&e->hash,hash); // publish
+      tab->used++;
+      return;
+    }
+    i = (i+1) & tab->mask;
+  }
+}
+
+bool thumbPackShard::Store(WDL_UINT64 hash, const void *data, int len)
+{
+  if (len < 0 || len > THUMBPACK_MAXBLOB) return false;
+  hash = thumbpack_fixhash(hash);
+
+  WDL_MutexLock lock(&m_wrmutex);
+  if (!m_tab) return false;
+
+  const int need = (THUMBPACK_RECHDRSIZE + len + 15) & ~15;
+  if (need > THUMBPACK_SEGSIZE) return false;
+
+  WDL_INT64 pos = m_wrpos;
+  if (pos % THUMBPACK_SEGSIZE + need > THUMBPACK_SEGSIZE) 
+    pos += THUMBPACK_SEGSIZE - pos % THUMBPACK_SEGSIZE; // records do not span segments
+
+  const int seg = (int) (pos / THUMBPACK_SEGSIZE);
+  if (!MapSegment(seg)) return false;
+
+  unsigned char *p = m_segs[seg] + (pos % THUMBPACK_SEGSIZE);
+  const int magic = THUMBPACK_RECMAGIC;
+  memcpy(p, &hash, 8);
+  memcpy(p + 8, &len, 4);
+  memcpy(p + 12, &magic, 4);
+  memcpy(p + THUMBPACK_RECHDRSIZE, data, len);
+
+  thumbPackEnt e;
+  e.hash = hash;
+  e.loc = ((WDL_UINT64) ((pos + THUMBPACK_RECHDRSIZE) / 16) << 24) | (WDL_UINT64) len;
+  TableInsert(e.hash,e.loc);
+  m_wrpos = pos + need;
+
+  m_idx_pending.Add(e);
+  if (m_idx_pending.GetSize() >= THUMBPACK_IDX_BATCH) FlushIndex();
+  return true;
+}
+
+void thumbPackShard::FlushIndex()
+{
+  WDL_MutexLock lock(&m_wrmutex);
+  if (m_idxfp && m_idx_pending.GetSize())
+  {
+    fwrite(m_idx_pending.Get(),sizeof(thumbPackEnt),m_idx_pending.GetSize(),m_idxfp);
+    fflush(m_idxfp);
+  }
+  m_idx_pending.Resize(0,false);
+}
+
+static int thumbPackEnt_cmp_loc(const void *a, const void *b)
+{
+  const WDL_UINT64 l1 = ((const thumbPackEnt *)a)->loc, l2 = ((const thumbPackEnt *)b)->loc;
+  return l1 < l2 ? -1 : l1 > l2 ? 1 : 0;
+}
+
+bool thumbPackShard::CopyLiveTo(thumbPackShard *dest, WDL_INT64 maxbytes)
+{
+  WDL_MutexLock lock(&m_wrmutex);
+  if (!m_tab) return false;
+
+  WDL_TypedBuf<thumbPackEnt> live;
+  WDL_INT64 tot = 0;
+  int x;
+  for (x = 0; x <= m_tab->mask; x ++)
+  {
+    const thumbPackEnt *e = m_tab->ents + x;
+    if (!e->hash) continue;
+    thumbPackEnt c;
+    c.hash = e->hash;
+    c.loc = e->loc;
+    live.Add(c);
+    tot += THUMBPACK_RECHDRSIZE + thumbpack_loc_len(c.loc);
+  }
+
+  // oldest first, as the pack is append-only
+  WDL_HeapBuf tmp;
+  if (!tmp.Resize(live.GetSize() * (int)sizeof(thumbPackEnt),false) && live.GetSize()) return false;
+  WDL_mergesort(live.Get(),live.GetSize(),sizeof(thumbPackEnt),thumbPackEnt_cmp_loc,(char *)tmp.Get());
+
+  for (x = 0; x < live.GetSize(); x ++)
+  {
+    const thumbPackEnt *e = live.Get() + x;
+    const int len = thumbpack_loc_len(e->loc);
+    if (maxbytes > 0 && tot > maxbytes)
+    {
+      tot -= THUMBPACK_RECHDRSIZE + len;
+      continue;
+    }
+    const unsigned char *p = GetData(e->hash,e->loc);
+    if (p && !dest->Store(e->hash,p,len)) return false;
+  }
+  dest->FlushIndex();
+  return true;
+}
+
+class thumbStorePackConnection : public IThumbStoreConnection
+{
+public:
+  thumbStorePackConnection(thumbPackShard *shards) { m_shards = shards; }
+  virtual ~thumbStorePackConnection() { }
+
+  virtual const void *Lookup(WDL_UINT64 hash, int *lenOut) { return m_shards[GetShard(hash)].Lookup(hash,lenOut); }
+  virtual bool Store(WDL_UINT64 hash, const void *data, int len) { return m_shards[GetShard(hash)].Store(hash,data,len); }
+
+  static int GetShard(WDL_UINT64 hash) { return (int) (hash >> 60) % THUMBPACK_SHARDS; } // low bits are used by the table
+
+private:
+  thumbPackShard *m_shards;
+};
+
+class thumbStorePack : public IThumbStore
+{
+public:
+  thumbStorePack(const char *path) : m_path(path) { }
+  virtual ~thumbStorePack() { }
+
+  static void GetShardFilenames(const char *path, int idx, WDL_FastString *packfn, WDL_FastString *idxfn, const char *suffix="")
+  {
+    packfn->SetFormatted(4096,"%s" PREF_DIRSTR "thumbs%02d.pack%s",path,idx,suffix);
+    idxfn->SetFormatted(4096,"%s" PREF_DIRSTR "thumbs%02d.idx%s",path,idx,suffix);
+  }
+
+  bool Init()
+  {
+    CreateDirectory(m_path.Get(),NULL);
+    int x;
+    for (x = 0; x < THUMBPACK_SHARDS; x ++)
+    {
+      WDL_FastString packfn, idxfn;
+      GetShardFilenames(m_path.Get(),x,&packfn,&idxfn);
+      if (!m_shards[x].Open(packfn.Get(),idxfn.Get())) return false;
+    }
+    return true;
+  }
+
+  virtual IThumbStoreConnection *Connect(const bool *abortflag) { return new thumbStorePackConnection(m_shards); } // lookups never wait
+
+  virtual bool Compact(WDL_INT64 maxbytes)
+  {
+    bool ok = true;
+    int x;
+    for (x = 0; x < THUMBPACK_SHARDS; x ++)
+    {
+      WDL_FastString packfn, idxfn, newpackfn, newidxfn;
+      GetShardFilenames(m_path.Get(),x,&packfn,&idxfn);
+      GetShardFilenames(m_path.Get(),x,&newpackfn,&newidxfn,".new");
+      DeleteFile(newpackfn.Get());
+      DeleteFile(newidxfn.Get());
+
+      thumbPackShard *ns = new thumbPackShard;
+      if (!ns->Open(newpackfn.Get(),newidxfn.Get()) || 
+          !m_shards[x].CopyLiveTo(ns, maxbytes > 0 ? max(maxbytes / THUMBPACK_SHARDS,1) : 0))
+      {
+        delete ns;
+        DeleteFile(newpackfn.Get());
+        DeleteFile(newidxfn.Get());
+        ok = false;
+        continue;
+      }
+      delete ns;
+
+      m_shards[x].Close();
+      DeleteFile(packfn.Get());
+      DeleteFile(idxfn.Get());
+      if (!MoveFile(newpackfn.Get(),packfn.Get()) || !MoveFile(newidxfn.Get(),idxfn.Get())) ok = false;
+      if (!m_shards[x].Open(packfn.Get(),idxfn.Get())) ok = false;
+    }
+    return ok;
+  }
+
+private:
+  WDL_FastString m_path;
+  thumbPackShard m_shards[THUMBPACK_SHARDS];
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+IThumbStore *ThumbStore_Create(int type, const char *path)
+{
+  if (type == THUMBSTORE_PACK)
+  {
+    thumbStorePack *s = new thumbStorePack(path);
+    if (s->Init()) return s;
+    delete s;
+  }
+  else if (type == THUMBSTORE_SQLITE)
+  {
+    thumbStoreSQLite *s = new thumbStoreSQLite(path);
+    if (s->Init()) return s;
+    delete s;
+  }
+  return NULL;
+}
+
+bool ThumbStore_DeleteFiles(int type, const char *path)
+{
+  if (type != THUMBSTORE_PACK) return !file_exists(path) || DeleteFile(path);
+
+  bool ok = true;
+  int x;
+  for (x = 0; x < THUMBPACK_SHARDS; x ++)
+  {
+    WDL_FastString packfn, idxfn;
+    thumbStorePack::GetShardFilenames(path,x,&packfn,&idxfn);
+    if (file_exists(packfn.Get()) && !DeleteFile(packfn.Get())) ok = false;
+    if (file_exists(idxfn.Get()) && !DeleteFile(idxfn.Get())) ok = false;
+  }
+  if (ok)
+  {
+#ifdef _WIN32
+    RemoveDirectory(path);
+#else
+    rmdir(path);
+#endif
+  }
+  return ok;
+}
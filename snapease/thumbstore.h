@@ -0,0 +1,58 @@
+/*
+    SnapEase
+    thumbstore.h -- thumbnail cache storage interface
+    Copyright (C) 2009 and onward Cockos Incorporated
+
+    SnapEase is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    SnapEase is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SnapEase; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _THUMBSTORE_H_
+#define _THUMBSTORE_H_
+
+#include "../WDL/wdltypes.h"
+
+// blobs are keyed by a 64-bit hash of the image filename/time/size (see DoProcessBitmap)
+
+class IThumbStoreConnection // one per thread
+{
+public:
+  virtual ~IThumbStoreConnection() { }
+
+  // returns the blob (valid until the next call on this connection), or NULL if not found.
+  // if lenOut is NULL, only checks for existence
+  virtual const void *Lookup(WDL_UINT64 hash, int *lenOut)=0; 
+  virtual bool Store(WDL_UINT64 hash, const void *data, int len)=0; // true if success
+};
+
+class IThumbStore
+{
+public:
+  virtual ~IThumbStore() { }
+
+  // NULL on error, delete when done (before deleting the store). if abortflag is set, lookups stop 
+  // waiting for a busy store once *abortflag becomes true
+  virtual IThumbStoreConnection *Connect(const bool *abortflag=NULL)=0;
+
+  // removes replaced entries, and the oldest entries beyond maxbytes (if nonzero).
+  // no connections may be in use while compacting
+  virtual bool Compact(WDL_INT64 maxbytes)=0; 
+};
+
+enum { THUMBSTORE_SQLITE=0, THUMBSTORE_PACK };
+
+IThumbStore *ThumbStore_Create(int type, const char *path); // path is the .sqlite3 file or the pack directory
+bool ThumbStore_DeleteFiles(int type, const char *path);
+
+#endif
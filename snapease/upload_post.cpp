@@ -48,6 +48,7 @@ class PostUploader : public IFileUploader
       }
       m_con=0;
       m_fr=0;
+      m_data=0;
       m_errorstate=0;
       m_linestate=0;
     }
@@ -59,12 +60,16 @@ class PostUploader : public IFileUploader
     }
 
     virtual bool SendFile(const char *srcfullfn, const char *destfn); // true if success
+    virtual bool SendData(const void *data, int len, const char *destfn);
     virtual int Run(char *statusBuf, int statusBufLen); // >0 completed, <0 error (statusBuf will be error text)
 
+    void StartPost(const char *destfn, WDL_INT64 size);
+
     WDL_String m_extrapost_content; // stuff to send at end
 
     JNL_IConnection *m_con;
-    WDL_FileRead *m_fr;
+    WDL_FileRead *m_fr; // source is either a file or m_data
+    const char *m_data;
     int m_file_size_sending;
     int m_file_send_pos;
 
@@ -87,6 +92,35 @@ static void AddTextField(WDL_String *s, const char *name, const char *value)
 
 
 bool PostUploader::SendFile(const char *srcfullfn, const char *destfn) // true if success
+{
+  m_errorstate=0;
+  m_data=0;
+
+  delete m_fr;
+  m_fr = new WDL_FileRead(srcfullfn);
+  if (!m_fr->IsOpen()) 
+  {
+    m_errorstate=-1;
+    return false;
+  }
+
+  StartPost(destfn,m_fr->GetSize());
+  return true;
+}
+
+bool PostUploader::SendData(const void *data, int len, const char *destfn)
+{
+  m_errorstate=0;
+
+  delete m_fr;
+  m_fr=0;
+  m_data = (const char *)data;
+
+  StartPost(destfn,len);
+  return true;
+}
+
+void PostUploader::StartPost(const char *destfn, WDL_INT64 fs)
 {
   char useUrl[1024];
   useUrl[0]=0;
@@ -104,21 +138,11 @@ bool PostUploader::SendFile(const char *srcfullfn, const char *destfn) // true i
   useLeadPath[0]=0;
   config_readstr("export_post_path",useLeadPath,sizeof(useLeadPath));
 
-  m_errorstate=0;
   m_linestate=0;
 
-  delete m_fr;
   delete m_con;
-  m_fr=0;
   m_con=0;
 
-  m_fr = new WDL_FileRead(srcfullfn);
-  if (!m_fr->IsOpen()) 
-  {
-    m_errorstate=-1;
-    return false;
-  }
-
   const char *hsrc = useUrl;
   if (!strnicmp(hsrc,"http://",7)) hsrc+=7;
   WDL_String hb(hsrc);
@@ -189,7 +213,6 @@ bool PostUploader::SendFile(const char *srcfullfn, const char *destfn) // true i
 
   
 
-  WDL_INT64 fs=m_fr->GetSize();
   m_file_size_sending = fs<1 ? 0 : fs > 1024*1024*1024 ? 1024*1024*1024 : (int) fs;
 
 
@@ -228,8 +251,6 @@ bool PostUploader::SendFile(const char *srcfullfn, const char *destfn) // true i
 
   // sending file!
   m_file_send_pos=0;
-
-  return true;
 }
 
 int PostUploader::Run(char *statusBuf, int statusBufLen) // >0 completed, <0 error (statusBuf will be error text)
@@ -344,7 +365,12 @@ int PostUploader::Run(char *statusBuf, int statusBufLen) // >0 completed, <0 err
   if (maxsend > m_con->send_bytes_available())
     maxsend = m_con->send_bytes_available();
 
-  if (maxsend>0)
+  if (maxsend>0 && m_data)
+  {
+    m_con->send_bytes(m_data+m_file_send_pos,maxsend);
+    m_file_send_pos+=maxsend;
+  }
+  else if (maxsend>0)
   {
     char buf[4096];
     if (maxsend >sizeof(buf)) maxsend=sizeof(buf);
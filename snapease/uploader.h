@@ -8,6 +8,7 @@ public:
   virtual ~IFileUploader() { }
 
   virtual bool SendFile(const char *srcfullfn, const char *destfn)=0; // true if success
+  virtual bool SendData(const void *data, int len, const char *destfn)=0; // data must stay valid until Run() completes
   virtual int Run(char *statusBuf, int statusBufLen)=0; // >0 completed, <0 error (statusBuf will be error text)
 
 };